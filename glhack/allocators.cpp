@@ -3,6 +3,16 @@
 */
 #include "allocators.h"
 
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <cstdint>
+#endif
+
 namespace {
     const size_t g_alignment = 16;
 }
@@ -27,3 +37,88 @@ void aligned_free(void* p)
         delete [] mem;
     }
 }
+
+#if defined(_WIN32)
+
+void* slab_alloc(size_t size, bool huge_pages)
+{
+    if(huge_pages)
+    {
+        // Large pages are aligned to the large page size.
+        if(size == GetLargePageMinimum())
+        {
+            void* p = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if(p) return p;
+        }
+    }
+
+    // Reserve twice the size to find an aligned address, release it and map the aligned
+    // range. Another thread may take the range in between so retry a few times.
+    for(int attempt = 0; attempt < 8; ++attempt)
+    {
+        char* p = (char*) VirtualAlloc(0, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
+        if(!p) return 0;
+        char* aligned = (char*)(((size_t)p + size - 1) & ~(size - 1));
+        VirtualFree(p, 0, MEM_RELEASE);
+        void* result = VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if(result) return result;
+    }
+
+    return 0;
+}
+
+void slab_free(void* p, size_t size)
+{
+    (void) size;
+    if(p) VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#else
+
+namespace {
+
+/** Map 2 * size bytes and unmap the parts outside an aligned range of size bytes.*/
+void* map_aligned(size_t size, int flags)
+{
+    void* mapped = mmap(0, 2 * size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(mapped == MAP_FAILED) return 0;
+
+    char* p = (char*) mapped;
+    char* aligned = (char*)(((uintptr_t)p + size - 1) & ~(uintptr_t)(size - 1));
+    if(aligned > p) munmap(p, aligned - p);
+    if(aligned + size < p + 2 * size) munmap(aligned + size, (p + 2 * size) - (aligned + size));
+
+    return aligned;
+}
+
+const size_t g_huge_page_size = 2 * 1024 * 1024;
+
+}
+
+void* slab_alloc(size_t size, bool huge_pages)
+{
+    void* p = 0;
+#if defined(MAP_HUGETLB)
+    if(huge_pages && size % g_huge_page_size == 0)
+    {
+        p = map_aligned(size, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB);
+        if(p) return p;
+    }
+#endif
+
+    p = map_aligned(size, MAP_PRIVATE | MAP_ANONYMOUS);
+
+#if defined(MADV_HUGEPAGE)
+    // Fall back to transparent huge pages.
+    if(p && huge_pages && size % g_huge_page_size == 0) madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+    return p;
+}
+
+void slab_free(void* p, size_t size)
+{
+    if(p) munmap(p, size);
+}
+
+#endif
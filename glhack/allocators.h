@@ -9,3 +9,9 @@
 /** Return memory aligned to 16 bytes. Must be freed using alignedFree */
 unsigned char* aligned_alloc(size_t size);
 void aligned_free(void* p);
+
+/** Return size bytes of memory mapped from the OS, aligned to size. Size must be a power of two
+ *  and a multiple of the page size. If huge_pages is set, huge pages are used when available.
+ *  Return null on failure. Must be freed using slab_free. */
+void* slab_alloc(size_t size, bool huge_pages);
+void slab_free(void* p, size_t size);
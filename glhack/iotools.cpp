@@ -4,6 +4,8 @@
 #include "iotools.h"
 #include "shims_and_types.h"
 #include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 #ifdef WIN32
@@ -98,6 +100,21 @@ bool string_to_file(const char* path, const char* string)
     return o.write(string);
 }
 
+bool bytes_to_file(const char* path, const std::vector<uint8_t>& bytes)
+{
+    OutputFile o(path);
+    if(!o.is_open()) return false;
+    o.file().write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return o.file().good();
+}
+
+std::tuple<uint64_t, int64_t, bool> file_stamp(const char* path)
+{
+    struct stat info;
+    if(stat(path, &info) != 0) return std::make_tuple(uint64_t(0), int64_t(0), false);
+    return std::make_tuple((uint64_t) info.st_size, (int64_t) info.st_mtime, true);
+}
+
 std::string path_join(const std::string& head, const std::string& tail)
 {
     char separator = platform_separator();
@@ -35,6 +35,10 @@ std::tuple<std::string, bool>          file_to_string(const char* path);
 std::tuple<std::vector<uint8_t>, bool> file_to_bytes(const char* path);
 
 bool string_to_file(const char* path, const char* string);
+bool bytes_to_file(const char* path, const std::vector<uint8_t>& bytes);
+
+/** Return size and modification time of file. The last element is false if the file could not be accessed.*/
+std::tuple<uint64_t, int64_t, bool>    file_stamp(const char* path);
 
 // All internal path operations expect '/' separator for paths
 
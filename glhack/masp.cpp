@@ -5,13 +5,14 @@
 #include "persistent_containers.h"
 #include "iotools.h"
 
-#include "glh_regex.h"
+#include "tinythread.h"
 
 
 #include<stack>
 #include<cstring>
 #include<algorithm>
 #include<cstdlib>
+#include<cstdio>
 #include<cctype>
 #include<sstream>
 #include<numeric>
@@ -19,6 +20,9 @@
 #include<utility>
 #include<limits>
 #include<type_traits>
+#include<chrono>
+#include<iomanip>
+#include<unordered_map>
 
 namespace {
 void local_assert(const char* msg)
@@ -52,25 +56,293 @@ void convert_to_int(NumberArray& arr)
     for(auto n = arr.begin(); n != arr.end(); ++n){int i = n->to_int(); n->set(i);}
 }
 
-struct Function{PrimitiveFunction fun;};
+///// Symbol table //////
+
+namespace {
+
+/** Process wide table of interned symbols. Symbol values are created by factories
+ *  that do not know their interpreter, so all interpreters share one table; this
+ *  also keeps symbols valid when values are passed between interpreters, as pmap
+ *  does with the workers of a MaspPool, and lets the special forms be interned once.
+ *  intern() may be called from any thread: lookup and insertion hold the mutex, and
+ *  records never move or change once added, so reading a Symbol needs no lock.
+ *  Symbols are never removed; the table is destroyed when the process exits. */
+class SymbolTable
+{
+public:
+    const Symbol* intern(const char* str, const char* str_end)
+    {
+        std::string name(str, str_end);
+
+        tthread::lock_guard<tthread::mutex> lock(mutex_);
+
+        auto i = index_.find(name);
+        if(i != index_.end()) return i->second;
+
+        symbols_.push_back(Symbol());
+        Symbol* s = &symbols_.back();
+        s->id   = (uint32_t) (symbols_.size() - 1);
+        s->hash = hash32(s->id);
+        s->name = name;
+        index_[name] = s;
+
+        return s;
+    }
+
+private:
+    tthread::mutex                                 mutex_;
+    std::deque<Symbol>                             symbols_; // deque: records do not move.
+    std::unordered_map<std::string, const Symbol*> index_;
+};
+
+SymbolTable& symbol_table()
+{
+    static SymbolTable table;
+    return table;
+}
+
+}
+
+const Symbol* intern_symbol(const char* str, const char* str_end)
+{
+    return symbol_table().intern(str, str_end);
+}
+
+/** Immutable string payload shared between values by reference count.
+ *  An owner holds its characters inline after the header. A slice refers to a
+ *  range of its owner's characters; it builds a terminated copy only when
+ *  c_str() is asked of a range that does not end at the owner's end. */
+struct StringData
+{
+    int         ref_count;
+    bool        has_hash;
+    uint32_t    hash;
+    size_t      length;
+    const char* chars;
+    StringData* owner;      //> Null for owners, otherwise the owner of chars.
+    StringData* terminated; //> Terminated copy of a slice, made on demand.
+
+    static StringData* create(const char* str, size_t len)
+    {
+        StringData* d = (StringData*) malloc(sizeof(StringData) + len + 1);
+        char* buffer = reinterpret_cast<char*>(d + 1);
+        memcpy(buffer, str, len);
+        buffer[len] = '\0';
+        d->init(buffer, len, 0);
+        return d;
+    }
+
+    static StringData* slice(StringData* str, size_t start, size_t end)
+    {
+        if(end > str->length) end = str->length;
+        if(start > end) start = end;
+        if(start == 0 && end == str->length){ str->add_ref(); return str;}
+
+        StringData* owner = str->owner ? str->owner : str;
+        owner->add_ref();
+        StringData* d = (StringData*) malloc(sizeof(StringData));
+        d->init(str->chars + start, end - start, owner);
+        return d;
+    }
+
+    void add_ref(){++ref_count;}
+
+    void release()
+    {
+        if(--ref_count == 0)
+        {
+            if(owner) owner->release();
+            if(terminated) terminated->release();
+            free(this);
+        }
+    }
+
+    const char* c_str()
+    {
+        if(!owner || chars[length] == '\0') return chars;
+        if(!terminated) terminated = create(chars, length);
+        return terminated->chars;
+    }
+
+    uint32_t get_hash()
+    {
+        if(!has_hash)
+        {
+            hash = hash32(chars, (int) length);
+            has_hash = true;
+        }
+        return hash;
+    }
+
+    bool equals(const StringData& s) const
+    {
+        return this == &s || (length == s.length && memcmp(chars, s.chars, length) == 0);
+    }
+
+    /** Lexicographic order of the characters.*/
+    bool less(const StringData& s) const
+    {
+        int order = memcmp(chars, s.chars, length < s.length ? length : s.length);
+        return order < 0 || (order == 0 && length < s.length);
+    }
+
+private:
+    void init(const char* str, size_t len, StringData* str_owner)
+    {
+        ref_count = 1;
+        has_hash = false;
+        hash = 0;
+        length = len;
+        chars = str;
+        owner = str_owner;
+        terminated = 0;
+    }
+};
+
+struct Closure;
+
+/** Function payload. Shared between copies of the value by reference count so that
+ *  loading a function for a call does not allocate. */
+struct Function{
+    PrimitiveFunction        fun;
+    NativeFunction           native;  //> Used instead of fun when set.
+    std::shared_ptr<Closure> closure; //> Non-null for functions compiled from masp code.
+    const Symbol*            name;    //> Name of a primitive added to the env. Used by the profiler.
+    int                      ref_count;
+
+    Function():native(0), name(0), ref_count(1){}
+};
+
+struct SeqChunk;
+
+/** Position in a lazily realized sequence. Copied with the value like list handles; the
+ *  chunks holding the elements are shared, so a sequence is realized only once. */
+struct LazySeq{
+    std::shared_ptr<SeqChunk> chunk;  //> Null at the end of the sequence.
+    size_t                    offset; //> Index of the first element in chunk.
+
+    LazySeq():offset(0){}
+    LazySeq(const std::shared_ptr<SeqChunk>& c, size_t o):chunk(c), offset(o){}
+
+    /** Return the first element, realizing the chunk holding it, or null at the end of the sequence.*/
+    const Value* first();
+
+    /** Skip the first element. first() must have returned an element.*/
+    void advance(){++offset;}
+
+    /** Realize the whole sequence and return the number of elements.*/
+    size_t count() const;
+};
+
+/** Producer of the elements of a lazy sequence. Reads a range, a list, a vector or another
+ *  sequence and passes each element through the stages in order. Stages applied to a sequence
+ *  that is not yet realized are appended to a copy of its source, so a pipeline of maps,
+ *  filters and takes is a single loop over the original elements. */
+struct SeqSource{
+    enum Kind{RANGE, LIST_CURSOR, VECTOR_CURSOR, SEQ_CURSOR};
+
+    struct Stage{
+        enum Kind{MAP, FILTER, DROP, DROP_WHILE, DROP_LAST, TAKE, TAKE_WHILE};
+        Kind              kind;
+        Value             fun;
+        size_t            count;   //> Elements left to drop or take. Nonzero while DROP_WHILE drops.
+        std::deque<Value> pending; //> Elements held back by DROP_LAST.
+
+        Stage(Kind k, const Value& f, size_t c):kind(k), fun(f), count(c){}
+    };
+
+    Masp*              masp;
+    Kind               kind;
+    Number             range_next;
+    Number             range_increment;
+    Number             range_end;
+    Value              collection; //> List or vector read by the cursor.
+    VRefIterator       list_pos;
+    size_t             vector_pos;
+    LazySeq            seq;        //> Sequence read by SEQ_CURSOR.
+    std::vector<Stage> stages;
+    Vector             args;       //> Arguments of stage calls.
+    bool               done;
+
+    SeqSource(Masp& m, Kind k):masp(&m), kind(k), vector_pos(0), done(false){}
+
+    /** Write the next element to out. Return false at the end of the sequence.*/
+    bool pull(Value& out);
+
+private:
+    bool read(Value& out);
+    bool call(const Value& fun, Value& arg, Value& result);
+};
+
+/** Realized elements of a lazy sequence. An unrealized chunk holds the source, which fills
+ *  it with up to SIZE elements and is then handed over to the next chunk. */
+struct SeqChunk{
+    enum{SIZE = 32};
+
+    std::vector<Value>         elements;
+    std::shared_ptr<SeqSource> source; //> Null once the chunk is realized.
+    std::shared_ptr<SeqChunk>  next;   //> Null at the end of the sequence.
+    uint32_t                   gc_visit;
+
+    SeqChunk():gc_visit(0){}
+
+    ~SeqChunk()
+    {
+        // Unlink the chunks no longer shared one at a time so long sequences do not exhaust the stack.
+        std::shared_ptr<SeqChunk> n(std::move(next));
+        while(n && n.use_count() == 1)
+        {
+            std::shared_ptr<SeqChunk> following(std::move(n->next));
+            n = std::move(following);
+        }
+    }
+
+    void realize()
+    {
+        // Elements are pulled one at a time, so a call that throws leaves the chunk
+        // holding the elements read so far and the source positioned after them.
+        Value v;
+        while(elements.size() < SIZE && source->pull(v)) elements.push_back(std::move(v));
+        if(elements.size() == SIZE)
+        {
+            next = std::make_shared<SeqChunk>();
+            next->source = source;
+        }
+        source.reset();
+    }
+};
 
 // ValuesAreEqual and ValueHash member implementations
 bool ValuesAreEqual::compare(const Value& k1, const Value& k2){return k1 == k2;} 
+
+bool ValueLess::operator()(const Value& k1, const Value& k2) const
+{
+    if(k1.type != k2.type) return k1.type < k2.type;
+
+    if(k1.type == NUMBER)       return k1.value.number < k2.value.number;
+    else if(k1.type == STRING)  return k1.value.string->less(*k2.value.string);
+    else if(k1.type == SYMBOL)  return k1.value.symbol != k2.value.symbol && k1.value.symbol->name < k2.value.symbol->name;
+    else if(k1.type == BOOLEAN) return k1.value.boolean < k2.value.boolean;
+
+    return false;
+}
 uint32_t ValueHash::hash(const Value& h){return h.get_hash();}
 
 Value::Value():type(NIL){}
 
 void Value::dealloc()
 {
-    if((type == STRING || type == SYMBOL) && value.string)
+    if(type == STRING && value.string)
     {
-        delete value.string;
+        value.string->release();
     }
     else if(type == LIST && value.list)      { delete value.list;}
     else if(type == MAP && value.map)        { delete value.map;}
+    else if(type == SORTED_MAP && value.sorted_map) { delete value.sorted_map;}
+    else if(type == LAZY_SEQ && value.lazy_seq) { delete value.lazy_seq;}
     else if(type == OBJECT && value.object)  { delete value.object;}
     else if(type == VECTOR && value.vector)  { delete value.vector;}
-    else if(type == FUNCTION && value.function)  { delete value.function;}
+    else if(type == FUNCTION && value.function)  { if(--value.function->ref_count == 0) delete value.function;}
     else if(type == NUMBER_ARRAY && value.number_array)  { delete value.number_array;}
 }
 
@@ -79,7 +351,10 @@ Value::~Value()
     dealloc();
 }
 
-bool Value::is_str(const char* str){return glh::any_of(type, STRING, SYMBOL) && strcmp(value.string->c_str(), str) == 0;}
+bool Value::is_str(const char* str){
+    if(type == SYMBOL) return strcmp(value.symbol->name.c_str(), str) == 0;
+    return type == STRING && strcmp(value.string->c_str(), str) == 0;
+}
 
 template<class V>
 V* copy_new(const V* v)
@@ -103,12 +378,23 @@ void Value::copy(const Value& v)
 
 #define COPY_PARAM_V(param_name) value. param_name = copy_new(v.value. param_name)
     if(type == NUMBER) value.number.set(v.value.number);
-    else if(type == SYMBOL || type == STRING) COPY_PARAM_V(string);
+    else if(type == STRING)
+    {
+        value.string = v.value.string;
+        value.string->add_ref();
+    }
+    else if(type == SYMBOL) value.symbol = v.value.symbol;
     else if(type == LIST)    COPY_PARAM_V(list);
     else if(type == MAP)     COPY_PARAM_V(map);
+    else if(type == SORTED_MAP) COPY_PARAM_V(sorted_map);
+    else if(type == LAZY_SEQ) COPY_PARAM_V(lazy_seq);
     else if(type == OBJECT) value.object = v.value.object->copy();
     else if(type == VECTOR)  COPY_PARAM_V(vector);
-    else if(type == FUNCTION) COPY_PARAM_V(function);
+    else if(type == FUNCTION)
+    {
+        value.function = v.value.function;
+        ++value.function->ref_count;
+    }
     else if(type == NUMBER_ARRAY) COPY_PARAM_V(number_array);
     else if(type == BOOLEAN) value.boolean = v.value.boolean;
     else if(type != NIL)
@@ -123,6 +409,7 @@ void Value::movefrom(Value& v)
     size_t value_size = sizeof(value);
     memcpy(reinterpret_cast<void*>(&value), that_value_ptr, sizeof(value));  
     memset(that_value_ptr, 0, value_size);
+    v.type = NIL;
 }
 
 Value::Value(Value&& v)
@@ -134,7 +421,10 @@ Value& Value::operator=(const Value& a)
 {
     if(&a != this)
     {
-        copy(a);
+        // Copy first: a may be owned by the payload released below.
+        Value tmp(a);
+        dealloc();
+        movefrom(tmp);
     }
     
     return *this;
@@ -144,7 +434,9 @@ Value& Value::operator=(Value&& v)
 {
     if(&v != this)
     {
-        movefrom(v);
+        Value tmp(std::move(v));
+        dealloc();
+        movefrom(tmp);
     }
 
     return *this; 
@@ -152,32 +444,76 @@ Value& Value::operator=(Value&& v)
 
 void Value::alloc_str(const std::string& str)
 {
-    value.string = new std::string(str);
+    value.string = StringData::create(str.c_str(), str.size());
 }
 
 void Value::alloc_str(const char* str)
 {
-    value.string = new std::string(str);
+    value.string = StringData::create(str, strlen(str));
 }
 
 void Value::alloc_str(const char* str, const char* str_end)
 {
-    value.string = new std::string(str, str_end);
+    value.string = StringData::create(str, str_end - str);
 }
 
 bool Value::is_nil() const {return type == NIL;}
 
+/** Compare sequences element by element, realizing them as far as they are equal.*/
+bool lazy_seq_equal(LazySeq a, LazySeq b)
+{
+    const Value* x = a.first();
+    const Value* y = b.first();
+    while(x && y)
+    {
+        if(!(*x == *y)) return false;
+        a.advance();
+        b.advance();
+        x = a.first();
+        y = b.first();
+    }
+    return !x && !y;
+}
+
+/** Compare a sequence with the elements of a list or a vector.*/
+template<class I>
+bool lazy_seq_equal(LazySeq a, I i, I end)
+{
+    const Value* x = a.first();
+    while(x && i != end)
+    {
+        if(!(*x == *i)) return false;
+        a.advance();
+        x = a.first();
+        ++i;
+    }
+    return !x && i == end;
+}
+
+/** Lazy sequences are equal to lists and vectors holding the same elements.*/
+bool lazy_seq_equal(const LazySeq& a, const Value& v)
+{
+    if(v.type == LIST)   return lazy_seq_equal(a, v.value.list->begin(), v.value.list->end());
+    if(v.type == VECTOR) return lazy_seq_equal(a, v.value.vector->begin(), v.value.vector->end());
+    return false;
+}
+
 bool Value::operator==(const Value& v) const
 {
+    if(type == LAZY_SEQ && v.type != LAZY_SEQ) return lazy_seq_equal(*value.lazy_seq, v);
+    if(v.type == LAZY_SEQ && type != LAZY_SEQ) return lazy_seq_equal(*v.value.lazy_seq, *this);
     if(v.type != type) return false;
     bool result = false;
 
     if(type == NUMBER)            result = value.number == v.value.number;
     else if(type == NUMBER_ARRAY) result = (*value.number_array) == (*v.value.number_array);
-    else if(type == STRING || type == SYMBOL) result = (*value.string) == (*v.value.string);
+    else if(type == STRING) result = value.string->equals(*v.value.string);
+    else if(type == SYMBOL) result = value.symbol == v.value.symbol;
     else if(type == VECTOR) result = (*value.vector) == *(v.value.vector);
     else if(type == LIST) result = (*(value.list) ==  *(v.value.list));
     else if(type == MAP) result = (*(value.map) == *(v.value.map));
+    else if(type == SORTED_MAP) result = (*(value.sorted_map) == *(v.value.sorted_map));
+    else if(type == LAZY_SEQ) result = lazy_seq_equal(*value.lazy_seq, *v.value.lazy_seq);
     else if(type == OBJECT)
     {
         // TODO - what to do.
@@ -208,11 +544,12 @@ uint32_t Value::get_hash() const
         uint32_t orig = 0;
         h = glh::fold_left<uint32_t, NumberArray>(orig, accum_number_hash, *value.number_array);
     }
-    else if(type == STRING || type == SYMBOL) h = hash32(*value.string);
+    else if(type == STRING) h = value.string->get_hash();
+    else if(type == SYMBOL) h = value.symbol->hash;
     else if(type == VECTOR)
     {
         uint32_t orig = 0;
-        h = glh::fold_left<uint32_t, Vector>(orig, accum_value_hash, *value.vector);
+        h = glh::fold_left<uint32_t, PVector>(orig, accum_value_hash, *value.vector);
     }
     else if(type == LIST) 
     {
@@ -231,6 +568,22 @@ uint32_t Value::get_hash() const
         }
         h = accum;
     }
+    else if(type == SORTED_MAP)
+    {
+        uint32_t accum = 0;
+        for(auto i = value.sorted_map->begin(); i != value.sorted_map->end(); ++i)
+        {
+            accum = accum_value_hash(accum_value_hash(accum, i->first), i->second);
+        }
+        h = accum;
+    }
+    else if(type == LAZY_SEQ)
+    {
+        uint32_t accum = 0;
+        LazySeq seq(*value.lazy_seq);
+        for(const Value* e = seq.first(); e; seq.advance(), e = seq.first()) accum = accum_value_hash(accum, *e);
+        h = accum;
+    }
     else if(type == OBJECT)
     {
         // TODO
@@ -275,10 +628,11 @@ inline Number value_number(const Value& v){return v.type == NUMBER ? v.value.num
 
 inline List* value_list(const Value& v){return v.type == LIST ? v.value.list : 0;}
 
-inline Vector* value_vector(const Value& v){return v.type == VECTOR ? v.value.vector : 0;}
+inline PVector* value_vector(const Value& v){return v.type == VECTOR ? v.value.vector : 0;}
 
 const char* value_string(const Value& v){
-    return (v.type == STRING ||  v.type == SYMBOL) ? v.value.string->c_str() : 0;
+    if(v.type == SYMBOL) return v.value.symbol->name.c_str();
+    return (v.type == STRING) ? v.value.string->c_str() : 0;
 }
 
 bool value_boolean(const Value& v){
@@ -325,11 +679,12 @@ inline const Value* value_list_fourth(const Value& v)
     return value_list_nth(v, 3);
 }
 
-Vector* value_vector(Value& v){return v.type == VECTOR ? v.value.vector : 0;}
+PVector* value_vector(Value& v){return v.type == VECTOR ? v.value.vector : 0;}
 
 NumberArray* value_number_array(Value& v){return v.type == NUMBER_ARRAY ? v.value.number_array : 0;}
 
 Map* value_map(const Value& v){return v.type == MAP ? v.value.map : 0;}
+SortedMap* value_sorted_map(const Value& v){return v.type == SORTED_MAP ? v.value.sorted_map : 0;}
 IObject* value_object(const Value& v){return v.type == OBJECT ? v.value.object : 0;}
 
 void append_to_value_stl_list(std::list<Value>& ext_value_list, const Value& v)
@@ -337,1690 +692,4296 @@ void append_to_value_stl_list(std::list<Value>& ext_value_list, const Value& v)
     ext_value_list.push_back(v);
 }
 
-///// Masp::Env //////
+///// Compiled code //////
+
+/** Bytecode operations. An instruction is a 32 bit word holding the opcode in the low
+ *  8 bits and an unsigned operand in the high 24 bits. */
+enum OpCode{
+    OP_CONST,         //> push constants[a]
+    OP_NIL,           //> push nil
+    OP_POP,           //> discard top of stack
+    OP_LOAD_LOCAL,    //> push frame slot a
+    OP_SET_LOCAL,     //> pop value to frame slot a, push nil
+    OP_STORE_LOCAL,   //> pop value to frame slot a
+    OP_LOAD_UPVAL,    //> push value of captured variable a
+    OP_SET_UPVAL,     //> pop value to captured variable a, push nil
+    OP_LOAD_GLOBAL,   //> push value bound to symbol constants[a] in root env
+    OP_DEF_GLOBAL,    //> pop value, bind it to symbol constants[a] in root env, push nil
+    OP_SET_GLOBAL,    //> pop value, replace root env binding of symbol constants[a], push nil
+    OP_JUMP,          //> ip = a
+    OP_JUMP_IF_FALSE, //> pop value, ip = a if value is false
+    OP_CLOSURE,       //> push function made of protos[a] capturing its upvalues
+    OP_CALL,          //> call function stored below a arguments on stack
+    OP_TAIL_CALL,     //> as OP_CALL but replace the current frame with the callee's
+    OP_CLOSE_UPVALS,  //> detach captured variables in frame slots from a upwards
+    OP_RETURN         //> leave frame, push top of stack to caller
+};
 
+typedef uint32_t Instruction;
 
-// Custom Garbage collection to remove dangling references.
-namespace {
+const uint32_t OPERAND_MAX = 0xffffff;
+
+inline Instruction make_instruction(OpCode op, uint32_t a){return (a << 8) | ((uint32_t) op);}
+inline OpCode      instruction_op(Instruction i){return (OpCode) (i & 0xff);}
+inline uint32_t    instruction_operand(Instruction i){return i >> 8;}
+
+/** Where a closure finds a captured variable when it is created: in a slot of the
+ *  enclosing frame or among the enclosing function's own captured variables. */
+struct UpvalueDesc{
+    bool     from_local;
+    uint32_t index;
+};
+
+/** Compiled function body or top level form. */
+struct Proto{
+    std::vector<Instruction>            code;
+    std::vector<Value>                  constants;
+    std::vector<std::shared_ptr<Proto>> protos;     //> Bodies of nested fn forms.
+    std::vector<UpvalueDesc>            upvalues;
+    uint32_t                            param_count;
+    uint32_t                            frame_size; //> Parameters and local defs.
+    const Symbol*                       name;       //> Symbol of a function body. Used by the profiler.
+
+    Proto():param_count(0), frame_size(0), name(0){}
+};
+
+/** Captured variable. While the frame owning the variable runs, it refers to the
+ *  frame's stack slot; when the frame returns the value is moved into the upvalue. */
+struct Upvalue{
+    size_t index;
+    bool   open;
+    Value  closed;
+
+    Upvalue(size_t i):index(i), open(true){}
+};
+
+/** Compiled function and the variables it captured. */
+struct Closure{
+    std::shared_ptr<Proto>                proto;
+    std::vector<std::shared_ptr<Upvalue>> upvalues;
+    uint32_t                              gc_visit; //> Guards gc traversal of cyclic captures.
 
-void value_increment_references(const Value& v);
-void map_increment_references(Map& map);
+    Closure(const std::shared_ptr<Proto>& p):proto(p), gc_visit(0){}
+};
 
-void list_increment_references(List& list)
+/** Arguments of primitive calls. Values are kept in segments that are never reallocated
+ *  while in use, so the span given to a primitive stays valid while the calls it makes push
+ *  further arguments. Argument lists longer than a segment get a segment of their own. The
+ *  machine visits the arguments in use as gc roots. */
+class ArgStack
 {
-#ifdef PRINT_GC
-    std::cout << "#Inc: List" << std::endl;
-#endif
-    list.increment_ref();
-    auto e = list.end();
-    for(auto i = list.begin(); i != e; ++i)
+public:
+    enum {SEGMENT_SIZE = 256};
+
+    struct Mark{size_t segment; size_t top;};
+
+    ArgStack(){mark_.segment = 0; mark_.top = 0;}
+
+    Mark mark() const {return mark_;}
+
+    /** Return count contiguous slots.*/
+    Value* push(size_t count)
     {
-        value_increment_references(*i);
+        bool fits = mark_.segment < segments_.size() && mark_.top + count <= sizes_[mark_.segment];
+        if(!fits && mark_.top > 0){++mark_.segment; mark_.top = 0;}
+
+        size_t size = std::max<size_t>(SEGMENT_SIZE, count);
+        if(mark_.segment == segments_.size())
+        {
+            segments_.emplace_back(new Value[size]);
+            sizes_.push_back(size);
+        }
+        else if(count > sizes_[mark_.segment])
+        {
+            // Segments above the mark are unused and can be replaced.
+            segments_[mark_.segment].reset(new Value[size]);
+            sizes_[mark_.segment] = size;
+        }
+
+        Value* slots = segments_[mark_.segment].get() + mark_.top;
+        mark_.top += count;
+        return slots;
     }
-}
 
-void value_increment_references(const Value& v)
-{
-    if(v.type == MAP)
+    /** Release the slots returned by the push made at mark.*/
+    void pop(const Mark& mark, Value* slots, size_t count)
     {
-        map_increment_references(*value_map(v));
+        for(size_t i = 0; i < count; ++i) slots[i] = Value();
+        mark_ = mark;
     }
-    else if(v.type == LIST)
+
+    template<class F>
+    void for_each(F f) const
     {
-        list_increment_references(*value_list(v));
+        for(size_t s = 0; s < segments_.size() && s <= mark_.segment; ++s)
+        {
+            size_t top = s == mark_.segment ? mark_.top : sizes_[s];
+            for(size_t i = 0; i < top; ++i) f(segments_[s][i]);
+        }
     }
-}
 
-void map_increment_references(Map& map)
+private:
+    std::vector<std::unique_ptr<Value[]>> segments_;
+    std::vector<size_t>                   sizes_;
+    Mark                                  mark_;
+};
+
+/** Arguments moved or copied to the ArgStack for the duration of a call. */
+class ArgFrame
 {
-#ifdef PRINT_GC
-    std::cout << "#Inc: Map" << std::endl;
-#endif
-    map.increment_ref();
-    auto e = map.end();
-    for(auto i = map.begin(); i != e; ++i)
+public:
+    template<class I>
+    ArgFrame(ArgStack& stack, I begin, I end):stack_(stack), mark_(stack.mark()), count_(std::distance(begin, end))
     {
-        value_increment_references(i->first);
-        value_increment_references(i->second);
+        begin_ = stack_.push(count_);
+        std::copy(begin, end, begin_);
     }
-}
 
+    ~ArgFrame(){stack_.pop(mark_, begin_, count_);}
 
-void collect_map_and_list_pools_with_roots(MapPool& map_pool, ListPool& list_pool, Map& map)
-{
-    // Mark all cells that can be visited only through root node
-    // #1 Set reference counts to zero for all roots.
-    // #2 Follow all references through map. For any map or list root cells increment
-    //    reference count.
-    // #3 Run garbage collection 
-    // Caveats: If the dereferenced cells contain data to which a pointer is stored in 
-    // some of the remaining cells, and it is deleted, the pointer is now invalid.
-    map_pool.clear_root_refcounts();
-    list_pool.clear_root_refcounts();
+    ArgSpan span() const {return ArgSpan(begin_, begin_ + count_);}
 
-    map_increment_references(map);
+private:
+    ArgFrame(const ArgFrame&);
+    ArgFrame& operator=(const ArgFrame&);
 
-    map_pool.gc();
-    list_pool.gc();
-}
+    ArgStack&      stack_;
+    ArgStack::Mark mark_;
+    size_t         count_;
+    Value*         begin_;
+};
 
-}
-class Masp::Env
+/** Instrumenting profiler. While enabled the machine reports each call of compiled functions,
+ *  top level forms and primitives. A call is timed and the pool nodes reserved during it are
+ *  counted, and both are attributed to the symbol the function was defined to. Anonymous
+ *  functions are named after the function they are defined in. Exclusive times are also kept
+ *  per call stack for the collapsed stack output. While disabled a call costs a test of the
+ *  enabled flag.
+ *
+ *  A call is recorded with the depth of the machine's frame stack it was made at, so records
+ *  left open by exceptions or by switching the profiler are closed with the frames.*/
+class Profiler
 {
 public:
-    Env()
+    static const size_t NO_RECORD = ~size_t(0);
+
+    struct Counts
     {
-        env_.reset(new Map(map_pool_.new_map()));
-        load_default_env();
-        out_ = &std::cout;
+        size_t list_nodes;
+        size_t map_nodes;
+        size_t other_nodes; //> Vector and sorted map nodes.
+    };
+
+    struct Entry
+    {
+        const Symbol* name;
+        size_t        calls;
+        int64_t       inclusive_ns;
+        int64_t       exclusive_ns;
+        Counts        allocated;  //> Exclusive.
+        size_t        active;     //> Open records of the entry. Only the outermost adds inclusive time.
+    };
+
+    bool enabled;
+
+    Profiler(ListPool& list_pool, MapPool& map_pool, VectorPool& vector_pool, SortedMapPool& sorted_map_pool):
+        enabled(false), list_pool_(list_pool), map_pool_(map_pool), vector_pool_(vector_pool),
+        sorted_map_pool_(sorted_map_pool), toplevel_(intern("<toplevel>")), primitive_(intern("<primitive>")){}
+
+    void set_enabled(bool on)
+    {
+        while(!records_.empty()) pop();
+        enabled = on;
     }
 
-    ~Env()
+    void reset()
     {
-        map_pool_.kill();
-        list_pool_.kill();
+        records_.clear();
+        entries_.clear();
+        index_.clear();
+        nodes_.clear();
+        roots_.clear();
     }
 
-    size_t reserved_size_bytes()
+    /** Record entering a call.
+     *  @param name  Function name or null for top level code and unnamed primitives.
+     *  @param depth Frame stack depth the call runs at.
+     *  @param frame True for calls that have a frame of their own.
+     *  @return      Record to leave.*/
+    size_t enter(const Symbol* name, size_t depth, bool frame)
     {
-        return list_pool_.reserved_size_bytes() + map_pool_.reserved_size_bytes();
+        if(!name) name = frame ? toplevel_ : primitive_;
+
+        size_t entry = entry_index(name);
+        size_t parent = records_.empty() ? NO_RECORD : records_.back().node;
+
+        Record r;
+        r.entry        = entry;
+        r.node         = child_node(parent, entry);
+        r.depth        = depth;
+        r.frame        = frame;
+        r.child_ns     = 0;
+        r.start_counts = counts();
+        r.child_counts = Counts();
+        r.start        = clock::now();
+
+        ++entries_[entry].calls;
+        ++entries_[entry].active;
+        records_.push_back(r);
+        return records_.size() - 1;
     }
 
-    size_t live_size_bytes()
+    /** Leave record and the records opened after it.*/
+    void leave(size_t record)
     {
-        return list_pool_.live_size_bytes() + map_pool_.live_size_bytes();
+        while(records_.size() > record) pop();
     }
 
-    void gc()
+    /** Leave the record of the frame at depth and the calls left open in it.*/
+    void leave_frame(size_t depth)
     {
-        collect_map_and_list_pools_with_roots(map_pool_, list_pool_, *env_);
+        while(!records_.empty() && records_.back().depth >= depth)
+        {
+            bool frame_record = records_.back().frame && records_.back().depth == depth;
+            pop();
+            if(frame_record) break;
+        }
     }
 
-    void add_fun(const char* name, PrimitiveFunction f);
+    /** Leave the records of calls deeper than depth.*/
+    void unwind(size_t depth)
+    {
+        while(!records_.empty() && records_.back().depth > depth) pop();
+    }
 
-    void def(const Value& key, const Value& value);
+    /** Return entries sorted by exclusive time.*/
+    std::vector<Entry> entries() const
+    {
+        std::vector<Entry> result(entries_);
+        std::sort(result.begin(), result.end(), [](const Entry& a, const Entry& b){return a.exclusive_ns > b.exclusive_ns;});
+        return result;
+    }
 
-    void load_default_env();
-    void load_default_extensions();
+    std::string report() const
+    {
+        std::ostringstream os;
+        os << std::setw(10) << "calls" << std::setw(12) << "incl ms" << std::setw(12) << "excl ms"
+           << std::setw(10) << "list" << std::setw(10) << "map" << std::setw(10) << "other" << "  name\n";
 
-    Map& get_env(){return *env_;}
+        os << std::fixed << std::setprecision(3);
+        for(auto& e : entries())
+        {
+            os << std::setw(10) << e.calls << std::setw(12) << e.inclusive_ns * 1e-6 << std::setw(12) << e.exclusive_ns * 1e-6
+               << std::setw(10) << e.allocated.list_nodes << std::setw(10) << e.allocated.map_nodes
+               << std::setw(10) << e.allocated.other_nodes << "  " << e.name->name << "\n";
+        }
+        return os.str();
+    }
 
-    // Locals
-    MapPool              map_pool_;
-    ListPool             list_pool_;
-    std::unique_ptr<Map> env_;
-    std::ostream*        out_;
-};
+    /** Exclusive microseconds per call stack, one "outer;inner count" line per stack.*/
+    std::string collapsed() const
+    {
+        std::ostringstream os;
+        std::vector<const std::string*> path;
 
+        for(auto& n : nodes_)
+        {
+            int64_t us = n.exclusive_ns / 1000;
+            if(us == 0) continue;
 
-inline List new_list(Masp& m){return m.env()->list_pool_.new_list();}
+            path.clear();
+            for(const Node* p = &n; p; p = p->parent == NO_RECORD ? 0 : &nodes_[p->parent])
+                path.push_back(&entries_[p->entry].name->name);
 
-template<class Cont>
-inline List new_list(Masp& m, const Cont& container){return m.env()->list_pool_.new_list(container);}
+            for(auto i = path.rbegin(); i != path.rend(); ++i) os << (i == path.rbegin() ? "" : ";") << **i;
+            os << " " << us << "\n";
+        }
+        return os.str();
+    }
 
-inline List* new_list_alloc(Masp& m)
-{
-    return new List(m.env()->list_pool_.new_list());
-}
+private:
+    typedef std::chrono::high_resolution_clock clock;
 
-inline Map* new_map_alloc(Masp& m)
-{
-    return new Map(m.env()->map_pool_.new_map());
-}
+    /** Node of the call tree. */
+    struct Node
+    {
+        size_t                                 entry;
+        size_t                                 parent;
+        int64_t                                exclusive_ns;
+        std::vector<std::pair<size_t, size_t>> children; //> Entry and node.
+    };
 
-inline MapPool& map_pool(Masp& m){return m.env()->map_pool_;}
+    struct Record
+    {
+        size_t            entry;
+        size_t            node;
+        size_t            depth;
+        bool              frame;
+        int64_t           child_ns;
+        Counts            start_counts;
+        Counts            child_counts;
+        clock::time_point start;
+    };
 
-inline Map new_map(Masp& m)
-{
-    return m.env()->map_pool_.new_map();
-}
+    static const Symbol* intern(const char* name){return intern_symbol(name, name + strlen(name));}
 
-// Value factories
+    Counts counts() const
+    {
+        Counts c = {list_pool_.allocated_count(), map_pool_.allocated_count(),
+                    vector_pool_.allocated_count() + sorted_map_pool_.allocated_count()};
+        return c;
+    }
 
-Value make_value_number(const Number& num)
-{
-    Value a;
-    a.value.number.set(num);
-    a.type = NUMBER;
-    return a;
-}
+    size_t entry_index(const Symbol* name)
+    {
+        auto i = index_.find(name);
+        if(i != index_.end()) return i->second;
 
-Value make_value_number(int i)
+        Entry e = {name, 0, 0, 0, Counts(), 0};
+        entries_.push_back(e);
+        index_[name] = entries_.size() - 1;
+        return entries_.size() - 1;
+    }
+
+    size_t child_node(size_t parent, size_t entry)
+    {
+        auto& children = parent != NO_RECORD ? nodes_[parent].children : roots_;
+        for(auto& c : children) if(c.first == entry) return c.second;
+
+        Node n;
+        n.entry = entry;
+        n.parent = parent;
+        n.exclusive_ns = 0;
+        nodes_.push_back(n);
+
+        size_t node = nodes_.size() - 1;
+        auto& added_to = parent != NO_RECORD ? nodes_[parent].children : roots_; // nodes_ may have moved.
+        added_to.push_back(std::make_pair(entry, node));
+        return node;
+    }
+
+    void pop()
+    {
+        Record& r(records_.back());
+        Entry&  e(entries_[r.entry]);
+
+        int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - r.start).count();
+        Counts  now = counts();
+        Counts  total = {now.list_nodes - r.start_counts.list_nodes, now.map_nodes - r.start_counts.map_nodes,
+                         now.other_nodes - r.start_counts.other_nodes};
+
+        if(--e.active == 0) e.inclusive_ns += elapsed;
+        e.exclusive_ns += elapsed - r.child_ns;
+        e.allocated.list_nodes  += total.list_nodes - r.child_counts.list_nodes;
+        e.allocated.map_nodes   += total.map_nodes - r.child_counts.map_nodes;
+        e.allocated.other_nodes += total.other_nodes - r.child_counts.other_nodes;
+        nodes_[r.node].exclusive_ns += elapsed - r.child_ns;
+
+        records_.pop_back();
+
+        if(!records_.empty())
+        {
+            Record& parent(records_.back());
+            parent.child_ns += elapsed;
+            parent.child_counts.list_nodes  += total.list_nodes;
+            parent.child_counts.map_nodes   += total.map_nodes;
+            parent.child_counts.other_nodes += total.other_nodes;
+        }
+    }
+
+    ListPool&                                     list_pool_;
+    MapPool&                                      map_pool_;
+    VectorPool&                                   vector_pool_;
+    SortedMapPool&                                sorted_map_pool_;
+    const Symbol*                                 toplevel_;
+    const Symbol*                                 primitive_;
+    std::vector<Entry>                            entries_;
+    std::unordered_map<const Symbol*, size_t>     index_;
+    std::vector<Node>                             nodes_;
+    std::vector<std::pair<size_t, size_t>>        roots_;   //> Entry and node of outermost calls.
+    std::vector<Record>                           records_;
+};
+
+/** Stack machine executing compiled code. Calls between compiled functions do
+ *  not recurse on the C++ stack, only calls through primitives (map, iter) do.
+ *  A frame is a window of the value stack: the called function value, then the
+ *  parameter and local slots, then temporaries. */
+class Machine
 {
-    Value a;
-    a.value.number.set(i);
-    a.type = NUMBER;
-    return a;
+public:
+    struct Frame{
+        const Proto* proto;
+        Closure*     closure; //> Owned by the function value below base. Null at top level.
+        size_t       ip;
+        size_t       base;
+
+        Frame(const Proto* p, Closure* c, size_t b):proto(p), closure(c), ip(0), base(b){}
+    };
+
+    Machine(Profiler& profiler):profiler_(profiler){stack_.reserve(1024);}
+
+    /** Run top level code in the root env. */
+    Value execute(Masp& m, const std::shared_ptr<Proto>& proto);
+
+    /** Call function value with arguments. Used by primitives calling back to masp code. */
+    Value call(Masp& m, const Value& fun, Vector& args, Map& env);
+
+    /** Mark values held by running frames for the gc visit. */
+    void increment_references(uint32_t visit);
+
+    /** Shade values held by running frames for the incremental collector. */
+    void shade_roots(uint32_t visit);
+
+    /** Drop the values held by frames. */
+    void clear()
+    {
+        open_upvalues_.clear();
+        frames_.clear();
+        stack_.clear();
+    }
+
+private:
+    Value run(Masp& m, size_t entry_depth);
+    void  enter(size_t callee, size_t argc);
+    void  close_upvalues(size_t stack_height);
+    void  unwind(size_t frame_count, size_t stack_height);
+    std::shared_ptr<Upvalue> capture(size_t index);
+
+    Value& upvalue_ref(Upvalue& u){return u.open ? stack_[u.index] : u.closed;}
+
+    std::vector<Value>                    stack_;
+    std::vector<Frame>                    frames_;
+    std::vector<std::shared_ptr<Upvalue>> open_upvalues_; //> Sorted by stack index.
+    ArgStack                              args_;          //> Arguments of running primitives.
+    Profiler&                             profiler_;
+};
+
+/** Compiled top level forms of an imported file. */
+struct Module{
+    uint64_t                            hash;  //> Content hash of the source.
+    std::vector<std::shared_ptr<Proto>> forms;
+};
+
+/** Modules imported by path. The size and modification time of the file at import
+ *  tell whether the file must be read again. */
+class ModuleCache
+{
+public:
+    struct Entry{
+        uint64_t                size;
+        int64_t                 modified;
+        std::shared_ptr<Module> module;
+    };
+
+    std::unordered_map<std::string, Entry> entries;
+    std::string                            directory; //> Directory of precompiled module files.
+    ModuleStats                            stats;
+
+    /** Mark values held by the compiled forms for the gc visit. */
+    void increment_references(uint32_t visit);
+
+    /** Shade values held by the compiled forms for the incremental collector. */
+    void shade_roots(uint32_t visit);
+};
+
+///// Masp::Env //////
+
+
+// Custom Garbage collection to remove dangling references.
+namespace {
+
+void value_increment_references(const Value& v, uint32_t visit);
+void map_increment_references(Map& map, uint32_t visit);
+void sorted_map_increment_references(SortedMap& map, uint32_t visit);
+void vector_increment_references(PVector& vector, uint32_t visit);
+
+/** Call visit with the values held by a lazy sequence: the realized elements and the values
+ *  read or called by the source of the unrealized chunk. Chunks already stamped with gc_visit,
+ *  the id of the running collection, are skipped with the chunks following them.*/
+template<class F>
+void lazy_seq_for_each_value(const LazySeq& seq, uint32_t gc_visit, F visit)
+{
+    for(SeqChunk* c = seq.chunk.get(); c && c->gc_visit != gc_visit; c = c->next.get())
+    {
+        c->gc_visit = gc_visit;
+        for(auto& e : c->elements) visit(e);
+
+        if(SeqSource* source = c->source.get())
+        {
+            visit(source->collection);
+            for(auto& stage : source->stages)
+            {
+                visit(stage.fun);
+                for(auto& p : stage.pending) visit(p);
+            }
+            lazy_seq_for_each_value(source->seq, gc_visit, visit);
+        }
+    }
 }
 
-Value make_value_number(double d)
+void proto_increment_references(const Proto& proto, uint32_t visit)
 {
-    Value a;
-    a.value.number.set(d);
-    a.type = NUMBER;
-    return a;
+    for(auto& c : proto.constants) value_increment_references(c, visit);
+    for(auto& p : proto.protos) proto_increment_references(*p, visit);
 }
 
-Value make_value_string(const char* str)
+void list_increment_references(List& list, uint32_t visit)
 {
-    Value a;
-    a.type = STRING;
-    a.alloc_str(str);
-    return a;
+#ifdef PRINT_GC
+    std::cout << "#Inc: List" << std::endl;
+#endif
+    list.increment_ref();
+    auto e = list.end();
+    for(auto i = list.begin(); i != e; ++i)
+    {
+        value_increment_references(*i, visit);
+    }
 }
 
-Value make_value_string(const std::string& str)
+void value_increment_references(const Value& v, uint32_t visit)
 {
-    Value a;
-    a.type = STRING;
-    a.alloc_str(str);
-    return a;
+    if(v.type == MAP)
+    {
+        map_increment_references(*value_map(v), visit);
+    }
+    else if(v.type == LIST)
+    {
+        list_increment_references(*value_list(v), visit);
+    }
+    else if(v.type == SORTED_MAP)
+    {
+        sorted_map_increment_references(*value_sorted_map(v), visit);
+    }
+    else if(v.type == VECTOR)
+    {
+        vector_increment_references(*value_vector(v), visit);
+    }
+    else if(v.type == LAZY_SEQ)
+    {
+        lazy_seq_for_each_value(*v.value.lazy_seq, visit, [visit](const Value& e){value_increment_references(e, visit);});
+    }
+    else if(v.type == FUNCTION && v.value.function->closure)
+    {
+        Closure& c(*v.value.function->closure);
+        if(c.gc_visit == visit) return;
+        c.gc_visit = visit;
+        for(auto& u : c.upvalues) if(!u->open) value_increment_references(u->closed, visit);
+        proto_increment_references(*c.proto, visit);
+    }
 }
 
-Value make_value_string(const char* str, const char* str_end)
+void vector_increment_references(PVector& vector, uint32_t visit)
 {
-    Value a;
-    a.type = STRING;
-    a.alloc_str(str, str_end);
-    return a;
+    vector.increment_ref();
+    auto e = vector.end();
+    for(auto i = vector.begin(); i != e; ++i)
+    {
+        value_increment_references(*i, visit);
+    }
 }
 
+void sorted_map_increment_references(SortedMap& map, uint32_t visit)
+{
+    map.increment_ref();
+    auto e = map.end();
+    for(auto i = map.begin(); i != e; ++i)
+    {
+        value_increment_references(i->second, visit);
+    }
+}
 
-Value make_value_symbol(const char* str)
+void map_increment_references(Map& map, uint32_t visit)
 {
-    Value a;
-    a.type = SYMBOL;
-    a.alloc_str(str);
-    return a;
+#ifdef PRINT_GC
+    std::cout << "#Inc: Map" << std::endl;
+#endif
+    map.increment_ref();
+    auto e = map.end();
+    for(auto i = map.begin(); i != e; ++i)
+    {
+        value_increment_references(i->first, visit);
+        value_increment_references(i->second, visit);
+    }
 }
 
-Value make_value_symbol(const char* str, const char* str_end)
+
+void collect_pools_with_roots(MapPool& map_pool, ListPool& list_pool, VectorPool& vector_pool, SortedMapPool& sorted_map_pool,
+                              Map& map, Machine& machine, ModuleCache& modules, uint32_t visit)
 {
-    Value a;
-    a.type = SYMBOL;
-    a.alloc_str(str, str_end);
-    return a;
+    // Mark all cells that can be visited only through root node
+    // #1 Set reference counts to zero for all roots.
+    // #2 Follow all references through map. For any map or list root cells increment
+    //    reference count.
+    // #3 Run garbage collection 
+    // Caveats: If the dereferenced cells contain data to which a pointer is stored in 
+    // some of the remaining cells, and it is deleted, the pointer is now invalid.
+    // Handles held outside the interpreter are not counted either, so the pools must not be
+    // shared through glh::Published.
+    map_pool.clear_root_refcounts();
+    list_pool.clear_root_refcounts();
+    vector_pool.clear_root_refcounts();
+    sorted_map_pool.clear_root_refcounts();
+
+    map_increment_references(map, visit);
+    machine.increment_references(visit);
+    modules.increment_references(visit);
+
+    // Sweeping a pool destroys values that hold references to the roots of the other pools,
+    // which would leave the counts of reachable roots too low. Prune and mark all pools first.
+    map_pool.gc_mark();
+    list_pool.gc_mark();
+    vector_pool.gc_mark();
+    sorted_map_pool.gc_mark();
+
+    map_pool.gc_sweep();
+    list_pool.gc_sweep();
+    vector_pool.gc_sweep();
+    sorted_map_pool.gc_sweep();
 }
 
-Value make_value_list(Masp& m)
+void value_shade(const Value& v, uint32_t visit);
+
+void proto_shade(const Proto& proto, uint32_t visit)
 {
-    Value a;
-    a.type = LIST;
-    List* list_ptr = new_list_alloc(m);
-    a.value.list = list_ptr;
-    return a;
+    for(auto& c : proto.constants) value_shade(c, visit);
+    for(auto& p : proto.protos) proto_shade(*p, visit);
 }
 
-Value make_value_list(const List& oldlist)
+/** Shade the pool roots held by value for the incremental collector.*/
+void value_shade(const Value& v, uint32_t visit)
 {
-    Value a;
-    a.type = LIST;
-    List* list_ptr = new List(oldlist);
-    a.value.list = list_ptr;
-    return a;
+    if(v.type == MAP)
+    {
+        value_map(v)->shade();
+    }
+    else if(v.type == LIST)
+    {
+        value_list(v)->shade();
+    }
+    else if(v.type == SORTED_MAP)
+    {
+        value_sorted_map(v)->shade();
+    }
+    else if(v.type == VECTOR)
+    {
+        value_vector(v)->shade();
+    }
+    else if(v.type == LAZY_SEQ)
+    {
+        lazy_seq_for_each_value(*v.value.lazy_seq, visit, [visit](const Value& e){value_shade(e, visit);});
+    }
+    else if(v.type == FUNCTION && v.value.function->closure)
+    {
+        Closure& c(*v.value.function->closure);
+        if(c.gc_visit == visit) return;
+        c.gc_visit = visit;
+        for(auto& u : c.upvalues) if(!u->open) value_shade(u->closed, visit);
+        proto_shade(*c.proto, visit);
+    }
 }
 
+struct ShadeValue{
+    uint32_t visit; //> Id of the running collection.
+    ShadeValue():visit(0){}
+    void operator()(const Value& v) const {value_shade(v, visit);}
+};
 
-Value* make_value_list_alloc(Masp& m)
+/** Incremental tri-color collector over the map, list, vector and sorted map pools. Marked slots are black,
+ *  shaded nodes waiting in the pools' gray stacks are gray and the rest are white. A
+ *  cycle shades the roots, marks in steps and then sweeps the pools a few chunks at a
+ *  time. The pools shade every root handed to a new handle while marking, so values
+ *  created or copied between steps are not lost. */
+class IncrementalCollector
 {
-    Value* a = new Value();
-    a->type = LIST;
-    List* list_ptr = new_list_alloc(m);
-    a->value.list = list_ptr;
-    return a;
+public:
+    enum Phase{IDLE, MARK, SWEEP};
+
+    enum{WORK_SLICE = 64}; //> Work done between checks of the time budget.
+
+    IncrementalCollector():phase_(IDLE), remarked_(false), visit_(0){}
+
+    /** Abandon the running cycle. The pools reset their own state on a full collection.*/
+    void reset(){phase_ = IDLE;}
+
+    /** Return a new id for a traversal of the values. Closures and sequence chunks stamped with
+     *  the id are visited once. Each interpreter counts its own collections, so workers
+     *  collecting at the same time do not share the stamps. */
+    uint32_t begin_visit(){return ++visit_;}
+
+    bool step(MapPool& map_pool, ListPool& list_pool, VectorPool& vector_pool, SortedMapPool& sorted_map_pool,
+              Map& env, Machine& machine, ModuleCache& modules, size_t work_budget, double time_budget_ms)
+    {
+        typedef std::chrono::high_resolution_clock clock;
+        auto start = clock::now();
+        auto elapsed_ms = [&start](){return std::chrono::duration<double, std::milli>(clock::now() - start).count();};
+
+        bool done = false;
+
+        if(phase_ == IDLE)
+        {
+            map_pool.begin_incremental();
+            list_pool.begin_incremental();
+            vector_pool.begin_incremental();
+            sorted_map_pool.begin_incremental();
+            shade_.visit = begin_visit();
+            shade_roots(env, machine, modules);
+            remarked_ = false;
+            phase_ = MARK;
+        }
+
+        while(work_budget > 0 && !done)
+        {
+            size_t slice = std::min<size_t>(work_budget, WORK_SLICE);
+            size_t work = slice;
+
+            if(phase_ == MARK)
+            {
+                work = map_pool.mark_step(slice, shade_) + list_pool.mark_step(slice, shade_) +
+                       vector_pool.mark_step(slice, shade_) + sorted_map_pool.mark_step(slice, shade_);
+
+                if(map_pool.marking_done() && list_pool.marking_done() && vector_pool.marking_done() &&
+                   sorted_map_pool.marking_done())
+                {
+                    if(!remarked_)
+                    {
+                        // Roots may have changed since the cycle began. Marking stops at black
+                        // nodes, so this only visits what was added after the first shading.
+                        // Closures and sequence chunks stamped by the first shading may have
+                        // been changed since, so they are visited again with a new id.
+                        shade_.visit = begin_visit();
+                        shade_roots(env, machine, modules);
+                        remarked_ = true;
+                    }
+                    else
+                    {
+                        map_pool.begin_sweep();
+                        list_pool.begin_sweep();
+                        vector_pool.begin_sweep();
+                        sorted_map_pool.begin_sweep();
+                        phase_ = SWEEP;
+                    }
+                }
+                work = std::max<size_t>(work, 1);
+            }
+            else
+            {
+                size_t chunks = slice;
+                if(map_pool.sweep_step(chunks) && list_pool.sweep_step(chunks) && vector_pool.sweep_step(chunks) &&
+                   sorted_map_pool.sweep_step(chunks))
+                {
+                    phase_ = IDLE;
+                    done = true;
+                }
+                work = slice - chunks;
+                work = std::max<size_t>(work, 1);
+            }
+
+            work_budget -= std::min(work, work_budget);
+            if(time_budget_ms > 0.0 && elapsed_ms() >= time_budget_ms) break;
+        }
+
+        double pause = elapsed_ms();
+        ++stats.steps;
+        if(done) ++stats.incremental_cycles;
+        add_pause(pause);
+
+        return done;
+    }
+
+    void add_pause(double pause_ms)
+    {
+        stats.last_pause_ms = pause_ms;
+        stats.max_pause_ms = std::max(stats.max_pause_ms, pause_ms);
+        stats.total_pause_ms += pause_ms;
+    }
+
+    GcStats stats;
+
+private:
+    void shade_roots(Map& env, Machine& machine, ModuleCache& modules)
+    {
+        env.shade();
+        machine.shade_roots(shade_.visit);
+        modules.shade_roots(shade_.visit);
+    }
+
+    Phase      phase_;
+    bool       remarked_; //> Roots were shaded again after marking first ran out.
+    uint32_t   visit_;    //> Id of the last traversal.
+    ShadeValue shade_;
+};
+
+}
+class Masp::Env
+{
+public:
+    Env():profiler_(list_pool_, map_pool_, vector_pool_, sorted_map_pool_), machine_(profiler_), worker_pool_(0)
+    {
+        env_.reset(new Map(map_pool_.new_map()));
+        load_default_env();
+        out_ = &std::cout;
+    }
+
+    ~Env()
+    {
+        // Release the handles held outside the pools before the pools free their nodes.
+        env_.reset();
+        machine_.clear();
+        modules_.entries.clear();
+        collector_.reset();
+
+        map_pool_.kill();
+        list_pool_.kill();
+        vector_pool_.kill();
+        sorted_map_pool_.kill();
+    }
+
+    size_t reserved_size_bytes()
+    {
+        return list_pool_.reserved_size_bytes() + map_pool_.reserved_size_bytes() + vector_pool_.reserved_size_bytes() +
+               sorted_map_pool_.reserved_size_bytes();
+    }
+
+    size_t live_size_bytes()
+    {
+        return list_pool_.live_size_bytes() + map_pool_.live_size_bytes() + vector_pool_.live_size_bytes() +
+               sorted_map_pool_.live_size_bytes();
+    }
+
+    void gc()
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        collector_.reset();
+        collect_pools_with_roots(map_pool_, list_pool_, vector_pool_, sorted_map_pool_, *env_, machine_, modules_,
+                                 collector_.begin_visit());
+
+        ++collector_.stats.full_collections;
+        collector_.add_pause(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+
+    bool gc_step(size_t work_budget, double time_budget_ms)
+    {
+        return collector_.step(map_pool_, list_pool_, vector_pool_, sorted_map_pool_, *env_, machine_, modules_, work_budget, time_budget_ms);
+    }
+
+    const GcStats& gc_stats() const {return collector_.stats;}
+
+    void add_fun(const char* name, PrimitiveFunction f);
+    void add_fun(const char* name, NativeFunction f);
+
+    void def(const Value& key, const Value& value);
+
+    void load_default_env();
+    void load_default_extensions();
+
+    Map& get_env(){return *env_;}
+
+    // Locals
+    MapPool              map_pool_;
+    ListPool             list_pool_;
+    VectorPool           vector_pool_;
+    SortedMapPool        sorted_map_pool_;
+    std::unique_ptr<Map> env_;
+    std::ostream*        out_;
+    Profiler             profiler_;
+    Machine              machine_;
+    ModuleCache          modules_;
+    IncrementalCollector collector_;
+    MaspPool*            worker_pool_; //> Pool pmap and pfor run on. Not owned.
+};
+
+
+inline List new_list(Masp& m){return m.env()->list_pool_.new_list();}
+
+template<class Cont>
+inline List new_list(Masp& m, const Cont& container){return m.env()->list_pool_.new_list(container);}
+
+inline List* new_list_alloc(Masp& m)
+{
+    return new List(m.env()->list_pool_.new_list());
+}
+
+inline Map* new_map_alloc(Masp& m)
+{
+    return new Map(m.env()->map_pool_.new_map());
+}
+
+inline MapPool& map_pool(Masp& m){return m.env()->map_pool_;}
+
+inline VectorPool& vector_pool(Masp& m){return m.env()->vector_pool_;}
+
+inline SortedMapPool& sorted_map_pool(Masp& m){return m.env()->sorted_map_pool_;}
+
+inline PVector* new_vector_alloc(Masp& m)
+{
+    return new PVector(m.env()->vector_pool_.new_vector());
+}
+
+inline Map new_map(Masp& m)
+{
+    return m.env()->map_pool_.new_map();
+}
+
+/** Values that hold no reference counts, so copying and hashing them from several threads is safe.*/
+inline bool is_plain_value(const Value& v)
+{
+    return v.type == NIL || v.type == BOOLEAN || v.type == NUMBER || v.type == SYMBOL;
+}
+
+/** Return map with entries added. Large maps of plain keys and values are built by several threads.*/
+inline Map map_add_entries(Masp& m, const Map& map, std::vector<MapPool::KeyValue>& entries)
+{
+    size_t thread_count = 1;
+    if(entries.size() >= PARALLEL_BUILD_MIN_SIZE &&
+       std::all_of(entries.begin(), entries.end(), [](const MapPool::KeyValue& e){return is_plain_value(e.first) && is_plain_value(e.second);}))
+    {
+        thread_count = std::max(tthread::thread::hardware_concurrency(), 1u);
+    }
+    return map_pool(m).add_entries(map, entries, thread_count);
+}
+
+// Value factories
+
+Value make_value_number(const Number& num)
+{
+    Value a;
+    a.value.number.set(num);
+    a.type = NUMBER;
+    return a;
+}
+
+Value make_value_number(int i)
+{
+    Value a;
+    a.value.number.set(i);
+    a.type = NUMBER;
+    return a;
+}
+
+Value make_value_number(double d)
+{
+    Value a;
+    a.value.number.set(d);
+    a.type = NUMBER;
+    return a;
+}
+
+Value make_value_string(const char* str)
+{
+    Value a;
+    a.type = STRING;
+    a.alloc_str(str);
+    return a;
+}
+
+Value make_value_string(const std::string& str)
+{
+    Value a;
+    a.type = STRING;
+    a.alloc_str(str);
+    return a;
+}
+
+Value make_value_string(const char* str, const char* str_end)
+{
+    Value a;
+    a.type = STRING;
+    a.alloc_str(str, str_end);
+    return a;
+}
+
+Value make_value_substring(const Value& str, size_t start, size_t end)
+{
+    Value a;
+    if(str.type == STRING)
+    {
+        a.type = STRING;
+        a.value.string = StringData::slice(str.value.string, start, end);
+    }
+    return a;
+}
+
+Value make_value_symbol(const char* str)
+{
+    return make_value_symbol(str, str + strlen(str));
+}
+
+Value make_value_symbol(const char* str, const char* str_end)
+{
+    Value a;
+    a.type = SYMBOL;
+    a.value.symbol = intern_symbol(str, str_end);
+    return a;
+}
+
+Value make_value_list(Masp& m)
+{
+    Value a;
+    a.type = LIST;
+    List* list_ptr = new_list_alloc(m);
+    a.value.list = list_ptr;
+    return a;
+}
+
+Value make_value_list(const List& oldlist)
+{
+    Value a;
+    a.type = LIST;
+    List* list_ptr = new List(oldlist);
+    a.value.list = list_ptr;
+    return a;
+}
+
+
+Value* make_value_list_alloc(Masp& m)
+{
+    Value* a = new Value();
+    a->type = LIST;
+    List* list_ptr = new_list_alloc(m);
+    a->value.list = list_ptr;
+    return a;
+}
+
+Value make_value_map(Masp& m)
+{
+    Value a;
+    a.type = MAP;
+    Map* map_ptr = new_map_alloc(m);
+    a.value.map = map_ptr;
+    return a;
+}
+
+Value make_value_map(const Map& oldmap)
+{
+    Value a;
+    a.type = MAP;
+    Map* map_ptr = new Map(oldmap);
+    a.value.map = map_ptr;
+    return a;
+}
+
+Value make_value_sorted_map(Masp& m)
+{
+    Value a;
+    a.type = SORTED_MAP;
+    a.value.sorted_map = new SortedMap(sorted_map_pool(m).new_map());
+    return a;
+}
+
+Value make_value_sorted_map(const SortedMap& oldmap)
+{
+    Value a;
+    a.type = SORTED_MAP;
+    a.value.sorted_map = new SortedMap(oldmap);
+    return a;
+}
+
+Value make_value_lazy_seq(const LazySeq& seq)
+{
+    Value a;
+    a.type = LAZY_SEQ;
+    a.value.lazy_seq = new LazySeq(seq);
+    return a;
+}
+
+/** Return sequence of the elements produced by source.*/
+Value make_value_lazy_seq(const std::shared_ptr<SeqSource>& source)
+{
+    std::shared_ptr<SeqChunk> chunk(std::make_shared<SeqChunk>());
+    chunk->source = source;
+    return make_value_lazy_seq(LazySeq(chunk, 0));
+}
+
+Value make_value_function(PrimitiveFunction f)
+{
+    Value v;
+    v.type = FUNCTION;
+    v.value.function = new Function();
+    v.value.function->fun = f;
+    return v;
+
+}
+
+Value make_value_function(NativeFunction f)
+{
+    Value v;
+    v.type = FUNCTION;
+    v.value.function = new Function();
+    v.value.function->native = f;
+    return v;
+}
+
+Value make_value_object(IObject* alloced_object)
+{
+    Value a;
+    a.type = OBJECT;
+    a.value.object = alloced_object;
+    return a;
+}
+
+Value make_value_vector(Masp& m)
+{
+    Value a;
+    a.type = VECTOR;
+    a.value.vector = new_vector_alloc(m);
+    return a;
+}
+
+Value make_value_vector(const PVector& oldvec)
+{
+    Value a;
+    a.type = VECTOR;
+    a.value.vector = new PVector(oldvec);
+    return a;
+}
+
+template<class I>
+Value make_value_vector(Masp& m, I begin, I end)
+{
+    return make_value_vector(vector_pool(m).new_vector(begin, end));
+}
+
+
+Value make_value_number_array()
+{
+    // TODO ?
+    Value a;
+    a.type = NUMBER_ARRAY;
+    a.value.number_array = new NumberArray();
+    return a;
+}
+
+Value make_value_boolean(bool b)
+{
+    Value v;
+    v.type = BOOLEAN;
+    v.value.boolean = b;
+    return v;
+}
+
+bool type_is(Value& v, Type t){return v.type == t;}
+
+///// Utility functions /////
+
+static inline bool is_digit(char c){return isdigit(c) != 0;}
+static inline bool is_space(char c){return (isspace(c) != 0) || (c == ',');}
+
+const char* g_delimiters = "(){}[];'";
+
+enum DelimEnum{
+    LEFT_PAREN    = 0,
+    RIGHT_PAREN   = 1,
+    LEFT_BRACE    = 2,
+    RIGHT_BRACE   = 3,
+    LEFT_BRACKET  = 4,
+    RIGHT_BRACKET = 5,
+    SEMICOLON     = 6,
+    QUOTE         = 7
+};
+
+/** Character classes for the lexer. A token ends at CHAR_TOKEN_END. */
+enum CharClass{
+    CHAR_SPACE     = 1,
+    CHAR_DELIMITER = 2,
+    CHAR_DIGIT     = 4,
+    CHAR_HEX       = 8,
+    CHAR_NUL       = 16,
+    CHAR_TOKEN_END = CHAR_SPACE | CHAR_DELIMITER | CHAR_NUL
+};
+
+struct CharClassTable
+{
+    uint8_t cls[256];
+
+    CharClassTable()
+    {
+        for(int i = 0; i < 256; ++i)
+        {
+            char c = (char) i;
+            uint8_t k = 0;
+            if(isspace(i) || c == ',')          k |= CHAR_SPACE;
+            if(c && strchr(g_delimiters, c))    k |= CHAR_DELIMITER;
+            if(c >= '0' && c <= '9')            k |= CHAR_DIGIT | CHAR_HEX;
+            if((c | 0x20) >= 'a' && (c | 0x20) <= 'f') k |= CHAR_HEX;
+            if(c == '\0')                       k |= CHAR_NUL;
+            cls[i] = k;
+        }
+    }
+
+    bool is(char c, uint8_t k) const {return (cls[(uint8_t) c] & k) != 0;}
+};
+
+static const CharClassTable g_char_class;
+
+/** Return pointer either to the next newline ('\n') or to the end of the given range.
+*/
+const char* to_newline(const char* begin, const char* end)
+{
+    const char* c = begin;
+    while(c != end && *c != '\n'){c++;}
+    return c;
+}
+
+/** Return pointer to end of string. Returns the pointer to the last
+ *  quote in strings delimited with " -characters.
+ *
+ *  @param begin Pointer to first element after the initial " in the string.
+ *  @param end   Pointer to the null termination character for the string.
+ *  @return      Pointer to the delimiting " in a string or to the end of the given range.
+ */
+static const char* last_quote_of_string(const char* begin, const char* end)
+{
+    const char* c = begin;
+
+    while(c != end)
+    {
+        if(*c == '\\')
+        {
+            c++;
+            if(c == end) return c;
+        }
+        else if(*c == '"') 
+        {
+            return c;
+        }
+
+        c++;
+    }
+
+    return c;
+}
+
+/** Match the pattern to the beginning of the given range.
+ * @param pattern        Pattern to match
+ * @param pattern_length Length of pattern (equalent to to strlen).
+ * @param begin          Beginning of the range to scan.
+ * @param end            End of the range to scan.
+ * @return               True if the pattern matched the beginning of the range, otherwise false.
+*/
+static bool match_string(const char* pattern, const size_t pattern_length, const char* begin, const char* end)
+{
+    bool result = false;
+    size_t length = end - begin;
+    if(length >= pattern_length)
+    {
+        size_t i = 0;
+        const char* c = begin;
+        result = true;
+        while(i++ < pattern_length && result){result = *pattern++ == *c++;}
+    }
+    return result;
+}
+
+/** Look for the character in the given null terminated string. If value found return index of character in string. */
+static int pos_in_string(const char c, const char* str)
+{
+    const char* ptr = str;
+    while(c != *ptr && *(++ptr)){}
+    if(*ptr) return ptr - str;
+    else return - 1;
+}
+
+static bool is_in_string(const char c, const char* str)
+{
+    return pos_in_string(c, str) >= 0;
+}
+
+static bool is_delimiter(const char c)
+{
+    return is_in_string(c, g_delimiters);
+}
+
+static bool equal(const char* str_1, const char* str_2)
+{
+    return (strcmp(str_1, str_2) == 0);
+}
+
+static bool string_value_is(const Value& v, const char* str)
+{
+    return (v.type == STRING) ? (strcmp(v.value.string->c_str(), str) == 0) : false;
+}
+
+static bool symbol_value_is(const Value& v, const char* str)
+{
+    return (v.type == SYMBOL) ? (strcmp(v.value.symbol->name.c_str(), str) == 0) : false;
+}
+
+static bool match_range(const char* begin, const char* end, const char*str)
+{
+    while(*str && begin != end && *str == *begin){str++;begin++;}
+    if(*str || begin != end) return false;
+    else return true;
+}
+
+struct ScopeError
+{
+    /* If scope left open, return character of scope opening and number of line where scope was opened.
+       If scope scoped pre-emptively, return line of error and and the faulty closing symbol.
+    */
+    enum Result{SCOPE_LEFT_OPEN, FAULTY_SCOPE_CLOSING, OK};
+    Result result;
+    int line;
+    char scope;
+    int char_on_line;
+
+    ScopeError():result(OK){}
+    ScopeError(Result res,char c, int cn , int l):result(res), line(l), scope(c), char_on_line(cn){}
+
+    bool success(){return result == OK;}
+
+    std::string report()
+    {
+        if(result == OK) return std::string("Scope ok");
+        else if(result == SCOPE_LEFT_OPEN)
+        {
+            std::ostringstream os;
+            os << "Scope "  << scope << "at character " << char_on_line << " at line " << line << " not closed.";
+            return os.str();
+        }
+        else if(result == FAULTY_SCOPE_CLOSING)
+        {
+            std::ostringstream os;
+            os << "Excess scope closing "  << scope << " at character " << char_on_line << " at line " << line  << ".";
+            return os.str();
+        }
+
+        return std::string("");
+    }
+};
+
+/** Verify that given scope delimiters balance out.
+ *  The scope start and scope end arrays must be of equal length and contain start and end characters symmetrical
+ *  positions such that scope_start[i] and scope_end[i] contain a character pair for a particular scope.
+ *  @param scope_start string of scope begin characters.
+ *  @param scope_end   string of scope end characters.
+ *  @return ScopeError containing the result of the check.
+*/
+
+static ScopeError check_scope(const char* begin, const char* end, const char* comment, const char* scope_start, const char* scope_end)
+{
+    using namespace std;
+
+    const char* c              = begin;
+    const char* line_start_c   = c;
+    size_t      comment_length = strlen(comment);
+    int         line_number    = 0;
+
+    std::stack<std::pair<int, std::pair<int, int>>> expected_closing; // Scope index; line number
+
+    while(c < end)
+    {
+        if(*c == '\n') line_start_c = c;
+
+        if(match_string(comment, comment_length, c, end))
+        {
+            c = to_newline(c, end);
+            line_start_c = c;
+            line_number++;
+        }
+
+        int scope_start_index = pos_in_string(*c, scope_start);
+        int scope_end_index = pos_in_string(*c, scope_end);
+
+        if(*c == '"')
+        {
+            c = last_quote_of_string(c+1, end);
+        }
+        else if(scope_start_index >= 0)
+        {
+            expected_closing.push(std::make_pair(scope_start_index, std::make_pair(c- line_start_c, line_number)));
+        }
+        else if(scope_end_index >= 0)
+        {
+            if(expected_closing.size() > 0 && expected_closing.top().first == scope_end_index)
+            {
+                expected_closing.pop();
+            }
+            else return ScopeError(ScopeError::FAULTY_SCOPE_CLOSING, *c, c - line_start_c, line_number);
+        }
+
+        c++;
+    }
+
+    if(expected_closing.size() > 0)
+    {
+        int scp; std::pair<int,int> col_line;
+        std::tie(scp, col_line) = expected_closing.top();
+        return ScopeError(ScopeError::SCOPE_LEFT_OPEN, scope_start[scp] , col_line.first , col_line.second);
+    }
+
+    return ScopeError();
+}
+
+/** Parse string to atom. Use one instance of AtomParser per string/atom pair. */
+class ValueParser
+{
+public:
+
+    Masp& masp_;
+
+    ValueParser(Masp& masp):masp_(masp)
+    {
+        reading_string = false;
+    }
+
+    bool reading_string;
+
+    // TODO: Write explanation of the parsing sequence
+    //
+    // a. Unless reading string symbols are broken on ', whitespace, (, ) and ;;
+    // b. if reading string string is broken only when reading matching quote as on start
+    //    \- will escape the following quote
+
+    typedef const char* charptr;
+
+    charptr c_;
+    charptr end_;
+
+    bool is(char ch){return *c_ == ch;}
+
+    bool at_end(){return c_ >= end_;}
+
+    void init(const char* start, const char* end){c_ = start; end_ = end;}
+
+    const char* next(){return c_ + 1;}
+
+    void move_forward(){c_ = c_ + 1;}
+
+    void set(const char* chp){c_ = chp;}
+
+    void to_newline()
+    {
+        while(c_ != end_ && *c_ != '\n'){c_++;}
+    }
+
+    const char* parse_string()
+    {
+        return last_quote_of_string(next(),end_);
+    }
+
+    static bool at_token_end(const char* c, const char* end)
+    {
+        return c == end || g_char_class.is(*c, CHAR_TOKEN_END);
+    }
+
+    /** Convert a float token to double. The token is copied as strtod reads
+     *  until the first character that does not belong to the number. */
+    static double token_to_double(const char* begin, const char* end)
+    {
+        char   buffer[64];
+        size_t length = end - begin;
+
+        if(length < sizeof(buffer))
+        {
+            memcpy(buffer, begin, length);
+            buffer[length] = '\0';
+            return strtod(buffer, 0);
+        }
+
+        return strtod(std::string(begin, end).c_str(), 0);
+    }
+
+    /** Lex a number in a single pass. Accepts decimal integers ([-+]?[1-9][0-9]* or 0),
+     *  hexadecimal (0x) and binary (0b) integers and floats of the form
+     *  [-+]?[0-9]+(.[0-9]*)?([eE][-+]?[0-9]+)?. Other decimal literals such as -0 or 007
+     *  are floats. Integers wrap to int.
+     *  @param begin First character of the token.
+     *  @param end   End of the input.
+     *  @param out   Receives the number.
+     *  @return      Pointer past the number or null if the token is not a number.
+     */
+    static const char* lex_number(const char* begin, const char* end, Number& out)
+    {
+        const CharClassTable& k = g_char_class;
+        const char* c = begin;
+
+        bool negative = *c == '-';
+        bool has_sign = negative || *c == '+';
+        c += has_sign;
+
+        if(c == end || !k.is(*c, CHAR_DIGIT)) return 0;
+
+        const char* digits   = c;
+        uint64_t    mantissa = 0;
+
+        if(!has_sign && *c == '0' && (c + 1) != end && ((c[1] | 0x20) == 'x' || (c[1] | 0x20) == 'b'))
+        {
+            bool hex = (c[1] | 0x20) == 'x';
+            c += 2;
+            digits = c;
+
+            if(hex) for(; c != end && k.is(*c, CHAR_HEX); ++c) mantissa = (mantissa << 4) | (uint64_t)((*c & 0xf) + (*c >> 6) * 9);
+            else    for(; c != end && (*c & ~1) == '0'; ++c)   mantissa = (mantissa << 1) | (uint64_t)(*c - '0');
+
+            if(c == digits || !at_token_end(c, end)) return 0;
+
+            out.set((int) mantissa);
+            return c;
+        }
+
+        for(; c != end && k.is(*c, CHAR_DIGIT); ++c) mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+
+        bool is_float = false;
+
+        if(c != end && *c == '.')
+        {
+            is_float = true;
+            for(++c; c != end && k.is(*c, CHAR_DIGIT); ++c){}
+        }
+
+        if(c != end && (*c | 0x20) == 'e')
+        {
+            is_float = true;
+            ++c;
+            c += (c != end && (*c == '+' || *c == '-'));
+            const char* exponent = c;
+            for(; c != end && k.is(*c, CHAR_DIGIT); ++c){}
+            if(c == exponent) return 0;
+        }
+
+        if(!at_token_end(c, end)) return 0;
+
+        if(!is_float && (*digits != '0' || ((c - digits) == 1 && !has_sign)))
+        {
+            out.set((int)(negative ? (0 - mantissa) : mantissa));
+        }
+        else
+        {
+            out.set(token_to_double(begin, c));
+        }
+
+        return c;
+    }
+
+    bool parse_number(Number& out)
+    {
+        const char* end = lex_number(c_, end_, out);
+
+        if(end) c_ = end - 1;
+
+        return end != 0;
+    }
+
+    bool parse_symbol(const char** begin, const char** end)
+    {
+        *begin = c_;
+        const char* last = c_ + 1;
+        while(!at_token_end(last, end_)) last++;
+        *end = last;
+        return true;
+    }
+
+    std::string format_string(const char* begin, const char* end)
+    {
+        std::string result;
+        size_t len = end - begin + 1;
+        result.resize(len);
+        auto i = std::begin(result);
+        bool prevskip = false;
+
+        while(begin != end){
+            char c = *begin++;
+
+            if(prevskip){
+                     if(c == 'n') *i++ = '\n';
+                else if(c == 'r') *i++ = '\r';
+                else if(c == 't') *i++ = '\t';
+                else if(c == 'b') *i++ = '\b';
+                else if(c == 'f') *i++ = '\f';
+                else *i++ = c;
+                prevskip = false;
+            } else {
+                if(c == '\\') prevskip = true;
+                else *i++ = c;
+            }
+        }
+        result.erase(i, result.end());
+        //*i = '\0';
+        return result;
+    }
+
+    Value get_value()
+    {
+        Number tmp_number;
+        const char* tmp_string_begin;
+        const char* tmp_string_end;
+
+        if(is('"')) //> string
+        {
+            const charptr first = c_ + 1;
+            const charptr last = parse_string();
+            set(last + 1);
+            std::string formatted_string = format_string(first, last);
+            return make_value_string(formatted_string);
+        }
+        else if(is('(')) // Enter list
+        {
+            Value result = make_value_list(masp_);
+            move_forward();
+            recursive_parse(result);
+            return result;
+        }
+        else if(is('[')) // Enter vector
+        {
+            Value result = make_value_list(masp_);
+            move_forward();
+            recursive_parse(result);
+            *result.value.list = result.value.list->add(make_value_symbol("make-vector"));
+            return result;
+        }
+        else if(is('{')) // Enter map
+        {
+            Value result = make_value_list(masp_);
+            move_forward();
+            recursive_parse(result);
+            *result.value.list = result.value.list->add(make_value_symbol("make-map"));
+            return result;
+        }
+        else if(parse_number(tmp_number))
+        {
+            move_forward();
+            return make_value_number(tmp_number);
+        }
+        else if(parse_symbol(&tmp_string_begin, &tmp_string_end))
+        {
+            set(tmp_string_end);
+            if(match_range(tmp_string_begin, tmp_string_end, "nil")) return Value(); 
+            else if(match_range(tmp_string_begin, tmp_string_end, "true")) return make_value_boolean(true);
+            else if(match_range(tmp_string_begin, tmp_string_end, "false")) return make_value_boolean(false);
+            else return make_value_symbol(tmp_string_begin, tmp_string_end);
+        }
+        else
+        {
+            throw EvaluationException("get_value: Masp parse error.");
+            return Value();
+        }
+    }
+
+    void rewrite_defn(std::list<Value>& build_list, List* list_ptr)
+    {
+            if(build_list.size() < 4) throw EvaluationException("recursive_parse: defn must contain at least 3 params.");
+
+            // Decompose build list to parts
+            auto build_iter = build_list.begin(); //build_list := (defn iname ilambda_params)
+            auto iname = build_iter; ++iname;
+            auto ilambda_params = iname; ++ilambda_params;
+            auto iend = build_list.end();
+
+            std::list<Value> rewritten_list;
+            rewritten_list.push_back(make_value_symbol("def"));
+            rewritten_list.push_back(*iname);
+
+            // Compose lambda_expressions
+            std::list<Value> lambda_list;
+            lambda_list.push_back(make_value_symbol("fn"));
+            lambda_list.insert(lambda_list.end(), ilambda_params, iend);
+
+            // Alloc storage for value containing lambda expression
+            rewritten_list.push_back(make_value_list(masp_));
+            List* lambda_list_ptr = value_list(rewritten_list.back());
+            *lambda_list_ptr = new_list(masp_, lambda_list);
+
+            *list_ptr = new_list(masp_, rewritten_list);
+    }
+
+    void rewrite_member_call(std::list<Value>& build_list, List* list_ptr)
+    {
+        // (. fun obj params) :=  (((fnext obj) fun) (first obj) params)
+        //                                 map       sym
+        //                                    function
+        if(build_list.size() < 3) throw EvaluationException("recursive_parse: member call must contain at least 3 params.");
+
+        // Decompose build list to parts
+        auto build_iter = build_list.begin(); //build_list := (. funname obj params)
+        auto funname = build_iter; ++funname;
+        auto obj = funname; ++obj;
+        auto params = obj; ++params;
+        auto iend = build_list.end();
+
+        // TODO: Add 'verify object' call somewhere in order not to make object
+        // evaluation errors so inscrutable.
+
+        // Populate outer list.
+        std::list<Value> rewritten_list;
+
+        rewritten_list.push_back(make_value_list(masp_));
+        List* outermaplist = value_list(*rewritten_list.rbegin());
+        rewritten_list.push_back(make_value_list(masp_));
+        List* symcalllist = value_list(*rewritten_list.rbegin());
+        rewritten_list.insert(rewritten_list.end(), params, iend);
+
+        // Populate first inner list
+        *outermaplist = outermaplist->add(*funname);
+        Value innermaplist = make_value_list(masp_);
+        List* innermap = value_list(innermaplist);
+        *innermap = innermap->add(*obj);
+        *innermap = innermap->add(make_value_symbol("fnext"));
+        *outermaplist = outermaplist->add(innermaplist);
+
+        // Populate second inner list
+        *symcalllist =  symcalllist->add(*obj);
+        *symcalllist =  symcalllist->add(make_value_symbol("first"));
+
+        *list_ptr = new_list(masp_, rewritten_list);
+    }
+
+    /** Parse values to build_list until the end of input or until the current scope closes.
+     *  next_is_quoted carries a pending quote over calls when the input is parsed in blocks.
+     */
+    void parse_forms(std::list<Value>& build_list, bool& next_is_quoted)
+    {
+        while(! at_end())
+        {
+            if(is(';'))  //> Comment, go to newline
+            {
+                to_newline();
+                if(c_ != end_) move_forward();
+            }
+            else if(is(')') || is(']') || is('}')) // Exit container - scope was checked before this
+            {
+                move_forward();
+                break;
+            }
+            else if(g_char_class.is(*c_, CHAR_SPACE))
+            {
+                move_forward();
+                // Skip whitespace
+                // After this we know that the input is either number or symbol
+            }
+            else if(is('\''))
+            {
+                next_is_quoted = true;
+                move_forward();
+            }
+            else
+            {
+                // append to root  
+                // push_to_value(root, get_value());
+                Value v = get_value();
+                if(next_is_quoted)
+                {
+                    Value quote_sym = make_value_symbol("quote");
+                    Value outer = make_value_list(masp_);
+                    *(outer.value.list) = outer.value.list->add(v);
+                    *(outer.value.list) = outer.value.list->add(quote_sym);
+                    append_to_value_stl_list(build_list, outer);
+                    next_is_quoted = false;
+                }
+                else
+                {
+                    append_to_value_stl_list(build_list, v);
+                }
+            }
+
+            if(at_end()) break;
+        }
+    }
+
+    /** Store the parsed values to list_ptr. */
+    void finish_list(std::list<Value>& build_list, bool next_is_quoted, List* list_ptr)
+    {
+        if(next_is_quoted) // Quoted flag was not used.
+        {
+            throw EvaluationException("Quote cannot be empty.");
+        }
+
+        // Term rewritings that we prefer to do in parsing rather than evaluation stage ("poor mans macro system").
+        bool list_occupied = !build_list.empty();
+        if(list_occupied && build_list.front().is_str("defn"))
+        {
+            rewrite_defn(build_list, list_ptr);
+        }
+        else if(list_occupied && build_list.front().is_str("."))
+        {
+            rewrite_member_call(build_list, list_ptr);
+        }
+        else
+        {
+            *list_ptr = new_list(masp_, build_list);
+        }
+    }
+
+    void recursive_parse(Value& root)
+    {
+        if(glh::is_not(root.type, LIST))
+            throw EvaluationException("recursive_parse: root type is not LIST.");
+
+        std::list<Value> build_list;
+
+        bool next_is_quoted = false;
+
+        parse_forms(build_list, next_is_quoted);
+
+        finish_list(build_list, next_is_quoted, value_list(root));
+    }
+
+    masp_result parse(const char* str)
+    {
+        size_t size = strlen(str);
+        init(str, str + size);
+
+        ScopeError scope_result = check_scope(c_, end_, ";", "({[", ")}]");
+
+        if(!scope_result.success())
+        {
+            return masp_fail(scope_result.report());
+        }
+
+        Value* root = make_value_list_alloc(masp_);
+
+        try{
+            recursive_parse(*root);
+        }
+        catch(EvaluationException& e){
+            return masp_fail(e.get_message());
+        }
+
+        List* root_list = value_list(*root);
+        *root_list = root_list->add(make_value_symbol("begin"));
+
+        return masp_result(ValuePtr(root, ValueDeleter()));
+    }
+
+    /** Positions in a block of text after which the top level forms seen so far are complete. */
+    struct FormBoundary
+    {
+        int  depth;
+        bool in_string;
+        bool escape;
+        bool in_comment;
+
+        FormBoundary():depth(0), in_string(false), escape(false), in_comment(false){}
+
+        /** Scan text[begin, end) continuing from the previous call.
+         *  @return Position following the last whitespace outside scopes, strings and comments
+         *          or 0 if there is none.
+         */
+        size_t scan(const char* text, size_t begin, size_t end)
+        {
+            size_t cut = 0;
+
+            for(size_t i = begin; i < end; ++i)
+            {
+                char c = text[i];
+
+                if(in_comment)
+                {
+                    in_comment = c != '\n';
+                    if(!in_comment && depth == 0) cut = i + 1;
+                }
+                else if(in_string)
+                {
+                    if(escape)         escape = false;
+                    else if(c == '\\') escape = true;
+                    else if(c == '"')  in_string = false;
+                }
+                else if(c == '"') in_string = true;
+                else if(c == ';') in_comment = true;
+                else if(c == '(' || c == '[' || c == '{') depth++;
+                else if(c == ')' || c == ']' || c == '}') depth = depth > 0 ? depth - 1 : 0; // Excess closings are reported by check_scope
+                else if(depth == 0 && g_char_class.is(c, CHAR_SPACE)) cut = i + 1;
+            }
+
+            return cut;
+        }
+    };
+
+    /** Parse the stream in blocks. Each block is parsed up to the last point where all its top level
+     *  forms are complete and the parsed text is dropped before reading the next block, so only the
+     *  text of the form spanning the block boundary is kept in memory.
+     */
+    masp_result parse(std::istream& is)
+    {
+        const size_t block_size = 64 * 1024;
+
+        ValuePtr         root(make_value_list_alloc(masp_), ValueDeleter());
+        std::list<Value> build_list;
+        bool             next_is_quoted = false;
+        FormBoundary     boundary;
+        std::string      buffer;
+
+        try{
+            bool eof = false;
+
+            while(!eof)
+            {
+                size_t scanned = buffer.size();
+                buffer.resize(scanned + block_size);
+                is.read(&buffer[scanned], block_size);
+                buffer.resize(scanned + (size_t) is.gcount());
+                eof = !is;
+
+                size_t cut = eof ? buffer.size() : boundary.scan(buffer.data(), scanned, buffer.size());
+
+                if(cut > 0)
+                {
+                    const char* text = buffer.data();
+
+                    ScopeError scope_result = check_scope(text, text + cut, ";", "({[", ")}]");
+
+                    if(!scope_result.success())
+                    {
+                        return masp_fail(scope_result.report());
+                    }
+
+                    init(text, text + cut);
+                    parse_forms(build_list, next_is_quoted);
+                    buffer.erase(0, cut);
+                }
+            }
+
+            finish_list(build_list, next_is_quoted, value_list(*root));
+        }
+        catch(EvaluationException& e){
+            return masp_fail(e.get_message());
+        }
+
+        List* root_list = value_list(*root);
+        *root_list = root_list->add(make_value_symbol("begin"));
+
+        return masp_result(root);
+    }
+
+};
+
+////// Masp ///////
+
+Masp::Masp()
+{
+    env_ = new Env();
+}
+
+Masp::~Masp()
+{
+    delete env_;
+}
+
+Masp::Env* Masp::env(){return env_;}
+
+Map& Masp::env_map(){
+    return env_->get_env();
+}
+
+void Masp::gc(){env_->gc();}
+
+bool Masp::gc_step(size_t work_budget, double time_budget_ms){return env_->gc_step(work_budget, time_budget_ms);}
+
+const GcStats& Masp::gc_stats(){return env_->gc_stats();}
+
+void Masp::set_module_cache_dir(const char* dir){env_->modules_.directory = dir ? dir : "";}
+
+void Masp::set_worker_pool(MaspPool* pool){env_->worker_pool_ = pool;}
+
+const ModuleStats& Masp::module_stats(){return env_->modules_.stats;}
+
+void Masp::set_profiling(bool on){env_->profiler_.set_enabled(on);}
+
+bool Masp::profiling(){return env_->profiler_.enabled;}
+
+void Masp::reset_profile(){env_->profiler_.reset();}
+
+std::string Masp::profile_report(){return env_->profiler_.report();}
+
+std::string Masp::profile_collapsed_stacks(){return env_->profiler_.collapsed();}
+
+size_t Masp::reserved_size_bytes(){return env_->reserved_size_bytes();}
+
+size_t Masp::live_size_bytes(){return env_->live_size_bytes();}
+
+void Masp::set_output(std::ostream* os)
+{
+    if(env_) env_->out_ = os;
+}
+
+void Masp::set_args(int argc, char* argv[])
+{
+    Value argmap = make_value_map(*this);
+    Map* map     = value_map(argmap);
+
+    std::list<std::string> fixed_args;
+
+    for(int i = 0; i < argc; ++i){
+        std::string arg(argv[i]);
+        size_t pos = std::string::npos;
+        pos = arg.find('\\');
+        while(pos != std::string::npos){
+            if((arg.size() > (pos + 1)) && arg[pos + 1] == '\\'){
+                pos = pos + 1;
+            } else {
+                arg = arg.replace(pos, 1, "/");
+                pos = pos + 1;
+            }
+            pos = arg.find('\\', pos);
+        } 
+        fixed_args.push_back(arg);
+    }
+
+    int order = 0;
+    for(auto &f : fixed_args){
+        *map = map->add(make_value_number(order++), make_value_string(f));
+    }
+
+    env_->def(make_value_symbol("sys/args"), argmap);
+
+    //std::cout << "Args set" << std::endl;
+
+}
+
+/** Get handle to output stream.*/
+std::ostream& Masp::get_output()
+{
+    if(env_) return *(env_->out_);
+    else return std::cout;
+}
+
+///// Evaluation utilities /////
+
+masp_result masp_fail(const char* str){
+    return masp_result(std::string(str));
+}
+
+masp_result masp_fail(const std::string& str){
+    return masp_result(str);
+}
+
+masp_result string_to_value(Masp& m, const char* str)
+{
+    ValueParser parser(m);
+
+    return parser.parse(str);
+}
+
+masp_result stream_to_value(Masp& m, std::istream& is)
+{
+    ValueParser parser(m);
+
+    return parser.parse(is);
+}
+
+masp_result file_to_value(Masp& m, const char* file_path)
+{
+    InputFile file(file_path);
+
+    if(!file.is_open()) return masp_fail(std::string("Could not read file:") + file_path);
+
+    return stream_to_value(m, file.file());
+}
+
+typedef std::string (*PrefixHelper)(const Value& v);
+
+static void value_to_string_helper(std::ostream& os, const Value& v, PrefixHelper prfx)
+{
+    auto out = [&]()->std::ostream& {
+        if(prfx) os << prfx(v) << " ";
+        return os;
+    };
+
+    switch(v.type)
+    {
+        case NIL:{out() << "nil"; break;} // TODO: Do we need to print nill?
+        case BOOLEAN:
+        {
+            if(v.value.boolean) out() << "true";
+            else out() << "false";
+            break;
+        }
+        case NUMBER:
+        {
+            if(v.value.number.type == Number::INT)
+            {
+                out() << v.value.number.to_int();
+            }
+            else
+            {
+                out() << v.value.number.to_float();
+            }
+            break;
+        }
+        case SYMBOL:
+        {
+            out() << v.value.symbol->name;
+            break;
+        }
+        case STRING:
+        {
+            std::string esc("\"");
+            out() << esc;
+            os.write(v.value.string->chars, v.value.string->length);
+            os << esc;
+            break;
+        }
+        case LIST:
+        {
+            out() << "(";
+            List* lst_ptr = v.value.list;
+            for(auto i = lst_ptr->begin(); i != lst_ptr->end(); ++i)
+            {
+                value_to_string_helper(os, *i, prfx);
+                os << " ";
+            }
+            os << ")";
+            break;
+        }
+        case LAZY_SEQ:
+        {
+            out() << "(";
+            LazySeq seq(*v.value.lazy_seq);
+            for(const Value* e = seq.first(); e; seq.advance(), e = seq.first())
+            {
+                value_to_string_helper(os, *e, prfx);
+                os << " ";
+            }
+            os << ")";
+            break;
+        }
+        case MAP:
+        {
+            Map* map_ptr = v.value.map;
+            out() << "{";
+            auto mend = map_ptr->end();
+            for(auto m = map_ptr->begin(); m != mend; ++m)
+            {
+                value_to_string_helper(os, m->first, prfx);
+                os << " ";
+                value_to_string_helper(os, m->second, prfx);
+                os << " ";
+            }
+            os << "}";
+            break;
+        }
+        case SORTED_MAP:
+        {
+            SortedMap* map_ptr = v.value.sorted_map;
+            out() << "{";
+            for(auto m = map_ptr->begin(); m != map_ptr->end(); ++m)
+            {
+                value_to_string_helper(os, m->first, prfx);
+                os << " ";
+                value_to_string_helper(os, m->second, prfx);
+                os << " ";
+            }
+            os << "}";
+            break;
+        }
+        case VECTOR:
+        {
+            PVector* vec_ptr = v.value.vector;
+            out() << "[";
+            for(auto i = vec_ptr->begin(); i != vec_ptr->end(); ++i)
+            {
+                value_to_string_helper(os, *i, prfx);
+                os << " ";
+            }
+            os << "]";
+            break;
+        }
+        case FUNCTION:
+        {
+            //const std::type_info& funtype(v.value.function->fun.target_type());
+            //const char* fun_type_name = funtype.name();
+
+            out() << "<function>" ; // TODO: add function name to Function member.
+            break;
+        }
+        case OBJECT:
+        {
+            //const std::type_info& funtype(v.value.function->fun.target_type());
+            //const char* fun_type_name = funtype.name();
+
+            out() << "<object>" ; // TODO: add function name to Function member.
+            break;
+        }
+        // TODO: Number array
+        default:
+        {
+            local_assert("Implement output for type");
+        }
+    }
+}
+
+std::string value_to_string(const Value& v)
+{
+    std::ostringstream stream;
+    value_to_string_helper(stream, v, 0);
+    return stream.str();
+}
+
+std::ostream& operator<<(std::ostream& os, const Value& v){
+    os << value_to_string(v);
+    return os;
+}
+
+std::string value_type_to_string(const Value& v);
+
+std::string value_to_typed_string(const Value* v)
+{
+    std::ostringstream stream;
+    value_to_string_helper(stream, *v, value_type_to_string);
+    return stream.str();
+}
+
+
+std::string value_type_to_string(const Value& v)
+{
+    switch(v.type)
+    {
+        case NUMBER:
+        {
+            if(v.value.number.type == Number::INT) return std::string("NUMBER:INT");
+            else                                   return std::string("NUMBER:FLOAT");
+        }
+        case STRING:        return std::string("STRING");
+        case BOOLEAN:       return std::string("BOOLEAN");
+        case NIL:           return std::string("");
+        case SYMBOL:        return std::string("SYMBOL");
+        case VECTOR:        return std::string("VECTOR");
+        case LIST:          return std::string("LIST");
+        case MAP:           return std::string("MAP");
+        case SORTED_MAP:    return std::string("SORTED MAP");
+        case LAZY_SEQ:      return std::string("LAZY SEQ");
+        case OBJECT:        return std::string("OBJECT");
+        case NUMBER_ARRAY:  return std::string("NUMBER ARRAY");
+        case FUNCTION:           return std::string("FUNCTION");
+    }
+    return "";
+}
+
+
+// Evaluation utils.
+// Source is compiled to bytecode which is then run on a stack machine. The special
+// forms follow the simple Evaluator in 'Structure and Interpretation of Computer Programs'
+// (Steele 1996) Section 4.1.1 'The Core of the Evaluator'.
+
+namespace {
+
+/** Symbols naming the special forms. */
+struct SpecialForms
+{
+    const Symbol* quote;
+    const Symbol* def;
+    const Symbol* set;
+    const Symbol* if_;
+    const Symbol* fn;
+    const Symbol* begin;
+    const Symbol* cond;
+    const Symbol* else_;
+    const Symbol* make_vector;
+    const Symbol* loop;
+    const Symbol* recur;
+
+    static const Symbol* intern(const char* name){return intern_symbol(name, name + strlen(name));}
+
+    SpecialForms():quote(intern("quote")), def(intern("def")), set(intern("set")), if_(intern("if")),
+        fn(intern("fn")), begin(intern("begin")), cond(intern("cond")), else_(intern("else")),
+        make_vector(intern("make-vector")), loop(intern("loop")), recur(intern("recur")){}
+};
+
+const SpecialForms& special_forms()
+{
+    static SpecialForms forms;
+    return forms;
+}
+
+bool is_tagged_list(const Value& v, const Symbol* sym)
+{
+    const Value* first = value_list_first(v);
+    return first && first->type == SYMBOL && first->value.symbol == sym;
+}
+
+bool is_quoted(const Value& v){ return is_tagged_list(v, special_forms().quote);}
+bool is_assignment(const Value& v){ return is_tagged_list(v, special_forms().def);}
+bool is_reassignment(const Value& v){ return is_tagged_list(v, special_forms().set);}
+bool is_if(const Value& v){return is_tagged_list(v, special_forms().if_);} 
+bool is_lambda(const Value& v){return is_tagged_list(v, special_forms().fn);} 
+bool is_begin(const Value& v){return is_tagged_list(v, special_forms().begin);} 
+bool is_cond(const Value& v){return is_tagged_list(v, special_forms().cond);} 
+bool is_else(const Value& v){return is_tagged_list(v, special_forms().else_);}
+bool is_loop(const Value& v){return is_tagged_list(v, special_forms().loop);}
+bool is_recur(const Value& v){return is_tagged_list(v, special_forms().recur);}
+
+bool is_true(const Value& v)
+{
+    bool v_is_false = v.type == NIL || (v.type == BOOLEAN && (!v.value.boolean));
+    return !v_is_false;
+}
+
+const Value* assignment_var(const Value& v){return value_list_second(v);}
+const Value* assignment_value(const Value& v){return value_list_third(v);}
+
+/** Attempts to assign addresses to elements accessible through iterator range. 
+ *  @return false if range is shorter than the number of reference addresses.*/
+template<class IT, class PPTR>
+bool range_decompose(IT begin, IT end, PPTR a, PPTR b)
+{
+    bool result = true;
+
+    if(begin != end){ *a = &(*begin); ++begin;} else result = false;
+    if(begin != end){ *b = &(*begin); ++begin;} else result = false;
+
+    return result;
+}
+
+Value sequence_exp(const List& action)
+{
+    if(action.empty())
+        return make_value_list(action);
+    else if(!action.has_rest())
+        return *action.first();
+    else // make begin
+        return make_value_list(action.add(make_value_symbol("begin")));
+}
+
+// cond: expand-clauses
+Value expand_clauses(const List& clauses, Masp& masp)
+{
+    if(clauses.empty()) return Value();
+    else
+    {
+        const Value* first = clauses.first();
+        List rest = clauses.rest();
+
+        if(!first) throw EvaluationException(std::string("expand_clauses: Error interpreting cond clause"));
+
+        if(is_else(*first))
+        {
+            if(rest.empty())
+            {
+                // Sequence-exp
+                List ca = value_list(*first)->rest(); // cond-actions
+                return sequence_exp(ca);
+            }
+            else
+            {
+                throw EvaluationException(std::string("expand_clauses: ELSE clause isn't last - COND->iF"));
+            }
+        }
+        else
+        {
+            if(first->type != LIST) throw EvaluationException(std::string("expand_clauses: element is not a list as expected but:") + value_to_string(*first));
+
+            if(rest.empty())
+            {
+                throw EvaluationException(std::string("expand_clauses: Final case in cond is not an else case. Cond expression requires for else case to be final expression: (cond (... ...) (else ...))."));
+            }
+
+            // make-if
+
+            Value v_iflist = make_value_list(masp);
+            List* iflist = value_list(v_iflist);
+
+            // first : (pred ca)
+
+            const Value* pred = value_list_first(*first); 
+            const List     ca = value_list(*first)->rest(); // cond-actions : (pred ca) -> ca
+            Value         seq = sequence_exp(ca); // (foo bar) -> (begin foo bar) OR (foo) -> foo
+
+            Value     clauses = expand_clauses(rest, masp); // (if foo bar (if ...))
+
+            *iflist = iflist->add(clauses);
+            *iflist = iflist->add(seq);
+            *iflist = iflist->add(*pred);
+            *iflist = iflist->add(make_value_symbol("if"));
+            // iflist := (if pred seq clauses)
+
+            return v_iflist;
+        }
+    }
 }
 
-Value make_value_map(Masp& m)
+// cond: cond->if
+Value convert_cond_to_if(const Value& v, Masp& masp)
 {
-    Value a;
-    a.type = MAP;
-    Map* map_ptr = new_map_alloc(m);
-    a.value.map = map_ptr;
-    return a;
+    return expand_clauses(value_list(v)->rest(), masp); 
 }
 
-Value make_value_map(const Map& oldmap)
-{
-    Value a;
-    a.type = MAP;
-    Map* map_ptr = new Map(oldmap);
-    a.value.map = map_ptr;
-    return a;
-}
+bool is_primitive_procedure(const Value& v){return v.type == FUNCTION && !v.value.function->closure;}
+bool is_compound_procedure(const Value& v){return v.type == FUNCTION && v.value.function->closure;}
 
-Value make_value_function(PrimitiveFunction f)
+Value make_value_closure(const std::shared_ptr<Proto>& proto)
 {
     Value v;
     v.type = FUNCTION;
     v.value.function = new Function();
-    v.value.function->fun = f;
+    v.value.function->closure.reset(new Closure(proto));
     return v;
-
 }
 
-Value make_value_object(IObject* alloced_object)
+/** Translate value data structure to bytecode. Variables are resolved at compile
+ *  time: parameters, loop variables and defs within fn bodies to frame slots,
+ *  variables of enclosing functions to captured upvalues and everything else to
+ *  root env bindings that are looked up when run. */
+class Compiler
 {
-    Value a;
-    a.type = OBJECT;
-    a.value.object = alloced_object;
-    return a;
-}
+public:
+    Compiler(Masp& masp):masp_(masp), scope_(0), def_name_(0){}
 
-Value make_value_vector()
-{
-    // TODO ?
-    Value a;
-    a.type = VECTOR;
-    a.value.vector = new Vector;
-    return a;
-}
+    /** Compile form to code run in the root env. */
+    std::shared_ptr<Proto> compile_toplevel(const Value& v)
+    {
+        std::shared_ptr<Proto> proto(new Proto());
+        Scope scope(0, proto.get(), true);
+        scope_ = &scope;
+        compile(v, *proto, 0);
+        emit(*proto, OP_RETURN);
+        scope_ = 0;
+        return proto;
+    }
 
-Value make_value_vector(Vector& old, Value& v)
-{
-    // TODO ?
-    Value a;
-    a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    a.value.vector->push_back(v);
-    return a;
-}
+private:
 
-template<class I>
-Value make_value_vector(Vector& old, I app_begin, I app_end )
-{
-    // TODO ?
-    Value a;
-    a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    while(app_begin != app_end)
+    /** Innermost loop of a scope. */
+    struct Loop
     {
-        a.value.vector->push_back(*app_begin);
-        ++app_begin;
-    }
-    return a;
-}
+        uint32_t first_slot;
+        uint32_t slot_count;
+        size_t   head; //> Address recur jumps to.
+    };
 
-Value make_value_vector(Value& v, Vector& old)
-{
-    // TODO ?
-    Value a;
-    a.type = VECTOR;
-    a.value.vector = new Vector(old);
-    a.value.vector->push_front(v);
-    return a;
-}
+    /** Variables of the function being compiled. */
+    struct Scope
+    {
+        Scope*                     parent;
+        Proto*                     proto;
+        bool                       toplevel; //> Defs bind in the root env.
+        std::vector<const Symbol*> locals;   //> Names of frame slots.
+        Loop*                      loop;
 
-template<class I>
-Value make_value_vector(I begin, I end)
-{
-    // TODO ?
-    Value a;
-    a.type = VECTOR;
-    a.value.vector = new Vector(begin, end);
-    return a;
-}
+        Scope(Scope* p, Proto* pr, bool top):parent(p), proto(pr), toplevel(top), loop(0){}
+    };
 
+    /** Position of an expression: its value is returned from the function and/or
+     *  is the value of the innermost loop. */
+    enum Position{TAIL = 1, LOOP_TAIL = 2};
 
-Value make_value_number_array()
-{
-    // TODO ?
-    Value a;
-    a.type = NUMBER_ARRAY;
-    a.value.number_array = new NumberArray();
-    return a;
-}
+    enum VariableKind{LOCAL, UPVALUE, GLOBAL};
 
-Value make_value_boolean(bool b)
-{
-    Value v;
-    v.type = BOOLEAN;
-    v.value.boolean = b;
-    return v;
-}
+    static int find_local(const Scope& scope, const Symbol* sym)
+    {
+        for(int i = (int) scope.locals.size() - 1; i >= 0; --i)
+            if(scope.locals[i] == sym) return i;
+        return -1;
+    }
 
-bool type_is(Value& v, Type t){return v.type == t;}
+    static uint32_t add_local(Scope& scope, const Symbol* sym)
+    {
+        scope.locals.push_back(sym);
+        uint32_t slot = (uint32_t) scope.locals.size() - 1;
+        if(scope.proto->frame_size <= slot) scope.proto->frame_size = slot + 1;
+        return slot;
+    }
 
-///// Utility functions /////
+    static uint32_t add_upvalue(Scope& scope, bool from_local, uint32_t index)
+    {
+        std::vector<UpvalueDesc>& upvalues(scope.proto->upvalues);
+        for(size_t i = 0; i < upvalues.size(); ++i)
+            if(upvalues[i].from_local == from_local && upvalues[i].index == index) return (uint32_t) i;
 
-static inline bool is_digit(char c){return isdigit(c) != 0;}
-static inline bool is_space(char c){return (isspace(c) != 0) || (c == ',');}
+        UpvalueDesc desc = {from_local, index};
+        upvalues.push_back(desc);
+        return (uint32_t) upvalues.size() - 1;
+    }
 
-const char* g_delimiters = "(){}[];'";
+    /** Find the variable sym refers to from within scope. Variables of enclosing
+     *  functions are added to the upvalues of each function in between. */
+    static VariableKind resolve(Scope* scope, const Symbol* sym, uint32_t* index)
+    {
+        if(!scope) return GLOBAL;
 
-enum DelimEnum{
-    LEFT_PAREN    = 0,
-    RIGHT_PAREN   = 1,
-    LEFT_BRACE    = 2,
-    RIGHT_BRACE   = 3,
-    LEFT_BRACKET  = 4,
-    RIGHT_BRACKET = 5,
-    SEMICOLON     = 6,
-    QUOTE         = 7
-};
+        int slot = find_local(*scope, sym);
+        if(slot >= 0)
+        {
+            *index = (uint32_t) slot;
+            return LOCAL;
+        }
 
-regex_t g_regfloat("^([-+]?[0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][-+]?[0-9]+)?$");
-regex_t g_regint("^(?:([-+]?[1-9][0-9]*)|(0)|(0[xX][0-9A-Fa-f]+)|0[bB]([01]+))$");
+        uint32_t outer_index;
+        VariableKind outer = resolve(scope->parent, sym, &outer_index);
+        if(outer == GLOBAL) return GLOBAL;
 
-typedef enum ParseResult_t{PARSE_NIL, PARSE_INT, PARSE_FLOAT} ParseResult;
+        *index = add_upvalue(*scope, outer == LOCAL, outer_index);
+        return UPVALUE;
+    }
 
-ParseResult parsenum(const char* num, const char* numend, int& intvalue, double& doublevalue)
-{
-    cmatch_t res; 
-    ParseResult result = PARSE_NIL;
+    void emit(Proto& p, OpCode op, size_t a = 0)
+    {
+        if(a > OPERAND_MAX) throw EvaluationException(std::string("compile: Operand out of range. Too large function?"));
+        p.code.push_back(make_instruction(op, (uint32_t) a));
+    }
 
-    if(glh_regex_search(num, numend, res, g_regint))
+    size_t add_constant(Proto& p, const Value& v)
     {
-        std::string is = res[0].str();
+        p.constants.push_back(v);
+        return p.constants.size() - 1;
+    }
 
-        if(is[0] == '0')
-        {
-            if(is.size() == 1) intvalue = 0;
-            else if(is[1] == 'x' ||is[1] == 'X') intvalue = strtol(is.c_str(), 0, 16);
-            else if(is[1] == 'b' || is[1] == 'B') intvalue = strtol(res[3].str().c_str(), 0, 2); 
-        }
-        else
+    /** Emit jump with unknown target. @return Address of the jump to patch.*/
+    size_t emit_jump(Proto& p, OpCode op)
+    {
+        emit(p, op, 0);
+        return p.code.size() - 1;
+    }
+
+    /** Set jump at address to target the next emitted instruction.*/
+    void patch_jump(Proto& p, size_t address)
+    {
+        size_t target = p.code.size();
+        if(target > OPERAND_MAX) throw EvaluationException(std::string("compile: Jump out of range. Too large function?"));
+        p.code[address] = make_instruction(instruction_op(p.code[address]), (uint32_t) target);
+    }
+
+    void compile_sequence(const List& expressions, Proto& p, unsigned position)
+    {
+        if(expressions.empty())
+            throw EvaluationException(std::string("compile: Trying to evaluate empty sequence"));
+
+        auto i = expressions.begin();
+        auto e = expressions.end();
+        while(true)
         {
-            intvalue = atoi(is.c_str());
+            const Value& v(*i);
+            ++i;
+            if(i == e)
+            {
+                compile(v, p, position);
+                break;
+            }
+            compile(v, p, 0);
+            emit(p, OP_POP);
         }
-        result = PARSE_INT;
     }
-    else if(glh_regex_search(num, numend, res, g_regfloat))
+
+    void compile_variable(const Value& sym, Proto& p)
     {
-        std::string sf = res[0].str();
-        doublevalue = atof(sf.c_str());
-        result = PARSE_FLOAT;
+        uint32_t index = 0;
+        VariableKind kind = resolve(scope_, sym.value.symbol, &index);
+
+        if(kind == LOCAL)        emit(p, OP_LOAD_LOCAL, index);
+        else if(kind == UPVALUE) emit(p, OP_LOAD_UPVAL, index);
+        else                     emit(p, OP_LOAD_GLOBAL, add_constant(p, sym));
     }
-    return result;
 
-}
+    void compile_def(const Value& v, Proto& p)
+    {
+        const Value *asgn_var = assignment_var(v);
+        const Value *asgn_val = assignment_value(v);
 
-/** Return pointer either to the next newline ('\n') or to the end of the given range.
-*/
-const char* to_newline(const char* begin, const char* end)
-{
-    const char* c = begin;
-    while(c != end && *c != '\n'){c++;}
-    return c;
-}
+        if(!(asgn_var && asgn_val))
+            throw EvaluationException(std::string("eval:Did not find anything to assign to. Input:") + value_to_string(v));
+        if(asgn_var->type != SYMBOL)
+            throw EvaluationException(std::string("eval: Value to assign to was not symbol. Input:") + value_to_string(v));
 
-/** Return pointer to end of string. Returns the pointer to the last
- *  quote in strings delimited with " -characters.
- *
- *  @param begin Pointer to first element after the initial " in the string.
- *  @param end   Pointer to the null termination character for the string.
- *  @return      Pointer to the delimiting " in a string or to the end of the given range.
- */
-static const char* last_quote_of_string(const char* begin, const char* end)
-{
-    const char* c = begin;
+        if(is_lambda(*asgn_val)) def_name_ = asgn_var->value.symbol;
 
-    while(c != end)
-    {
-        if(*c == '\\')
-        {
-            c++;
-            if(c == end) return c;
-        }
-        else if(*c == '"') 
+        if(scope_->toplevel)
         {
-            return c;
+            compile(*asgn_val, p, 0);
+            emit(p, OP_DEF_GLOBAL, add_constant(p, *asgn_var));
+            return;
         }
 
-        c++;
-    }
+        // Def within a function makes a local. A function defined this way can
+        // refer to itself, other values see the previous binding of the name.
+        int slot = find_local(*scope_, asgn_var->value.symbol);
+        if(slot < 0 && is_lambda(*asgn_val)) slot = add_local(*scope_, asgn_var->value.symbol);
 
-    return c;
-}
+        compile(*asgn_val, p, 0);
 
-/** Match the pattern to the beginning of the given range.
- * @param pattern        Pattern to match
- * @param pattern_length Length of pattern (equalent to to strlen).
- * @param begin          Beginning of the range to scan.
- * @param end            End of the range to scan.
- * @return               True if the pattern matched the beginning of the range, otherwise false.
-*/
-static bool match_string(const char* pattern, const size_t pattern_length, const char* begin, const char* end)
-{
-    bool result = false;
-    size_t length = end - begin;
-    if(length >= pattern_length)
-    {
-        size_t i = 0;
-        const char* c = begin;
-        result = true;
-        while(i++ < pattern_length && result){result = *pattern++ == *c++;}
+        if(slot < 0) slot = add_local(*scope_, asgn_var->value.symbol);
+        emit(p, OP_SET_LOCAL, slot);
     }
-    return result;
-}
 
-/** Look for the character in the given null terminated string. If value found return index of character in string. */
-static int pos_in_string(const char c, const char* str)
-{
-    const char* ptr = str;
-    while(c != *ptr && *(++ptr)){}
-    if(*ptr) return ptr - str;
-    else return - 1;
-}
+    void compile_set(const Value& v, Proto& p)
+    {
+        const Value *asgn_var = assignment_var(v);
+        const Value *asgn_val = assignment_value(v);
 
-static bool is_in_string(const char c, const char* str)
-{
-    return pos_in_string(c, str) >= 0;
-}
+        if(!(asgn_var && asgn_val))
+            throw EvaluationException(std::string("eval:Did not find anything to set to. Input:") + value_to_string(v));
+        if(asgn_var->type != SYMBOL)
+            throw EvaluationException(std::string("eval: Value to assign to was not symbol. Input:") + value_to_string(v));
 
-static bool is_delimiter(const char c)
-{
-    return is_in_string(c, g_delimiters);
-}
+        compile(*asgn_val, p, 0);
 
-static bool equal(const char* str_1, const char* str_2)
-{
-    return (strcmp(str_1, str_2) == 0);
-}
+        uint32_t index = 0;
+        VariableKind kind = resolve(scope_, asgn_var->value.symbol, &index);
 
-static bool string_value_is(const Value& v, const char* str)
-{
-    return (v.type == STRING) ? (strcmp(v.value.string->c_str(), str) == 0) : false;
-}
+        if(kind == LOCAL)        emit(p, OP_SET_LOCAL, index);
+        else if(kind == UPVALUE) emit(p, OP_SET_UPVAL, index);
+        else                     emit(p, OP_SET_GLOBAL, add_constant(p, *asgn_var));
+    }
 
-static bool symbol_value_is(const Value& v, const char* str)
-{
-    return (v.type == SYMBOL) ? (strcmp(v.value.string->c_str(), str) == 0) : false;
-}
+    void compile_if(const Value& v, Proto& p, unsigned position)
+    {
+        const Value* if_predicate = value_list_second(v);
+        const Value* if_then = value_list_third(v);
+        const Value* if_else = value_list_nth(v, 3);
+
+        if(!if_predicate) throw EvaluationException(std::string("Did not find 'pred' in expected form (if pred fst snd). Input:") + value_to_string(v));
+        if(!if_then) throw EvaluationException(std::string("eval: Did not find 'fst' in expected form (if pred fst snd). Input:") + value_to_string(v));
+
+        compile(*if_predicate, p, 0);
+        size_t to_else = emit_jump(p, OP_JUMP_IF_FALSE);
+        compile(*if_then, p, position);
+        size_t to_end = emit_jump(p, OP_JUMP);
+        patch_jump(p, to_else);
+        if(if_else) compile(*if_else, p, position);
+        else        emit(p, OP_NIL);
+        patch_jump(p, to_end);
+    }
 
-static bool match_range(const char* begin, const char* end, const char*str)
-{
-    while(*str && begin != end && *str == *begin){str++;begin++;}
-    if(*str || begin != end) return false;
-    else return true;
-}
+    /** Name of the function compiled next: the symbol it is defined to or
+     *  enclosing/fn for anonymous functions. */
+    const Symbol* lambda_name()
+    {
+        const Symbol* name = def_name_;
+        def_name_ = 0;
+        if(name) return name;
 
-struct ScopeError
-{
-    /* If scope left open, return character of scope opening and number of line where scope was opened.
-       If scope scoped pre-emptively, return line of error and and the faulty closing symbol.
-    */
-    enum Result{SCOPE_LEFT_OPEN, FAULTY_SCOPE_CLOSING, OK};
-    Result result;
-    int line;
-    char scope;
-    int char_on_line;
+        const Symbol* outer = scope_ ? scope_->proto->name : 0;
+        std::string anonymous = outer ? outer->name + "/fn" : std::string("fn");
+        return intern_symbol(anonymous.c_str(), anonymous.c_str() + anonymous.size());
+    }
 
-    ScopeError():result(OK){}
-    ScopeError(Result res,char c, int cn , int l):result(res), line(l), scope(c), char_on_line(cn){}
+    void compile_lambda(const Value& v, Proto& p)
+    {
+        List* l = value_list(v);
+        const Value* lambda_parameters = value_list_second(v);
 
-    bool success(){return result == OK;}
+        if(!lambda_parameters)
+            throw EvaluationException(std::string("Could not find one or more of 'params' 'body' in (lambda params body) expression. Input:")  + value_to_string(v));
 
-    std::string report()
-    {
-        if(result == OK) return std::string("Scope ok");
-        else if(result == SCOPE_LEFT_OPEN)
+        List* params = value_list(*lambda_parameters);
+        if(!params)
+            throw EvaluationException(std::string("compile: fn parameters must be a list. Input:")  + value_to_string(v));
+
+        std::shared_ptr<Proto> proto(new Proto());
+        Scope scope(scope_, proto.get(), false);
+        proto->name = lambda_name();
+
+        auto pi = params->begin();
+        auto pe = params->end();
+        if(is_tagged_list(*lambda_parameters, special_forms().make_vector)) ++pi; // Parameters as [a b c]
+
+        for(; pi != pe; ++pi)
         {
-            std::ostringstream os;
-            os << "Scope "  << scope << "at character " << char_on_line << " at line " << line << " not closed.";
-            return os.str();
+            if(pi->type != SYMBOL)
+                throw EvaluationException(std::string("compile: fn parameter is not a symbol. Input:")  + value_to_string(v));
+            add_local(scope, pi->value.symbol);
         }
-        else if(result == FAULTY_SCOPE_CLOSING)
+        proto->param_count = (uint32_t) scope.locals.size();
+
+        scope_ = &scope;
+        compile_sequence(l->rrest(), *proto, TAIL);
+        emit(*proto, OP_RETURN);
+        scope_ = scope.parent;
+
+        p.protos.push_back(proto);
+        emit(p, OP_CLOSURE, p.protos.size() - 1);
+    }
+
+    /** (loop (sym init ...) body...) or (loop [sym init ...] body...) */
+    void compile_loop(const Value& v, Proto& p, unsigned position)
+    {
+        const Value* bindings = value_list_second(v);
+        List* binding_list = bindings ? value_list(*bindings) : 0;
+
+        if(!binding_list)
+            throw EvaluationException(std::string("compile: loop bindings must be a list (loop (sym init ...) body). Input:") + value_to_string(v));
+
+        auto bi = binding_list->begin();
+        auto be = binding_list->end();
+        if(is_tagged_list(*bindings, special_forms().make_vector)) ++bi;
+
+        // Init values are evaluated before any of the loop variables are visible.
+        std::vector<const Symbol*> names;
+        while(bi != be)
         {
-            std::ostringstream os;
-            os << "Excess scope closing "  << scope << " at character " << char_on_line << " at line " << line  << ".";
-            return os.str();
+            if(bi->type != SYMBOL)
+                throw EvaluationException(std::string("compile: loop variable is not a symbol. Input:") + value_to_string(v));
+            names.push_back(bi->value.symbol);
+            ++bi;
+            if(bi == be)
+                throw EvaluationException(std::string("compile: loop variable has no init value. Input:") + value_to_string(v));
+            compile(*bi, p, 0);
+            ++bi;
         }
 
-        return std::string("");
+        size_t outer_local_count = scope_->locals.size();
+        Loop loop = {(uint32_t) outer_local_count, (uint32_t) names.size(), 0};
+
+        for(auto& n : names) add_local(*scope_, n);
+        for(size_t i = names.size(); i > 0; --i) emit(p, OP_STORE_LOCAL, loop.first_slot + i - 1);
+
+        loop.head = p.code.size();
+
+        Loop* outer_loop = scope_->loop;
+        scope_->loop = &loop;
+        compile_sequence(value_list(v)->rrest(), p, LOOP_TAIL | (position & TAIL));
+        scope_->loop = outer_loop;
+
+        // Loop variables and defs in the body go out of scope; closures keep their values.
+        emit(p, OP_CLOSE_UPVALS, loop.first_slot);
+        scope_->locals.resize(outer_local_count);
     }
-};
 
-/** Verify that given scope delimiters balance out.
- *  The scope start and scope end arrays must be of equal length and contain start and end characters symmetrical
- *  positions such that scope_start[i] and scope_end[i] contain a character pair for a particular scope.
- *  @param scope_start string of scope begin characters.
- *  @param scope_end   string of scope end characters.
- *  @return ScopeError containing the result of the check.
-*/
+    /** (recur value ...) : rebind the loop variables and jump to the loop head. */
+    void compile_recur(const Value& v, Proto& p, unsigned position)
+    {
+        Loop* loop = scope_->loop;
 
-static ScopeError check_scope(const char* begin, const char* end, const char* comment, const char* scope_start, const char* scope_end)
-{
-    using namespace std;
+        if(!loop || !(position & LOOP_TAIL))
+            throw EvaluationException(std::string("compile: recur must be in tail position of a loop. Input:") + value_to_string(v));
 
-    const char* c              = begin;
-    const char* line_start_c   = c;
-    size_t      comment_length = strlen(comment);
-    int         line_number    = 0;
+        List args = value_list(v)->rest();
+        size_t argc = 0;
+        for(auto i = args.begin(); i != args.end(); ++i, ++argc) compile(*i, p, 0);
 
-    std::stack<std::pair<int, std::pair<int, int>>> expected_closing; // Scope index; line number
+        if(argc != loop->slot_count)
+            throw EvaluationException(std::string("compile: recur argument count does not match loop variables. Input:") + value_to_string(v));
 
-    while(c < end)
+        // Closures made during this round keep the values of this round.
+        emit(p, OP_CLOSE_UPVALS, loop->first_slot);
+        for(size_t i = argc; i > 0; --i) emit(p, OP_STORE_LOCAL, loop->first_slot + i - 1);
+        emit(p, OP_JUMP, loop->head);
+    }
+
+    void compile_application(const Value& v, Proto& p, unsigned position)
     {
-        if(*c == '\n') line_start_c = c;
+        size_t argc = 0;
+        List* l = value_list(v);
+        auto i = l->begin();
+        auto e = l->end();
 
-        if(match_string(comment, comment_length, c, end))
+        compile(*i, p, 0);
+        for(++i; i != e; ++i, ++argc) compile(*i, p, 0);
+
+        emit(p, (position & TAIL) ? OP_TAIL_CALL : OP_CALL, argc);
+    }
+
+    void compile(const Value& v, Proto& p, unsigned position)
+    {
+        if(v.type == SYMBOL) compile_variable(v, p);
+        else if(v.type == NIL) emit(p, OP_NIL);
+        else if(v.type != LIST) emit(p, OP_CONST, add_constant(p, v));
+        else if(value_list(v)->empty())
+            throw EvaluationException(std::string("Could not find evaluable value. Input:") + value_to_string(v));
+        else if(is_quoted(v))
         {
-            c = to_newline(c, end);
-            line_start_c = c;
-            line_number++;
+            const Value* ref_result = value_list_second(v);
+            if(!ref_result) throw EvaluationException(std::string("eval: Quote was not followed by an element. Input:") + value_to_string(v));
+            emit(p, OP_CONST, add_constant(p, *ref_result));
         }
+        else if(is_assignment(v))   compile_def(v, p);
+        else if(is_reassignment(v)) compile_set(v, p);
+        else if(is_if(v))           compile_if(v, p, position);
+        else if(is_lambda(v))       compile_lambda(v, p);
+        else if(is_begin(v))        compile_sequence(value_list(v)->rest(), p, position);
+        else if(is_cond(v))         compile(convert_cond_to_if(v, masp_), p, position);
+        else if(is_loop(v))         compile_loop(v, p, position);
+        else if(is_recur(v))        compile_recur(v, p, position);
+        else                        compile_application(v, p, position);
+    }
 
-        int scope_start_index = pos_in_string(*c, scope_start);
-        int scope_end_index = pos_in_string(*c, scope_end);
+    Masp&         masp_;
+    Scope*        scope_;    //> Innermost function being compiled or the top level scope.
+    const Symbol* def_name_; //> Symbol the next compiled function is defined to.
+};
 
-        if(*c == '"')
+/** Call primitive. Functions taking a Vector get a copy of the arguments, which stay
+ *  visible to the gc in params.*/
+Value call_primitive(Masp& masp, const Function& f, ArgSpan params, Map& env)
+{
+    if(f.native) return f.native(masp, params, env);
+
+    Vector args(params.begin(), params.end());
+    return f.fun(masp, args, env);
+}
+
+/** Apply anything that is not compiled code.*/
+Value apply_value(Masp& masp, const Value& v, ArgSpan params, Map& env)
+{
+    if(is_primitive_procedure(v))
+    {
+        return call_primitive(masp, *v.value.function, params, env);
+    }
+    else if(v.type == MAP)
+    {
+        Map* m = value_map(v);
+
+        if(params.begin() != params.end())
         {
-            c = last_quote_of_string(c+1, end);
+            glh::ConstOption<Value> result = m->try_get_value(*params.begin());
+            if(!result.is_valid()) return Value();
+            return *result;
         }
-        else if(scope_start_index >= 0)
+        else
         {
-            expected_closing.push(std::make_pair(scope_start_index, std::make_pair(c- line_start_c, line_number)));
+            throw EvaluationException(std::string("apply: Attempting to apply map without key to search for."));
         }
-        else if(scope_end_index >= 0)
+    }
+    else if(v.type == SORTED_MAP)
+    {
+        if(params.begin() == params.end())
+            throw EvaluationException(std::string("apply: Attempting to apply sorted map without key to search for."));
+
+        glh::ConstOption<Value> result = value_sorted_map(v)->try_get_value(*params.begin());
+        if(!result.is_valid()) return Value();
+        return *result;
+    }
+    else if(v.type == VECTOR)
+    {
+        PVector* vec = value_vector(v);
+        size_t param_size = params.size();
+        if(param_size != 1)
         {
-            if(expected_closing.size() > 0 && expected_closing.top().first == scope_end_index)
-            {
-                expected_closing.pop();
-            }
-            else return ScopeError(ScopeError::FAULTY_SCOPE_CLOSING, *c, c - line_start_c, line_number);
+            throw EvaluationException(std::string("apply: Vector: Invalid number of arguments:") + glh::to_string(param_size));
         }
 
-        c++;
-    }
+        if(params.begin()->type != NUMBER || params.begin()->value.number.type != Number::INT) 
+            throw EvaluationException(std::string("apply: Vector: Index parameter must be integer. Was:") + value_to_string(*params.begin()));
 
-    if(expected_closing.size() > 0)
+        int index = params.begin()->value.number.to_int();
+        int vec_size = vec->size();
+        if(index < 0 || index >= vec_size)
+            throw EvaluationException(std::string("apply: Vector: Index parameter out of range:") + glh::to_string(index));
+
+        return (*vec)[index];
+    }
+    else
     {
-        int scp; std::pair<int,int> col_line;
-        std::tie(scp, col_line) = expected_closing.top();
-        return ScopeError(ScopeError::SCOPE_LEFT_OPEN, scope_start[scp] , col_line.first , col_line.second);
+        throw EvaluationException(std::string("apply: Attempting to apply non-procedure. Input:") + value_to_string(v));
+        return Value();
     }
-
-    return ScopeError();
 }
 
-/** Parse string to atom. Use one instance of AtomParser per string/atom pair. */
-class ValueParser
-{
-public:
+} // empty namespace
 
-    Masp& masp_;
+///// Machine //////
 
-    ValueParser(Masp& masp):masp_(masp)
+void Machine::enter(size_t callee, size_t argc)
+{
+    Closure* closure = stack_[callee].value.function->closure.get();
+    const Proto& proto(*closure->proto);
+    size_t base = callee + 1;
+
+    if(argc != proto.param_count)
     {
-        reading_string = false;
+        throw EvaluationException(std::string("apply: ") + (proto.name ? proto.name->name : std::string("fn")) +
+                                  (argc < proto.param_count ? ": Too few arguments." : ": Too many arguments.") +
+                                  " Expected:" + glh::to_string(proto.param_count) + " Got:" + glh::to_string(argc));
     }
 
-    bool reading_string;
-
-    // TODO: Write explanation of the parsing sequence
-    //
-    // a. Unless reading string symbols are broken on ', whitespace, (, ) and ;;
-    // b. if reading string string is broken only when reading matching quote as on start
-    //    \- will escape the following quote
-
-    typedef const char* charptr;
+    stack_.resize(base + proto.frame_size);
 
-    charptr c_;
-    charptr end_;
+    frames_.push_back(Frame(&proto, closure, base));
+    if(profiler_.enabled) profiler_.enter(proto.name, frames_.size(), true);
+}
 
-    bool is(char ch){return *c_ == ch;}
+std::shared_ptr<Upvalue> Machine::capture(size_t index)
+{
+    auto i = open_upvalues_.end();
+    while(i != open_upvalues_.begin() && (*(i - 1))->index >= index)
+    {
+        --i;
+        if((*i)->index == index) return *i;
+    }
 
-    bool at_end(){return c_ >= end_;}
+    std::shared_ptr<Upvalue> upvalue(new Upvalue(index));
+    open_upvalues_.insert(i, upvalue);
+    return upvalue;
+}
 
-    void init(const char* start, const char* end){c_ = start; end_ = end;}
+void Machine::close_upvalues(size_t stack_height)
+{
+    while(!open_upvalues_.empty() && open_upvalues_.back()->index >= stack_height)
+    {
+        Upvalue& u(*open_upvalues_.back());
+        u.closed = std::move(stack_[u.index]);
+        u.open = false;
+        open_upvalues_.pop_back();
+    }
+}
 
-    const char* next(){return c_ + 1;}
+void Machine::unwind(size_t frame_count, size_t stack_height)
+{
+    if(profiler_.enabled) profiler_.unwind(frame_count);
+    close_upvalues(stack_height);
+    frames_.resize(frame_count, Frame(0, 0, 0));
+    stack_.resize(stack_height);
+}
 
-    void move_forward(){c_ = c_ + 1;}
+Value Machine::execute(Masp& m, const std::shared_ptr<Proto>& proto)
+{
+    size_t frame_count = frames_.size();
+    size_t stack_height = stack_.size();
 
-    void set(const char* chp){c_ = chp;}
+    frames_.push_back(Frame(proto.get(), 0, stack_height));
+    if(profiler_.enabled) profiler_.enter(proto->name, frames_.size(), true);
 
-    void to_newline()
+    try
     {
-        while(c_ != end_ && *c_ != '\n'){c_++;}
+        stack_.resize(stack_height + proto->frame_size);
+        return run(m, frame_count);
     }
-
-    const char* parse_string()
+    catch(...)
     {
-        return last_quote_of_string(next(),end_);
+        unwind(frame_count, stack_height);
+        throw;
     }
+}
 
-    bool parse_number(Number& out)
+Value Machine::call(Masp& m, const Value& fun, Vector& args, Map& env)
+{
+    if(!is_compound_procedure(fun))
     {
-        bool result = false;
-
-        const char* c = c_;
-        bool is_prefix = (*c == '+' || *c == '-');
-        bool next_is_num = (c_ != end_ && (c_ + 1) != end_) && is_digit(c[1]);
+        ArgFrame frame(args_, args.begin(), args.end());
+        if(!profiler_.enabled || fun.type != FUNCTION) return apply_value(m, fun, frame.span(), env);
+        size_t record = profiler_.enter(fun.value.function->name, frames_.size(), false);
+        try
+        {
+            Value result = apply_value(m, fun, frame.span(), env);
+            profiler_.leave(record);
+            return result;
+        }
+        catch(...)
+        {
+            profiler_.leave(record);
+            throw;
+        }
+    }
 
-        const char* begin = c_;
-        const char* end;
+    size_t frame_count = frames_.size();
+    size_t stack_height = stack_.size();
 
-        if(is_digit(*c) || (is_prefix && next_is_num))
-        {
-            int intvalue;
-            double floatvalue;
+    try
+    {
+        stack_.push_back(fun);
+        for(auto& a : args) stack_.push_back(a);
+        enter(stack_height, args.size());
+        return run(m, frame_count);
+    }
+    catch(...)
+    {
+        unwind(frame_count, stack_height);
+        throw;
+    }
+}
 
-            end = c_ + 1;
-            while(!is_space(*end) && (! is_delimiter(*end)) && *end) end++;
+void Machine::increment_references(uint32_t visit)
+{
+    for(auto& v : stack_) value_increment_references(v, visit);
+    args_.for_each([visit](const Value& v){value_increment_references(v, visit);});
+    for(auto& f : frames_) proto_increment_references(*f.proto, visit);
+}
 
-            ParseResult r = parsenum(begin, end, intvalue, floatvalue);
-            result = r != PARSE_NIL;
+void Machine::shade_roots(uint32_t visit)
+{
+    for(auto& v : stack_) value_shade(v, visit);
+    args_.for_each([visit](const Value& v){value_shade(v, visit);});
+    for(auto& f : frames_) proto_shade(*f.proto, visit);
+}
 
-            if(r == PARSE_INT) out.set(intvalue);
-            else if(r == PARSE_FLOAT) out.set(floatvalue);
-        }
+///// ModuleCache //////
 
-        if(result) c_ = end - 1;
+void ModuleCache::increment_references(uint32_t visit)
+{
+    for(auto& e : entries) for(auto& f : e.second.module->forms) proto_increment_references(*f, visit);
+}
 
-        return result;
-    }
+void ModuleCache::shade_roots(uint32_t visit)
+{
+    for(auto& e : entries) for(auto& f : e.second.module->forms) proto_shade(*f, visit);
+}
 
-    bool parse_symbol(const char** begin, const char** end)
-    {
-        bool result = false;
-        *begin = c_;
-        const char* last = c_ + 1;
-        while(!is_space(*last) && (! is_delimiter(*last)) && *last) last++;
-        *end = last;
-        result = true;
-        return result;
-    }
+Value Machine::run(Masp& m, size_t entry_depth)
+{
+    Map& root(m.env()->get_env());
 
-    std::string format_string(const char* begin, const char* end)
-    {
-        std::string result;
-        size_t len = end - begin + 1;
-        result.resize(len);
-        auto i = std::begin(result);
-        bool prevskip = false;
+    Frame*             f = 0;
+    const Instruction* code = 0;
+    const Value*       constants = 0;
 
-        while(begin != end){
-            char c = *begin++;
+#define MASP_LOAD_FRAME() f = &frames_.back(); code = f->proto->code.data(); constants = f->proto->constants.data();
 
-            if(prevskip){
-                     if(c == 'n') *i++ = '\n';
-                else if(c == 'r') *i++ = '\r';
-                else if(c == 't') *i++ = '\t';
-                else if(c == 'b') *i++ = '\b';
-                else if(c == 'f') *i++ = '\f';
-                else *i++ = c;
-                prevskip = false;
-            } else {
-                if(c == '\\') prevskip = true;
-                else *i++ = c;
-            }
-        }
-        result.erase(i, result.end());
-        //*i = '\0';
-        return result;
-    }
+    MASP_LOAD_FRAME();
 
-    Value get_value()
+    while(true)
     {
-        Number tmp_number;
-        const char* tmp_string_begin;
-        const char* tmp_string_end;
+        Instruction ins = code[f->ip++];
+        uint32_t a = instruction_operand(ins);
 
-        if(is('"')) //> string
+        switch(instruction_op(ins))
         {
-            const charptr first = c_ + 1;
-            const charptr last = parse_string();
-            set(last + 1);
-            std::string formatted_string = format_string(first, last);
-            return make_value_string(formatted_string);
+        case OP_CONST:
+            stack_.push_back(constants[a]);
+            break;
+        case OP_NIL:
+            stack_.push_back(Value());
+            break;
+        case OP_POP:
+            stack_.pop_back();
+            break;
+        case OP_LOAD_LOCAL:
+        {
+            Value v(stack_[f->base + a]);
+            stack_.push_back(std::move(v));
+            break;
         }
-        else if(is('(')) // Enter list
+        case OP_SET_LOCAL:
+            stack_[f->base + a] = std::move(stack_.back());
+            stack_.back() = Value();
+            break;
+        case OP_STORE_LOCAL:
+            stack_[f->base + a] = std::move(stack_.back());
+            stack_.pop_back();
+            break;
+        case OP_LOAD_UPVAL:
         {
-            Value result = make_value_list(masp_);
-            move_forward();
-            recursive_parse(result);
-            return result;
+            Value v(upvalue_ref(*f->closure->upvalues[a]));
+            stack_.push_back(std::move(v));
+            break;
         }
-        else if(is('[')) // Enter vector
+        case OP_SET_UPVAL:
+            upvalue_ref(*f->closure->upvalues[a]) = std::move(stack_.back());
+            stack_.back() = Value();
+            break;
+        case OP_LOAD_GLOBAL:
         {
-            Value result = make_value_list(masp_);
-            move_forward();
-            recursive_parse(result);
-            *result.value.list = result.value.list->add(make_value_symbol("make-vector"));
-            return result;
+            const Value& sym(constants[a]);
+            glh::ConstOption<Value> result = root.try_get_value(sym);
+            if(!result.is_valid())
+                throw EvaluationException(std::string("eval: Symbol not found. Input:") + sym.value.symbol->name);
+            stack_.push_back(*result);
+            break;
+        }
+        case OP_DEF_GLOBAL:
+            root = root.add(constants[a], stack_.back());
+            stack_.back() = Value();
+            break;
+        case OP_SET_GLOBAL:
+        {
+            const Value& sym(constants[a]);
+            if(!root.try_replace_value(sym, stack_.back()))
+                throw EvaluationException(std::string("eval:Set value failed. Probably missing key. Input:") + value_to_string(sym));
+            stack_.back() = Value();
+            break;
+        }
+        case OP_JUMP:
+            f->ip = a;
+            break;
+        case OP_JUMP_IF_FALSE:
+        {
+            bool pred = is_true(stack_.back());
+            stack_.pop_back();
+            if(!pred) f->ip = a;
+            break;
         }
-        else if(is('{')) // Enter map
+        case OP_CLOSURE:
         {
-            Value result = make_value_list(masp_);
-            move_forward();
-            recursive_parse(result);
-            *result.value.list = result.value.list->add(make_value_symbol("make-map"));
-            return result;
+            const std::shared_ptr<Proto>& proto(f->proto->protos[a]);
+            Value fun = make_value_closure(proto);
+            Closure* closure = fun.value.function->closure.get();
+            for(auto& u : proto->upvalues)
+            {
+                if(u.from_local) closure->upvalues.push_back(capture(f->base + u.index));
+                else             closure->upvalues.push_back(f->closure->upvalues[u.index]);
+            }
+            stack_.push_back(std::move(fun));
+            break;
         }
-        else if(parse_number(tmp_number))
+        case OP_TAIL_CALL:
         {
-            move_forward();
-            return make_value_number(tmp_number);
+            size_t callee = stack_.size() - a - 1;
+
+            if(f->closure && is_compound_procedure(stack_[callee]))
+            {
+                // Move callee and arguments over the current frame and reuse its place.
+                size_t target = f->base - 1;
+                close_upvalues(f->base);
+                std::move(stack_.begin() + callee, stack_.end(), stack_.begin() + target);
+                stack_.resize(target + a + 1);
+                if(profiler_.enabled) profiler_.leave_frame(frames_.size());
+                frames_.pop_back();
+                enter(target, a);
+                MASP_LOAD_FRAME();
+                break;
+            }
+            // Other calls are made as usual; the value is returned by the following OP_RETURN.
         }
-        else if(parse_symbol(&tmp_string_begin, &tmp_string_end))
+        case OP_CALL:
         {
-            set(tmp_string_end);
-            if(match_range(tmp_string_begin, tmp_string_end, "nil")) return Value(); 
-            else if(match_range(tmp_string_begin, tmp_string_end, "true")) return make_value_boolean(true);
-            else if(match_range(tmp_string_begin, tmp_string_end, "false")) return make_value_boolean(false);
-            else return make_value_symbol(tmp_string_begin, tmp_string_end);
+            size_t callee = stack_.size() - a - 1;
+
+            if(is_compound_procedure(stack_[callee]))
+            {
+                enter(callee, a);
+                MASP_LOAD_FRAME();
+            }
+            else
+            {
+                // The applied value stays on the stack, where the gc finds it, until the call returns.
+                Value fun(stack_[callee]);
+                ArgFrame args(args_, std::make_move_iterator(stack_.begin() + callee + 1), std::make_move_iterator(stack_.end()));
+                stack_.resize(callee + 1);
+                size_t record = profiler_.enabled && fun.type == FUNCTION ?
+                                profiler_.enter(fun.value.function->name, frames_.size(), false) : Profiler::NO_RECORD;
+                Value result = apply_value(m, fun, args.span(), root);
+                if(record != Profiler::NO_RECORD) profiler_.leave(record);
+                stack_.resize(callee);
+                stack_.push_back(std::move(result));
+                MASP_LOAD_FRAME(); // The primitive may have called back and grown frames_.
+            }
+            break;
         }
-        else
+        case OP_CLOSE_UPVALS:
+            close_upvalues(f->base + a);
+            break;
+        case OP_RETURN:
         {
-            throw EvaluationException("get_value: Masp parse error.");
-            return Value();
+            Value result(std::move(stack_.back()));
+            close_upvalues(f->base);
+            stack_.resize(f->closure ? f->base - 1 : f->base); // Drop the function value too.
+            if(profiler_.enabled) profiler_.leave_frame(frames_.size());
+            frames_.pop_back();
+            if(frames_.size() == entry_depth) return result;
+            stack_.push_back(std::move(result));
+            MASP_LOAD_FRAME();
+            break;
+        }
+        default:
+            throw EvaluationException(std::string("eval: Invalid instruction."));
         }
     }
 
-    void rewrite_defn(std::list<Value>& build_list, List* list_ptr)
-    {
-            if(build_list.size() < 4) throw EvaluationException("recursive_parse: defn must contain at least 3 params.");
-
-            // Decompose build list to parts
-            auto build_iter = build_list.begin(); //build_list := (defn iname ilambda_params)
-            auto iname = build_iter; ++iname;
-            auto ilambda_params = iname; ++ilambda_params;
-            auto iend = build_list.end();
+#undef MASP_LOAD_FRAME
 
-            std::list<Value> rewritten_list;
-            rewritten_list.push_back(make_value_symbol("def"));
-            rewritten_list.push_back(*iname);
+    return Value();
+}
 
-            // Compose lambda_expressions
-            std::list<Value> lambda_list;
-            lambda_list.push_back(make_value_symbol("fn"));
-            lambda_list.insert(lambda_list.end(), ilambda_params, iend);
+namespace {
 
-            // Alloc storage for value containing lambda expression
-            rewritten_list.push_back(make_value_list(masp_));
-            List* lambda_list_ptr = value_list(rewritten_list.back());
-            *lambda_list_ptr = new_list(masp_, lambda_list);
+/** Call function value from native code.*/
+Value call_function(Masp& masp, const Value& fun, Vector& params, Map& env)
+{
+    return masp.env()->machine_.call(masp, fun, params, env);
+}
 
-            *list_ptr = new_list(masp_, rewritten_list);
-    }
+/** Compile and run value. The forms of a top level sequence are compiled and run
+ *  one at a time so definitions are visible to the forms that follow.*/
+Value eval(const Value& v, Masp& masp)
+{
+    Compiler compiler(masp);
+    Machine& machine(masp.env()->machine_);
 
-    void rewrite_member_call(std::list<Value>& build_list, List* list_ptr)
+    if(is_begin(v))
     {
-        // (. fun obj params) :=  (((fnext obj) fun) (first obj) params)
-        //                                 map       sym
-        //                                    function
-        if(build_list.size() < 3) throw EvaluationException("recursive_parse: member call must contain at least 3 params.");
-
-        // Decompose build list to parts
-        auto build_iter = build_list.begin(); //build_list := (. funname obj params)
-        auto funname = build_iter; ++funname;
-        auto obj = funname; ++obj;
-        auto params = obj; ++params;
-        auto iend = build_list.end();
+        List forms = value_list(v)->rest();
+        if(forms.empty())
+            throw EvaluationException(std::string("eval_sequence: Trying to evaluate empty sequence"));
 
-        // TODO: Add 'verify object' call somewhere in order not to make object
-        // evaluation errors so inscrutable.
+        Value result;
+        for(auto i = forms.begin(); i != forms.end(); ++i)
+        {
+            result = machine.execute(masp, compiler.compile_toplevel(*i));
+        }
+        return result;
+    }
 
-        // Populate outer list.
-        std::list<Value> rewritten_list;
+    return machine.execute(masp, compiler.compile_toplevel(v));
+}
 
-        rewritten_list.push_back(make_value_list(masp_));
-        List* outermaplist = value_list(*rewritten_list.rbegin());
-        rewritten_list.push_back(make_value_list(masp_));
-        List* symcalllist = value_list(*rewritten_list.rbegin());
-        rewritten_list.insert(rewritten_list.end(), params, iend);
+///// Modules //////
+//
+// A precompiled module file holds the compiled top level forms of a source file:
+//
+//   header  "MASPC", format version, byte order mark and content hash of the source
+//   symbols symbol count followed by the names as length and characters
+//   forms   form count followed by the forms
+//   proto   parameter count, frame size, code, upvalues, constants and nested protos
+//   value   type tag and payload. Symbols are stored as their index in the symbol
+//           table, strings as length and characters and lists as length and elements.
+//
+// Values passed between interpreters are written in the same way as a symbol table
+// followed by a value count and the values. These can also be vectors, maps and
+// functions: a primitive is stored as its name and a compiled function as its proto.
+//
+// Counts, indices and integers are stored as varints, other numbers in the byte order
+// of the writer. Files with a different version, byte order or content hash are ignored
+// and rewritten.
+
+const char     g_module_magic[]    = "MASPC";
+const uint32_t g_module_version    = 2;
+const uint32_t g_module_byte_order = 0x01020304;
+
+/** 64 bit FNV-1a hash of the source text. */
+uint64_t content_hash(const char* data, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; ++i)
+    {
+        h ^= (uint8_t) data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-        // Populate first inner list
-        *outermaplist = outermaplist->add(*funname);
-        Value innermaplist = make_value_list(masp_);
-        List* innermap = value_list(innermaplist);
-        *innermap = innermap->add(*obj);
-        *innermap = innermap->add(make_value_symbol("fnext"));
-        *outermaplist = outermaplist->add(innermaplist);
+/** Serialize compiled module or values. */
+class ModuleWriter
+{
+public:
+    std::vector<uint8_t> bytes;
 
-        // Populate second inner list
-        *symcalllist =  symcalllist->add(*obj);
-        *symcalllist =  symcalllist->add(make_value_symbol("first"));
+    template<class T>
+    void put(const T& t)
+    {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(&t);
+        bytes.insert(bytes.end(), b, b + sizeof(T));
+    }
 
-        *list_ptr = new_list(masp_, rewritten_list);
+    /** Little endian base 128: seven bits per byte, high bit set on all but the last byte.*/
+    void put_varint(uint32_t n)
+    {
+        while(n >= 0x80)
+        {
+            bytes.push_back((uint8_t)(n | 0x80));
+            n >>= 7;
+        }
+        bytes.push_back((uint8_t) n);
     }
 
-    void recursive_parse(Value& root)
+    static uint32_t zigzag(int32_t i){return ((uint32_t) i << 1) ^ (uint32_t)(i >> 31);}
+
+    void put_chars(const char* str, size_t length)
     {
-        if(glh::is_not(root.type, LIST))
-            throw EvaluationException("recursive_parse: root type is not LIST.");
+        put_varint(length);
+        bytes.insert(bytes.end(), str, str + length);
+    }
 
-        std::list<Value> build_list;
+    void put_value(const Value& v)
+    {
+        if(v.type == LAZY_SEQ)
+        {
+            // Sequences are realized and read back as lists.
+            Vector elements;
+            LazySeq seq(*v.value.lazy_seq);
+            for(const Value* e = seq.first(); e; seq.advance(), e = seq.first()) elements.push_back(*e);
+            put((uint8_t) LIST);
+            put_varint(elements.size());
+            for(auto& e : elements) put_value(e);
+            return;
+        }
 
-        bool next_is_quoted = false;;
+        put((uint8_t) v.type);
 
-        while(! at_end())
+        switch(v.type)
         {
-            if(is(';'))  //> Comment, go to newline
-            {
-                to_newline();
-                if(c_ != end_) move_forward();
-            }
-            else if(is(')') || is(']') || is('}')) // Exit container - scope was checked before this
+            case NIL: break;
+            case BOOLEAN: put((uint8_t) v.value.boolean); break;
+            case NUMBER:
             {
-                move_forward();
+                put((uint8_t) v.value.number.type);
+                if(v.value.number.type == Number::INT) put_varint(zigzag(v.value.number.to_int()));
+                else                                   put((double) v.value.number.to_float());
                 break;
             }
-            else if(is_space(*c_))
+            case SYMBOL: put_varint(symbol_index(v.value.symbol)); break;
+            case STRING: put_chars(v.value.string->chars, v.value.string->length); break;
+            case LIST:
             {
-                move_forward();
-                // Skip whitespace
-                // After this we know that the input is either number or symbol
+                List* l = value_list(v);
+                put_varint(l->size());
+                for(auto i = l->begin(); i != l->end(); ++i) put_value(*i);
+                break;
             }
-            else if(is('\''))
+            case VECTOR:
             {
-                next_is_quoted = true;
-                move_forward();
+                PVector* vector = v.value.vector;
+                put_varint(vector->size());
+                for(auto i = vector->begin(); i != vector->end(); ++i) put_value(*i);
+                break;
             }
-            else
+            case MAP:
             {
-                // append to root  
-                // push_to_value(root, get_value());
-                Value v = get_value();
-                if(next_is_quoted)
-                {
-                    Value quote_sym = make_value_symbol("quote");
-                    Value outer = make_value_list(masp_);
-                    *(outer.value.list) = outer.value.list->add(v);
-                    *(outer.value.list) = outer.value.list->add(quote_sym);
-                    append_to_value_stl_list(build_list, outer);
-                    next_is_quoted = false;
-                }
-                else
-                {
-                    append_to_value_stl_list(build_list, v);
-                }
+                Map* map = value_map(v);
+                put_varint(map->size());
+                for(auto i = map->begin(); i != map->end(); ++i){put_value(i->first); put_value(i->second);}
+                break;
             }
-
-            if(at_end()) break;
-        }
-
-        if(next_is_quoted) // Quoted flag was not used.
-        {
-            throw EvaluationException("Quote cannot be empty.");
+            case FUNCTION: put_function(*v.value.function); break;
+            default:
+                throw EvaluationException(std::string("Cannot serialize value:") + value_to_string(v));
         }
+    }
 
-
-        List* list_ptr = value_list(root);
-
-        // Term rewritings that we prefer to do in parsing rather than evaluation stage ("poor mans macro system").
-        bool list_occupied = !build_list.empty();
-        if(list_occupied && build_list.front().is_str("defn"))
-        {
-            rewrite_defn(build_list, list_ptr);
-        }
-        else if(list_occupied && build_list.front().is_str("."))
+    /** Compiled functions are written as their proto. They can refer to globals, which are
+     *  looked up in the env of the reader, but not to local variables of enclosing functions.*/
+    void put_function(const Function& f)
+    {
+        if(f.closure)
         {
-            rewrite_member_call(build_list, list_ptr);
+            if(!f.closure->upvalues.empty())
+                throw EvaluationException(std::string("Cannot serialize function that captures local variables:") +
+                                          (f.closure->proto->name ? f.closure->proto->name->name : std::string("fn")));
+            put((uint8_t) 1);
+            put_proto(*f.closure->proto);
         }
         else
         {
-            *list_ptr = new_list(masp_, build_list);
+            if(!f.name) throw EvaluationException("Cannot serialize primitive without a name.");
+            put((uint8_t) 0);
+            put_varint(symbol_index(f.name));
         }
     }
 
-    masp_result parse(const char* str)
+    uint32_t symbol_index(const Symbol* s)
     {
-        size_t size = strlen(str);
-        init(str, str + size);
-
-        ScopeError scope_result = check_scope(c_, end_, ";", "({[", ")}]");
-
-        if(!scope_result.success())
+        auto i = symbol_index_.find(s);
+        if(i == symbol_index_.end())
         {
-            return masp_fail(scope_result.report());
+            i = symbol_index_.insert(std::make_pair(s, (uint32_t) symbols_.size())).first;
+            symbols_.push_back(s);
         }
+        return i->second;
+    }
 
-        Value* root = make_value_list_alloc(masp_);
+    void put_proto(const Proto& p)
+    {
+        put_varint(p.name ? symbol_index(p.name) + 1 : 0);
+        put_varint(p.param_count);
+        put_varint(p.frame_size);
 
-        try{
-            recursive_parse(*root);
-        }
-        catch(EvaluationException& e){
-            return masp_fail(e.get_message());
-        }
+        put_varint(p.code.size());
+        for(auto i : p.code) put(i);
 
-        List* root_list = value_list(*root);
-        *root_list = root_list->add(make_value_symbol("begin"));
+        put_varint(p.upvalues.size());
+        for(auto& u : p.upvalues){put((uint8_t) u.from_local); put_varint(u.index);}
 
-        return masp_result(ValuePtr(root, ValueDeleter()));
-    }
+        put_varint(p.constants.size());
+        for(auto& c : p.constants) put_value(c);
 
-};
+        put_varint(p.protos.size());
+        for(auto& n : p.protos) put_proto(*n);
+    }
 
-////// Masp ///////
+    void put_module(const Module& m)
+    {
+        put_varint(m.forms.size());
+        for(auto& f : m.forms) put_proto(*f);
 
-Masp::Masp()
-{
-    env_ = new Env();
-}
+        std::vector<uint8_t> forms;
+        forms.swap(bytes);
 
-Masp::~Masp()
-{
-    delete env_;
-}
+        bytes.insert(bytes.end(), g_module_magic, g_module_magic + sizeof(g_module_magic));
+        put(g_module_version);
+        put(g_module_byte_order);
+        put(m.hash);
 
-Masp::Env* Masp::env(){return env_;}
+        put_symbols();
+        bytes.insert(bytes.end(), forms.begin(), forms.end());
+    }
 
-Map& Masp::env_map(){
-    return env_->get_env();
-}
+    void put_values(const Vector& values)
+    {
+        put_varint(values.size());
+        for(auto& v : values) put_value(v);
 
-void Masp::gc(){env_->gc();}
+        std::vector<uint8_t> data;
+        data.swap(bytes);
 
-size_t Masp::reserved_size_bytes(){return env_->reserved_size_bytes();}
+        put_symbols();
+        bytes.insert(bytes.end(), data.begin(), data.end());
+    }
 
-size_t Masp::live_size_bytes(){return env_->live_size_bytes();}
+private:
+    void put_symbols()
+    {
+        put_varint(symbols_.size());
+        for(auto sym : symbols_) put_chars(sym->name.c_str(), sym->name.size());
+    }
 
-void Masp::set_output(std::ostream* os)
-{
-    if(env_) env_->out_ = os;
-}
+    std::unordered_map<const Symbol*, uint32_t> symbol_index_;
+    std::vector<const Symbol*>                  symbols_;
+};
 
-void Masp::set_args(int argc, char* argv[])
+/** Deserialize compiled module or values. Throws EvaluationException on malformed data. */
+class ModuleReader
 {
-    Value argmap = make_value_map(*this);
-    Map* map     = value_map(argmap);
-
-    std::list<std::string> fixed_args;
-
-    for(int i = 0; i < argc; ++i){
-        std::string arg(argv[i]);
-        size_t pos = std::string::npos;
-        pos = arg.find('\\');
-        while(pos != std::string::npos){
-            if((arg.size() > (pos + 1)) && arg[pos + 1] == '\\'){
-                pos = pos + 1;
-            } else {
-                arg = arg.replace(pos, 1, "/");
-                pos = pos + 1;
-            }
-            pos = arg.find('\\', pos);
-        } 
-        fixed_args.push_back(arg);
-    }
+public:
+    ModuleReader(Masp& masp, const uint8_t* begin, const uint8_t* end):masp_(masp), c_(begin), end_(end){}
 
-    int order = 0;
-    for(auto &f : fixed_args){
-        *map = map->add(make_value_number(order++), make_value_string(f));
-    }
+    /** @return Module or null if the file was written for another source or format.*/
+    std::shared_ptr<Module> get_module(uint64_t hash)
+    {
+        std::shared_ptr<Module> module;
 
-    env_->def(make_value_symbol("sys/args"), argmap);
+        if((size_t)(end_ - c_) < sizeof(g_module_magic) || memcmp(c_, g_module_magic, sizeof(g_module_magic)) != 0) return module;
+        c_ += sizeof(g_module_magic);
 
-    //std::cout << "Args set" << std::endl;
+        if(get<uint32_t>() != g_module_version || get<uint32_t>() != g_module_byte_order || get<uint64_t>() != hash) return module;
 
-}
+        get_symbols();
 
-/** Get handle to output stream.*/
-std::ostream& Masp::get_output()
-{
-    if(env_) return *(env_->out_);
-    else return std::cout;
-}
+        module.reset(new Module());
+        module->hash = hash;
 
-///// Evaluation utilities /////
+        uint32_t count = get_count();
+        for(uint32_t i = 0; i < count; ++i) module->forms.push_back(get_proto());
 
-masp_result masp_fail(const char* str){
-    return masp_result(std::string(str));
-}
+        if(c_ != end_) fail();
 
-masp_result masp_fail(const std::string& str){
-    return masp_result(str);
-}
+        return module;
+    }
 
-masp_result string_to_value(Masp& m, const char* str)
-{
-    ValueParser parser(m);
+    /** @return Values written by ModuleWriter::put_values. Functions are made in the env of masp.*/
+    Vector get_values()
+    {
+        get_symbols();
 
-    return parser.parse(str);
-}
+        Vector values;
+        uint32_t count = get_count();
+        for(uint32_t i = 0; i < count; ++i) values.push_back(get_value());
 
-typedef std::string (*PrefixHelper)(const Value& v);
+        if(c_ != end_) fail();
 
-static void value_to_string_helper(std::ostream& os, const Value& v, PrefixHelper prfx)
-{
-    auto out = [&]()->std::ostream& {
-        if(prfx) os << prfx(v) << " ";
-        return os;
-    };
+        return values;
+    }
 
-    switch(v.type)
+private:
+    void fail(){throw EvaluationException("module: Malformed precompiled module.");}
+
+    void get_symbols()
     {
-        case NIL:{out() << "nil"; break;} // TODO: Do we need to print nill?
-        case BOOLEAN:
+        uint32_t count = get_count();
+        for(uint32_t i = 0; i < count; ++i)
         {
-            if(v.value.boolean) out() << "true";
-            else out() << "false";
-            break;
+            uint32_t length = get_count();
+            const char* chars = get_chars(length);
+            symbols_.push_back(make_value_symbol(chars, chars + length));
         }
-        case NUMBER:
+    }
+
+    template<class T>
+    T get()
+    {
+        if((size_t)(end_ - c_) < sizeof(T)) fail();
+        T t;
+        memcpy(&t, c_, sizeof(T));
+        c_ += sizeof(T);
+        return t;
+    }
+
+    uint32_t get_varint()
+    {
+        uint32_t n = 0;
+        for(unsigned shift = 0; shift < 35; shift += 7)
         {
-            if(v.value.number.type == Number::INT)
+            uint8_t b = get<uint8_t>();
+            n |= (uint32_t)(b & 0x7f) << shift;
+            if(!(b & 0x80)) return n;
+        }
+        fail();
+        return 0;
+    }
+
+    static int unzigzag(uint32_t n){return (int)(n >> 1) ^ -(int)(n & 1);}
+
+    /** Each counted item takes at least a byte, which bounds the count by the remaining data.*/
+    uint32_t get_count()
+    {
+        uint32_t count = get_varint();
+        if(count > (size_t)(end_ - c_)) fail();
+        return count;
+    }
+
+    const char* get_chars(uint32_t length)
+    {
+        const char* chars = reinterpret_cast<const char*>(c_);
+        c_ += length;
+        return chars;
+    }
+
+    Value get_value()
+    {
+        uint8_t type = get<uint8_t>();
+
+        switch(type)
+        {
+            case NIL: return Value();
+            case BOOLEAN: return make_value_boolean(get<uint8_t>() != 0);
+            case NUMBER:
             {
-                out() << v.value.number.to_int();
+                uint8_t number_type = get<uint8_t>();
+                if(number_type == Number::INT)   return make_value_number(unzigzag(get_varint()));
+                if(number_type == Number::FLOAT) return make_value_number(get<double>());
+                break;
             }
-            else
+            case SYMBOL:
             {
-                out() << v.value.number.to_float();
+                uint32_t index = get_varint();
+                if(index >= symbols_.size()) fail();
+                return symbols_[index];
             }
-            break;
-        }
-        case SYMBOL:
-        {
-            out() << *(v.value.string);
-            break;
-        }
-        case STRING:
-        {
-            std::string esc("\"");
-            out() << esc << *(v.value.string) << esc;
-            break;
-        }
-        case LIST:
-        {
-            out() << "(";
-            List* lst_ptr = v.value.list;
-            for(auto i = lst_ptr->begin(); i != lst_ptr->end(); ++i)
+            case STRING:
             {
-                value_to_string_helper(os, *i, prfx);
-                os << " ";
+                uint32_t length = get_count();
+                const char* chars = get_chars(length);
+                return make_value_string(chars, chars + length);
             }
-            os << ")";
-            break;
-        }
-        case MAP:
-        {
-            Map* map_ptr = v.value.map;
-            out() << "{";
-            auto mend = map_ptr->end();
-            for(auto m = map_ptr->begin(); m != mend; ++m)
+            case LIST:
             {
-                value_to_string_helper(os, m->first, prfx);
-                os << " ";
-                value_to_string_helper(os, m->second, prfx);
-                os << " ";
+                uint32_t count = get_count();
+                std::list<Value> elements;
+                for(uint32_t i = 0; i < count; ++i) elements.push_back(get_value());
+
+                Value result = make_value_list(masp_);
+                *value_list(result) = new_list(masp_, elements);
+                return result;
             }
-            os << "}";
-            break;
-        }
-        case VECTOR:
-        {
-            Vector* vec_ptr = v.value.vector;
-            out() << "[";
-            for(auto i = vec_ptr->begin(); i != vec_ptr->end(); ++i)
+            case VECTOR:
             {
-                value_to_string_helper(os, *i, prfx);
-                os << " ";
+                uint32_t count = get_count();
+                Vector elements;
+                for(uint32_t i = 0; i < count; ++i) elements.push_back(get_value());
+                return make_value_vector(masp_, elements.begin(), elements.end());
             }
-            os << "]";
-            break;
+            case MAP:
+            {
+                uint32_t count = get_count();
+                std::vector<MapPool::KeyValue> entries;
+                for(uint32_t i = 0; i < count; ++i)
+                {
+                    Value key = get_value();
+                    entries.push_back(MapPool::KeyValue::make(0, key, get_value()));
+                }
+                return make_value_map(map_add_entries(masp_, new_map(masp_), entries));
+            }
+            case FUNCTION: return get_function();
         }
-        case FUNCTION:
-        {
-            //const std::type_info& funtype(v.value.function->fun.target_type());
-            //const char* fun_type_name = funtype.name();
 
-            out() << "<function>" ; // TODO: add function name to Function member.
-            break;
-        }
-        case OBJECT:
-        {
-            //const std::type_info& funtype(v.value.function->fun.target_type());
-            //const char* fun_type_name = funtype.name();
+        fail();
+        return Value();
+    }
 
-            out() << "<object>" ; // TODO: add function name to Function member.
-            break;
-        }
-        // TODO: Number array
-        default:
+    /** Primitives are looked up by name in the env of masp.*/
+    Value get_function()
+    {
+        if(get<uint8_t>())
         {
-            local_assert("Implement output for type");
+            std::shared_ptr<Proto> proto = get_proto();
+            if(!proto->upvalues.empty()) fail();
+            return make_value_closure(proto);
         }
-    }
-}
 
-std::string value_to_string(const Value& v)
-{
-    std::ostringstream stream;
-    value_to_string_helper(stream, v, 0);
-    return stream.str();
-}
+        uint32_t index = get_varint();
+        if(index >= symbols_.size()) fail();
 
-std::ostream& operator<<(std::ostream& os, const Value& v){
-    os << value_to_string(v);
-    return os;
-}
+        glh::ConstOption<Value> fun = masp_.env_map().try_get_value(symbols_[index]);
+        if(!fun.is_valid() || (*fun).type != FUNCTION)
+            throw EvaluationException(std::string("Function not found:") + symbols_[index].value.symbol->name);
+        return *fun;
+    }
 
-std::string value_type_to_string(const Value& v);
+    std::shared_ptr<Proto> get_proto()
+    {
+        std::shared_ptr<Proto> p(new Proto());
 
-std::string value_to_typed_string(const Value* v)
-{
-    std::ostringstream stream;
-    value_to_string_helper(stream, *v, value_type_to_string);
-    return stream.str();
-}
+        uint32_t name = get_varint();
+        if(name > symbols_.size()) fail();
+        if(name) p->name = symbols_[name - 1].value.symbol;
 
+        p->param_count = get_varint();
+        p->frame_size  = get_varint();
 
-std::string value_type_to_string(const Value& v)
-{
-    switch(v.type)
-    {
-        case NUMBER:
+        uint32_t count = get_count();
+        p->code.reserve(count);
+        for(uint32_t i = 0; i < count; ++i) p->code.push_back(get<Instruction>());
+
+        count = get_count();
+        for(uint32_t i = 0; i < count; ++i)
         {
-            if(v.value.number.type == Number::INT) return std::string("NUMBER:INT");
-            else                                   return std::string("NUMBER:FLOAT");
+            UpvalueDesc u;
+            u.from_local = get<uint8_t>() != 0;
+            u.index      = get_varint();
+            p->upvalues.push_back(u);
         }
-        case STRING:        return std::string("STRING");
-        case BOOLEAN:       return std::string("BOOLEAN");
-        case NIL:           return std::string("");
-        case SYMBOL:        return std::string("SYMBOL");
-        case VECTOR:        return std::string("VECTOR");
-        case LIST:          return std::string("LIST");
-        case MAP:           return std::string("MAP");
-        case OBJECT:        return std::string("OBJECT");
-        case NUMBER_ARRAY:  return std::string("NUMBER ARRAY");
-        case FUNCTION:           return std::string("FUNCTION");
-    }
-    return "";
-}
 
+        count = get_count();
+        for(uint32_t i = 0; i < count; ++i) p->constants.push_back(get_value());
 
-// Evaluation utils.
-// More or less straightforward translation of the simple Evaluator 
-// in 'Structure and Interpretation of Computer Programs' (Steele 1996)
-// Section 4.1.1 'The Core of the Evaluator'
+        count = get_count();
+        for(uint32_t i = 0; i < count; ++i) p->protos.push_back(get_proto());
 
-namespace {
+        verify(*p);
+        return p;
+    }
 
-Value eval(const Value& v, Map& env, Masp& masp);
-Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map& env, Masp& masp);
+    /** Check that the operands of the code refer to existing constants, protos and code.*/
+    void verify(const Proto& p)
+    {
+        if(p.param_count > p.frame_size || p.code.empty() || instruction_op(p.code.back()) != OP_RETURN) fail();
 
-bool is_self_evaluating(const Value& v)
-{
-    return v.type == NUMBER || v.type == STRING || v.type == MAP || v.type == NIL || v.type == BOOLEAN ||
-        v.type == NUMBER_ARRAY || v.type == VECTOR || v.type == FUNCTION;
-}
+        for(auto i : p.code)
+        {
+            uint32_t a = instruction_operand(i);
 
-bool is_tagged_list(const Value& v, const char* symname)
-{
-    bool result = false;
-    const Value* first = value_list_first(v);
-    if(first) result = symbol_value_is(*first, symname);
-    return result;
-}
+            switch(instruction_op(i))
+            {
+                case OP_CONST: case OP_LOAD_GLOBAL: case OP_DEF_GLOBAL: case OP_SET_GLOBAL:
+                    if(a >= p.constants.size()) fail();
+                    break;
+                case OP_LOAD_LOCAL: case OP_SET_LOCAL: case OP_STORE_LOCAL: case OP_CLOSE_UPVALS:
+                    if(a >= p.frame_size && !(instruction_op(i) == OP_CLOSE_UPVALS && a == p.frame_size)) fail();
+                    break;
+                case OP_LOAD_UPVAL: case OP_SET_UPVAL:
+                    if(a >= p.upvalues.size()) fail();
+                    break;
+                case OP_JUMP: case OP_JUMP_IF_FALSE:
+                    if(a >= p.code.size()) fail();
+                    break;
+                case OP_CLOSURE:
+                    if(a >= p.protos.size()) fail();
+                    break;
+                case OP_NIL: case OP_POP: case OP_CALL: case OP_TAIL_CALL: case OP_RETURN:
+                    break;
+                default:
+                    fail();
+            }
+        }
 
-bool is_quoted(const Value& v){ return is_tagged_list(v,"quote");}
-bool is_assignment(const Value& v){ return is_tagged_list(v,"def");}
-bool is_function_assignment(const Value& v){ return is_tagged_list(v,"defn");}
-bool is_reassignment(const Value& v){ return is_tagged_list(v,"set");}
-bool is_if(const Value& v){return is_tagged_list(v, "if");} 
-bool is_lambda(const Value& v){return is_tagged_list(v, "fn");} 
-bool is_begin(const Value& v){return is_tagged_list(v, "begin");} 
-bool is_cond(const Value& v){return is_tagged_list(v, "cond");} 
-bool is_else(const Value& v){return is_tagged_list(v, "else");}
-bool is_application(const Value& v){return v.is(LIST);}
+        for(auto& child : p.protos)
+        {
+            for(auto& u : child->upvalues) if(u.index >= (u.from_local ? p.frame_size : p.upvalues.size())) fail();
+        }
 
-Value begin_actions(const Value& v)
-{
-    List* vlist = value_list(v);
-    if(vlist)
-    {
-        return make_value_list(vlist->rest());  
+        verify_stack(p);
     }
-    else
+
+    /** Follow each path through the code and check that the operands are on the stack
+     *  when an instruction takes them, and that paths joining at an instruction have the
+     *  same stack height there. The machine does not check this when it runs.*/
+    void verify_stack(const Proto& p)
     {
-        return Value();
-    }
-}
+        const size_t UNKNOWN = size_t(-1);
+        std::vector<size_t> heights(p.code.size(), UNKNOWN);
+        std::vector<size_t> pending;
 
-bool is_true(const Value& v)
-{
-    bool v_is_false = v.type == NIL || (v.type == BOOLEAN && (!v.value.boolean));
-    return !v_is_false;
-}
+        auto reach = [&](size_t target, size_t height)
+        {
+            if(target >= p.code.size()) fail();
+            if(heights[target] == UNKNOWN)
+            {
+                heights[target] = height;
+                pending.push_back(target);
+            }
+            else if(heights[target] != height) fail();
+        };
 
-const Value* assignment_var(const Value& v){return value_list_second(v);}
-const Value* assignment_value(const Value& v){return value_list_third(v);}
+        reach(0, 0);
 
-Value eval_sequence(const List& expressions, Map& env, Masp& masp)
+        while(!pending.empty())
+        {
+            size_t ip = pending.back();
+            pending.pop_back();
+
+            size_t height = heights[ip];
+            uint32_t a = instruction_operand(p.code[ip]);
+
+            switch(instruction_op(p.code[ip]))
+            {
+                case OP_CONST: case OP_NIL: case OP_LOAD_LOCAL: case OP_LOAD_UPVAL: case OP_LOAD_GLOBAL: case OP_CLOSURE:
+                    reach(ip + 1, height + 1);
+                    break;
+                case OP_SET_LOCAL: case OP_SET_UPVAL: case OP_DEF_GLOBAL: case OP_SET_GLOBAL:
+                    if(height < 1) fail();
+                    reach(ip + 1, height);
+                    break;
+                case OP_POP: case OP_STORE_LOCAL:
+                    if(height < 1) fail();
+                    reach(ip + 1, height - 1);
+                    break;
+                case OP_JUMP:
+                    reach(a, height);
+                    break;
+                case OP_JUMP_IF_FALSE:
+                    if(height < 1) fail();
+                    reach(ip + 1, height - 1);
+                    reach(a, height - 1);
+                    break;
+                case OP_CALL: case OP_TAIL_CALL:
+                    if(height < size_t(a) + 1) fail();
+                    reach(ip + 1, height - a);
+                    break;
+                case OP_CLOSE_UPVALS:
+                    reach(ip + 1, height);
+                    break;
+                case OP_RETURN:
+                    if(height < 1) fail();
+                    break;
+            }
+        }
+    }
+
+    Masp&              masp_;
+    const uint8_t*     c_;
+    const uint8_t*     end_;
+    std::vector<Value> symbols_;
+};
+
+/** Compile the top level forms of a parsed file. */
+std::shared_ptr<Module> compile_module(Masp& masp, const Value& source, uint64_t hash)
 {
-    if(expressions.empty())
-        throw EvaluationException(std::string("eval_sequence: Trying to evaluate empty sequence"));
+    std::shared_ptr<Module> module(new Module());
+    module->hash = hash;
+
+    Compiler compiler(masp);
 
-    if(!expressions.has_rest()) 
+    if(is_begin(source))
     {
-        return eval(*expressions.first(), env, masp);
+        List forms = value_list(source)->rest();
+        for(auto i = forms.begin(); i != forms.end(); ++i) module->forms.push_back(compiler.compile_toplevel(*i));
     }
     else
     {
-        eval(*expressions.first(), env, masp);
-        return eval_sequence(expressions.rest(), env, masp);
+        module->forms.push_back(compiler.compile_toplevel(source));
     }
-}
 
-Value sequence_exp(const List& action)
-{
-    if(action.empty())
-        return make_value_list(action);
-    else if(!action.has_rest())
-        return *action.first();
-    else // make begin
-        return make_value_list(action.add(make_value_symbol("begin")));
+    return module;
 }
 
-// cond: expand-clauses
-Value expand_clauses(const List& clauses, Masp& masp)
+Value run_module(Masp& masp, const Module& module)
 {
-    if(clauses.empty()) return Value();
-    else
-    {
-        const Value* first = clauses.first();
-        List rest = clauses.rest();
-
-        if(!first) throw EvaluationException(std::string("expand_clauses: Error interpreting cond clause"));
+    if(module.forms.empty())
+        throw EvaluationException(std::string("eval_sequence: Trying to evaluate empty sequence"));
 
-        if(is_else(*first))
-        {
-            if(rest.empty())
-            {
-                // Sequence-exp
-                List ca = value_list(*first)->rest(); // cond-actions
-                return sequence_exp(ca);
-            }
-            else
-            {
-                throw EvaluationException(std::string("expand_clauses: ELSE clause isn't last - COND->iF"));
-            }
-        }
-        else
-        {
-            if(first->type != LIST) throw EvaluationException(std::string("expand_clauses: element is not a list as expected but:") + value_to_string(*first));
+    Value result;
+    for(auto& f : module.forms) result = masp.env()->machine_.execute(masp, f);
+    return result;
+}
 
-            if(rest.empty())
-            {
-                throw EvaluationException(std::string("expand_clauses: Final case in cond is not an else case. Cond expression requires for else case to be final expression: (cond (... ...) (else ...))."));
-            }
+std::string module_file_path(const ModuleCache& cache, const std::string& source_path, uint64_t hash)
+{
+    if(cache.directory.empty()) return source_path + "c";
 
-            // make-if
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mpc", (unsigned long long) hash);
+    return path_join(cache.directory, name);
+}
 
-            Value v_iflist = make_value_list(masp);
-            List* iflist = value_list(v_iflist);
+std::shared_ptr<Module> load_module_file(Masp& masp, const std::string& path, uint64_t hash)
+{
+    std::vector<uint8_t> bytes;
+    bool                 success;
+    std::tie(bytes, success) = file_to_bytes(path.c_str());
 
-            // first : (pred ca)
+    if(!success || bytes.empty()) return std::shared_ptr<Module>();
 
-            const Value* pred = value_list_first(*first); 
-            const List     ca = value_list(*first)->rest(); // cond-actions : (pred ca) -> ca
-            Value         seq = sequence_exp(ca); // (foo bar) -> (begin foo bar) OR (foo) -> foo
+    try
+    {
+        ModuleReader reader(masp, bytes.data(), bytes.data() + bytes.size());
+        return reader.get_module(hash);
+    }
+    catch(EvaluationException&)
+    {
+        return std::shared_ptr<Module>();
+    }
+}
 
-            Value     clauses = expand_clauses(rest, masp); // (if foo bar (if ...))
+/** Write the module file. A module that cannot be written is only kept in memory.*/
+void save_module_file(const std::string& path, const Module& module)
+{
+    ModuleWriter writer;
 
-            *iflist = iflist->add(clauses);
-            *iflist = iflist->add(seq);
-            *iflist = iflist->add(*pred);
-            *iflist = iflist->add(make_value_symbol("if"));
-            // iflist := (if pred seq clauses)
+    try
+    {
+        writer.put_module(module);
+    }
+    catch(EvaluationException&)
+    {
+        return;
+    }
 
-            return v_iflist;
-        }
+    bytes_to_file(path.c_str(), writer.bytes);
+}
+
+} // empty namespace
+
+///// Lazy sequences //////
+
+const Value* LazySeq::first()
+{
+    while(chunk)
+    {
+        if(chunk->source) chunk->realize();
+        if(offset < chunk->elements.size()) return &chunk->elements[offset];
+        std::shared_ptr<SeqChunk> next(chunk->next);
+        chunk = std::move(next);
+        offset = 0;
     }
+    return 0;
 }
 
-// cond: cond->if
-Value convert_cond_to_if(const Value& v, Masp& masp)
+size_t LazySeq::count() const
 {
-    return expand_clauses(value_list(v)->rest(), masp); 
+    LazySeq seq(*this);
+    size_t n = 0;
+    while(seq.first())
+    {
+        n += seq.chunk->elements.size() - seq.offset;
+        seq.offset = seq.chunk->elements.size();
+    }
+    return n;
 }
 
-Value eval(const Value& v, Map& env, Masp& masp)
+bool SeqSource::read(Value& out)
 {
-    if(is_self_evaluating(v)) return v;
-    else if(v.type == SYMBOL)
+    if(kind == RANGE)
     {
-        glh::ConstOption<Value> result = env.try_get_value(v);
-        if(!result.is_valid()){
-                throw EvaluationException(std::string("eval: Symbol not found. Input:") + *v.value.string);
-        }
-        return *result;
+        bool increasing = range_increment > Number::make(0);
+        if(increasing ? !(range_next < range_end) : !(range_next > range_end)) return false;
+        out = make_value_number(range_next);
+        range_next += range_increment;
+        return true;
     }
-    else if(is_quoted(v))
+    else if(kind == LIST_CURSOR)
     {
-        const Value* ref_result = value_list_second(v);
-        if(!ref_result) throw EvaluationException(std::string("eval: Quote was not followed by an element. Input:") + value_to_string(v));
-        return *ref_result;
+        if(list_pos == value_list(collection)->end()) return false;
+        out = *list_pos;
+        ++list_pos;
+        return true;
     }
-    else if(is_assignment(v))
+    else if(kind == VECTOR_CURSOR)
     {
-        const Value *asgn_var = assignment_var(v);
-        const Value *asgn_val = assignment_value(v);
-        if(asgn_var && asgn_val)
-        {
-            if(asgn_var->type != SYMBOL)
-                throw EvaluationException(std::string("eval: Value to assign to was not symbol. Input:") + value_to_string(v));
-            if(is_self_evaluating(*asgn_val))
-                env = env.add(*asgn_var, *asgn_val);
-            else
-                env = env.add(*asgn_var, eval(*asgn_val, env, masp));
-        }
-        else
-        {
-            throw EvaluationException(std::string("eval:Did not find anything to assign to. Input:") + value_to_string(v));
-        }
-        return Value();
+        PVector* vec = collection.value.vector;
+        if(vector_pos >= vec->size()) return false;
+        out = (*vec)[vector_pos++];
+        return true;
     }
-    else if(is_reassignment(v))
+    else
     {
-        const Value *asgn_var = assignment_var(v);
-        const Value *asgn_val = assignment_value(v);
-        bool result = false;
-        if(asgn_var && asgn_val)
-        {
-            if(asgn_var->type != SYMBOL)
-                throw EvaluationException(std::string("eval: Value to assign to was not symbol. Input:") + value_to_string(v));
+        const Value* v = seq.first();
+        if(!v) return false;
+        out = *v;
+        seq.advance();
+        return true;
+    }
+}
 
-            if(is_self_evaluating(*asgn_val))
-                result = env.try_replace_value(*asgn_var, *asgn_val);
-            else
-                result = env.try_replace_value(*asgn_var, eval(*asgn_val, env, masp));
-        }
-        else
+bool SeqSource::call(const Value& fun, Value& arg, Value& result)
+{
+    args.clear();
+    args.push_back(arg);
+    result = call_function(*masp, fun, args, masp->env_map());
+    // The arguments are not visited by the collector, so none are kept between calls.
+    args.clear();
+    return is_true(result);
+}
+
+bool SeqSource::pull(Value& out)
+{
+    Value result;
+    while(!done)
+    {
+        // A take that is complete ends the sequence before the next element is read.
+        for(auto& s : stages)
         {
-            throw EvaluationException(std::string("eval:Did not find anything to set to. Input:") + value_to_string(v));
+            if(s.kind == Stage::TAKE && s.count == 0) done = true;
         }
+        if(done || !read(out)) break;
 
-        if(!result) throw EvaluationException(std::string("eval:Set value failed. Probably missing key. Input:") + value_to_string(v));
-
-        return Value();
-    }
-    else if(is_if(v))
-    {
-        const Value* if_predicate = value_list_second(v);
-        if(if_predicate)
+        bool keep = true;
+        for(auto s = stages.begin(); keep && s != stages.end(); ++s)
         {
-            if(is_true(eval(*if_predicate, env, masp)))
-            {
-                const Value* if_then = value_list_third(v);
-                if(if_then)
-                {
-                    if(is_self_evaluating(*if_then)) return *if_then;
-                    else return eval(*if_then, env, masp);
-                }
-                else throw EvaluationException(std::string("eval: Did not find 'fst' in expected form (if pred fst snd). Input:") + value_to_string(v));
-            }
-            else
+            switch(s->kind)
             {
-                const Value* if_else = value_list_nth(v, 3);
-                if(if_else)
-                {
-                    if(is_self_evaluating(*if_else))
-                        return *if_else;
-                    else
-                        return eval(*if_else, env, masp);
-                }
-                else
+                case Stage::MAP:        call(s->fun, out, result); out = std::move(result); break;
+                case Stage::FILTER:     keep = call(s->fun, out, result); break;
+                case Stage::DROP:       if(s->count > 0){--s->count; keep = false;} break;
+                case Stage::DROP_WHILE: if(s->count > 0){keep = !call(s->fun, out, result); if(keep) s->count = 0;} break;
+                case Stage::TAKE:       --s->count; break;
+                case Stage::TAKE_WHILE: if(!call(s->fun, out, result)){done = true; keep = false;} break;
+                case Stage::DROP_LAST:
                 {
-                    return Value();
+                    s->pending.push_back(std::move(out));
+                    keep = s->pending.size() > s->count;
+                    if(keep)
+                    {
+                        out = std::move(s->pending.front());
+                        s->pending.pop_front();
+                    }
+                    break;
                 }
             }
         }
-        else  throw EvaluationException(std::string("Did not find 'pred' in expected form (if pred fst snd). Input:") + value_to_string(v));
+        if(keep) return true;
     }
-    else if(is_lambda(v))
+    done = true;
+    return false;
+}
+
+masp_result eval(Masp& m, const Value* v)
+{
+    ValuePtr result(new Value(), ValueDeleter());
+
+    try
     {
-        List* l = value_list(v);
-        const Value* lambda_parameters = value_list_second(v);
+        *result = eval(*v, m);
 
-        if(lambda_parameters && l)
-        {
-            std::list<Value> lambda_list = glh::list(make_value_symbol("procedure"),
-                    *lambda_parameters,
-                    make_value_list(l->rrest()), // lambda body
-                    make_value_map(env));
-            return make_value_list(new_list(masp, lambda_list));
-        }
-        else
-        {
-            throw EvaluationException(std::string("Could not find one or more of 'params' 'body' in (lambda params body) expression. Input:")  + value_to_string(v));
-        }
-    }
-    else if(is_begin(v))
+        // Run the stages of a lazy result here so that their errors fail the evaluation
+        // instead of the printing of the result.
+        if(result->type == LAZY_SEQ) result->value.lazy_seq->count();
+    }catch(const EvaluationException& e)
     {
-        return eval_sequence(value_list(v)->rest(), env, masp);
-    }
-    else if(is_cond(v))
+        return masp_fail(e.get_message());
+    }catch(const std::exception& e)
     {
-        return eval(convert_cond_to_if(v, masp), env, masp);
+        return masp_fail(e.what());
     }
-    else if(is_application(v) && (!value_list(v)->empty())) // Is application
+    catch(...)
     {
-        // Get operator
-        const Value* first = value_list_first(v);
-        Value op;
-
-        if(!is_self_evaluating(*first)) 
-            op = eval(*first, env, masp);
-        else
-            op = *first;
-
-        List operands = value_list(v)->rest(); // TODO: eval each operand prior to application. Store result in temp. container or list.
-
-        return apply(op, operands.begin(), operands.end(), env, masp);
+        return masp_fail("Unknown error.");
     }
 
-    throw EvaluationException(std::string("Could not find evaluable value. Input:") + value_to_string(v));
-
-    return Value();
+    return masp_result(result);
 }
 
-bool is_primitive_procedure(const Value& v){return v.type == FUNCTION;}
-bool is_compound_procedure(const Value& v){return is_tagged_list(v, "procedure");}
-
-PrimitiveFunction value_function(const Value& v)
-{
-    return v.value.function->fun;
+masp_result read_eval(Masp& m, const char* str){
+    masp_result parse_result = string_to_value(m, str);
+    if(parse_result.valid()){
+        return eval(m, parse_result.as_value()->get());
+    }
+    else{
+        return parse_result;
+    }
 }
 
-Vector eval_list_to_vector(VRefIterator args_begin, VRefIterator args_end, Map& env, Masp& masp)
-{
-    Vector v;
-    while(args_begin != args_end)
-    {
-        v.push_back(eval(*args_begin, env, masp));
-        ++args_begin;
+masp_result read_eval_file(Masp& m, const char* file_path){
+    masp_result parse_result = file_to_value(m, file_path);
+    if(parse_result.valid()){
+        return eval(m, parse_result.as_value()->get());
+    }
+    else{
+        return parse_result;
     }
-    return v;
 }
 
-/** Attempts to assign addresses to elements accessible through iterator range. 
- *  @return false if range is shorter than the number of reference addresses.*/
-template<class IT, class PPTR>
-bool range_decompose(IT begin, IT end, PPTR a, PPTR b)
+masp_result import_file(Masp& m, const char* file_path)
 {
-    bool result = true;
+    ModuleCache& cache(m.env()->modules_);
+    std::string  path(file_path);
 
-    if(begin != end){ *a = &(*begin); ++begin;} else result = false;
-    if(begin != end){ *b = &(*begin); ++begin;} else result = false;
+    uint64_t size;
+    int64_t  modified;
+    bool     found;
+    std::tie(size, modified, found) = file_stamp(file_path);
 
-    return result;
-}
+    if(!found) return masp_fail(std::string("Could not read file:") + path);
 
-/** Attempts to read as many entries from the list into input parameters.*/
-void list_decompose(const List& l, const Value** first, const Value** second, const Value** third, const Value** fourth)
-{
-    auto i = l.begin();
-    auto e = l.end();
+    auto entry = cache.entries.find(path);
+    std::shared_ptr<Module> module;
 
-    if(first)  *first = 0;
-    if(second) *second = 0;
-    if(third)  *third = 0;
-    if(fourth) *fourth = 0;
+    if(entry != cache.entries.end() && entry->second.size == size && entry->second.modified == modified)
+    {
+        module = entry->second.module;
+        ++cache.stats.cached;
+    }
+    else
+    {
+        std::string source;
+        bool        success;
+        std::tie(source, success) = file_to_string(file_path);
 
-    if(i != e && first) *first = i.data_ptr();
+        if(!success) return masp_fail(std::string("Could not read file:") + path);
 
-    if(i != e) ++i; else return;
-    if(i != e && second) *second = i.data_ptr();
+        uint64_t hash = content_hash(source.data(), source.size());
 
-    if(i != e) ++i; else return;
-    if(i != e && third) *third = i.data_ptr();
+        if(entry != cache.entries.end() && entry->second.module->hash == hash)
+        {
+            module = entry->second.module;
+            ++cache.stats.cached;
+        }
+        else
+        {
+            std::string module_path = module_file_path(cache, path, hash);
+            module = load_module_file(m, module_path, hash);
 
-    if(i != e) ++i; else return;
-    if(i != e && fourth) *fourth = i.data_ptr();
+            if(module)
+            {
+                ++cache.stats.precompiled;
+            }
+            else
+            {
+                masp_result parse_result = string_to_value(m, source.c_str());
+                if(!parse_result.valid()) return parse_result;
 
-}
+                ++cache.stats.parsed;
 
-Value eval_compound_procedure(const Value& v, Vector& params, Masp& masp)
-{
-        // Eval sequence. #1 : Extract params, body and env from procedure list.
-        const Value* proc_params = 0;
-        const Value* proc_body   = 0;
-        const Value* proc_env    = 0;
+                try
+                {
+                    module = compile_module(m, *parse_result.as_value()->get(), hash);
+                }
+                catch(const EvaluationException&)
+                {
+                    // Run the forms up to the one that does not compile and report its error.
+                    return eval(m, parse_result.as_value()->get());
+                }
 
-        List* l = value_list(v);
+                save_module_file(module_path, *module);
+            }
+        }
 
-        list_decompose(*l, 0, &proc_params, &proc_body, &proc_env);
+        ModuleCache::Entry e = {size, modified, module};
+        cache.entries[path] = e;
+    }
 
-        if(!proc_params) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure parameters."));
-        if(!proc_body) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure body."));
-        if(!proc_env) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure environment."));
+    ValuePtr result(new Value(), ValueDeleter());
 
-        List* params_list = value_list(*proc_params);
-        List* body_list   = value_list(*proc_body);
-        Map* proc_env_map = value_map(*proc_env);
+    try
+    {
+        *result = run_module(m, *module);
+    }catch(const EvaluationException& e)
+    {
+        return masp_fail(e.get_message());
+    }catch(const std::exception& e)
+    {
+        return masp_fail(e.what());
+    }
+    catch(...)
+    {
+        return masp_fail("Unknown error.");
+    }
 
-        if(proc_params->type != LIST)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_params was not a list but:") + value_to_string(*proc_params));
-        
-        if(proc_body->type != LIST)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_body was not a list but:") + value_to_string(*proc_body));
+    return masp_result(result);
+}
 
-        if(proc_env->type != MAP)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_env was not a map but:") + value_to_string(*proc_env));
+///// Worker pool //////
 
-        if(!params_list) throw EvaluationException(std::string("apply: params_list is null."));
-        if(!body_list) throw EvaluationException(std::string("apply: body_list is null."));
-        if(!proc_env_map) throw EvaluationException(std::string("apply: env_map is null."));
+namespace {
 
-        Map seq_env = proc_env_map->add(params_list->begin(), params_list->end(), params.begin(), params.end());
+const size_t g_worker_gc_bytes   = 8 * 1024 * 1024; //> Live bytes a worker can reach before it collects.
+const size_t g_chunks_per_worker = 8;               //> Items of a map are split to chunks taken by idle workers.
 
-        return eval_sequence(*value_list(*proc_body), seq_env, masp);
+Vector read_values(Masp& masp, const std::vector<uint8_t>& bytes)
+{
+    ModuleReader reader(masp, bytes.data(), bytes.data() + bytes.size());
+    return reader.get_values();
 }
 
-Value apply(const Value& v, VRefIterator args_begin, VRefIterator args_end, Map& env, Masp& masp)
+std::vector<uint8_t> write_values(const Vector& values)
 {
-    Vector params = eval_list_to_vector(args_begin, args_end, env, masp);
+    ModuleWriter writer;
+    writer.put_values(values);
+    return std::move(writer.bytes);
+}
 
-    if(is_primitive_procedure(v))
-    {
-        return value_function(v)(masp, params, env);
-    }
-    else if(is_compound_procedure(v))
-    {
-        return eval_compound_procedure(v, params, masp);
+const char* g_pool_busy = "Worker pool is running another job.";
 
-#if 0
-        // Eval sequence. #1 : Extract params, body and env from procedure list.
-        const Value* proc_params = 0;
-        const Value* proc_body   = 0;
-        const Value* proc_env    = 0;
+/** Marks the pool busy while a job runs.*/
+class JobGuard
+{
+public:
+    bool acquired;
 
-        List* l = value_list(v);
+    JobGuard(std::atomic<bool>& busy):acquired(!busy.exchange(true)), busy_(busy){}
+    ~JobGuard(){if(acquired) busy_ = false;}
 
-        list_decompose(*l, 0, &proc_params, &proc_body, &proc_env);
+private:
+    std::atomic<bool>& busy_;
+};
 
-        if(!proc_params) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure parameters."));
-        if(!proc_body) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure body."));
-        if(!proc_env) throw EvaluationException(std::string("apply: Malformed compound procedure. Could not find procedure environment."));
+}
 
-        List* params_list = value_list(*proc_params);
-        List* body_list   = value_list(*proc_body);
-        Map* proc_env_map = value_map(*proc_env);
+class MaspPool::Worker
+{
+public:
+    Masp   masp;
+    size_t gc_threshold;
 
-        if(proc_params->type != LIST)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_params was not a list but:") + value_to_string(*proc_params));
-        
-        if(proc_body->type != LIST)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_body was not a list but:") + value_to_string(*proc_body));
+    Worker():gc_threshold(g_worker_gc_bytes){}
 
-        if(proc_env->type != MAP)
-            throw EvaluationException(std::string("apply: Malformed compound procedure. Proc_env was not a map but:") + value_to_string(*proc_env));
+    /** Collect after a job once the garbage of jobs has grown past the threshold.*/
+    void collect_garbage()
+    {
+        if(masp.live_size_bytes() < gc_threshold) return;
+        masp.gc();
+        gc_threshold = std::max(g_worker_gc_bytes, 2 * masp.live_size_bytes());
+    }
+};
 
-        if(!params_list) throw EvaluationException(std::string("apply: params_list is null."));
-        if(!body_list) throw EvaluationException(std::string("apply: body_list is null."));
-        if(!proc_env_map) throw EvaluationException(std::string("apply: env_map is null."));
+namespace {
 
-        Map seq_env = proc_env_map->add(params_list->begin(), params_list->end(), params.begin(), params.end());
+typedef std::vector<std::unique_ptr<MaspPool::Worker>> Workers;
 
-        return eval_sequence(*value_list(*proc_body), seq_env, masp);
-#endif
+/** Chunks of items the function of a map is called with. Each worker takes the next chunk
+ *  until none are left or a worker has failed.*/
+struct MapJob
+{
+    Workers&                          workers;
+    bool                              collect;
+    std::vector<uint8_t>              function;
+    std::vector<std::vector<uint8_t>> chunks;
+    std::vector<std::vector<uint8_t>> results;  //> Results per chunk.
+    std::atomic<size_t>               next;
+    std::atomic<bool>                 failed;
+    tthread::mutex                    mutex;
+    std::string                       error;    //> First error. Guarded by mutex.
+
+    MapJob(Workers& w, bool c):workers(w), collect(c), next(0), failed(false){}
+
+    void fail(const std::string& message)
+    {
+        tthread::lock_guard<tthread::mutex> lock(mutex);
+        if(!failed) error = message;
+        failed = true;
     }
-    else if(v.type == MAP)
+
+    void operator()(size_t index)
     {
-        Map* m = value_map(v);
+        MaspPool::Worker& worker(*workers[index]);
+        Masp& m(worker.masp);
 
-        if(params.begin() != params.end())
+        try
         {
-            glh::ConstOption<Value> result = m->try_get_value(*params.begin());
-            if(!result.is_valid()) return Value();
-            return *result;
+            Value fun = read_values(m, function)[0];
+
+            for(size_t c = next++; c < chunks.size() && !failed; c = next++)
+            {
+                Vector items = read_values(m, chunks[c]);
+                Vector out;
+                Vector args(1);
+
+                for(auto& item : items)
+                {
+                    args[0] = item;
+                    Value result = call_function(m, fun, args, m.env_map());
+                    if(collect) out.push_back(result);
+                }
+
+                if(collect) results[c] = write_values(out);
+            }
         }
-        else
+        catch(const EvaluationException& e)
         {
-            throw EvaluationException(std::string("apply: Attempting to apply map without key to search for."));
+            fail(e.get_message());
         }
-    }
-    else if(v.type == VECTOR)
-    {
-        Vector* vec = value_vector(v);
-        size_t param_size = params.size();
-        if(param_size != 1)
+        catch(const std::exception& e)
         {
-            throw EvaluationException(std::string("apply: Vector: Invalid number of arguments:") + glh::to_string(param_size));
+            fail(e.what());
         }
 
-        if(params.begin()->type != NUMBER || params.begin()->value.number.type != Number::INT) 
-            throw EvaluationException(std::string("apply: Vector: Index parameter must be integer. Was:") + value_to_string(*params.begin()));
+        worker.collect_garbage();
+    }
+};
 
-        int index = params.begin()->value.number.to_int();
-        int vec_size = vec->size();
-        if(index < 0 || index >= vec_size)
-            throw EvaluationException(std::string("apply: Vector: Index parameter out of range:") + glh::to_string(index));
+/** Evaluation run in the workers from first on.*/
+struct WorkerEval
+{
+    Workers&                           workers;
+    size_t                             first;
+    std::function<masp_result(Masp&)>  eval;
+    std::vector<std::string>           errors;  //> Empty for the workers that succeeded.
+    ValuePtr                           value;   //> Result of the first worker.
 
-        return (*vec)[index];
+    WorkerEval(Workers& w, const std::function<masp_result(Masp&)>& e):workers(w), first(0), eval(e), errors(w.size()){}
+
+    void operator()(size_t index)
+    {
+        size_t i = first + index;
+        masp_result result = eval(workers[i]->masp);
+
+        if(!result.valid()) errors[i] = result.message().empty() ? std::string("Unknown error.") : result.message();
+        else if(i == 0)     value = *result;
     }
-    else
+
+    masp_result result()
     {
-        throw EvaluationException(std::string("apply: Attempting to apply non-procedure. Input:") + value_to_string(v));
-        return Value();
+        for(size_t i = 0; i < errors.size(); ++i)
+            if(!errors[i].empty()) return masp_fail(errors[i]);
+        return masp_result(value);
+    }
+};
+
+}
+
+MaspPool::MaspPool(size_t worker_count, const Init& init):busy_(false)
+{
+    if(worker_count == 0) worker_count = std::max(tthread::thread::hardware_concurrency(), 1u);
+
+    for(size_t i = 0; i < worker_count; ++i)
+    {
+        workers_.emplace_back(new Worker());
+        if(init) init(workers_.back()->masp);
     }
 }
 
-} // empty namespace
+MaspPool::~MaspPool(){}
 
-masp_result eval(Masp& m, const Value* v)
+size_t MaspPool::size() const {return workers_.size();}
+
+masp_result MaspPool::load(const char* source)
 {
-    ValuePtr result(new Value(), ValueDeleter());
+    JobGuard guard(busy_);
+    if(!guard.acquired) return masp_fail(g_pool_busy);
 
-    try
-    {
-        *result = eval(*v, m.env()->get_env(), m);
-    }catch(const EvaluationException& e)
-    {
-        return masp_fail(e.get_message());
-    }catch(const std::exception& e)
-    {
-        return masp_fail(e.what());
-    }
-    catch(...)
+    std::string text(source);
+    WorkerEval job(workers_, [&text](Masp& m){return read_eval(m, text.c_str());});
+    glh::run_in_parallel(workers_.size(), job);
+    return job.result();
+}
+
+masp_result MaspPool::import(const char* file_path)
+{
+    JobGuard guard(busy_);
+    if(!guard.acquired) return masp_fail(g_pool_busy);
+
+    std::string path(file_path);
+    WorkerEval job(workers_, [&path](Masp& m){return import_file(m, path.c_str());});
+
+    // The first worker writes the precompiled module the others load.
+    glh::run_in_parallel(1, job);
+    if(job.errors[0].empty() && workers_.size() > 1)
     {
-        return masp_fail("Unknown error.");
+        job.first = 1;
+        glh::run_in_parallel(workers_.size() - 1, job);
     }
 
-    return masp_result(result);
+    return job.result();
 }
 
-masp_result read_eval(Masp& m, const char* str){
-    masp_result parse_result = string_to_value(m, str);
-    if(parse_result.valid()){
-        return eval(m, parse_result.as_value()->get());
+Vector MaspPool::map(Masp& caller, const Value& fun, const Vector& items, bool collect)
+{
+    Vector results;
+    size_t chunk_count = std::min(items.size(), workers_.size() * g_chunks_per_worker);
+    if(chunk_count == 0) return results;
+
+    JobGuard guard(busy_);
+    if(!guard.acquired) throw EvaluationException(g_pool_busy);
+
+    MapJob job(workers_, collect);
+    job.function = write_values(Vector(1, fun));
+
+    for(size_t c = 0; c < chunk_count; ++c)
+    {
+        auto begin = items.begin() + items.size() * c / chunk_count;
+        auto end   = items.begin() + items.size() * (c + 1) / chunk_count;
+        job.chunks.push_back(write_values(Vector(begin, end)));
     }
-    else{
-        return parse_result;
+    job.results.resize(chunk_count);
+
+    glh::run_in_parallel(std::min(workers_.size(), chunk_count), job);
+
+    if(job.failed) throw EvaluationException(job.error);
+
+    if(collect)
+    {
+        for(auto& r : job.results)
+        {
+            Vector values = read_values(caller, r);
+            results.insert(results.end(), values.begin(), values.end());
+        }
     }
+
+    return results;
 }
 
 const Value* get_value(Masp& m, const char* pathstr)
@@ -2085,7 +5046,7 @@ Type value_type(const Value* v)
 std::string  get_value_string(const Value* v)
 {
     std::string result;
-    if(v->is(STRING) || v->is(SYMBOL)) result = *v->value.string;
+    if(v->is(STRING) || v->is(SYMBOL)) result = value_string(*v);
     return result;
 }
 
@@ -2102,8 +5063,8 @@ Number get_value_number(const Value* v)
 
 namespace {
 
-#define OPDEF(name_param, i_start_param, i_end_param) Value name_param(Masp& m, Vector& args, Map& env){\
-            VecIterator i_start_param = args.begin(); VecIterator i_end_param = args.end();
+#define OPDEF(name_param, i_start_param, i_end_param) Value name_param(Masp& m, ArgSpan args, Map& env){\
+            ArgIterator i_start_param = args.begin(); ArgIterator i_end_param = args.end();
 
     // Arithmetic operators
 
@@ -2183,7 +5144,7 @@ namespace {
 
     OPDEF(op_make_range, arg_start, arg_end)
 
-        ArgWrap wrapper(arg_start, arg_end); 
+        ArgWrapRange<ArgIterator> wrapper(arg_start, arg_end); 
 
         size_t count = args.size();
         
@@ -2218,18 +5179,14 @@ namespace {
         else throw EvaluationException("op_make_range: need 1 - 3 numeric arguments.");
 
         glh::Range<Number> range(start, increment, end);
-        
-        std::vector<Value> rangeinstance;
 
-        for(auto r : range){
-            rangeinstance.push_back(make_value_number(r));
-        }
+        // The elements are realized when the sequence is read.
+        std::shared_ptr<SeqSource> source(std::make_shared<SeqSource>(m, SeqSource::RANGE));
+        source->range_next = range.range_start_;
+        source->range_increment = range.increment_;
+        source->range_end = range.range_end_;
 
-        Value result = make_value_list(m);
-        List* res_list = value_list(result);
-        *res_list = new_list(m, rangeinstance);
-        
-        return result;
+        return make_value_lazy_seq(source);
     }
 
     // Booleans
@@ -2259,9 +5216,9 @@ namespace {
         return make_value_boolean(Result);
     }
 
-    Value op_not_equal(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_not_equal(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         bool Result = true;
 
         const Value* first;
@@ -2288,7 +5245,7 @@ namespace {
     class NumLeq{public: static bool op(const Number& first, const Number& second){return first <= second;} };
     class NumGeq{public: static bool op(const Number& first, const Number& second){return first >= second;} };
 
-    template<class OP> bool num_op_loop(VecIterator arg_start, VecIterator arg_end)
+    template<class OP> bool num_op_loop(ArgIterator arg_start, ArgIterator arg_end)
     {
        bool Result = true;
 
@@ -2313,30 +5270,30 @@ namespace {
         return Result;
     }
 
-    Value op_less_or_eq(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_less_or_eq(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         bool Result = num_op_loop<NumLeq>(arg_start, arg_end);
         return make_value_boolean(Result);
     }
 
-    Value op_less(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_less(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         bool Result = num_op_loop<NumLess>(arg_start, arg_end);
         return make_value_boolean(Result);
     }
 
-    Value op_gt(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_gt(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         bool Result = num_op_loop<NumGt>(arg_start, arg_end);
         return make_value_boolean(Result);
     }
 
-    Value op_gt_or_eq(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_gt_or_eq(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         bool Result = num_op_loop<NumGeq>(arg_start, arg_end);
         return make_value_boolean(Result);
     }
@@ -2351,18 +5308,13 @@ namespace {
         }
         else if(v->type == VECTOR)
         {
-            Vector* vec = value_vector(*v);
-
-            if(vec->size() > 0)
-            {
-                auto i = vec->begin();
-                ++i;
-                return make_value_vector(i , vec->end());
-            }
-            else
-            {
-                return make_value_vector();
-            }
+            return make_value_vector(value_vector(*v)->drop(1));
+        }
+        else if(v->type == LAZY_SEQ)
+        {
+            LazySeq seq(*v->value.lazy_seq);
+            if(seq.first()) seq.advance();
+            return make_value_lazy_seq(seq);
         }
         return Value();
     }
@@ -2376,15 +5328,19 @@ namespace {
         }
         else if(v->type == VECTOR)
         {
-            Vector* vec = v->value.vector;
+            PVector* vec = v->value.vector;
             if(vec->size() > 0) first = &(*vec)[0];
         }
+        else if(v->type == LAZY_SEQ)
+        {
+            first = v->value.lazy_seq->first();
+        }
         return first;
     }
 
-    Value op_first(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_first(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         const Value* first = 0;
         if(arg_start != arg_end)
         {
@@ -2394,9 +5350,9 @@ namespace {
         return first ? *first : Value();
     }
 
-    Value op_next(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_next(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         if(arg_start != arg_end)
         {
             Value* v =  &(*arg_start);
@@ -2405,9 +5361,9 @@ namespace {
         return Value();
     }
 
-    Value op_fnext(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_fnext(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         if(arg_start != arg_end)
         {
             if(arg_start->type == LIST)
@@ -2420,19 +5376,25 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = value_vector(*arg_start);
+                PVector* vec = value_vector(*arg_start);
                 auto i = vec->begin();
                 auto e = vec->end();
                 if(i != e) ++i;
                 if(i != e) return *i;
             }
+            else if(arg_start->type == LAZY_SEQ)
+            {
+                LazySeq seq(*arg_start->value.lazy_seq);
+                if(seq.first()) seq.advance();
+                if(const Value* second = seq.first()) return *second;
+            }
         }
         return Value();
     }
 
-    Value op_nnext(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_nnext(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         if(arg_start != arg_end)
         {
             if(arg_start->type == LIST)
@@ -2441,26 +5403,21 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = value_vector(*arg_start);
-
-                if(vec->size() > 1)
-                {
-                    auto i = vec->begin();
-                    ++i;++i;
-                    return make_value_vector(i , vec->end());
-                }
-                else
-                {
-                    return make_value_vector();
-                }
+                return make_value_vector(value_vector(*arg_start)->drop(2));
+            }
+            else if(arg_start->type == LAZY_SEQ)
+            {
+                LazySeq seq(*arg_start->value.lazy_seq);
+                for(int i = 0; i < 2 && seq.first(); ++i) seq.advance();
+                return make_value_lazy_seq(seq);
             }
         }
         return Value();
     }
 
-    Value op_nfirst(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_nfirst(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         const Value* first = 0;
         if(arg_start != arg_end)
         {
@@ -2470,9 +5427,13 @@ namespace {
             }
             else if(arg_start->type == VECTOR)
             {
-                Vector* vec = arg_start->value.vector;
+                PVector* vec = arg_start->value.vector;
                 if(vec->size() > 0) first = &(*vec)[0];
             }
+            else if(arg_start->type == LAZY_SEQ)
+            {
+                first = arg_start->value.lazy_seq->first();
+            }
 
             if(first)
             {
@@ -2482,9 +5443,9 @@ namespace {
         return Value();
     }
 
-    Value op_ffirst(Masp& m, Vector& args, Map& env){
-        VecIterator arg_start = args.begin();
-        VecIterator arg_end = args.end();
+    Value op_ffirst(Masp& m, ArgSpan args, Map& env){
+        ArgIterator arg_start = args.begin();
+        ArgIterator arg_end = args.end();
         const Value* ffirst = 0;
         if(arg_start != arg_end)
         {
@@ -2498,8 +5459,8 @@ namespace {
 
     // Type query operations
 
-#define OP_1_DEFN(opval_param, i_param)    Value opval_param(Masp& m, Vector& args, Map& env) \
-    {VecIterator i_param = args.begin(); VecIterator arg_end = args.end(); if(i_param != arg_end){
+#define OP_1_DEFN(opval_param, i_param)    Value opval_param(Masp& m, ArgSpan args, Map& env) \
+    {ArgIterator i_param = args.begin(); ArgIterator arg_end = args.end(); if(i_param != arg_end){
 
     OP_1_DEFN(op_value_is_integer, vi)
         if(vi->type == NUMBER && vi->value.number.type == Number::INT) return make_value_boolean(true);
@@ -2525,16 +5486,26 @@ namespace {
         if(vi->type == MAP) return make_value_boolean(true);
     } return make_value_boolean(false);}
 
+    OP_1_DEFN(op_value_is_sorted_map, vi)
+        if(vi->type == SORTED_MAP) return make_value_boolean(true);
+    } return make_value_boolean(false);}
+
+    OP_1_DEFN(op_value_is_lazy_seq, vi)
+        if(vi->type == LAZY_SEQ) return make_value_boolean(true);
+    } return make_value_boolean(false);}
+
     OP_1_DEFN(op_value_is_vector, vi)
         if(vi->type == VECTOR) return make_value_boolean(true);
     } return make_value_boolean(false);}
     
+    // Lazy sequences are lists that are realized when read, so list? is true for them too.
+    // Ranges are lazy sequences. lazy-seq? tells the two apart.
     OP_1_DEFN(op_value_is_list, vi)
-        if(vi->type == LIST) return make_value_boolean(true);
+        if(vi->type == LIST || vi->type == LAZY_SEQ) return make_value_boolean(true);
     } return make_value_boolean(false);}
 
     OP_1_DEFN(op_value_is_fn, vi)
-        if(is_primitive_procedure(*vi) || is_compound_procedure(*vi)) return make_value_boolean(true);
+        if(vi->type == FUNCTION) return make_value_boolean(true);
     } return make_value_boolean(false);}
 
     OP_1_DEFN(op_value_is_object, vi)
@@ -2545,24 +5516,55 @@ namespace {
 
     OPDEF(op_make_map, arg_start, arg_end)
 
-        Map map = new_map(m);
-        MapPool* pool = &map_pool(m);
-        return make_value_map(pool->add(map, arg_start, arg_end));
+        std::vector<MapPool::KeyValue> entries;
+        for(ArgIterator key = arg_start; key != arg_end && key + 1 != arg_end; key += 2)
+        {
+            entries.push_back(MapPool::KeyValue::make(0, *key, *(key + 1)));
+        }
+        return make_value_map(map_add_entries(m, new_map(m), entries));
+    }
+
+    /** Throw unless key can be ordered in a sorted map.*/
+    void check_sorted_key(const char* op, const Value& key)
+    {
+        if(key.type != NIL && glh::none_of(key.type, BOOLEAN, NUMBER, STRING, SYMBOL))
+            throw EvaluationException(std::string(op) + ": sorted map keys must be numbers, strings, symbols, booleans or nil. Type was:" +
+                                      value_type_to_string(key) + ".");
+    }
+
+    SortedMap sorted_map_add(const SortedMap& map, ArgIterator arg_i, ArgIterator arg_end, const char* op)
+    {
+        SortedMap result = map;
+        while(arg_i != arg_end)
+        {
+            ArgIterator key = arg_i++;
+            if(arg_i == arg_end) throw EvaluationException(std::string(op) + ": key without value.");
+            check_sorted_key(op, *key);
+            result = result.add(*key, *arg_i++);
+        }
+        return result;
+    }
+
+    // (make-sorted-map key value key value ...)
+    OPDEF(op_make_sorted_map, arg_start, arg_end)
+
+        return make_value_sorted_map(sorted_map_add(sorted_map_pool(m).new_map(), arg_start, arg_end, "op_make_sorted_map"));
     }
 
     OPDEF(op_make_vector, arg_start, arg_end)
 
-        return make_value_vector(arg_start, arg_end);
+        return make_value_vector(m, arg_start, arg_end);
     }
 
     // Printers
 
-    std::string value_iters_to_string(VecIterator i_start, VecIterator i_end, const char* spacer)
+    std::string value_iters_to_string(ArgIterator i_start, ArgIterator i_end, const char* spacer)
     {
         std::ostringstream os;
         for(;i_start != i_end;)
         {
-            if (i_start->type == SYMBOL || i_start->type == STRING) os << *i_start->value.string;
+            if (i_start->type == STRING) os.write(i_start->value.string->chars, i_start->value.string->length);
+            else if (i_start->type == SYMBOL) os << value_string(*i_start);
             else os <<  value_to_string(*i_start);
             ++i_start;
             if(i_start != i_end) os << spacer;
@@ -2575,6 +5577,26 @@ namespace {
         return make_value_string(value_iters_to_string(arg_start, arg_end, ""));
     }
 
+    /** (subs s start [end]) - Substring of s. Shares the character buffer of s.*/
+    OPDEF(op_subs, arg_i, arg_end)
+
+        const Value* str = arg_i != arg_end ? &*arg_i++ : 0;
+        if(!str || str->type != STRING) throw EvaluationException("op_subs: first argument is not a string.");
+        size_t length = str->value.string->length;
+
+        size_t index[2] = {0, length};
+        for(size_t n = 0; n < 2 && arg_i != arg_end; ++n, ++arg_i)
+        {
+            if(arg_i->type != NUMBER) throw EvaluationException("op_subs: index is not a number.");
+            int i = arg_i->value.number.to_int();
+            index[n] = i < 0 ? 0 : (size_t) i;
+        }
+
+        if(index[1] > length || index[0] > index[1]) throw EvaluationException("op_subs: index out of range.");
+
+        return make_value_substring(*str, index[0], index[1]);
+    }
+
     OPDEF(op_println, arg_start, arg_end)
 
         m.get_output() << value_iters_to_string(arg_start, arg_end, " ");
@@ -2598,7 +5620,9 @@ namespace {
             if(arg_i->type == VECTOR)     {count = arg_i->value.vector->size();}
             else if(arg_i->type == LIST)  {count = arg_i->value.list->size();}
             else if(arg_i->type == MAP)   {count = arg_i->value.map->size();}
-            else if(arg_i->type == STRING){count = arg_i->value.string->size();}
+            else if(arg_i->type == SORTED_MAP){count = arg_i->value.sorted_map->size();}
+            else if(arg_i->type == LAZY_SEQ){count = (int) arg_i->value.lazy_seq->count();}
+            else if(arg_i->type == STRING){count = arg_i->value.string->length;}
     } return make_value_number(Number::make(count));}
 
     OPDEF(op_cons, arg_i, arg_end) 
@@ -2615,11 +5639,19 @@ namespace {
             }
             else if(snd->type == VECTOR)
             {
-                Vector* v = value_vector(*snd);
-                
-                return make_value_vector(*fst, *v);
+                PVector* v = value_vector(*snd);
+                return make_value_vector(vector_pool(m).new_vector().add(*fst).add_end(v->begin(), v->end()));
+            }
+            else if(snd->type == LAZY_SEQ)
+            {
+                // The first chunk holds the new element and is filled up from the old sequence when read.
+                std::shared_ptr<SeqChunk> chunk(std::make_shared<SeqChunk>());
+                chunk->elements.push_back(*fst);
+                chunk->source = std::make_shared<SeqSource>(m, SeqSource::SEQ_CURSOR);
+                chunk->source->seq = *snd->value.lazy_seq;
+                return make_value_lazy_seq(LazySeq(chunk, 0));
             }
-            else throw EvaluationException("op_cons: value to append to must be LIST or VECTOR (was:" +  value_to_string(*snd) + ")."); 
+            else throw EvaluationException("op_cons: value to append to must be LIST, VECTOR or LAZY SEQ (was:" +  value_to_string(*snd) + ")."); 
         }
 
         throw EvaluationException("op_cons: bad syntax. Cons must be applied to two parameters: (cons param1 param2)."); 
@@ -2641,11 +5673,21 @@ namespace {
             }
             else if(fst->type == VECTOR)
             {
-                Vector* v = value_vector(*snd);
+                PVector* v = value_vector(*fst);
                 ++arg_i; 
-                return make_value_vector(*v, arg_i, arg_end);
+                return make_value_vector(v->add_end(arg_i, arg_end));
             }
-            else throw EvaluationException("op_conj: value to append to must be LIST or VECTOR (was:" +  value_to_string(*fst) + ")."); 
+            else if(fst->type == LAZY_SEQ)
+            {
+                // Appending realizes the sequence into a list.
+                Vector items;
+                LazySeq seq(*fst->value.lazy_seq);
+                for(const Value* v = seq.first(); v; seq.advance(), v = seq.first()) items.push_back(*v);
+                ++arg_i;
+                items.insert(items.end(), arg_i, arg_end);
+                return make_value_list(new_list(m, items));
+            }
+            else throw EvaluationException("op_conj: value to append to must be LIST, VECTOR or LAZY SEQ (was:" +  value_to_string(*fst) + ")."); 
         }
 
         throw EvaluationException("op_conj: bad syntax. Cons must be applied to at least two parameters: (conj collection elem ... )."); 
@@ -2658,6 +5700,11 @@ namespace {
 
         if(args.size() < 3 && args.size() % 2 == 0) throw EvaluationException("op_insert_data: wrong number of input arguments. Signature is (add map key value key value ...).");
 
+        if(SortedMap* sorted = value_sorted_map(args[0]))
+        {
+            return make_value_sorted_map(sorted_map_add(*sorted, arg_i + 1, arg_end, "op_insert_data"));
+        }
+
         Map* map = value_map(args[0]);
 
         if(!map){
@@ -2665,28 +5712,27 @@ namespace {
             throw EvaluationException("op_insert_data: first argument must be a map. You entered:" + first_str);
         }
 
-        Value result = make_value_map(*map);
-
         ++arg_i;
 
-        Map* resmap = value_map(result);
-
-        while(arg_i != arg_end)
-        {
-            auto key = arg_i;
-            ++arg_i;
-            auto value = arg_i;
-            ++arg_i;
-            *resmap = resmap->add(*key, *value);
-        }
+        // Intermediate maps are not visible, so the keys are added in place to a transient.
+        auto builder = map->transient();
+        builder.add(arg_i, arg_end);
 
-        return result;
+        return make_value_map(builder.persistent());
     }
 
     // Remove keyvalue pair from map
     OPDEF(op_remove_data, arg_i, arg_end) 
                 // Signature (add map key value key value key value ...)
         if(args.size() < 2) throw EvaluationException("op_remove_data: wrong number of input arguments. Signature is (remove map key key...");
+
+        if(SortedMap* sorted = value_sorted_map(args[0]))
+        {
+            SortedMap result = *sorted;
+            for(++arg_i; arg_i != arg_end; ++arg_i) result = result.remove(*arg_i);
+            return make_value_sorted_map(result);
+        }
+
         Map* map = value_map(args[0]);
         if(!map){
             std::string first_str = value_to_typed_string(&args[0]);
@@ -2709,8 +5755,66 @@ namespace {
         return result;
     }
 
+    // Return a map from each key added, removed or changed in new-map to [old-value new-value].
+    Value op_map_diff(Masp& m, ArgSpan args, Map& env){
+        // Signature (diff old-map new-map)
+        if(args.size() != 2) throw EvaluationException("op_map_diff: wrong number of input arguments. Signature is (diff old-map new-map)");
+        Map* old_map = value_map(args[0]);
+        Map* new_map = value_map(args[1]);
+        if(!old_map || !new_map){
+            std::string types = value_type_to_string(args[0]) + ", " + value_type_to_string(args[1]);
+            throw EvaluationException("op_map_diff: arguments must be maps. Types were:" + types + ".");
+        }
+
+        Value result = make_value_map(m);
+        auto builder = value_map(result)->transient();
+
+        old_map->diff(*new_map, [&](const Value& key, const Value* old_value, const Value* new_value){
+            Value change[2] = {old_value ? *old_value : Value(), new_value ? *new_value : Value()};
+            builder.add(key, make_value_vector(m, change, change + 2));
+        });
+
+        return make_value_map(builder.persistent());
+    }
+
+    // Return the union of two maps.
+    Value op_map_merge(Masp& m, ArgSpan args, Map& env){
+        // Signature (merge map other-map) or (merge map other-map fn). A key in both maps gets the value
+        // in other-map or, if fn is given, (fn key value other-value).
+        if(args.size() != 2 && args.size() != 3) throw EvaluationException("op_map_merge: wrong number of input arguments. Signature is (merge map other-map [fn])");
+        Map* map = value_map(args[0]);
+        Map* other = value_map(args[1]);
+        if(!map || !other){
+            std::string types = value_type_to_string(args[0]) + ", " + value_type_to_string(args[1]);
+            throw EvaluationException("op_map_merge: first two arguments must be maps. Types were:" + types + ".");
+        }
+
+        if(args.size() == 2){
+            return make_value_map(map->merge(*other, [](const Value&, const Value&, const Value& other_value){return other_value;}));
+        }
+
+        Value& fun = args[2];
+        if(fun.type != FUNCTION) throw EvaluationException("op_map_merge: third argument must be a function. Type was:" + value_type_to_string(fun) + ".");
+
+        return make_value_map(map->merge(*other, [&](const Value& key, const Value& value, const Value& other_value){
+            Vector params;
+            params.push_back(key);
+            params.push_back(value);
+            params.push_back(other_value);
+            return call_function(m, fun, params, env);
+        }));
+    }
+
     OPDEF(op_map_keys, arg_i, arg_end)
         if(args.size() != 1) throw EvaluationException("op_map_keys: wrong number of input arguments. Signature is (keys map)");
+
+        if(SortedMap* sorted = value_sorted_map(*arg_i))
+        {
+            Vector keys;
+            for(auto& kv : *sorted) keys.push_back(kv.first);
+            return make_value_list(new_list(m, keys));
+        }
+
         Map* map = value_map(*arg_i);
         if(!map){
             std::string value_type = value_type_to_string(*arg_i);
@@ -2729,6 +5833,14 @@ namespace {
 
     OPDEF(op_map_vals, arg_i, arg_end)
         if(args.size() != 1) throw EvaluationException("op_map_vals: wrong number of input arguments. Signature is (vals map)");
+
+        if(SortedMap* sorted = value_sorted_map(*arg_i))
+        {
+            Vector vals;
+            for(auto& kv : *sorted) vals.push_back(kv.second);
+            return make_value_list(new_list(m, vals));
+        }
+
         Map* map = value_map(*arg_i);
         if(!map){
             std::string value_type = value_type_to_string(*arg_i);
@@ -2745,28 +5857,62 @@ namespace {
         return result;
     }
 
+    SortedMap* sorted_map_arg(ArgSpan args, size_t count, const char* op, const char* signature)
+    {
+        if(args.size() != count) throw EvaluationException(std::string(op) + ": wrong number of input arguments. Signature is " + signature);
+        SortedMap* map = value_sorted_map(args[0]);
+        if(!map) throw EvaluationException(std::string(op) + ": first argument must be a sorted map. Type was:" + value_type_to_string(args[0]) + ".");
+        for(size_t i = 1; i < count; ++i) check_sorted_key(op, args[i]);
+        return map;
+    }
+
+    Value sorted_entry_to_value(Masp& m, const SortedMapPool::KeyValue* kv)
+    {
+        if(!kv) return Value();
+        Value entry[2] = {kv->first, kv->second};
+        return make_value_vector(m, entry, entry + 2);
+    }
+
+    // Return [key value] of the greatest key not greater than key or nil.
+    Value op_sorted_floor(Masp& m, ArgSpan args, Map& env){
+        SortedMap* map = sorted_map_arg(args, 2, "op_sorted_floor", "(floor-entry sorted-map key)");
+        return sorted_entry_to_value(m, map->floor(args[1]));
+    }
+
+    // Return [key value] of the least key not less than key or nil.
+    Value op_sorted_ceiling(Masp& m, ArgSpan args, Map& env){
+        SortedMap* map = sorted_map_arg(args, 2, "op_sorted_ceiling", "(ceiling-entry sorted-map key)");
+        return sorted_entry_to_value(m, map->ceiling(args[1]));
+    }
+
+    // Return the entries with keys from start up to but not including end as a sorted map.
+    Value op_sorted_subrange(Masp& m, ArgSpan args, Map& env){
+        SortedMap* map = sorted_map_arg(args, 3, "op_sorted_subrange", "(subrange sorted-map start end)");
+
+        SortedMap result = sorted_map_pool(m).new_map();
+        for(auto i = map->lower_bound(args[1]), end = map->lower_bound(args[2]); i != end; ++i)
+        {
+            result = result.add(i->first, i->second);
+        }
+        return make_value_sorted_map(result);
+    }
+
     struct IterContext{
-        Vector& args;
+        ArgSpan args;
         size_t count;
         size_t symcount;
         Value& collection;
         Value& fun;
          
-        IterContext(Vector& arguments)
+        IterContext(ArgSpan arguments)
             :args(arguments), count(args.size()),symcount(count - 2), collection(args[count - 2]), fun(args[count - 1]){
         }
 
         Value apply(Vector& params, Map& env, Masp& masp)
         {
-            if(is_primitive_procedure(fun))
-            {
-                return value_function(fun)(masp, params, env);
-            }
-            else if(is_compound_procedure(fun))
-            {
-                return eval_compound_procedure(fun, params, masp);
-            }
-            else throw EvaluationException("IterContext::apply: malformed call, attempting call non-callable value."); 
+            if(fun.type != FUNCTION)
+                throw EvaluationException("IterContext::apply: malformed call, attempting call non-callable value."); 
+            return call_function(masp, fun, params, env);
         }
     };
 
@@ -2797,7 +5943,8 @@ namespace {
     }
 
     // TODO: raise exception or unify: iter for map takes only 2 parameters. Make explicit.
-    Value extract_apply_map(Map::iterator begin, Map::iterator end, IterContext& ic, Map& env, Masp& masp)
+    template<class I>
+    Value extract_apply_map(I begin, I end, IterContext& ic, Map& env, Masp& masp)
     {
         if(ic.symcount != 0) throw EvaluationException("op_iter: map does not accept decomposition symbols. call as (map mapref fun)."); 
 
@@ -2815,24 +5962,48 @@ namespace {
         return Value();
     }
 
-    Value do_iter_list(Masp& m, Vector& args, Map& env){
+    Value do_iter_list(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
         List* list = value_list(ic.collection);
         return extract_apply(list->begin(), list->end(), ic, env, m);
     }
     
-    Value do_iter_vector(Masp& m, Vector& args, Map& env){
+    Value do_iter_vector(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
-        Vector* vector = value_vector(ic.collection);
+        PVector* vector = value_vector(ic.collection);
         return extract_apply(vector->begin(), vector->end(), ic, env, m);
     }
     
-    Value do_iter_map(Masp& m, Vector& args, Map& env){
+    Value do_iter_map(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
         Map* map = value_map(ic.collection);
        return extract_apply_map(map->begin(), map->end(), ic, env, m);
     }
 
+    Value do_iter_sorted_map(Masp& m, ArgSpan args, Map& env){
+        IterContext ic(args);
+        SortedMap* map = value_sorted_map(ic.collection);
+        return extract_apply_map(map->begin(), map->end(), ic, env, m);
+    }
+
+    /** Iterator over a lazy sequence for the iteration templates. Only the end compares equal to the end.*/
+    struct SeqIterator{
+        LazySeq      seq;
+        const Value* current;
+
+        SeqIterator():current(0){}
+        explicit SeqIterator(const LazySeq& s):seq(s){current = seq.first();}
+        const Value& operator*() const {return *current;}
+        void operator++(){seq.advance(); current = seq.first();}
+        bool operator!=(const SeqIterator& i) const {return current != i.current;}
+        bool operator==(const SeqIterator& i) const {return current == i.current;}
+    };
+
+    Value do_iter_lazy_seq(Masp& m, ArgSpan args, Map& env){
+        IterContext ic(args);
+        return extract_apply(SeqIterator(*ic.collection.value.lazy_seq), SeqIterator(), ic, env, m);
+    }
+
     // iter: (iter <syms> collection f)
     OPDEF(op_iter, arg_start, arg_end)
         size_t count = args.size();
@@ -2852,15 +6023,17 @@ namespace {
         Value& collection(args[count - 2]);
         Value& fun(args[count - 1]);
         
-        if(glh::none_of(collection.type, VECTOR, LIST, MAP))
-            throw EvaluationException("op_iter: second to last parameter must be a collection (list, vector or map)."); 
+        if(glh::none_of(collection.type, VECTOR, LIST, MAP, SORTED_MAP) && collection.type != LAZY_SEQ)
+            throw EvaluationException("op_iter: second to last parameter must be a collection (list, vector, map or lazy sequence)."); 
        
-        if(!(is_primitive_procedure(fun) || is_compound_procedure(fun)))
+        if(fun.type != FUNCTION)
             throw EvaluationException("op_iter: last parameter must be a function."); 
 
         if(collection.type == VECTOR)    return do_iter_vector(m, args ,env);
         else if(collection.type == LIST) return do_iter_list(m, args ,env);
         else if(collection.type == MAP)  return do_iter_map(m, args ,env);
+        else if(collection.type == SORTED_MAP) return do_iter_sorted_map(m, args ,env);
+        else if(collection.type == LAZY_SEQ) return do_iter_lazy_seq(m, args ,env);
 
         return Value();
     }
@@ -2901,7 +6074,7 @@ namespace {
             return result;
         }
         else{
-            return make_value_vector(result_vec.begin(), result_vec.end());
+            return make_value_vector(m, result_vec.begin(), result_vec.end());
         }
 
         return Value();
@@ -2939,7 +6112,7 @@ namespace {
             }
             else if(applied.type == VECTOR)
             {
-                Vector& vec(*value_vector(applied));
+                PVector& vec(*value_vector(applied));
                 size_t size = vec.size();
                 if(size != 2) throw EvaluationException("map :: map Result vector did not contain 2 elements. "); 
                 *resmap = resmap->add(vec[0], vec[1]);
@@ -2962,24 +6135,72 @@ namespace {
         return result;
     }
 
-    Value do_map_list(Masp& m, Vector& args, Map& env){
+    Value do_map_list(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
         List* list = value_list(ic.collection);
         return extract_apply_collect<List, List::iterator>(list->begin(), list->end(), ic, env, m);
     }
     
-    Value do_map_vector(Masp& m, Vector& args, Map& env){
+    Value do_map_vector(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
-        Vector* vector = value_vector(ic.collection);
-        return extract_apply_collect<Vector, Vector::iterator>(vector->begin(), vector->end(), ic, env, m);
+        PVector* vector = value_vector(ic.collection);
+        return extract_apply_collect<PVector, PVector::iterator>(vector->begin(), vector->end(), ic, env, m);
     }
     
-    Value do_map_map(Masp& m, Vector& args, Map& env){
+    Value do_map_map(Masp& m, ArgSpan args, Map& env){
         IterContext ic(args);
         Map* map = value_map(ic.collection);
        return extract_apply_map_collect(map->begin(), map->end(), ic, env, m);
     }
 
+    /** Return lazy sequence of the elements of collection passed through stage. If no element of
+     *  a lazy collection is realized yet, the stage is appended to a copy of its source instead
+     *  of reading the collection, so the stages run in one loop.*/
+    Value lazy_seq_with_stage(Masp& m, const Value& collection, const SeqSource::Stage& stage, const char* op_name)
+    {
+        std::shared_ptr<SeqSource> source;
+
+        if(collection.type == LAZY_SEQ)
+        {
+            const LazySeq& seq(*collection.value.lazy_seq);
+            SeqChunk* chunk = seq.chunk.get();
+            if(chunk && chunk->source && chunk->elements.empty())
+            {
+                source = std::make_shared<SeqSource>(*chunk->source);
+            }
+            else
+            {
+                source = std::make_shared<SeqSource>(m, SeqSource::SEQ_CURSOR);
+                source->seq = seq;
+            }
+        }
+        else if(collection.type == LIST)
+        {
+            source = std::make_shared<SeqSource>(m, SeqSource::LIST_CURSOR);
+            source->collection = collection;
+            source->list_pos = value_list(collection)->begin();
+        }
+        else if(collection.type == VECTOR)
+        {
+            source = std::make_shared<SeqSource>(m, SeqSource::VECTOR_CURSOR);
+            source->collection = collection;
+        }
+        else
+        {
+            throw EvaluationException(std::string(op_name) + ": collection must be a list, vector or lazy sequence (was:" +
+                                      value_to_string(collection) + ").");
+        }
+
+        source->stages.push_back(stage);
+        return make_value_lazy_seq(source);
+    }
+
+    Value do_map_lazy_seq(Masp& m, ArgSpan args, Map& env){
+        IterContext ic(args);
+        if(ic.symcount > 1) throw EvaluationException("op_map: lazy sequences are mapped one element at a time. call as (map seq fun).");
+        return lazy_seq_with_stage(m, ic.collection, SeqSource::Stage(SeqSource::Stage::MAP, ic.fun, 0), "op_map");
+    }
+
     // TODO
     // map: (map <syms> collection f)
     OPDEF(op_map, arg_start, arg_end)
@@ -3001,18 +6222,67 @@ namespace {
         Value& collection(args[count - 2]);
         Value& fun(args[count - 1]);
  
-        if(glh::none_of(collection.type, VECTOR, LIST, MAP))
-            throw EvaluationException("op_iter: second to last parameter must be a collection (list, vector or map)."); 
+        if(glh::none_of(collection.type, VECTOR, LIST, MAP, LAZY_SEQ))
+            throw EvaluationException("op_iter: second to last parameter must be a collection (list, vector, map or lazy sequence)."); 
        
-        if(!(is_primitive_procedure(fun) || is_compound_procedure(fun)))
+        if(fun.type != FUNCTION)
             throw EvaluationException("op_iter: last parameter must be a function."); 
 
         if(collection.type == VECTOR)    return do_map_vector(m, args ,env);
         else if(collection.type == LIST) return do_map_list(m, args ,env);
         else if(collection.type == MAP)  return do_map_map(m, args ,env);
+        else if(collection.type == LAZY_SEQ) return do_map_lazy_seq(m, args ,env);
 
         return Value();
     }
+
+    // Lazy sequence stages. Each returns a lazy sequence of the elements of a list, vector or lazy sequence.
+
+    /** Stage with a predicate: (op collection pred).*/
+    Value predicate_stage(Masp& m, ArgSpan args, SeqSource::Stage::Kind kind, const char* op_name)
+    {
+        if(args.size() != 2 || args[1].type != FUNCTION)
+            throw EvaluationException(std::string(op_name) + ": call as (" + op_name + " collection pred).");
+        return lazy_seq_with_stage(m, args[0], SeqSource::Stage(kind, args[1], kind == SeqSource::Stage::DROP_WHILE ? 1 : 0), op_name);
+    }
+
+    /** Stage with an element count: (op n collection).*/
+    Value count_stage(Masp& m, ArgSpan args, SeqSource::Stage::Kind kind, const char* op_name)
+    {
+        if(args.size() != 2 || args[0].type != NUMBER || args[0].value.number.to_int() < 0)
+            throw EvaluationException(std::string(op_name) + ": call as (" + op_name + " n collection) with n >= 0.");
+        return lazy_seq_with_stage(m, args[1], SeqSource::Stage(kind, Value(), (size_t) args[0].value.number.to_int()), op_name);
+    }
+
+    // filter: (filter collection pred)
+    Value op_filter(Masp& m, ArgSpan args, Map& env){
+        return predicate_stage(m, args, SeqSource::Stage::FILTER, "filter");
+    }
+
+    // drop-while: (drop-while collection pred)
+    Value op_drop_while(Masp& m, ArgSpan args, Map& env){
+        return predicate_stage(m, args, SeqSource::Stage::DROP_WHILE, "drop-while");
+    }
+
+    // take-while: (take-while collection pred)
+    Value op_take_while(Masp& m, ArgSpan args, Map& env){
+        return predicate_stage(m, args, SeqSource::Stage::TAKE_WHILE, "take-while");
+    }
+
+    // drop: (drop n collection)
+    Value op_drop(Masp& m, ArgSpan args, Map& env){
+        return count_stage(m, args, SeqSource::Stage::DROP, "drop");
+    }
+
+    // drop-last: (drop-last n collection)
+    Value op_drop_last(Masp& m, ArgSpan args, Map& env){
+        return count_stage(m, args, SeqSource::Stage::DROP_LAST, "drop-last");
+    }
+
+    // take: (take n collection)
+    Value op_take(Masp& m, ArgSpan args, Map& env){
+        return count_stage(m, args, SeqSource::Stage::TAKE, "take");
+    }
     // System ops
 
     OPDEF(op_import_file, arg_i, arg_end)
@@ -3023,26 +6293,101 @@ namespace {
         {
             const char* path = value_string(*fst);
 
-            std::string contents;
-            bool        success;
-            std::tie(contents, success) = file_to_string(path);
+            masp_result res = import_file(m, path);
 
-            if(success){
-                masp_result res = read_eval(m, contents.c_str());
+            if(res.valid()){ 
+                return *(res.as_value()->get());
+            } else {
+                throw EvaluationException(res.message());
+            }
+        }
+        else throw EvaluationException("op_import_file: first value must be string"); 
 
-                if(res.valid()){ 
-                    return *(res.as_value()->get());
-                } else {
-                    throw EvaluationException(res.message());
-                }
+        return Value();
+    }
+
+    /** Call the function of (op collection fun) with each element of a list, vector or lazy
+     *  sequence on the worker pool of m, or in m if it has none. Lazy sequences are realized
+     *  and their results returned as a vector.*/
+    Value parallel_map(Masp& m, ArgSpan args, Map& env, const char* op_name, bool collect)
+    {
+        if(args.size() != 2 || glh::none_of(args[0].type, VECTOR, LIST, LAZY_SEQ) || args[1].type != FUNCTION)
+            throw EvaluationException(std::string(op_name) + ": call as (" + op_name + " collection fun) with a list, vector or lazy sequence.");
+
+        Vector items;
+        if(args[0].type == VECTOR)
+        {
+            PVector* vector = value_vector(args[0]);
+            for(auto i = vector->begin(); i != vector->end(); ++i) items.push_back(*i);
+        }
+        else if(args[0].type == LIST)
+        {
+            List* list = value_list(args[0]);
+            for(auto i = list->begin(); i != list->end(); ++i) items.push_back(*i);
+        }
+        else
+        {
+            LazySeq seq(*args[0].value.lazy_seq);
+            for(const Value* v = seq.first(); v; seq.advance(), v = seq.first()) items.push_back(*v);
+        }
+
+        Vector results;
+
+        if(MaspPool* pool = m.env()->worker_pool_)
+        {
+            try
+            {
+                results = pool->map(m, args[1], items, collect);
             }
-            else{
-                std::string msg = std::string("op_import_file: Could not read in file:") +
-                                  std::string(path);
-                throw EvaluationException(msg);
+            catch(const EvaluationException& e)
+            {
+                throw EvaluationException(std::string(op_name) + ": " + e.get_message());
             }
         }
-        else throw EvaluationException("op_import_file: first value must be string"); 
+        else
+        {
+            Vector call_args(1);
+            for(auto& item : items)
+            {
+                call_args[0] = item;
+                Value result = call_function(m, args[1], call_args, env);
+                if(collect) results.push_back(result);
+            }
+        }
+
+        if(!collect) return Value();
+
+        if(args[0].type == LIST)
+        {
+            Value result = make_value_list(m);
+            List* list = value_list(result);
+            *list = list->add_end(results.begin(), results.end());
+            return result;
+        }
+
+        return make_value_vector(m, results.begin(), results.end());
+    }
+
+    // pmap: (pmap collection fun) Like map but the calls are run on the worker pool.
+    Value op_pmap(Masp& m, ArgSpan args, Map& env){
+        return parallel_map(m, args, env, "pmap", true);
+    }
+
+    // pfor: (pfor collection fun) Call fun with each element on the worker pool. Returns nil.
+    Value op_pfor(Masp& m, ArgSpan args, Map& env){
+        return parallel_map(m, args, env, "pfor", false);
+    }
+
+    // pimport: (pimport "path") Import file in the workers of the pool, or in m if it has none.
+    Value op_pimport(Masp& m, ArgSpan args, Map& env){
+
+        if(args.size() != 1 || args[0].type != STRING)
+            throw EvaluationException("pimport: call as (pimport \"path\").");
+
+        MaspPool* pool = m.env()->worker_pool_;
+        masp_result res = pool ? pool->import(value_string(args[0])) : import_file(m, value_string(args[0]));
+
+        if(!res.valid()) throw EvaluationException(std::string("pimport: ") + res.message());
 
         return Value();
     }
@@ -3058,7 +6403,18 @@ namespace {
 
 void Masp::Env::add_fun(const char* name, PrimitiveFunction f)
 {
-    *env_ = env_->add(make_value_symbol(name), make_value_function(f));
+    Value symbol = make_value_symbol(name);
+    Value fun = make_value_function(f);
+    fun.value.function->name = symbol.value.symbol;
+    *env_ = env_->add(symbol, fun);
+}
+
+void Masp::Env::add_fun(const char* name, NativeFunction f)
+{
+    Value symbol = make_value_symbol(name);
+    Value fun = make_value_function(f);
+    fun.value.function->name = symbol.value.symbol;
+    *env_ = env_->add(symbol, fun);
 }
 
 void Masp::Env::def(const Value& key, const Value& value)
@@ -3095,12 +6451,15 @@ void Masp::Env::load_default_env()
     add_fun("boolean?", op_value_is_boolean);
     add_fun("symbol?", op_value_is_symbol);
     add_fun("map?", op_value_is_map);
+    add_fun("sorted-map?", op_value_is_sorted_map);
+    add_fun("lazy-seq?", op_value_is_lazy_seq);
     add_fun("vector?", op_value_is_vector);
     add_fun("list?", op_value_is_list);
     add_fun("fn?", op_value_is_fn);
     add_fun("object?", op_value_is_object);
 
     add_fun("make-map", op_make_map);
+    add_fun("make-sorted-map", op_make_sorted_map);
     add_fun("make-vector", op_make_vector);
 
     add_fun("count", op_count); 
@@ -3108,23 +6467,39 @@ void Masp::Env::load_default_env()
     add_fun("conj", op_conj);
     add_fun("iter", op_iter);
     add_fun("map", op_map);
+    add_fun("filter", op_filter);
+    add_fun("drop", op_drop);
+    add_fun("drop-while", op_drop_while);
+    add_fun("drop-last", op_drop_last);
+    add_fun("take", op_take);
+    add_fun("take-while", op_take_while);
 
     add_fun("insert", op_insert_data);
     add_fun("remove", op_remove_data);
+    add_fun("diff", op_map_diff);
+    add_fun("merge", op_map_merge);
     add_fun("keys", op_map_keys);
     add_fun("vals", op_map_vals);
+    add_fun("floor-entry", op_sorted_floor);
+    add_fun("ceiling-entry", op_sorted_ceiling);
+    add_fun("subrange", op_sorted_subrange);
 
     // TODO fold
 
     add_fun("println", op_println);
     add_fun("printf", op_printf);
     add_fun("str", op_str);
+    add_fun("subs", op_subs);
 
     add_fun("read", wrap_function(file_to_string));
     add_fun("write", wrap_function(string_to_file));
     add_fun("import", op_import_file);
+    add_fun("pimport", op_pimport);
+    add_fun("pmap", op_pmap);
+    add_fun("pfor", op_pfor);
 }
 
 void add_fun(Masp& m, const char* name, PrimitiveFunction f) {m.env()->add_fun(name, f);}
+void add_fun(Masp& m, const char* name, NativeFunction f) {m.env()->add_fun(name, f);}
 
 } // Namespace masp ends
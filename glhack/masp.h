@@ -10,14 +10,16 @@
 #include<list>
 #include<memory>
 #include<cstdint>
+#include<istream>
 #include<ostream>
 #include<deque>
 #include<functional>
 #include<vector>
+#include<atomic>
 
 namespace masp{
 
-enum Type{NIL, BOOLEAN, NUMBER, NUMBER_ARRAY, STRING, SYMBOL, VECTOR, LIST, MAP, OBJECT, FUNCTION};
+enum Type{NIL, BOOLEAN, NUMBER, NUMBER_ARRAY, STRING, SYMBOL, VECTOR, LIST, MAP, SORTED_MAP, LAZY_SEQ, OBJECT, FUNCTION};
 
 struct Number{
     enum Type{INT, FLOAT};
@@ -119,6 +121,12 @@ class ValueHash { public:
     static uint32_t hash(const Value& h);
 };
 
+/** Order of the keys of sorted maps. Values are ordered by type first. Numbers are compared by
+ *  value, strings by their characters and symbols by name. Values of other types are equal.*/
+class ValueLess { public:
+    bool operator()(const Value& k1, const Value& k2) const;
+};
+
 
 typedef glh::PMapPool<Value, Value, ValuesAreEqual, ValueHash> MapPool;
 typedef MapPool::Map   Map;
@@ -127,6 +135,12 @@ typedef glh::PListPool<Value>              ListPool;
 typedef glh::PListPool<Value>::List        List;
 typedef List::iterator VRefIterator;
 
+typedef glh::PVectorPool<Value>            VectorPool;
+typedef glh::PVectorPool<Value>::Vector    PVector;
+
+typedef glh::PSortedMapPool<Value, Value, ValueLess> SortedMapPool;
+typedef SortedMapPool::Map                           SortedMap;
+
 /**  Object interface */
 
 class IObject{
@@ -137,6 +151,20 @@ public:
 };
 
 struct Function;
+struct StringData;
+struct LazySeq;
+
+/** Interned symbol name. There is exactly one Symbol per distinct name so symbols
+ *  are copied as a pointer and compared and hashed by identity. */
+struct Symbol
+{
+    uint32_t    id;
+    uint32_t    hash; //> Hash of id. Used as the symbol's key hash in maps.
+    std::string name;
+};
+
+/** Return the symbol record for the given name. Records are never released.*/
+const Symbol* intern_symbol(const char* str, const char* str_end);
 
 /** Masp value. */
 class Value
@@ -149,10 +177,13 @@ public:
     union
     {
         Number       number;
-        std::string* string; //> Data for string | symbol
+        StringData*  string; //> Shared immutable data for string
+        const Symbol* symbol; //> Interned data for symbol
         List*        list;
         Map*         map;
-        Vector*      vector;
+        SortedMap*   sorted_map;
+        LazySeq*     lazy_seq; //> Position in a lazily realized sequence
+        PVector*     vector;
         Function*    function;
         IObject*     object;
         NumberArray* number_array;
@@ -188,6 +219,32 @@ typedef Value::Vector Vector;
 typedef Vector::iterator VecIterator;
 typedef std::function<Value(Masp& m, Vector& args, Map& env)> PrimitiveFunction;
 
+/** Arguments of a native call. Refers to storage owned by the interpreter and is valid
+ *  only for the duration of the call. The values belong to the call and may be consumed.*/
+class ArgSpan
+{
+public:
+    typedef Value* iterator;
+
+    ArgSpan(Value* begin, Value* end):begin_(begin), end_(end){}
+
+    iterator begin() const {return begin_;}
+    iterator end() const {return end_;}
+    size_t   size() const {return end_ - begin_;}
+    bool     empty() const {return begin_ == end_;}
+    Value&   operator[](size_t i) const {return begin_[i];}
+
+private:
+    Value* begin_;
+    Value* end_;
+};
+
+typedef ArgSpan::iterator ArgIterator;
+
+/** Primitive taking its arguments in place. Calls to these do not allocate; functions
+ *  of type PrimitiveFunction are called through an adapter that copies the arguments to a Vector.*/
+typedef Value (*NativeFunction)(Masp& m, ArgSpan args, Map& env);
+
 
 void free_value(Value* v);
 
@@ -198,6 +255,32 @@ public:
 
 typedef std::shared_ptr<Value> ValuePtr;
 
+/** Garbage collection pause statistics. Times are in milliseconds. */
+struct GcStats
+{
+    size_t full_collections;
+    size_t incremental_cycles; //> Completed incremental collections.
+    size_t steps;              //> Incremental steps run.
+    double last_pause_ms;
+    double max_pause_ms;
+    double total_pause_ms;
+
+    GcStats():full_collections(0), incremental_cycles(0), steps(0),
+              last_pause_ms(0.0), max_pause_ms(0.0), total_pause_ms(0.0){}
+};
+
+/** Module import statistics. */
+struct ModuleStats
+{
+    size_t parsed;      //> Imports that parsed and compiled the source.
+    size_t precompiled; //> Imports that loaded a precompiled module file.
+    size_t cached;      //> Imports served from the modules already loaded.
+
+    ModuleStats():parsed(0), precompiled(0), cached(0){}
+};
+
+class MaspPool;
+
 /** Script environment. */
 class Masp
 {
@@ -225,12 +308,49 @@ public:
     /** Garbage collect the used data structures.*/
     void gc();
 
+    /** Run a step of incremental garbage collection. The step stops once work_budget units
+     *  (nodes marked or chunks swept) are done or, if time_budget_ms is positive, once that
+     *  much time has passed. A new collection is started if none is running.
+     *  Return true if the step completed a collection.*/
+    bool gc_step(size_t work_budget, double time_budget_ms = 0.0);
+
+    /** Pause times of collections run so far.*/
+    const GcStats& gc_stats();
+
     /** Number of bytes used by the state.*/
     size_t reserved_size_bytes();
 
     /** Number of bytes marked used.*/
     size_t live_size_bytes();
 
+    /** Set the directory of precompiled module files. When dir is null or empty
+     *  a module is precompiled to the file next to its source with 'c' appended to the name.*/
+    void set_module_cache_dir(const char* dir);
+
+    /** Sources of imported modules read so far.*/
+    const ModuleStats& module_stats();
+
+    /** Set the pool pmap and pfor run on. Without a pool they run in this interpreter.
+     *  The pool is not owned and must outlive its use.*/
+    void set_worker_pool(MaspPool* pool);
+
+    /** Record calls, time and allocated nodes per function while on. Turning
+     *  profiling off closes the calls open at the time but keeps the results.*/
+    void set_profiling(bool on);
+
+    bool profiling();
+
+    /** Drop the profile recorded so far.*/
+    void reset_profile();
+
+    /** Table of calls, inclusive and exclusive time and allocated nodes per
+     *  function, ordered by exclusive time.*/
+    std::string profile_report();
+
+    /** Exclusive microseconds per call stack in the collapsed format read by
+     *  flame graph tools: "outer;inner microseconds" per line.*/
+    std::string profile_collapsed_stacks();
+
     /** Set output stream for messages. */
     void set_output(std::ostream* os);
 
@@ -250,6 +370,43 @@ typedef glh::AnnotatedResult<ValuePtr> masp_result;
 masp_result masp_fail(const char* str);
 masp_result masp_fail(const std::string& str);
 
+/** Interpreters running on worker threads. Each worker has an env of its own, set up by
+ *  running the same scripts in every worker. Functions and values are passed to and from
+ *  the workers serialized, so no data is shared between interpreters. Functions passed to
+ *  workers may refer to globals of the worker env but not capture local variables.
+ *  A pool runs one job at a time. */
+class MaspPool
+{
+public:
+    typedef std::function<void(Masp& m)> Init;
+
+    /** Create worker_count interpreters, one per hardware thread if worker_count is zero.
+     *  init is called for each new interpreter, e.g. to add native extensions.*/
+    explicit MaspPool(size_t worker_count = 0, const Init& init = Init());
+    ~MaspPool();
+
+    /** Number of worker interpreters.*/
+    size_t size() const;
+
+    /** Parse and evaluate source in every worker. Return the result of the first worker
+     *  or the first error.*/
+    masp_result load(const char* source);
+
+    /** Import file in every worker.*/
+    masp_result import(const char* file_path);
+
+    /** Call fun with each of items in the workers and return the results, made in caller,
+     *  in the order of items. If collect is false the results are dropped in the workers.
+     *  Throws EvaluationException with the first error of the workers.*/
+    Vector map(Masp& caller, const Value& fun, const Vector& items, bool collect = true);
+
+    class Worker;
+
+private:
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool>                    busy_;
+};
+
 /** Parse string to value data structure.*/
 masp_result string_to_value(Masp& m, const char* str);
 
@@ -259,8 +416,20 @@ masp_result eval(Masp& m, const Value* v);
 /** Parse string and evaluate result */
 masp_result read_eval(Masp& m, const char* str);
 
+/** Parse stream to value data structure. The stream is read in blocks and the text is not kept
+ *  in memory beyond the top level form being parsed. */
+masp_result stream_to_value(Masp& m, std::istream& is);
+
+/** Parse contents of file to value data structure. The file is streamed through stream_to_value.*/
+masp_result file_to_value(Masp& m, const char* file_path);
+
 /** Parse and evaluate contents of file and return the result as a value data structure. */
-// TODO: masp_result readfile(Masp& m, const char* file_path);
+masp_result read_eval_file(Masp& m, const char* file_path);
+
+/** Evaluate file as a module. The compiled forms of the file are kept in memory and written to
+ *  a precompiled module file keyed by the content hash of the source, so that importing the file
+ *  again does not parse or compile it. */
+masp_result import_file(Masp& m, const char* file_path);
 
 /** Return string representation of value. */
 std::string value_to_string(const Value& v);
@@ -275,6 +444,7 @@ const char* value_type_to_string(const Value* v);
 
 
 void add_fun(Masp& m, const char* name, PrimitiveFunction f);
+void add_fun(Masp& m, const char* name, NativeFunction f);
 
 /// State accessors
 
@@ -294,9 +464,10 @@ Type         value_type(const Value* v);
 // TOOD: add shorthand (. fun obj params) :=  (((fnext obj) fun) (first obj) params) = 
 //                           
 
-Vector*      value_vector(Value& v);
+PVector*     value_vector(Value& v);
 NumberArray* value_number_array(Value& v);
 Map*         value_map(const Value& v);
+SortedMap*   value_sorted_map(const Value& v);
 IObject*     value_object(const Value& v);
 Number       value_number(const Value& v);
 List*        value_list(const Value& v);
@@ -314,6 +485,8 @@ Value make_value_number(double d);
 Value make_value_string(const char* str);
 Value make_value_string(const std::string& str);
 Value make_value_string(const char* str, const char* str_end);
+/** Return a string sharing the character buffer of str. Range is clamped to str.*/
+Value make_value_substring(const Value& str, size_t start, size_t end);
 
 Value make_value_symbol(const char* str);
 Value make_value_symbol(const char* str, const char* str_end);
@@ -323,13 +496,16 @@ Value make_value_list(const List& oldlist);
 Value make_value_map(Masp& m);
 Value make_value_map(const Map& oldmap);
 
+Value make_value_sorted_map(Masp& m);
+Value make_value_sorted_map(const SortedMap& oldmap);
+
 Value make_value_function(PrimitiveFunction f);
+Value make_value_function(NativeFunction f);
 
 Value make_value_object(IObject* alloced_object);
 
-Value make_value_vector();
-Value make_value_vector(Vector& old, Value& v);
-Value make_value_vector(Value& v, Vector& old);
+Value make_value_vector(Masp& m);
+Value make_value_vector(const PVector& oldvec);
 
 Value make_value_number_array();
 Value make_value_boolean(bool b);
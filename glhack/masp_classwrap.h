@@ -138,12 +138,13 @@ class FunBase{public:
 typedef std::shared_ptr<FunBase> FunBasePtr;
 
 /** Parameter extraction. */
-class ArgWrap{
+template<class I>
+class ArgWrapRange{
 public:
 
-    VecIterator i_; VecIterator end_;
+    I i_; I end_;
 
-    ArgWrap(VecIterator i, VecIterator end):i_(i), end_(end){}
+    ArgWrapRange(I i, I end):i_(i), end_(end){}
 
     template<typename T>
     void wrap(T* t){
@@ -163,7 +164,7 @@ public:
     
     /** Return number of elements in wrapped range*/
     size_t size() const{
-        VecIterator i(i_);
+        I i(i_);
         size_t count = 0;
         while(i != end_){count++; ++i;}
         return count;
@@ -172,7 +173,7 @@ public:
     /** Bind parameters to input sequence */
     template<class T>
     void bind(T& value_seq) const {
-        VecIterator i(i_);
+        I i(i_);
         if(size() < value_seq.size()) throw EvaluationException("Incompatible sizes");
         for(auto& v: value_seq)
         {
@@ -183,6 +184,8 @@ public:
 
 };
 
+typedef ArgWrapRange<VecIterator> ArgWrap;
+
 
 class FunWrap0_0 : public FunBase{public:
     typedef std::function<void(void)> funt;
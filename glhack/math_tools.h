@@ -20,6 +20,10 @@
 #include<vector>
 #include<limits>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #define PIf 3.141592846f
 
 /////////////// Hash functions //////////////
@@ -258,6 +262,36 @@ inline bool bit_is_on(const uint32_t field, const uint32_t bit)
     return  (field & 1 << bit) != 0;
 }
 
+/** Count bits in 64 bit field */
+inline uint32_t count_bits64(uint64_t field)
+{
+#if defined(__GNUC__)
+    return (uint32_t) __builtin_popcountll(field);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (uint32_t) __popcnt64(field);
+#else
+    uint32_t count = 0;
+    for(;field;count++) field &= field - 1;
+    return count;
+#endif
+}
+
+/** Return index of lowest set bit in 64 bit field. Field must not be zero. */
+inline uint32_t lowest_set_bit64(uint64_t field)
+{
+#if defined(__GNUC__)
+    return (uint32_t) __builtin_ctzll(field);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, field);
+    return (uint32_t) index;
+#else
+    uint32_t index = 0;
+    for(;!(field&0x1); field >>= 1, index++){}
+    return index;
+#endif
+}
+
 //////////////////// Linear algebra etc. ///////////////////////////
 
 template<class T, int N, int M>
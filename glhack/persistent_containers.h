@@ -6,13 +6,21 @@
  *
  * Datastructures that are implemented:
  *  - persistent list PList
- *      - a simple linked list with distinct heads nodes for reference counting
+ *      - an unrolled linked list of 8 element nodes, each storing the length of the list following it
  *  - persistent map PMap
  *      - a simple persistent map with node copying
+ *  - persistent vector PVector
+ *      - a bit-partitioned trie of 32 element leaves with the last leaf kept outside the trie
+ *  - persistent sorted map PSortedMap
+ *      - a B+ tree of 16 entry leaves kept in key order
  *
- * TODO: Should be straightforward to modify chunkbuffer so it supports parallel deallocation. 
+ * Full collections mark and sweep in parallel (see ParallelMarker and ChunkBox::collect_chunks).
+ * The collection is run by the thread using the pools, so no chunks need to be locked from
+ * allocation while it runs: the marking threads share a work queue of nodes and the chunks are
+ * split into one group per thread for the sweep. Slots holding types that are not trivially
+ * destructible are swept by the calling thread as their destructors may touch shared state.
  *
- * I quickly sketched the parallel marking & collection algorithm below. Might be faulty. TODO: verify.
+ * The original sketch for collecting concurrently with allocation follows.
  *
  * For parallel marking, a portion of the chunks must be 'locked' so no new space can be allocated
  * from them prior to collecting. So, to parallellize:
@@ -42,6 +50,8 @@
 
 #include "math_tools.h"
 #include "shims_and_types.h"
+#include "tinythread.h"
+#include "allocators.h"
 
 #include<type_traits>
 #include<unordered_map>
@@ -49,104 +59,461 @@
 #include<sstream>
 #include<new>
 #include<algorithm>
+#include<vector>
+#include<atomic>
+#include<memory>
+#include<cstdint>
 
 namespace glh{
 
-#define CHUNK_BUFFER_SIZE 32
+/** Phase of an incremental collection in a pool. */
+enum GcPhase{GC_IDLE, GC_MARK, GC_SWEEP};
 
-/** Chunk. Can be used only for storing classes with parameterless constructor and a destructor.*/
-template<class T>
+/** Number of free chunks searched for consecutive elements before a new chunk is created. */
+#define FREE_CHUNK_SEARCH_LIMIT 8
+
+/** Pools with fewer chunks than this are collected by the calling thread only. */
+#define PARALLEL_GC_MIN_CHUNKS 1024
+
+/** Maps are built by several threads from at least this many added keys. */
+#define PARALLEL_BUILD_MIN_SIZE 16384
+
+/** Run f(i) for each i in [0, thread_count), each on its own thread. The calling thread runs f(0).*/
+template<class F>
+void run_in_parallel(size_t thread_count, F& f)
+{
+    struct Task
+    {
+        F*     f;
+        size_t index;
+        static void run(void* arg){Task* t = static_cast<Task*>(arg); (*t->f)(t->index);}
+    };
+
+    std::vector<Task> tasks(thread_count);
+    std::vector<std::unique_ptr<tthread::thread>> threads;
+
+    for(size_t i = 1; i < thread_count; ++i)
+    {
+        tasks[i].f = &f;
+        tasks[i].index = i;
+        threads.emplace_back(new tthread::thread(Task::run, &tasks[i]));
+    }
+
+    f(0);
+
+    for(auto& t : threads) t->join();
+}
+
+/** Parallel marking of a graph. Each thread works from a stack of its own and moves part of
+ *  it to a shared queue when the queue has run empty. Marking is done once all threads are
+ *  idle with the queue empty.
+ *
+ *  process(p, stack) must mark p and, if p was not marked before, push the objects p
+ *  refers to on stack. It is called from several threads at once. */
+template<class P, class F>
+class ParallelMarker
+{
+public:
+    enum{SHARE_SIZE = 64}; //> Stack size above which work is handed to idle threads.
+
+    ParallelMarker(F& process, size_t thread_count):process_(process), thread_count_(thread_count), idle_(0), queue_empty_(true){}
+
+    void run(const std::vector<P>& roots)
+    {
+        queue_ = roots;
+        queue_empty_ = queue_.empty();
+        idle_ = 0;
+        run_in_parallel(thread_count_, *this);
+    }
+
+    void operator()(size_t)
+    {
+        std::vector<P> stack;
+        while(take(stack))
+        {
+            while(!stack.empty())
+            {
+                P p = stack.back();
+                stack.pop_back();
+                process_(p, stack);
+                if(stack.size() > SHARE_SIZE && queue_empty_) share(stack);
+            }
+        }
+    }
+
+private:
+    /** Fill empty stack from the queue. Return false once there is no work left for any thread.*/
+    bool take(std::vector<P>& stack)
+    {
+        bool idle = false;
+        while(true)
+        {
+            {
+                tthread::lock_guard<tthread::mutex> lock(mutex_);
+                if(!queue_.empty())
+                {
+                    if(idle) --idle_;
+                    size_t count = std::min<size_t>(queue_.size(), SHARE_SIZE);
+                    stack.assign(queue_.end() - count, queue_.end());
+                    queue_.resize(queue_.size() - count);
+                    queue_empty_ = queue_.empty();
+                    return true;
+                }
+                if(!idle)
+                {
+                    idle = true;
+                    ++idle_;
+                }
+                if(idle_ == thread_count_) return false;
+            }
+            tthread::this_thread::yield();
+        }
+    }
+
+    /** Move the bottom half of stack to the queue.*/
+    void share(std::vector<P>& stack)
+    {
+        size_t count = stack.size() / 2;
+        tthread::lock_guard<tthread::mutex> lock(mutex_);
+        queue_.insert(queue_.end(), stack.begin(), stack.begin() + count);
+        stack.erase(stack.begin(), stack.begin() + count);
+        queue_empty_ = false;
+    }
+
+    F&                process_;
+    size_t            thread_count_;
+    size_t            idle_;        //> Threads out of work. Guarded by mutex_.
+    std::vector<P>    queue_;       //> Guarded by mutex_.
+    std::atomic<bool> queue_empty_; //> Hint read without the lock.
+    tthread::mutex    mutex_;
+};
+
+/** Epochs announced by threads reading shared containers. A reader announces the current epoch
+ *  before it loads a shared root and clears it when done. A root replaced at epoch e may still be
+ *  read by readers that announced e or earlier, and can be released once the oldest announced
+ *  epoch is later than e.*/
+class ReaderEpochs
+{
+public:
+    enum{MAX_READERS = 64}; //> Readers active at once.
+
+    ReaderEpochs():epoch_(1)
+    {
+        for(size_t i = 0; i < MAX_READERS; ++i) slots_[i].store(0);
+    }
+
+    /** Announce the current epoch. Return the slot to give to exit(). Called by readers.*/
+    size_t enter()
+    {
+        while(true)
+        {
+            for(size_t i = 0; i < MAX_READERS; ++i)
+            {
+                uint64_t free_slot = 0;
+                if(slots_[i].load(std::memory_order_relaxed) == 0 &&
+                   slots_[i].compare_exchange_strong(free_slot, epoch_.load())) return i;
+            }
+            tthread::this_thread::yield();
+        }
+    }
+
+    /** Clear the epoch announced in slot. Called by readers.*/
+    void exit(size_t slot){slots_[slot].store(0);}
+
+    /** Start a new epoch. Return the epoch ended. Called by the owner after replacing a root.*/
+    uint64_t advance(){return epoch_.fetch_add(1);}
+
+    /** Return the oldest epoch announced by an active reader or the current one if none is active.*/
+    uint64_t oldest_active() const
+    {
+        uint64_t oldest = epoch_.load();
+        for(size_t i = 0; i < MAX_READERS; ++i)
+        {
+            uint64_t e = slots_[i].load();
+            if(e != 0 && e < oldest) oldest = e;
+        }
+        return oldest;
+    }
+
+private:
+    std::atomic<uint64_t> epoch_;
+    std::atomic<uint64_t> slots_[MAX_READERS]; //> Announced epoch or 0 for free slots.
+};
+
+/** A version of a persistent container published for reading from other threads.
+ *
+ *  The owner thread publishes versions of a container handle H (a Map, List or Vector) and keeps
+ *  using the pool. Other threads read the latest version through a Reader. Readers only use the
+ *  const interface of H and never copy the handle, so they do not touch reference counts.
+ *
+ *  The published handle keeps its nodes alive. A replaced version is kept, and so not freed by
+ *  gc(), until all readers that may have loaded it are done. publish() and reclaim() release
+ *  the versions no reader can see any more; call reclaim() before gc() to collect them.
+ *
+ *  Nodes of a published version must not be modified in place: do not publish a map of a
+ *  running Transient or call try_replace_value on a published map.
+ *
+ *  The versions are kept alive by the reference counts of their handles. Do not publish from a
+ *  pool whose owner clears the root refcounts and recounts them from its own roots before gc(),
+ *  as masp's full collection does: the published and retired handles are not among those roots,
+ *  so their nodes would be freed while readers use them.*/
+template<class H>
+class Published
+{
+public:
+
+    /** Access to the version published when the reader was created. Called by reader threads.*/
+    class Reader
+    {
+    public:
+        Reader(const Published& p):epochs_(p.epochs_), slot_(p.epochs_.enter()), handle_(p.current_.load()){}
+        ~Reader(){epochs_.exit(slot_);}
+
+        const H& operator*() const {return *handle_;}
+        const H* operator->() const {return handle_;}
+
+    private:
+        Reader(const Reader&);
+        Reader& operator=(const Reader&);
+
+        ReaderEpochs& epochs_;
+        size_t        slot_;
+        const H*      handle_;
+    };
+
+    Published(const H& h):current_(new H(h)){}
+
+    /** Owner thread only. No reader may be active.*/
+    ~Published()
+    {
+        delete current_.load();
+        for(auto& r : retired_) delete r.handle;
+    }
+
+    /** Replace the published version. Owner thread only.*/
+    void publish(const H& h)
+    {
+        Retired r = {0, current_.exchange(new H(h))};
+        r.epoch = epochs_.advance();
+        retired_.push_back(r);
+        reclaim();
+    }
+
+    /** Release the replaced versions no reader can see. Owner thread only.*/
+    void reclaim()
+    {
+        uint64_t oldest = epochs_.oldest_active();
+        auto first_kept = std::partition(retired_.begin(), retired_.end(), [oldest](const Retired& r){return r.epoch < oldest;});
+        for(auto r = retired_.begin(); r != first_kept; ++r) delete r->handle;
+        retired_.erase(retired_.begin(), first_kept);
+    }
+
+    /** Return the latest version. Owner thread only.*/
+    const H& current() const {return *current_.load();}
+
+    /** Return the number of replaced versions not yet released.*/
+    size_t retired_count() const {return retired_.size();}
+
+private:
+    Published(const Published&);
+    Published& operator=(const Published&);
+
+    struct Retired{uint64_t epoch; H* handle;};
+
+    mutable ReaderEpochs  epochs_;
+    std::atomic<H*>       current_;
+    std::vector<Retired>  retired_; //> Replaced versions with the epoch they were replaced in.
+};
+
+/** Reference count of handles to a root node, stored in the node. The top bit is set while
+ *  the node is listed in a RootSet.*/
+struct RootCount
+{
+    enum{LISTED = 0x80000000u};
+
+    uint32_t value;
+
+    RootCount():value(0){}
+
+    // The count belongs to the node it is in: copying a node does not copy its handles.
+    RootCount(const RootCount&):value(0){}
+    RootCount& operator=(const RootCount&){return *this;}
+
+    uint32_t count() const {return value & ~LISTED;}
+    bool     listed() const {return (value & LISTED) != 0;}
+};
+
+/** Root nodes of a pool. Nodes must have a RootCount member refs. Nodes are listed when first
+ *  referenced and stay listed until prune() finds them unreferenced, so adding and removing a
+ *  reference only changes the count in the node.*/
+template<class Node>
+class RootSet
+{
+public:
+    typedef typename std::vector<Node*>::const_iterator const_iterator;
+
+    void add_ref(Node* n)
+    {
+        if(!n) return;
+        if(!n->refs.listed())
+        {
+            n->refs.value |= RootCount::LISTED;
+            roots_.push_back(n);
+        }
+        ++n->refs.value;
+    }
+
+    void remove_ref(Node* n)
+    {
+        if(n && n->refs.count() > 0) --n->refs.value;
+    }
+
+    /** Set the count of all roots to zero. The nodes stay listed until pruned.*/
+    void clear_counts()
+    {
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) (*r)->refs.value = RootCount::LISTED;
+    }
+
+    /** Drop the unreferenced nodes. Must be called before the unreferenced nodes can be freed.*/
+    void prune()
+    {
+        size_t kept = 0;
+        for(size_t i = 0; i < roots_.size(); ++i)
+        {
+            Node* n = roots_[i];
+            if(n->refs.count() > 0) roots_[kept++] = n;
+            else n->refs.value = 0;
+        }
+        roots_.resize(kept);
+    }
+
+    /** Drop all nodes.*/
+    void clear()
+    {
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) (*r)->refs.value = 0;
+        roots_.clear();
+    }
+
+    const_iterator begin() const {return roots_.begin();}
+    const_iterator end() const {return roots_.end();}
+    size_t size() const {return roots_.size();}
+
+    const std::vector<Node*>& nodes() const {return roots_;}
+
+private:
+    std::vector<Node*> roots_;
+};
+
+/** Default number of threads used by full collections.*/
+inline size_t default_gc_thread_count()
+{
+    unsigned count = tthread::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+/** Chunk. Can be used only for storing classes with parameterless constructor and a destructor.
+ *  Mask is the type of the occupancy masks and its bit count is the number of slots (32 or 64).*/
+template<class T, class Mask = uint64_t>
 struct Chunk
 {
-    typename std::aligned_storage <sizeof(T), std::alignment_of<T>::value>::type buffer[CHUNK_BUFFER_SIZE];
+    typedef Mask mask_type;
+    enum{SLOT_COUNT = sizeof(Mask) * 8};
+
+    typename std::aligned_storage <sizeof(T), std::alignment_of<T>::value>::type buffer[SLOT_COUNT];
 
     /** Used for storing the allocation state of buffer, with array position matching bit position
      *  1<<i : buffer[i]
      *  i.e the expression
      *  used_elements = 1<<n means buffer[n] is allocated.*/
-    uint32_t used_elements;
-    uint32_t mark_field; // use for garbage collection
+    Mask used_elements;
+    std::atomic<Mask> mark_field; // use for garbage collection. Atomic for parallel marking.
           
     Chunk*   next;
 
-    Chunk(){
-        used_elements = 0;
-        mark_field = 0;
-        next = 0;
-        memset(buffer, 0 , CHUNK_BUFFER_SIZE * sizeof(T));
-    }
+    // The buffer is left uninitialized, slots are constructed when reserved.
+    Chunk():used_elements(0), mark_field(0), next(0){}
 
-    bool is_full(){return (used_elements == 0xffffffff);}
+    static Mask slot_bit(size_t index){return ((Mask) 1) << index;}
+
+    /** Return mask with count lowest bits set.*/
+    static Mask low_mask(size_t count){return count >= SLOT_COUNT ? ~((Mask) 0) : slot_bit(count) - 1;}
+
+    size_t index_of(const T* ptr) const {return ptr - ((const T*)buffer);}
+
+    bool is_full(){return used_elements == ~((Mask) 0);}
+
+    bool is_empty() const {return used_elements == 0;}
+
+    bool is_marked(const T* ptr) const {return (mark_field.load(std::memory_order_relaxed) & slot_bit(index_of(ptr))) != 0;}
 
     T* get_new()
     {
         if(is_full()) return 0;
-        uint32_t index = lowest_unset_bit(used_elements);
-        used_elements = set_bit_on(used_elements, index);
+        uint32_t index = lowest_set_bit64(~used_elements);
+        used_elements |= slot_bit(index);
         T* address = ((T*)buffer) + index;
         T* t = new(address)T;
         return t;
     }
-   
-    T* at(size_t index) 
-    {
-        return ((T*)buffer)[index];
-    }
 
     T* get_new_array(const size_t count)
     {
-        T* result = 0;
+        if(count == 0 || count > SLOT_COUNT) return 0;
 
-        if(count > CHUNK_BUFFER_SIZE) return result;
-
-        // Return pointer to start of array if enough consecutive slots are found.
-        // Try to find a position where there are count free bits-
- 
-        // First make a mask such as 000001111 where the number of set fields is equal to the
-        // number of elements stored. 
-        uint32_t mask = 0;
-        uint32_t i = count;
-        while(i--) mask |= (1 << (i));
-        
-        uint32_t positions_to_search = CHUNK_BUFFER_SIZE - count + 1;
-        uint32_t array_start_index = 0;
-
-        while(positions_to_search--)
+        // Bit i of starts is set when slots [i, i + run) are all free. Extend the run until
+        // it covers count slots: if [i, i + run) and [i + s, i + s + run) are free for s <= run,
+        // so is [i, i + run + s).
+        Mask starts = ~used_elements;
+        for(size_t run = 1; run < count && starts;)
         {
-            if((used_elements & mask) == 0)
-            {
-                result = ((T*) buffer) + array_start_index;
-                T* tmp;
-                for(size_t i = 0; i  < count; ++i) tmp = new(result + i)T;
-                (void) tmp;
-                used_elements |= mask;
-                break;
-            }
-            mask <<= 1;
-            array_start_index++;
+            size_t s = std::min(run, count - run);
+            starts &= starts >> s;
+            run += s;
         }
 
+        if(!starts) return 0;
+
+        uint32_t array_start_index = lowest_set_bit64(starts);
+        T* result = ((T*) buffer) + array_start_index;
+        for(size_t i = 0; i  < count; ++i) new(result + i)T;
+        used_elements |= low_mask(count) << array_start_index;
+
         return result;
     }
 
     void set_marked(const T* ptr)
     {
-        uint32_t index = ptr - ((T*)buffer);
-        // Note: if ptr < buffer, then index will wrap (to a very large number >> CHUNK_BUFFER_SIZE)
+        size_t index = index_of(ptr);
+        // Note: if ptr < buffer, then index will wrap (to a very large number >> SLOT_COUNT)
         // and the following clause will be false.
-        if(index < CHUNK_BUFFER_SIZE)
+        if(index < SLOT_COUNT)
         {
-            mark_field = set_bit_on(mark_field, index);
+            mark_field.store(mark_field.load(std::memory_order_relaxed) | slot_bit(index), std::memory_order_relaxed);
         }
     }
 
-    T* begin(){return buffer;}
-    T* end(){return buffer + CHUNK_BUFFER_SIZE;}
+    /** Mark ptr. Safe to call from several threads. Return true if ptr was not marked before.*/
+    bool set_marked_atomic(const T* ptr)
+    {
+        Mask bit = slot_bit(index_of(ptr));
+        return (mark_field.fetch_or(bit) & bit) == 0;
+    }
+
+    /** Mark count consecutive slots from start. Safe to call from several threads.*/
+    void set_marked_array_atomic(const T* start, const size_t count)
+    {
+        mark_field.fetch_or(low_mask(count) << index_of(start));
+    }
+
+    const T* first() const {return (const T*) buffer;}
+
+    T* begin(){return (T*) buffer;}
+    T* end(){return ((T*) buffer) + SLOT_COUNT;}
 
     bool contains(const T* ptr)
     {
         return ptr >= ((T*) buffer) &&
-               ptr < (((T*) buffer) + CHUNK_BUFFER_SIZE);
+               ptr < (((T*) buffer) + SLOT_COUNT);
     }
 
     bool set_marked_if_contains(const T* elem)
@@ -163,10 +530,10 @@ struct Chunk
     bool set_marked_if_contains_array(const T* start, const size_t count)
     {
         bool result = false;
-        if(contains(start) && ((start - ((T*)buffer)) + count) <= CHUNK_BUFFER_SIZE)
+        if(contains(start) && (index_of(start) + count) <= SLOT_COUNT)
         {
-            for(size_t i = 0; i < count; ++i) set_marked(start + i);
-
+            Mask mask = low_mask(count) << index_of(start);
+            mark_field.store(mark_field.load(std::memory_order_relaxed) | mask, std::memory_order_relaxed);
             result = true;
         }
         return result;
@@ -175,18 +542,17 @@ struct Chunk
     /** For each used/marked bit */
     void collect_marked()
     {
-        uint32_t is_used = (used_elements ^ mark_field) & used_elements;
-                              // 1 ^ 0 = 1
-        for(int index = 0; index < CHUNK_BUFFER_SIZE; ++index)
+        // Fields used but unmarked as active
+        Mask garbage = used_elements & ~mark_field.load(std::memory_order_relaxed);
+        used_elements &= ~garbage;
+
+        // Call destructor on the memory of each
+        while(garbage)
         {
-            // If field is used but unmarked as active
-            if((is_used >> index)&0x1)
-            {
-                // Set slot unused and call destructor on allocated memory
-                used_elements = set_bit_off(used_elements, index);
-                T* t = &((T*)buffer)[index];
-                t->~T();
-            }
+            uint32_t index = lowest_set_bit64(garbage);
+            garbage &= garbage - 1;
+            T* t = &((T*)buffer)[index];
+            t->~T();
         }
     }
 
@@ -194,39 +560,87 @@ struct Chunk
     size_t reserved_size_bytes() const {return sizeof(*this);}
 
     /** Return size of referred storage used. */
-    size_t live_size_bytes() const {return sizeof(T) * count_bits(used_elements);}
+    size_t live_size_bytes() const {return sizeof(T) * count_bits64(used_elements);}
 
 };
 
 
-template<class T>
+/** Storage for chunks. Chunks are placed in slabs mapped from the OS and aligned to their size
+ *  so that the chunk containing a slot is found from the address of the slot in constant time.
+ *  Slabs left empty by collect_chunks are returned to the OS unless keep_slabs() was called.
+ *  Mask sets the number of slots in a chunk, see Chunk. */
+template<class T, class Mask = uint64_t>
 class ChunkBox
 {
 public:
-    typedef Chunk<T>                        chunk_type;
-    typedef std::list<chunk_type>           chunk_container;
-    typedef typename std::list<chunk_type>::iterator iterator;
-    
-    ChunkBox()
+    typedef Chunk<T, Mask>                  chunk_type;
+    typedef typename std::vector<chunk_type*>::iterator iterator;
+
+    enum{SLAB_DEFAULT_SIZE = 1024 * 1024};
+
+    /** @param slab_size  Size of slabs in bytes. Rounded up to a power of two that fits a chunk.
+     *  @param huge_pages Map slabs from huge pages when available. Use with slabs of 2MB or more.*/
+    ChunkBox(size_t slab_size = SLAB_DEFAULT_SIZE, bool huge_pages = false):
+        current_slab_(0), huge_pages_(huge_pages), sweep_(0), mark_new_(false), keep_slabs_(false), allocated_(0)
     {
+        // Smallest power of two not less than slab_size that fits the header and a chunk.
+        slab_size_ = 4096;
+        while(slab_size_ < slab_size || slab_size_ < slab_header_size() + sizeof(chunk_type)) slab_size_ <<= 1;
+        chunks_per_slab_ = (slab_size_ - slab_header_size()) / sizeof(chunk_type);
+
         free_chunks_ = new_chunk();
     }
 
+    ~ChunkBox()
+    {
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c) (*c)->~chunk_type();
+        for(auto s = slabs_.begin(); s != slabs_.end(); ++s) slab_free(*s, slab_size_);
+    }
+
+    /** Pools are assigned to themselves through the handles. Only self assignment is valid.*/
+    ChunkBox& operator=(const ChunkBox& box)
+    {
+        assert(this == &box && "ChunkBox: cannot assign chunk storage.");
+        return *this;
+    }
+
     chunk_type* new_chunk()
     {
-        chunks_.push_back(chunk_type());
-        chunk_type* chunk = &chunks_.back();
+        if(!current_slab_ || current_slab_->chunk_count == chunks_per_slab_)
+        {
+            void* mem = slab_alloc(slab_size_, huge_pages_);
+            if(!mem) throw std::bad_alloc();
+            current_slab_ = new(mem) Slab(this);
+            slabs_.push_back(current_slab_);
+        }
+
+        chunk_type* chunk = new(current_slab_->first() + current_slab_->chunk_count) chunk_type;
+        current_slab_->chunk_count++;
+        chunks_.push_back(chunk);
         return chunk;
     }
 
+    /** Return the chunk containing ptr or null. ptr must be null or a slot reserved from a
+     *  ChunkBox<T, Mask> with the same slab size. Safe to call from several threads.*/
+    chunk_type* find_chunk(const T* ptr) const
+    {
+        if(!ptr) return 0;
+        const Slab* slab = reinterpret_cast<const Slab*>(reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t)(slab_size_ - 1));
+        if(slab->owner != this) return 0;
+        size_t index = (reinterpret_cast<const char*>(ptr) - reinterpret_cast<const char*>(slab->first())) / sizeof(chunk_type);
+        return index < slab->chunk_count ? const_cast<chunk_type*>(slab->first() + index) : 0;
+    }
+
     T* reserve_element()
     {
         T* elem = 0;
 
         if(free_chunks_)
         {
+            ++allocated_;
             elem = free_chunks_->get_new();
             chunk_type* chunk = free_chunks_;
+            if(mark_new_) chunk->set_marked(elem);
             // Check if free chunks is still free or do we need new chunks
             if(chunk->is_full())
             {
@@ -251,16 +665,20 @@ public:
     T* reserve_consecutive_elements(const size_t element_count)
     {
         T* result = 0;
-        if(element_count <= CHUNK_BUFFER_SIZE)
+        if(element_count <= chunk_type::SLOT_COUNT)
         {
+            allocated_ += element_count;
             chunk_type* chunk = free_chunks_;
             chunk_type* first_chunk =  chunk;
             chunk_type* prev_chunk = 0;
+            size_t      searched = 0;
 
             while(chunk)
             {
                 if((result = chunk->get_new_array(element_count))) 
                 {
+                    if(mark_new_) chunk->set_marked_if_contains_array(result, element_count);
+
                     // Check if chunk still has space left and if not maintain free node list
                     if(chunk->is_full())
                     {
@@ -286,6 +704,8 @@ public:
                {
                    prev_chunk = chunk;
                    chunk = chunk->next;
+                   // Fragmented chunks gather to the free list. Do not walk all of them.
+                   if(++searched == FREE_CHUNK_SEARCH_LIMIT) chunk = 0;
                    if(chunk == first_chunk)
                    {
                        assert(!"ChunkBox: Free chunk list is circular.");
@@ -300,7 +720,7 @@ public:
                 // free list if the array does not consume it completely.
                 chunk_type* created_chunk = new_chunk();
 
-                if(element_count < CHUNK_BUFFER_SIZE)
+                if(element_count < chunk_type::SLOT_COUNT)
                 {
                     created_chunk->next = free_chunks_;
                     free_chunks_ = created_chunk;
@@ -308,6 +728,7 @@ public:
 
                 // At this point we know the operation cannot fail.
                 result = created_chunk->get_new_array(element_count);
+                if(mark_new_) created_chunk->set_marked_if_contains_array(result, element_count);
             }
         }
 
@@ -317,12 +738,13 @@ public:
     void refresh_free_chunk_list()
     {
         free_chunks_ = 0;
-        for(auto chunk = chunks_.begin(); chunk != chunks_.end(); ++chunk)
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
         {
+            chunk_type* chunk = *c;
             if(!chunk->is_full())
             {
                 chunk->next = free_chunks_;
-                free_chunks_ = &(*chunk);
+                free_chunks_ = chunk;
             }
         }
     }
@@ -331,75 +753,262 @@ public:
     {
         for(auto c = chunks_.begin(); c != chunks_.end(); ++c)
         {
-            c->mark_field = 0;
+            (*c)->mark_field = 0;
         }
     }
 
     /** After the chunks have been marked, collect the unused memory in all of them. If 
-     * chunk has been full and has some memory freed move it to the free_chunks_ list.*/
-    void collect_chunks()
+     * chunk has been full and has some memory freed move it to the free_chunks_ list.
+     * @param thread_count Number of threads to sweep with. Only used if T is trivially destructible.*/
+    void collect_chunks(size_t thread_count = 1)
     {
-        free_chunks_ = 0;
-        for(auto chunk = begin(); chunk != end(); ++chunk)
+        mark_new_ = false;
+        sweep_ = chunks_.size();
+
+        if(thread_count > 1 && std::is_trivially_destructible<T>::value)
         {
-            chunk->collect_marked();
+            struct Sweep
+            {
+                std::vector<chunk_type*>& chunks;
+                size_t                    group_size;
+                void operator()(size_t group)
+                {
+                    size_t first = std::min(chunks.size(), group * group_size);
+                    size_t last = std::min(chunks.size(), first + group_size);
+                    for(size_t i = first; i < last; ++i) chunks[i]->collect_marked();
+                }
+            } sweep = {chunks_, (chunks_.size() + thread_count - 1) / thread_count};
+            run_in_parallel(thread_count, sweep);
+        }
+        else
+        {
+            for(auto c = chunks_.begin(); c != chunks_.end(); ++c) (*c)->collect_marked();
+        }
+
+        if(!keep_slabs_) release_empty_slabs();
+        sweep_ = chunks_.size();
+
+        refresh_free_chunk_list();
+        if(!free_chunks_) free_chunks_ = new_chunk();
+    }
+
+    /** Keep empty slabs mapped until the box is destroyed. Used by killed pools: handles
+     *  released after kill() still refer to their chunks.*/
+    void keep_slabs(){keep_slabs_ = true;}
+
+    /** Return slabs with no used slots to the OS. The slab new chunks are placed in is kept.
+     *  Chunks in the free list must be refreshed after calling this.*/
+    void release_empty_slabs()
+    {
+        size_t kept = 0;
+        for(size_t i = 0; i < slabs_.size(); ++i)
+        {
+            Slab* slab = slabs_[i];
+            bool empty = slab != current_slab_;
+            for(size_t c = 0; c < slab->chunk_count && empty; ++c) empty = slab->first()[c].is_empty();
+
+            if(empty)
+            {
+                for(size_t c = 0; c < slab->chunk_count; ++c) slab->first()[c].~chunk_type();
+                slab_free(slab, slab_size_);
+            }
+            else
+            {
+                slabs_[kept++] = slab;
+            }
+        }
+
+        if(kept == slabs_.size()) return;
+
+        slabs_.resize(kept);
+        chunks_.clear();
+        for(auto s = slabs_.begin(); s != slabs_.end(); ++s)
+        {
+            for(size_t c = 0; c < (*s)->chunk_count; ++c) chunks_.push_back((*s)->first() + c);
+        }
+    }
+
+    /** Move the slabs of box, and the slots reserved from them, to this box. box is left empty.
+     *  During a sweep the slots moved are marked so that the sweep keeps them.*/
+    void adopt(ChunkBox& box)
+    {
+        assert(box.slab_size_ == slab_size_ && "ChunkBox: cannot adopt slabs of different size.");
+
+        for(auto s = box.slabs_.begin(); s != box.slabs_.end(); ++s) (*s)->owner = this;
 
+        for(auto c = box.chunks_.begin(); c != box.chunks_.end(); ++c)
+        {
+            chunk_type* chunk = *c;
+            chunk->mark_field = mark_new_ ? chunk->used_elements : 0;
+            chunk->next = 0;
             if(!chunk->is_full())
             {
                 chunk->next = free_chunks_;
-                free_chunks_ = &(*chunk);
+                free_chunks_ = chunk;
+            }
+        }
+
+        slabs_.insert(slabs_.end(), box.slabs_.begin(), box.slabs_.end());
+        chunks_.insert(chunks_.end(), box.chunks_.begin(), box.chunks_.end());
+        allocated_ += box.allocated_;
+
+        box.slabs_.clear();
+        box.chunks_.clear();
+        box.current_slab_ = 0;
+        box.free_chunks_ = 0;
+    }
+
+    /** Mark the slot of ptr. Return false if the slot was already marked or is not in the box.*/
+    bool mark(const T* ptr)
+    {
+        chunk_type* c = find_chunk(ptr);
+        if(!c || c->is_marked(ptr)) return false;
+        c->set_marked(ptr);
+        return true;
+    }
+
+    /** Mark the slot of ptr from one of several marking threads. Return false if the slot was
+     *  already marked or is not in the box.*/
+    bool mark_atomic(const T* ptr)
+    {
+        chunk_type* c = find_chunk(ptr);
+        return c && c->set_marked_atomic(ptr);
+    }
+
+    /** Mark size slots from ptr from one of several marking threads.*/
+    void mark_array_atomic(const T* ptr, size_t size)
+    {
+        chunk_type* c = find_chunk(ptr);
+        if(c) c->set_marked_array_atomic(ptr, size);
+    }
+
+    /** Start collecting the chunks one at a time. Until the sweep is done slots reserved
+     *  are marked so that chunks not yet swept keep them.*/
+    void begin_sweep()
+    {
+        sweep_ = 0;
+        mark_new_ = true;
+    }
+
+    /** Collect at most chunk_budget chunks. Return true once all chunks have been collected.
+     *  Chunks that were full and have slots freed are added to the free list.*/
+    bool sweep_step(size_t& chunk_budget)
+    {
+        for(; sweep_ < chunks_.size() && chunk_budget > 0; ++sweep_, --chunk_budget)
+        {
+            chunk_type* chunk = chunks_[sweep_];
+            bool was_full = chunk->is_full();
+            chunk->collect_marked();
+            if(was_full && !chunk->is_full())
+            {
+                chunk->next = free_chunks_;
+                free_chunks_ = chunk;
             }
         }
+
+        if(sweep_ < chunks_.size()) return false;
+
+        mark_new_ = false;
+        return true;
     }
 
     void set_marked_if_contained(const T* ptr)
     {
-        std::for_each(begin(), end(), [&ptr](chunk_type& c){c.set_marked_if_contains(ptr);});
+        chunk_type* c = find_chunk(ptr);
+        if(c) c->set_marked(ptr);
     }
     
     void set_marked_if_contained_array(const T* ptr, size_t size)
     {
-        // TODO replace for_each with a loop that break immediately whem a match is found.
-        std::for_each(begin(), end(), [&ptr, &size](chunk_type& c){c.set_marked_if_contains_array(ptr, size);});
+        chunk_type* c = find_chunk(ptr);
+        if(c) c->set_marked_if_contains_array(ptr, size);
     }
 
     iterator begin(){return chunks_.begin();}
     iterator end(){return chunks_.end();}
 
-    chunk_container& chunks(){return chunks_;}
+    size_t chunk_count() const {return chunks_.size();}
+    size_t slab_count() const {return slabs_.size();}
+    size_t allocated_count() const {return allocated_;} //> Slots reserved since creation.
+    size_t slab_size() const {return slab_size_;}
     chunk_type* free_chunks(){return free_chunks_;}
 
     size_t reserved_size_bytes() const {
-        return sizeof(chunk_type) * chunks_.size();
+        return slab_size_ * slabs_.size();
     }
 
     size_t live_size_bytes() const
     {
-        auto collect = [](size_t r, const chunk_type& t)->size_t {return r + t.live_size_bytes();};
-        size_t init = 0;
-        return fold_left<size_t, chunk_container>(init, collect, chunks_);
+        size_t result = 0;
+        for(auto c = chunks_.begin(); c != chunks_.end(); ++c) result += (*c)->live_size_bytes();
+        return result;
     }
 
 private:
-    chunk_container chunks_;
-    chunk_type*     free_chunks_;
+    /** Slab header. Chunks follow the header.*/
+    struct Slab
+    {
+        const ChunkBox* owner;
+        size_t          chunk_count; //> Chunks constructed in the slab.
+
+        Slab(const ChunkBox* box):owner(box), chunk_count(0){}
+
+        chunk_type* first(){return reinterpret_cast<chunk_type*>(reinterpret_cast<char*>(this) + slab_header_size());}
+        const chunk_type* first() const {return reinterpret_cast<const chunk_type*>(reinterpret_cast<const char*>(this) + slab_header_size());}
+    };
+
+    static size_t slab_header_size()
+    {
+        const size_t align = std::alignment_of<chunk_type>::value;
+        return ((sizeof(Slab) + align - 1) / align) * align;
+    }
+
+    ChunkBox(const ChunkBox&);
+
+    std::vector<Slab*>       slabs_;
+    std::vector<chunk_type*> chunks_;          //> Chunks in the order of creation.
+    Slab*                    current_slab_;    //> Slab new chunks are placed in.
+    size_t                   slab_size_;       //> Size and alignment of slabs in bytes.
+    size_t                   chunks_per_slab_;
+    bool                     huge_pages_;
+    chunk_type*              free_chunks_;
+    size_t                   sweep_;    //> Next chunk to collect in an incremental sweep.
+    bool                     mark_new_; //> Mark reserved slots while sweeping.
+    bool                     keep_slabs_;
+    size_t                   allocated_;
 };
 
 
 /////////// Persistent list //////////////
 
 /** Pool manager and collector for persistent lists. 
- *  Not a particularly efficient implementation. */
-template<class T>
+ *
+ *  The list is unrolled: a node holds up to WIDTH elements in an array and links to the node
+ *  holding the rest of the list. A list is a node and the offset of its first element in the node,
+ *  so rest() only moves the offset and iteration reads consecutive elements of a node.
+ *
+ *  Nodes made by add() fill their array from the back. The first slot before the lowest element
+ *  of a node is claimed in place by the first add() to the list starting from that element,
+ *  other lists sharing the node never see it. Nodes made by Transient fill their array from the front.
+ *
+ *  Each node stores the length of the list following it, so size() is constant time. */
+template<class T>
 class PListPool
 {
 public:
 
-    /** List node. */
+    enum{WIDTH = 8};
+
+    /** List node. Elements are held in data[low, end).*/
     struct Node
     {
-        Node* next;
-        T     data;
+        T         data[WIDTH];
+        Node*     next;
+        uint32_t  next_offset; //> Offset of the first element of the rest of the list in next.
+        uint32_t  low;         //> Lowest slot holding an element.
+        uint32_t  end;         //> One past the last slot holding an element.
+        size_t    tail_size;   //> Number of elements in the list starting from next.
+        RootCount refs; //> Handles to the lists starting from this node.
     };
 
     /** Stores head to List */
@@ -408,41 +1017,45 @@ public:
     public:
         struct iterator
         {
-            Node* node;
-            iterator():node(0){}
-            iterator(Node* n):node(n){}
-            const T& operator*() const {return node->data;}
-            T& operator*() {return node->data;}
-            const T* operator->() const {return &(node->data);}
-            T* operator->() {return &(node->data);}
-            T* data_ptr() {return &node->data;}
-            void operator++(){if(node) node = node->next;}
-            bool operator!=(const iterator& i) const {return node != i.node;}
-            bool operator==(const iterator& i) const {return node == i.node;}
+            Node*    node;
+            uint32_t index;
+            iterator():node(0), index(0){}
+            iterator(Node* n, uint32_t i):node(n), index(i){}
+            const T& operator*() const {return node->data[index];}
+            T& operator*() {return node->data[index];}
+            const T* operator->() const {return &(node->data[index]);}
+            T* operator->() {return &(node->data[index]);}
+            T* data_ptr() {return &node->data[index];}
+            void operator++(){if(node) PListPool::advance(node, index);}
+            bool operator!=(const iterator& i) const {return node != i.node || index != i.index;}
+            bool operator==(const iterator& i) const {return node == i.node && index == i.index;}
         };
 
     public:
 
         typedef T value_type;
 
-        List(PListPool& pool, Node* head):pool_(pool), head_(head){if(head_) pool_.add_ref(head_);}
+        List(PListPool& pool, Node* head, uint32_t offset):pool_(pool), head_(head), offset_(offset){if(head_) pool_.add_ref(head_);}
         ~List(){if(head_) pool_.remove_ref(head_);}
        
-        List(const List& old_list):pool_(old_list.pool_), head_(old_list.head_)
+        List(const List& old_list):pool_(old_list.pool_), head_(old_list.head_), offset_(old_list.offset_)
         {
             if(head_) pool_.add_ref(head_);
         }
 
-        List(List&& temp_list):pool_(temp_list.pool_), head_(temp_list.head_)
+        List(List&& temp_list):pool_(temp_list.pool_), head_(temp_list.head_), offset_(temp_list.offset_)
         {
             temp_list.head_ = 0;
+            temp_list.offset_ = 0;
         }
 
         List& operator=(const List& list)
         {
             if(this != &list)
             {
+                if(head_) pool_.remove_ref(head_);
                 head_ = list.head_;
+                offset_ = list.offset_;
                 pool_ = list.pool_;
                 if(head_) pool_.add_ref(head_);
             }
@@ -453,9 +1066,12 @@ public:
         {
             if(this != &list)
             {
+                if(head_) pool_.remove_ref(head_);
                 head_ = list.head_;
+                offset_ = list.offset_;
                 pool_ = list.pool_;
                 list.head_ = 0;
+                list.offset_ = 0;
             }
             return *this;
         }
@@ -466,20 +1082,39 @@ public:
             if(head_) pool_.add_ref(head_);
         }
 
+        /** Mark the list reachable in the running incremental collection.*/
+        void shade() const {pool_.shade(head_);}
+
         /** Find first element from list matching with predicate or return end. */ 
         iterator find(const List* list, std::function<bool(const T&)>& pred) const
         {
-            Node* n = head_;
-            while(n && ! pred(n->data)) n = n->next;
-            return iterator(n);
+            iterator i = begin(), last = end();
+            while(i != last && !pred(*i)) ++i;
+            return i;
         }
 
         /** Add element to list */
         List add(const T& data) const
         {
-            Node* n = pool_.new_node(data);
+            if(head_ && offset_ > 0 && head_->low == offset_)
+            {
+                // The slot before the first element is free and no other list can claim it
+                // after this one, so the element is prepended in place.
+                uint32_t offset = offset_ - 1;
+                head_->data[offset] = data;
+                head_->low = offset;
+                pool_.regray(head_);
+                return List(pool_, head_, offset);
+            }
+
+            Node* n = pool_.new_node();
+            n->data[WIDTH - 1] = data;
+            n->low = WIDTH - 1;
+            n->end = WIDTH;
             n->next = head_; // prepend new element to head
-            return List(pool_, n);
+            n->next_offset = offset_;
+            n->tail_size = size();
+            return List(pool_, n, WIDTH - 1);
         }
 
         /** Add iterator range to list.*/
@@ -495,32 +1130,24 @@ public:
             // Neither head nor node to remove can be null.
             if(i.node != 0 && head_)
             {
-                // If node is first, just return a list starting from next node.
-                if(head_ == i.node) return List(pool_, head_->next);
-
-                // Otherwise must duplicate nodes prior to node to remove
-                // [a]->[b]->[c]->[d]
-                //
-                //[a']->[b']->[d]
-
-                // find position
-                Node* n        = head_;
-                Node* new_head = pool_.copy(n);;
-                Node* build    = new_head;
-
-                n = n->next;
-
-                while(n && n != i.node)
+                // If element is first, just return the rest of the list.
+                if(i == begin()) return rest();
+
+                // Otherwise the elements prior to the one to remove are prepended to
+                // the rest of the list following it.
+                std::vector<T> prefix;
+                iterator n = begin();
+                while(n != end() && n != i)
                 {
-                    build->next = pool_.copy(n);
-                    build = build->next;
-                    n = n->next;
+                    prefix.push_back(*n);
+                    ++n;
                 }
-                
-                // Finally tie to the next cell from to be removed
-                build->next = i.node->next;
+                if(n == end()) return *this;
 
-                return List(pool_, new_head);
+                ++n;
+                List result(pool_, n.node, n.index);
+                for(auto p = prefix.rbegin(); p != prefix.rend(); ++p) result = result.add(*p);
+                return result;
             }
             else
             {
@@ -531,54 +1158,51 @@ public:
         /** Return list containing all but the first element or emtpy list. */
         List rest() const
         {
-            return head_ ? List(pool_, head_->next) : List(pool_, 0);
+            return drop(1);
         }
 
         /** Return list containing all but the two first elements or emtpy list. */
         List rrest() const
         {
-            if(head_ && head_->next) return List(pool_, head_->next->next);
-            else return List(pool_, 0);
+            return drop(2);
         }
 
         /** Return list containing all but the three first elements or emtpy list. */
         List rrrest() const
         {
-            if(head_ && head_->next && head_->next->next) return List(pool_, head_->next->next);
-            else return List(pool_, 0);
+            return drop(3);
         }
 
         /** Return reference to the first element of list or null.*/
         const T* first() const
         {
-            return head_ ? &head_->data : 0;
+            return head_ ? &head_->data[offset_] : 0;
         }
 
         /** Return the second element in the list or empty.*/ 
         const T* second() const
         {
-            if(head_ && head_->next && head_->next->next)
-                return &head_->next->next->data;
-            else return 0;
+            if(size() < 2) return 0;
+            iterator i = begin();
+            ++i;
+            return &*i;
         }
 
         bool empty() const {return head_ == 0;}
 
-        bool has_rest() const {return head_ ? head_->next != 0 : false;}
+        bool has_rest() const {return size() > 1;}
 
-        iterator begin() const {return iterator(head_);}
-        iterator end() const {return iterator(0);}
+        iterator begin() const {return iterator(head_, offset_);}
+        iterator end() const {return iterator(0, 0);}
 
         const size_t size() const
         {
-            size_t s = 0;
-            Node* n = head_;
-            while(n){ n = n->next; s++;}
-            return s;
+            return head_ ? head_->end - offset_ + head_->tail_size : 0;
         }
 
         bool operator==(const List& l) const
         {
+            if(size() != l.size()) return false;
             iterator i = begin(), last = end(), li = l.begin(), le = l.end();
             while(i != last && li != le)
             {
@@ -590,26 +1214,129 @@ public:
         }
 
     private:
+
+        /** Return list containing all but the count first elements or empty list.*/
+        List drop(size_t count) const
+        {
+            if(size() <= count) return List(pool_, 0, 0);
+            Node* n = head_;
+            uint32_t offset = offset_;
+            while(count > 0)
+            {
+                uint32_t in_node = n->end - offset;
+                if(count < in_node)
+                {
+                    offset += (uint32_t) count;
+                    break;
+                }
+                count -= in_node;
+                offset = n->next_offset;
+                n = n->next;
+            }
+            return List(pool_, n, offset);
+        }
+
         PListPool& pool_;
         Node*      head_; 
+        uint32_t   offset_; //> Slot of the first element in head_.
+    };
+
+    /** Mutable builder of a list. Elements are appended in place to the end of the list.
+     *  persistent() returns the list built so far and leaves the builder empty.*/
+    class Transient
+    {
+    public:
+        Transient(PListPool& pool):pool_(pool), head_(0), tail_(0), size_(0){}
+
+        Transient(Transient&& t):pool_(t.pool_), head_(t.head_), tail_(t.tail_), size_(t.size_)
+        {
+            t.head_ = t.tail_ = 0;
+            t.size_ = 0;
+        }
+
+        ~Transient(){pool_.remove_ref(head_);}
+
+        /** Append element to the end of the list.*/
+        Transient& add_end(const T& data)
+        {
+            if(tail_ && tail_->end < WIDTH)
+            {
+                tail_->data[tail_->end++] = data;
+                pool_.regray(tail_);
+            }
+            else
+            {
+                Node* n = pool_.new_node();
+                n->data[0] = data;
+                n->low = 0;
+                n->end = 1;
+                // Marking stops at marked nodes, so nodes linked after one are shaded separately.
+                pool_.shade(n);
+                if(tail_)
+                {
+                    tail_->next = n;
+                }
+                else
+                {
+                    head_ = n;
+                    pool_.add_ref(head_);
+                }
+                tail_ = n;
+            }
+            ++size_;
+            return *this;
+        }
+
+        /** Append elements in iterator range to the end of the list.*/
+        template<class I>
+        Transient& add_end(I ibegin, I iend)
+        {
+            for(; ibegin != iend; ++ibegin) add_end(*ibegin);
+            return *this;
+        }
+
+        List persistent()
+        {
+            // Lengths of the lists following each node are known only once the list is complete.
+            size_t remaining = size_;
+            for(Node* n = head_; n; n = n->next)
+            {
+                remaining -= n->end;
+                n->tail_size = remaining;
+            }
+
+            List l(pool_, head_, 0);
+            pool_.remove_ref(head_);
+            head_ = tail_ = 0;
+            size_ = 0;
+            return l;
+        }
+
+    private:
+        Transient(const Transient&);
+        Transient& operator=(const Transient&);
+
+        PListPool& pool_;
+        Node*      head_;
+        Node*      tail_;
+        size_t     size_;
     };
 
     typedef Chunk<Node>                    node_chunk;
     typedef ChunkBox<Node>                 node_chunk_box;
 
-    typedef std::unordered_map<Node*, int> ref_count_map;
-    
     /** Recycle all memory. */
     void kill()
     {
         // Deleting ListPool before the end of the lifetime of all heads will result
         // in undefined behaviour.
         // Call destructor on unused elements
-        ref_count_.clear();
+        roots_.clear();
+        chunks_.keep_slabs();
         gc(); 
     }
 
-    PListPool()
+    PListPool():phase_(GC_IDLE), gc_thread_count_(default_gc_thread_count()), gc_min_chunks_(PARALLEL_GC_MIN_CHUNKS)
     {
     }
 
@@ -621,224 +1348,287 @@ public:
     /** Create new empty list. */
     List new_list()
     {
-        return List( *this, 0);
+        return List( *this, 0, 0);
     }
 
     /** Remove reference to node */
     void remove_ref(Node* n)
     {
-        int* ref_count = try_get_value(ref_count_, n);
-        if(ref_count && (*ref_count > 0)) --(*ref_count);
+        roots_.remove_ref(n);
     }
 
-    /** Add reference to node*/
+    /** Add reference to node. Also the write barrier of the incremental collection.*/
     void add_ref(Node* n)
     {
-        if(has_key(ref_count_, n)) ref_count_[n]++;
-        else ref_count_[n] = 1;
+        shade(n);
+        roots_.add_ref(n);
     }
 
     /** Create new list from stl compatible container. */
     template<class Cont>
     List new_list(const Cont& container)
     {
-        if(container.size() == 0) return List(*this, 0);
-
-        auto i = container.begin();
-        Node* head = new_node(*i);
-        Node* node = head;
-        i++;
-
-        for(;i != container.end(); ++i)
-        {
-            node->next = new_node(*i);
-            node = node->next;
-        }
-
-        return List( *this, head);
+        Transient t(*this);
+        t.add_end(container.begin(), container.end());
+        return t.persistent();
     }
- 
-    template<class I>
-    Node* add_elem(I i_begin, I i_end) 
+
+    /** Return an empty list builder.*/
+    Transient transient()
     {
-        if(i_begin == i_end) return 0;
-        else
-        {
-            Node* n = new_node(*i_begin);
-            ++i_begin;
-            n->next = add_elem(i_begin, i_end);
-            
-            return n;
-        }
+        return Transient(*this);
     }
 
     /** Create new list by appending elements in iterator range to list. */
     template<class I>
     List add(const List& old, I i_begin, I i_end)
     {
-        //if(i_begin == i_end) return List(*old); // TODO: need this?
-
-
-        auto o_i = old.begin();
-        auto o_end = old.end();
-
-        Node* cpy_head = 0;
-        Node* cpy_pos;
-
-        if(o_i == o_end){
-            Node* new_head = add_elem(i_begin, i_end);
-            return List( *this, new_head);
-        }else{
-
-            while(o_i != o_end)
-            {
-                Node* n = new_node(*o_i);
-
-                if(!cpy_head)
-                {
-                    cpy_head = n;
-                    cpy_pos = cpy_head;
-                }
-                else
-                {
-                    cpy_pos->next = n;
-                    cpy_pos = n;
-                }
-
-                ++o_i;
-            }
-
-            cpy_pos->next = add_elem(i_begin, i_end);
-            return List( *this, cpy_head);
-        }
+        Transient t(*this);
+        t.add_end(old.begin(), old.end());
+        t.add_end(i_begin, i_end);
+        return t.persistent();
     }
 
-
     /** Create new list from a number of input values. */
     List new_list(const T& a)
     {
-        Node* head = new_node(a);
-
-        return List( *this, head);
+        Node* head = new_node();
+        head->data[WIDTH - 1] = a;
+        return end_list(head, 1);
     }
 
     /** Create new list from a number of input values. */
     List new_list(const T& a, const T& b)
     {
-        Node* head = new_node(a);
-        Node* node = head;
-
-        node->next = new_node(b);
-
-        return List( *this, head);
+        Node* head = new_node();
+        head->data[WIDTH - 2] = a;
+        head->data[WIDTH - 1] = b;
+        return end_list(head, 2);
     }
 
     /** Create new list from a number of input values. */
     List new_list(const T& a, const T& b, const T& c)
     {
-        Node* head = new_node(a);
-        Node* node = head;
-
-        node->next = new_node(b);
-        node = node->next;
-
-        node->next = new_node(c);
+        Node* head = new_node();
+        head->data[WIDTH - 3] = a;
+        head->data[WIDTH - 2] = b;
+        head->data[WIDTH - 1] = c;
+        return end_list(head, 3);
+    }
 
-        return List( *this, head);
+    /** Return an empty node. */
+    Node* new_node()
+    {
+        Node* n = chunks_.reserve_element();
+        n->next = 0;
+        n->next_offset = 0;
+        n->low = 0;
+        n->end = 0;
+        n->tail_size = 0;
+        return n;
     }
 
-    // Return duplicate of existing node sans the links
-    Node* copy(Node* n)
+    /** Move list position (node, index) to the next element. The position past the
+     *  last element is (0, 0).*/
+    static void advance(Node*& node, uint32_t& index)
     {
-        Node* c = 0;
-        if(n)
+        if(++index == node->end)
         {
-           c = new_node(n->data); 
+            index = node->next_offset;
+            node = node->next;
         }
-        return c; 
     }
 
-    Node* new_node(const T& data)
+    void mark_referenced(Node* node)
     {
-        Node* n = chunks_.reserve_element();
-        n->data = data;
-        n->next = 0;
-        return n;
+        // Nodes following a marked node are marked already.
+        while(node && chunks_.mark(node)) node = node->next;
     }
 
-    void mark_referenced(Node* node)
+    /** Mark the nodes of a list from one of several marking threads.*/
+    struct ParallelMark
     {
-        auto chunks_end = chunks_.end();
-        auto chunk_iterator = chunks_end;
-
-        // Follow referenced nodes
-        while(node)
+        node_chunk_box& chunks;
+        void operator()(Node* node, std::vector<Node*>&)
         {
-            // Store reference to previous chunk visited. If there is not too much
-            // fragmentation there is a fair chance that nodes have been reserved
-            // linearly and that the previous chunk contains this node.
-
-            if(chunk_iterator != chunks_end && chunk_iterator->set_marked_if_contains(node))
-            {
-                node = node->next;
-                continue;
-            }
-
-            // Find the chunk that contains the node and label used.
-            for(chunk_iterator = chunks_.begin(); chunk_iterator != chunks_end; ++chunk_iterator)
-            {
-                if(chunk_iterator->set_marked_if_contains(node)) break;
-            }
+            while(node && chunks.mark_atomic(node)) node = node->next;
+        }
+    };
 
-            node = node->next;
-        }   
-    }
-    
     /** Return number of bytes used by the chunk pool in total. */
     size_t reserved_size_bytes()
     {
-        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        size_t ref_map_size = roots_.size() * sizeof(Node*);
         size_t total = sizeof(*this) + ref_map_size + chunks_.reserved_size_bytes(); 
         return total;
     }
 
     size_t live_size_bytes()
     {
-        size_t ref_map_size = ref_count_.size() * (sizeof(Node*) + sizeof(int));
+        size_t ref_map_size = roots_.size() * sizeof(Node*);
         size_t total = sizeof(*this) + ref_map_size +  chunks_.live_size_bytes();
         return total;
     }
 
+    /** Return number of nodes reserved since the pool was created. */
+    size_t allocated_count() const {return chunks_.allocated_count();}
+
     // Collect all slots taken by unvisitable nodes //TODO: 
     void gc()
+    {
+        gc_mark();
+        gc_sweep();
+    }
+
+    /** First half of gc(): mark the nodes reachable from the referenced lists. Pools whose
+     *  elements refer to each other must all be marked before any is swept, since sweeping
+     *  destroys elements that may release references to the roots of the other pools.*/
+    void gc_mark()
     {
         // Currently bit expensive - the cost is 
         //    constant * block_count (free all nodes) + m * block_count/2 (mark all visited nodes)
         // where m is the number of live nodes in all the lists
 
+        // Abandon incremental collection if one is running.
+        phase_ = GC_IDLE;
+        gray_.clear();
+        regray_.clear();
+
         // First mark all as empty
         chunks_.mark_all_empty();
 
         // Then clean up unused references, visit all heads and mark visited nodes as active
-        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        roots_.prune();
 
-        // Now ref_count_ contains as keys the head nodes of active lists.
-        for(auto r = ref_count_.begin(); r != ref_count_.end(); ++r) mark_referenced(r->first);
+        // Now roots_ contains the head nodes of active lists.
+        size_t thread_count = chunks_.chunk_count() >= gc_min_chunks_ ? gc_thread_count_ : 1;
+        if(thread_count > 1)
+        {
+            ParallelMark mark = {chunks_};
+            ParallelMarker<Node*, ParallelMark> marker(mark, thread_count);
+            marker.run(roots_.nodes());
+        }
+        else
+        {
+            for(auto r = roots_.begin(); r != roots_.end(); ++r) mark_referenced(*r);
+        }
+    }
 
-        // Lastly, go through the blocks, deallocate free's slots and move chunks to free list
+    /** Second half of gc(): free the nodes left unmarked by gc_mark().*/
+    void gc_sweep()
+    {
+        // Go through the blocks, deallocate free's slots and move chunks to free list
         // if space became available on a full one
-        chunks_.collect_chunks();
+        size_t thread_count = chunks_.chunk_count() >= gc_min_chunks_ ? gc_thread_count_ : 1;
+        chunks_.collect_chunks(thread_count);
+    }
+
+    /** Set the number of threads used by gc(). Pools of less than min_chunks chunks
+     *  are collected by the calling thread only.*/
+    void set_gc_thread_count(size_t count, size_t min_chunks = PARALLEL_GC_MIN_CHUNKS)
+    {
+        gc_thread_count_ = count > 0 ? count : 1;
+        gc_min_chunks_ = min_chunks;
     }
 
     /** Clear refcounts. Warning: use only if you know what you are doing. */
     void clear_root_refcounts()
     {
-        ref_count_.clear();
+        roots_.clear_counts();
+    }
+
+    /** Start an incremental collection. Roots are given to shade(). While marking, add_ref
+     *  shades each head it is given: all handles are made through it, so this is the
+     *  write barrier for List::add and the other operations returning lists. */
+    void begin_incremental()
+    {
+        chunks_.mark_all_empty();
+        gray_.clear();
+        regray_.clear();
+        phase_ = GC_MARK;
+
+        // Nodes referenced by handles are roots as well.
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) shade(*r);
+    }
+
+    /** Add node to the nodes to mark if marking is in progress.*/
+    void shade(Node* n){if(n && phase_ == GC_MARK) gray_.push_back(n);}
+
+    /** Scan node again if marking is in progress. Elements written in place to a node
+     *  already marked are visited this way.*/
+    void regray(Node* n){if(phase_ == GC_MARK) regray_.push_back(n);}
+
+    /** Mark at most budget nodes reachable from the shaded ones. visit is called with
+     *  each element of the nodes marked. Return the number of nodes marked.*/
+    template<class F>
+    size_t mark_step(size_t budget, F& visit)
+    {
+        size_t work = 0;
+        while(work < budget && !(gray_.empty() && regray_.empty()))
+        {
+            if(!regray_.empty())
+            {
+                Node* n = regray_.back();
+                regray_.pop_back();
+                if(chunks_.mark(n)) shade(n->next);
+                for(uint32_t i = n->low; i < n->end; ++i) visit(n->data[i]);
+                ++work;
+                continue;
+            }
+
+            Node* n = gray_.back();
+            gray_.pop_back();
+
+            while(n && chunks_.mark(n))
+            {
+                for(uint32_t i = n->low; i < n->end; ++i) visit(n->data[i]);
+                n = n->next;
+                if(++work == budget){shade(n); break;}
+            }
+        }
+        return work;
+    }
+
+    bool marking_done() const {return gray_.empty() && regray_.empty();}
+
+    /** Start freeing the nodes left unmarked.*/
+    void begin_sweep()
+    {
+        // Unreferenced roots may be freed by the sweep.
+        roots_.prune();
+        chunks_.begin_sweep();
+        phase_ = GC_SWEEP;
+    }
+
+    /** Free unmarked nodes in at most chunk_budget chunks. Return true when the collection is complete.*/
+    bool sweep_step(size_t& chunk_budget)
+    {
+        if(!chunks_.sweep_step(chunk_budget)) return false;
+
+        phase_ = GC_IDLE;
+        return true;
     }
 
+    GcPhase gc_phase() const {return phase_;}
+
 private:
+
+    /** Return list of the count elements at the end of the array of head.*/
+    List end_list(Node* head, uint32_t count)
+    {
+        head->low = WIDTH - count;
+        head->end = WIDTH;
+        return List( *this, head, WIDTH - count);
+    }
+
     node_chunk_box        chunks_;
-    ref_count_map         ref_count_;   //> Head node reference counts
+    RootSet<Node>         roots_;       //> Head nodes referenced by lists
+    GcPhase               phase_;
+    std::vector<Node*>    gray_;        //> Nodes shaded but not yet marked.
+    std::vector<Node*>    regray_;      //> Nodes written to in place while marking. Rescanned even if marked.
+    size_t                gc_thread_count_; //> Threads used by gc() on large pools.
+    size_t                gc_min_chunks_;   //> Chunk count from which gc() uses several threads.
 
 };
 
@@ -846,38 +1636,48 @@ private:
 /////////// Persistent map //////////////
 
 #if 1
-/** A persistent, self garbage-collecting version of Bagwell's persistent hash tries.
+/** A persistent, self garbage-collecting version of Steindorfer's compressed hash-array mapped
+    prefix-trees (CHAMP), a variant of Bagwell's hash array mapped tries.
     Hash key: uint32_t
 
-    The key is split to five 5-bit length fields and one 2-bit length field as
+    The key is split to six 5-bit length fields and one 2-bit length field as
 
 level  0     1     2     3     4     5   6
     |aaaaa|bbbbb|ccccc|ddddd|eeeee|fffff|gg
      0-31  0-31  0-31  0-31  0-31  0-31  0-3
 
-    where each level give the index to use at the child-node array at the given level.
+    where each level gives the position of the key in the node at the given level.
 
 
-    Node: used_field: uint32_t
-          ref_array = Ref * [huffmanlength(used_field)]
+    Node: datamap:  uint32_t, positions holding a keyvalue
+          nodemap:  uint32_t, positions holding a child node
+          data     = KeyValue[bitcount(datamap)]
+          children = Node*[bitcount(nodemap)]
 
-    Each node contains 32 slots for children.
+    Each node contains 32 positions. A position holds either a keyvalue or a child node, never both.
 
-    The ref_array is allocated only to the huffman length of the used_field (i.e. numbers of bits 1
-    in the field).
+    The keyvalues of a node are stored inline in one contiguous array and the children in another,
+    both allocated to the number of bits set in the corresponding map. A lookup reads the key at its
+    position in the data array or descends to the child node, so each level costs one array access.
+    Iteration visits the data array of a node before descending to its children.
 
-    Each element in ref-array stores either: a) A reference to a child-node, b) A reference to the stored element or c) A reference to a list of stored elements in
-    case the hash-key is overwritten.
+    Keys with equal hashes are pushed down to a collision node below level 6. A collision node holds
+    its keyvalues in a vector and is searched linearly.
 
-    The datum for the element is not stored inside the node, only a reference to it.
+    Deletion keeps the trie canonical: a node left with a single keyvalue and no children is
+    replaced by the keyvalue in its parent, so the shape of a trie depends only on its contents.
 
-    The storage used by a node _without the stored elements_ is 
+    The storage used by a node _without the stored elements_ is
 
-    4 bytes (used_field) + 8 bytes (ref_array pointer) + elem_count(1 to 32) * 8 (ref_array contents) -> 20 to 268 bytes
+    32 bytes (maps, refcount, edit id and array pointers) + child_count * 8 (children) -> 32 to 288 bytes
 
     The hash trie is used in a persistent manner - each modifications return a new root-node
-    with the path to the changed node re-allocated. The stored elements themselves are not
-    copied, only the references to them.
+    with the path to the changed node re-allocated. The keyvalues held in the nodes of the path are
+    copied, the rest are shared.
+
+    Integral keys of at most 32 bits with the default hash are their own hash and are not stored
+    with it. Their trie is indexed from the most significant bits of the key instead, so maps of
+    such keys iterate in key order (see PMapKeyValue).
 
     Each non-value type (i.e. that encompass more memory than just sizeof(T), std::string etc,
     stored in the map must have it's own implementation of the hash32 function.
@@ -886,7 +1686,7 @@ level  0     1     2     3     4     5   6
 
 template<class K>
 class AreEqual { public:
-    static bool compare(const K& k1, const K& k2){return k1 == k2;} 
+    static bool compare(const K& k1, const K& k2){return k1 == k2;}
 };
 
 template<class H>
@@ -894,363 +1694,341 @@ class MapHash { public:
     static uint32_t hash(const H& h){return get_hash32(h);}
 };
 
+/** True for integral types of at most 32 bits. K may be incomplete if it is not integral.*/
+template<class K, bool Integral = std::is_integral<K>::value>
+struct IsSmallInteger : std::false_type {};
+
+template<class K>
+struct IsSmallInteger<K, true> : std::integral_constant<bool, sizeof(K) <= sizeof(uint32_t)> {};
+
+/** Key-value pair of a PMapPool. The hash of the key is stored with it.*/
+template<class K, class V, class Compare, class HashFun,
+         bool IntegerKey = IsSmallInteger<K>::value && std::is_same<HashFun, MapHash<K>>::value>
+struct PMapKeyValue
+{
+    uint32_t hash; K first; V second;
+
+    static uint32_t hash_of(const K& key){return HashFun::hash(key);}
+    static PMapKeyValue make(uint32_t hash, const K& key, const V& value){PMapKeyValue kv = {hash, key, value}; return kv;}
+
+    /** Return the position of hash in a node at level. The root is indexed by the lowest bits.*/
+    static uint32_t position(uint32_t hash, uint32_t level){return (hash >> (level * 5)) & 0x1f;}
+
+    uint32_t key_hash() const {return hash;}
+    void set_hash(uint32_t h){hash = h;}
+    bool matches(const K& key, uint32_t h) const {return hash == h && Compare::compare(key, first);}
+};
+
+/** Key-value pair of a map with integral keys of at most 32 bits. The key is its own hash and is
+ *  not stored twice. The trie is indexed from the most significant bits, 2 at the root and 5 at
+ *  the other levels, so that it is ordered by key and nodes at the last level hold 32 consecutive keys.*/
+template<class K, class V, class Compare, class HashFun>
+struct PMapKeyValue<K, V, Compare, HashFun, true>
+{
+    K first; V second;
+
+    /** Return the key as unsigned with the sign bit flipped, so that negative keys come first.*/
+    static uint32_t hash_of(const K& key)
+    {
+        const uint32_t sign = std::is_signed<K>::value ? (1u << (sizeof(K) * 8 - 1)) : 0;
+        return uint32_t(key) ^ sign;
+    }
+
+    static PMapKeyValue make(uint32_t, const K& key, const V& value){PMapKeyValue kv = {key, value}; return kv;}
+
+    static uint32_t position(uint32_t hash, uint32_t level){return (hash >> (30 - level * 5)) & 0x1f;}
+
+    uint32_t key_hash() const {return hash_of(first);}
+    void set_hash(uint32_t){}
+    bool matches(const K& key, uint32_t) const {return Compare::compare(key, first);}
+};
+
 template<class K, class V, class Compare = AreEqual<K>, class HashFun = MapHash<K>>
 class PMapPool
 {
 public:
 
     /** Key-value pair. */
-    struct KeyValue{uint32_t hash; K first; V second;};
-   
-    static const V* keyvalue_match_get(const KeyValue& kv, const K& key, const uint32_t hash) 
+    typedef PMapKeyValue<K, V, Compare, HashFun> KeyValue;
+
+    static const V* keyvalue_match_get(const KeyValue& kv, const K& key, const uint32_t hash)
     {
-        if(kv.hash == hash && Compare::compare(key, kv.first))
+        if(kv.matches(key, hash))
             return &kv.second;
         else return 0;
     }
 
+    enum{BITS = 5, MASK = 0x1f, COLLISION_LEVEL = 7}; //> Nodes at COLLISION_LEVEL are collision nodes.
+
     /* Data structure types. */
-    
-    typedef          PListPool<const KeyValue*>       KeyValueListPool;
-    typedef typename PListPool<const KeyValue*>::List KeyValueList;
 
-    struct RefCell;
+    typedef std::vector<KeyValue> KeyValueList;
 
     struct Node
     {
-        struct Ref
-        {
-            Node* node;
-            Node& operator*(){return *node;}
-            Node& operator->(){return *node;}
-        };
+        enum{COLLISION = 0xffffffffu}; //> datamap and nodemap of a collision node.
 
-        enum NodeType{EmptyNode, ValueNode, CollisionNode};
+        uint32_t  datamap;  //> Positions holding keyvalues or COLLISION.
+        uint32_t  nodemap;  //> Positions holding children or COLLISION.
+        RootCount refs;     //> Handles to the map rooted at this node.
+        uint32_t  edit;     //> Id of the transient that may edit the node in place or 0.
 
-        uint32_t used;
-        Ref*     child_array; //> Pointer to an allocated child sequence
-       
-        /** For ValueNodes the keyvalue field is referenced. For
-         *  CollisionNodes the collision_list field is referenced. */ 
         union
         {
-            const KeyValue*     keyvalue;
-            KeyValueList* collision_list; 
-            //Before end of the trie tree hash collisions are just proapagated downwards.
-            //The collided elements are always only keyvalues.
-        }value;
+            KeyValue*     data;       //> Keyvalues in position order.
+            KeyValueList* collisions; //> Keyvalues of a collision node.
+        };
 
-        NodeType type; 
+        Node**    children; //> Children in position order.
 
-        Node():used(0), child_array(0){}
+        Node():datamap(0), nodemap(0), edit(0), data(0), children(0){}
 
         ~Node()
         {
-            if(type == CollisionNode && value.collision_list) delete value.collision_list;
+            if(is_collision()) delete collisions;
         }
 
-        /** Return number of elements stored */
-        size_t size(){ return count_bits(used);}
+        bool is_collision() const {return (datamap & nodemap) != 0;}
 
-        /** Return pointer to hash value if type is not EmptyNode */
-        const uint32_t* hash_value()
-        {
-            const uint32_t* result = 0;
-            if(type == CollisionNode)
-            {
-                typename KeyValueList::iterator kvi = value.collision_list->begin();
-                const KeyValue* kv(*kvi.data_ptr());
-                result = &(kv->hash);
+        /** Return number of keyvalues stored in the node */
+        uint32_t data_count() const {return is_collision() ? uint32_t(collisions->size()) : count_bits64(datamap);}
 
-            }
-            else if(type == ValueNode)
-            {
-                result = &(value.keyvalue->hash);
-            }
-            return result;
-        }
+        /** Return number of children */
+        uint32_t child_count() const {return is_collision() ? 0 : count_bits64(nodemap);}
 
-        /** Return true if the index signified by the index is used.*/
-        bool index_in_use(uint32_t index){return bit_is_on(used, index);}
+        KeyValue* entries() const {return is_collision() ? &(*collisions)[0] : data;}
 
-        /** Return index matching the bitfield. The bitfield must reflect an actually used bit.*/
-        uint32_t index(uint32_t bitfield){return count_bits(used & (bitfield - 1));}
+        /** Return index in the array of map corresponding to position bit.*/
+        static uint32_t index(uint32_t map, uint32_t bit){return count_bits64(map & (bit - 1));}
+    };
 
-        /** Return element corresponding to the hash-key.*/
-        Node* get_child_by_fieldindex(uint32_t parsed_index)
-        {
-            if(index_in_use(parsed_index))
-            {
-                uint32_t child_index = index(1 << parsed_index);
-                return child_array[child_index].node;
-            }
-            else
-            {
-                return 0;
-            }
-        }
+    static uint32_t position_bit(uint32_t hash, uint32_t level){return 1u << KeyValue::position(hash, level);}
 
-        Node* get_child_by_hash_and_depth(const uint32_t hash, const uint32_t depth)
+    /** Return the value of key in the trie at node or null. node is at the given level of the trie.*/
+    static const V* find(const Node* node, const K& key, const uint32_t hash, uint32_t level = 0)
+    {
+        for(; level < COLLISION_LEVEL; ++level)
         {
-            return get_child_by_fieldindex((hash >> (depth * 5)) & 0x1f);
+            uint32_t bit = position_bit(hash, level);
+            if(node->datamap & bit) return keyvalue_match_get(node->data[Node::index(node->datamap, bit)], key, hash);
+            if(!(node->nodemap & bit)) return 0;
+            node = node->children[Node::index(node->nodemap, bit)];
         }
 
-        /** Return reference matching the bit pattern or null if array is not large enough.*/
-        Ref* get(uint32_t key, uint32_t level)
+        for(auto i = node->collisions->begin(); i != node->collisions->end(); ++i)
         {
-            Ref* result = 0;
-            uint32_t local_index = (key >> (level*5)) & 0x1f;
-            uint32_t child_index = index(1 << local_index);
-            if(child_index < size()) result = child_array + child_index;
-            return result;
+            const V* v = keyvalue_match_get(*i, key, hash);
+            if(v) return v;
         }
+        return 0;
+    }
 
-        Ref* begin(){return child_array;}
-        Ref* end(){return child_array + size();}
-    };
+    typedef Chunk<KeyValue>  keyvalue_chunk;
+    typedef Chunk<Node>      node_chunk;
+    typedef Chunk<Node*>     ref_chunk;
 
-    static bool node_has_children(Node* n) {return n->child_array != 0;}
-    static bool node_has_keyvalues(Node* n) {return n->type != Node::EmptyNode;}
+    typedef ChunkBox<KeyValue>  keyvalue_chunk_box;
+    typedef ChunkBox<Node>      node_chunk_box;
+    typedef ChunkBox<Node*>     ref_chunk_box;
 
-    /**
-     * Iterator for the values in one node.
-     */
-    struct NodeValueIterator
+
+    // Unordered iterator to map nodes
+    //
+    // The purpose is to support stl -like iteration.
+    class node_iterator
     {
-        Node* node;
-        typename KeyValueList::iterator iter;
-        typename KeyValueList::iterator end;
-        
-        const KeyValue* keyvalue;
-        bool      iteration_ongoing;
+        // Depth first in the order of the positions in each node, so that maps of integral
+        // keys are iterated in key order.
+        struct Position
+        {
+            const Node* node;
+            uint32_t    positions;   //> Positions not yet visited.
+            uint32_t    data_index;
+            uint32_t    child_index;
+        };
 
+        Position        stack_[COLLISION_LEVEL + 1];
+        uint32_t        depth_;
+        const KeyValue* current;
 
-        NodeValueIterator():node(0), keyvalue(0), iteration_ongoing(false){}
+        public:
 
-        NodeValueIterator(Node* node_in):node(node_in), keyvalue(0), iteration_ongoing(false)
+        node_iterator(const Node* node):depth_(0), current(0)
         {
-            if(node->type == Node::CollisionNode) end = node->value.collision_list->end();
+            if(node)
+            {
+                push(node);
+                advance();
+            }
         }
 
-        /** Returns true as long as the iterator is ongoing. Once the iteration is complete
-         *  the internal reference to keyvalue is in undefined state. */
-        bool move_next()
+        void push(const Node* node)
         {
-            bool result = false;
-            switch(node->type)
+            Position& p = stack_[depth_++];
+            p.node = node;
+            p.positions = node->is_collision() ? 0 : node->datamap | node->nodemap;
+            p.data_index = 0;
+            p.child_index = 0;
+        }
+
+        void advance()
+        {
+            while(depth_ > 0)
             {
-                case Node::ValueNode:
+                Position& p = stack_[depth_ - 1];
+                if(p.node->is_collision() && p.data_index < p.node->collisions->size())
                 {
-                    if(!keyvalue)
-                    {
-                        // Can visit the only value only once.
-                        keyvalue = node->value.keyvalue;
-                        result = true;
-                    }
-                    break;
+                    current = &(*p.node->collisions)[p.data_index++];
+                    return;
                 }
-                case Node::CollisionNode:
+                if(p.positions)
                 {
-                    if(iteration_ongoing)
-                    {
-                        ++iter;
-                        if(iter != end)
-                        {
-                            keyvalue = *iter;
-                            result = true;
-                        }
-                    }
-                    else
+                    uint32_t bit = p.positions & (~p.positions + 1);
+                    p.positions &= p.positions - 1;
+                    if(p.node->datamap & bit)
                     {
-                        iteration_ongoing = true;
-                        // The list has at least two elements. No need to check for nil head.
-                        iter = node->value.collision_list->begin();
-                        keyvalue = *iter;
-                        result = true;
+                        current = p.node->data + p.data_index++;
+                        return;
                     }
-                    break;
+                    push(p.node->children[p.child_index++]);
+                }
+                else
+                {
+                    --depth_;
                 }
-                case Node::EmptyNode:
-                default:
-                    break;
             }
-            return result;
+            // Stack emtpy, nothing left to do - terminate iteration.
+            current = 0;
         }
 
-        const KeyValue* current() const {return keyvalue;}
-    };
-
-    // Itearator for children inside node.
-    struct NodeChildIterator
-    {
-        Node* node;
-        typename Node::Ref* iter;  
-        typename Node::Ref* end;  
-        bool iterating;
-        bool node_has_children;
-
-        NodeChildIterator(Node* node_in):node(node_in), iterating(false), node_has_children(false)
-        {
-            end = node->end();
-            if(node_in->size() > 0) node_has_children = true;
-        }
-
-        bool move_next()
-        {
-            if(!node_has_children) return false;
-
-            bool result = false;
-            if(iterating) 
-            {
-                iter++;
-            }
-            else
-            {
-                iter = node->begin();
-                iterating = true;
-            }
-
-            if(iter != end) result = true;
-
-            return result;
-        }
+        void operator++(){advance();}
 
-        Node* current(){return iter->node;}
+        bool operator==(const node_iterator& i) const {return current == i.current;}
+        bool operator!=(const node_iterator& i) const {return current != i.current;}
+        const KeyValue* data_ptr() const {return current;}
+        const KeyValue& operator*() const {return *current;}
+        const KeyValue* operator->() const {return current;}
     };
-    
-    typedef Chunk<KeyValue>  keyvalue_chunk;
-    typedef Chunk<Node>      node_chunk;
-    typedef Chunk<typename Node::Ref> ref_chunk;
-
-    typedef ChunkBox<KeyValue>  keyvalue_chunk_box;
-    typedef ChunkBox<Node>      node_chunk_box;
-    typedef ChunkBox<typename Node::Ref> ref_chunk_box;
-
-    typedef std::unordered_map<Node*, int> refcount_map;
 
-    // Unordered iterator to map nodes
-    //
-    // The purpose is to support stl -like iteration.
-    class node_iterator
+    /** Call visit(key, old_value, new_value) for each key whose value differs between the tries
+     *  at a and b. old_value is null for keys only in b and new_value for keys only in a. Subtrees
+     *  shared by the tries are skipped, so the cost is proportional to the size of the change.*/
+    template<class F>
+    static void diff_nodes(const Node* a, const Node* b, uint32_t level, F& visit)
     {
-        // Use stack of node child iterators to keep track of state.
-        // Algorithm:
-        //  i)  Go to the leftmost node foundable
-        //  ii) iterate it's values
-        //  ii) go to node sibling, 
-        
-        FixedStack<NodeChildIterator, 8> iter_stack; //Max tree depth is 7 plus root.
-        NodeValueIterator value_iter;
-
-        const KeyValue* current;
+        if(a == b) return;
 
-#define CURRENT_NODE iter_stack.top()->current()
-
-        // For each node:
-        // Iterate over each value in array. If value is a node, go into node.
-        public:
-
-        node_iterator(Node* node):current(0)
+        if(!a || !b)
         {
-            if(node && node_has_children(node))
+            for(node_iterator i(a ? a : b); i != node_iterator(0); ++i)
             {
-                push_node(node);
+                if(a) visit(i->first, &i->second, (const V*) 0);
+                else  visit(i->first, (const V*) 0, &i->second);
             }
+            return;
         }
 
-        // Latch onto the children of the node - make sure the node has children prior to pushing it
-        void push_node(Node* parent_node)
+        if(level == COLLISION_LEVEL)
         {
-            iter_stack.push(NodeChildIterator(parent_node));
-            NodeChildIterator* ni = iter_stack.top();
-            ni->move_next(); // Must succeed as node has children - now have a valid node
-
-            Node* node = ni->current();
-            if(node_has_keyvalues(node))
+            for(auto i = a->collisions->begin(); i != a->collisions->end(); ++i) diff_entry(*i, find(b, i->first, i->key_hash(), level), visit);
+            for(auto i = b->collisions->begin(); i != b->collisions->end(); ++i)
             {
-                value_iter = NodeValueIterator(node);
-                advance(); // Move value_iter to valid value
-            }
-            else
-            {
-                // Push until a node with values is found.
-                push_node(node);
+                if(!find(a, i->first, i->key_hash(), level)) visit(i->first, (const V*) 0, &i->second);
             }
+            return;
         }
 
-        void advance()
+        uint32_t positions = a->datamap | a->nodemap | b->datamap | b->nodemap;
+
+        while(positions)
         {
-            if(value_iter.move_next())
-            {
-                current = value_iter.current();
-            }
-            else
+            uint32_t bit = positions & (~positions + 1);
+            positions &= positions - 1;
+
+            const KeyValue* data_a = (a->datamap & bit) ? &a->data[Node::index(a->datamap, bit)] : 0;
+            const KeyValue* data_b = (b->datamap & bit) ? &b->data[Node::index(b->datamap, bit)] : 0;
+            const Node* child_a = (a->nodemap & bit) ? a->children[Node::index(a->nodemap, bit)] : 0;
+            const Node* child_b = (b->nodemap & bit) ? b->children[Node::index(b->nodemap, bit)] : 0;
+
+            if(data_a && data_b)
             {
-                NodeChildIterator* ni = iter_stack.top();
-                Node* node =ni->current();
-                // Ran out of values - find next node.
-                if(node_has_children(node))
+                if(data_b->matches(data_a->first, data_a->key_hash()))
                 {
-                    push_node(node);
+                    diff_entry(*data_a, &data_b->second, visit);
                 }
                 else
                 {
-                    // Move to next sibling node or if none left pop.
-                    if(ni->move_next())
-                    {
-                        Node* next_node = ni->current();
-                        value_iter = NodeValueIterator(next_node);
-                        advance(); // Move value_iter to valid value
-                    }
-                    else
-                    {
-                        // No siblings left - pop stack
-                        pop();
-                    }
+                    visit(data_a->first, &data_a->second, (const V*) 0);
+                    visit(data_b->first, (const V*) 0, &data_b->second);
                 }
             }
-        }
-
-        void pop()
-        {
-            iter_stack.pop();
-
-            if(iter_stack.depth() > 0)
+            else if(data_a)
             {
-                NodeChildIterator* ni = iter_stack.top();
-                if(ni->move_next())
+                // The entry of a may have been pushed down to the subtree of b.
+                diff_entry(*data_a, child_b ? find(child_b, data_a->first, data_a->key_hash(), level + 1) : 0, visit);
+                for(node_iterator i(child_b); i != node_iterator(0); ++i)
                 {
-                    Node* node = ni->current();
-                    if(node_has_keyvalues(node))
-                    {
-                        value_iter = NodeValueIterator(node);
-                        advance();
-                    }
-                    else
-                    {
-                        push_node(node);
-                    }
+                    if(!i->matches(data_a->first, data_a->key_hash())) visit(i->first, (const V*) 0, &i->second);
                 }
-                else
+            }
+            else if(data_b)
+            {
+                for(node_iterator i(child_a); i != node_iterator(0); ++i)
                 {
-                    pop();
+                    if(i->matches(data_b->first, data_b->key_hash())) diff_entry(*i, &data_b->second, visit);
+                    else visit(i->first, &i->second, (const V*) 0);
                 }
+                if(!(child_a && find(child_a, data_b->first, data_b->key_hash(), level + 1))) visit(data_b->first, (const V*) 0, &data_b->second);
             }
             else
             {
-                // Stack emtpy, nothing left to do - terminate iteration.
-                current = 0;
+                diff_nodes(child_a, child_b, level + 1, visit);
             }
         }
+    }
 
-        void operator++(){advance();}
+    /** Visit the entry kv of the old trie if the value in the new one is missing or different.*/
+    template<class F>
+    static void diff_entry(const KeyValue& kv, const V* new_value, F& visit)
+    {
+        if(!new_value) visit(kv.first, &kv.second, (const V*) 0);
+        else if(!(kv.second == *new_value)) visit(kv.first, &kv.second, new_value);
+    }
 
-        bool operator==(const node_iterator& i){return current == i.current;}
-        bool operator!=(const node_iterator& i){return current != i.current;}
-        const KeyValue* data_ptr(){return current;}
-        const KeyValue& operator*(){return *current;}
-        const KeyValue* operator->(){return current;}
-    };
+    /** Return true if the tries at a and b hold the same keyvalues. Tries are kept canonical, so
+     *  equal tries have equal node maps and the comparison stops at subtrees shared by both.*/
+    static bool equal_nodes(const Node* a, const Node* b)
+    {
+        if(a == b) return true;
+        if(!a || !b) return false;
+        if(a->datamap != b->datamap || a->nodemap != b->nodemap) return false;
+
+        if(a->is_collision())
+        {
+            if(a->collisions->size() != b->collisions->size()) return false;
+            for(auto i = a->collisions->begin(); i != a->collisions->end(); ++i)
+            {
+                const V* v = find(b, i->first, i->key_hash(), COLLISION_LEVEL);
+                if(!(v && *v == i->second)) return false;
+            }
+            return true;
+        }
+
+        for(uint32_t i = 0, count = a->data_count(); i < count; ++i)
+        {
+            const KeyValue& kva = a->data[i];
+            const KeyValue& kvb = b->data[i];
+            if(!(kvb.matches(kva.first, kva.key_hash()) && kva.second == kvb.second)) return false;
+        }
+
+        for(uint32_t i = 0, count = a->child_count(); i < count; ++i)
+        {
+            if(!equal_nodes(a->children[i], b->children[i])) return false;
+        }
+        return true;
+    }
+
+    class Transient;
 
     /** The map class.*/
     class Map
@@ -1289,7 +2067,7 @@ public:
                 if(root_) pool_.remove_ref(root_);
                 pool_ = map.pool_;
                 root_ = map.root_;
-                pool_.add_ref(root_);
+                if(root_) pool_.add_ref(root_);
             }
             return *this;
         }
@@ -1312,46 +2090,13 @@ public:
             if(root_) pool_.add_ref(root_);
         }
 
+        /** Mark the map reachable in the running incremental collection.*/
+        void shade() const {pool_.shade(root_);}
+
         ConstOption<V> try_get_value(const K& key) const
         {
             if(!root_) return ConstOption<V>(0);
-
-            uint32_t hash = HashFun::hash(key);
-            uint32_t level = 0; 
-            const V* result = 0;
-            Node* current = root_;
-
-            for(;level < 8; level++) 
-            {
-                Node* n = current->get_child_by_hash_and_depth(hash, level);
-                if(n)
-                {     
-                    if(n->type == Node::ValueNode)
-                    {
-                        result = keyvalue_match_get(*n->value.keyvalue, key, hash);
-                    }
-                    else if (n->type == Node::CollisionNode)
-                    {
-                        typename KeyValueList::iterator i = n->value.collision_list->begin();
-                        typename KeyValueList::iterator end = n->value.collision_list->end();
-                        for(;i != end && (result == 0); ++i)
-                        {
-                            result = keyvalue_match_get(**i, key, hash);
-                        }
-                    }
-
-                    if(result) break;
-
-                    current = n; // Just move on if match not found.
-                }
-                else
-                {
-                    // Trie path ran out. No value.
-                    break;
-                }
-            }
-
-            return ConstOption<V>(result);
+            return ConstOption<V>(find(root_, key, KeyValue::hash_of(key)));
         }
 
         /** Rewrite value held in existing key. In most instances avoid this if possible. */
@@ -1368,7 +2113,11 @@ public:
             return result;
         }
 
-        // TODO: template<class T> Map.add_seq keyvalue-pair list - add sequence of pairs in one update
+        /** Return a builder that adds to this map in place. */
+        Transient transient() const
+        {
+            return Transient(pool_, root_);
+        }
 
         // TODO: map_add_diff -> map -> value -> diff that implements the element add operator
         // on a map and also returns a diff between the two versions of the maps.
@@ -1391,84 +2140,14 @@ public:
         /** Remove key entry from map.*/
         Map remove(const K& key)
         {
-            if(try_get_value(key).is_valid())
-            {
-                // Remove root and branch containing the removed value. Collect all keyvalues not equal to missing key.
-                std::list<const KeyValue*> kept_keys;
-
-                Node* root = root_;
-                Node* new_root = pool_.new_node();
-
-                // Copy values first from old root to new as is.
-                *new_root = *root;
-
-                uint32_t hash = HashFun::hash(key);
-                Node* removed_branch = root_->get_child_by_hash_and_depth(hash, 0);
-
-                // Have to collect the keyvalue from node separately.
-                NodeValueIterator node_val_iter(removed_branch);
-                while(node_val_iter.move_next())
-                {
-                    const KeyValue* current = node_val_iter.current();
-                    if(! keyvalue_match_get(*current, key, hash)) 
-                    {
-                        kept_keys.push_back(current);
-                    }
-                }
-
-                // Visit the branch containing the keyvalue and collect all keyvalues except the one to remove.
-                node_iterator iter(removed_branch);
-                node_iterator end(0);
-
-                for(;iter != end; ++iter)
-                {
-                    const KeyValue* current = iter.data_ptr();
-                    if(! keyvalue_match_get(*current, key, hash)) 
-                    {
-                        kept_keys.push_back(current);
-                    }
-                }
-
-                // Remove the branch holding the sought out keyvalue from the new_root.
-                size_t old_size = new_root->size();
-                size_t new_size = old_size - 1;
-
-                if(new_size > 0)
-                {
-                    uint32_t invalid_index = (hash) & 0x1f;
-                    new_root->used = set_bit_off(new_root->used, invalid_index);
-
-                    typename Node::Ref* new_child_array = pool_.ref_chunks_.reserve_consecutive_elements(new_size);
-                    new_root->child_array = new_child_array;
-                    size_t i = 0;
-                    size_t child_index = 0;
-                    for(i = 0; i < old_size; ++i)
-                    {
-                        if(root_->child_array[i].node != removed_branch) new_child_array[child_index++] = root_->child_array[i];
-                    }
-                }
-                else
-                {
-                    new_root->used = 0;
-                    new_root->child_array = 0;
-                }
-
-                // Init new map root and child array - add the kept keyvalues from the removed branch.
-
-                Map out_map(pool_, new_root);
-
-                for(auto i = kept_keys.begin(); i != kept_keys.end(); ++i)
-                {
-                    out_map = pool_.add(out_map, *i);
-                }
-
-                return out_map;
-            }
-            else
+            uint32_t hash = KeyValue::hash_of(key);
+            if(!root_ || !find(root_, key, hash))
             {
                 // Nothing to remove, just return a new instance of the current map.
                 return *this;
             }
+
+            return Map(pool_, pool_.remove_path(root_, key, hash, 0));
         }
 
         // Run garbage collector on the root pool.
@@ -1476,17 +2155,38 @@ public:
 
         iterator begin() const {return iterator(root_);}
         iterator end() const {return iterator(0);}
-      
+
         bool operator==(const Map& m) const
         {
-            iterator i = begin(), last = end();
-            while(i != last)
+            return equal_nodes(root_, m.root_);
+        }
+
+        /** Call visit(key, old_value, new_value) for each key added, removed or changed in map to.
+         *  old_value is null for added keys and new_value for removed ones. Subtrees shared with
+         *  to are skipped. */
+        template<class F>
+        void diff(const Map& to, F visit) const
+        {
+            diff_nodes(root_, to.root_, 0, visit);
+        }
+
+        /** Return the union of this map and m. A key in both maps with different values gets the
+         *  value resolve(key, value, value_in_m). Subtrees shared with m are skipped. */
+        template<class F>
+        Map merge(const Map& m, F resolve) const
+        {
+            if(!m.root_) return *this;
+            if(!root_) return m;
+
+            Transient t(pool_, root_);
+            auto add_change = [&](const K& key, const V* value, const V* value_in_m)
             {
-                ConstOption<V> opt = m.try_get_value(i->first);
-                if(! (opt.is_valid() && (*opt) == i->second)) return false;
-                ++i;
-            }
-            return true;
+                if(!value_in_m) return; // Keys only in this map are kept.
+                if(value) t.add(key, resolve(key, *value, *value_in_m));
+                else      t.add(key, *value_in_m);
+            };
+            diff(m, add_change);
+            return t.persistent();
         }
 
         const size_t size() const
@@ -1501,15 +2201,89 @@ public:
         Node* root_;
     };
 
+    /** Mutable builder of a map. Nodes the transient has copied or created are owned by it and
+     *  edited in place by later additions. persistent() returns the map built in constant time;
+     *  additions after it copy the nodes shared with the returned map again. */
+    class Transient
+    {
+    public:
+        Transient(PMapPool& pool, Node* root):pool_(pool), root_(root), edit_(pool.new_edit_id())
+        {
+            if(root_) pool_.add_ref(root_);
+        }
+
+        Transient(Transient&& t):pool_(t.pool_), root_(t.root_), edit_(t.edit_)
+        {
+            t.root_ = 0;
+        }
+
+        ~Transient()
+        {
+            if(root_) pool_.remove_ref(root_);
+        }
+
+        /** Add key and value.*/
+        Transient& add(const K& key, const V& value)
+        {
+            set_root(pool_.insert(root_, key, value, edit_));
+            return *this;
+        }
+
+        /** Add keys and values from alternating elements of the range. */
+        template<class KVI>
+        Transient& add(KVI i_elems, KVI elems_end)
+        {
+            while(i_elems != elems_end)
+            {
+                KVI first = i_elems;
+                ++i_elems;
+                if(i_elems == elems_end) break;
+                add(*first, *i_elems);
+                ++i_elems;
+            }
+            return *this;
+        }
+
+        /** Return the map built so far.*/
+        Map persistent()
+        {
+            Map m(pool_, root_);
+            edit_ = pool_.new_edit_id();
+            return m;
+        }
+
+    private:
+        Transient(const Transient&);
+        Transient& operator=(const Transient&);
+
+        void set_root(Node* root)
+        {
+            if(root == root_) return;
+            pool_.add_ref(root);
+            if(root_) pool_.remove_ref(root_);
+            root_ = root;
+        }
+
+        PMapPool& pool_;
+        Node*     root_;
+        uint32_t  edit_;
+    };
+
     /** Recycle all memory. */
     void kill()
     {
         // Must call destructor on all used cells.
         // TODO: Should this be the responsibility of individual containers?
-        ref_count_.clear();
+        roots_.clear();
+        keyvalue_chunks_.keep_slabs();
+        node_chunks_.keep_slabs();
+        ref_chunks_.keep_slabs();
         gc();
     }
 
+    PMapPool():phase_(GC_IDLE), gc_thread_count_(default_gc_thread_count()), gc_min_chunks_(PARALLEL_GC_MIN_CHUNKS),
+               build_thread_count_(1), build_min_size_(PARALLEL_BUILD_MIN_SIZE), edit_count_(0){}
+
     ~PMapPool()
     {
         kill();
@@ -1518,339 +2292,693 @@ public:
     /** Remove reference to node */
     void remove_ref(Node* n)
     {
-        int* ref_count = try_get_value(ref_count_, n);
-        if(ref_count && (*ref_count > 0)) --(*ref_count);
+        roots_.remove_ref(n);
     }
 
-    /** Add reference to node*/
+    /** Add reference to node. Also the write barrier of the incremental collection.*/
     void add_ref(Node* n)
     {
-        if(has_key(ref_count_, n)) ref_count_[n]++;
-        else ref_count_[n] = 1;
+        shade(n);
+        roots_.add_ref(n);
     }
 
     /** Clear refcounts. Warning: use only if you know what you are doing. */
     void clear_root_refcounts()
     {
-        ref_count_.clear();
+        roots_.clear_counts();
+    }
+
+    /** Start an incremental collection. Roots are given to shade(). While marking, add_ref
+     *  shades each root it is given: all handles are made through it, so this is the
+     *  write barrier for Map::add, Map::remove and try_replace_value (through the copied value). */
+    void begin_incremental()
+    {
+        keyvalue_chunks_.mark_all_empty();
+        node_chunks_.mark_all_empty();
+        ref_chunks_.mark_all_empty();
+        gray_.clear();
+        regray_.clear();
+        phase_ = GC_MARK;
+
+        // Nodes referenced by handles are roots as well.
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) shade(*r);
+    }
+
+    /** Add node to the nodes to mark if marking is in progress.*/
+    void shade(Node* n){if(n && phase_ == GC_MARK) gray_.push_back(n);}
+
+    /** Mark at most budget nodes reachable from the shaded ones. visit is called with the
+     *  key and the value of each keyvalue marked. Return the number of nodes marked.*/
+    template<class F>
+    size_t mark_step(size_t budget, F& visit)
+    {
+        size_t work = 0;
+        while(work < budget && !(gray_.empty() && regray_.empty()))
+        {
+            Node* node;
+            if(!regray_.empty())
+            {
+                node = regray_.back();
+                regray_.pop_back();
+                node_chunks_.mark(node);
+            }
+            else
+            {
+                node = gray_.back();
+                gray_.pop_back();
+                if(!node_chunks_.mark(node)) continue;
+            }
+            ++work;
+
+            mark_arrays(node);
+
+            const KeyValue* kv = node->entries();
+            for(uint32_t i = 0, count = node->data_count(); i < count; ++i)
+            {
+                visit(kv[i].first);
+                visit(kv[i].second);
+            }
+
+            for(uint32_t i = 0, count = node->child_count(); i < count; ++i) gray_.push_back(node->children[i]);
+        }
+        return work;
+    }
+
+    bool marking_done() const {return gray_.empty() && regray_.empty();}
+
+    /** Scan node again if marking is in progress. A transient that edits a node in place calls
+     *  this so that children added to a node already marked are marked as well.*/
+    void regray(Node* n){if(phase_ == GC_MARK) regray_.push_back(n);}
+
+    /** Start freeing the nodes left unmarked.*/
+    void begin_sweep()
+    {
+        // Unreferenced roots may be freed by the sweep.
+        roots_.prune();
+        keyvalue_chunks_.begin_sweep();
+        node_chunks_.begin_sweep();
+        ref_chunks_.begin_sweep();
+        phase_ = GC_SWEEP;
+    }
+
+    /** Free unmarked slots in at most chunk_budget chunks. Return true when the collection is complete.*/
+    bool sweep_step(size_t& chunk_budget)
+    {
+        if(!(keyvalue_chunks_.sweep_step(chunk_budget) &&
+             node_chunks_.sweep_step(chunk_budget) &&
+             ref_chunks_.sweep_step(chunk_budget))) return false;
+
+        phase_ = GC_IDLE;
+        return true;
     }
 
+    GcPhase gc_phase() const {return phase_;}
+
     /** Create new empty map */
     Map new_map()
     {
         Map m(*this, 0);
         return m;
     }
-    
+
     /** Create a copy from existing map. TODO: Remove this?*/
     template<class M>
     Map new_map(const M& map_in)
     {
-        Node* root = 0;
-
-        for(auto i = map_in.begin(); i != map_in.end(); ++i)
-        {
-            KeyValue* kv = new_keyvalue(i->first, i->second);
-            root = instantiate_tree_path(root, kv);
-        }
+        Transient t(*this, 0);
 
-        Map m(*this, root);
+        for(auto i = map_in.begin(); i != map_in.end(); ++i) t.add(i->first, i->second);
 
-        return m;
+        return t.persistent();
     }
 
     /** Create new map with one element*/
     Map new_map(const K& key, const V& value)
     {
-        KeyValue* kv = new_keyvalue(key, value);
-        Node* root = instantiate_tree_path(0, kv);
-
-        Map m(*this, root);
-        return m;
+        return Map(*this, insert(0, key, value));
     }
 
     /** Create a new map by adding an element to existing map*/
     Map add(const Map& old, const K& key, const V& value)
     {
-        KeyValue* kv = new_keyvalue(key, value);
-        Node* new_root = instantiate_tree_path(old.root_, kv);
-        return Map(*this, new_root);
+        return Map(*this, insert(old.root_, key, value));
     }
 
     /** Create a new map by adding an elements and values to an existing map*/
     template<class KI, class VI>
     Map add(const Map& old, KI i_key, KI key_end, VI i_value, VI value_end)
     {
-        Node* new_root = old.root_;
+        if(build_thread_count_ > 1)
+        {
+            std::vector<KeyValue> entries;
+            for(; i_key != key_end && i_value != value_end; ++i_key, ++i_value)
+            {
+                KeyValue kv = KeyValue::make(0, *i_key, *i_value);
+                entries.push_back(kv);
+            }
+            return add_entries(old, entries);
+        }
 
-        while((i_key != key_end) && 
+        Transient t(*this, old.root_);
+
+        while((i_key != key_end) &&
               (i_value != value_end))
         {
-            KeyValue* kv = new_keyvalue(*i_key, *i_value);
-
-            new_root = instantiate_tree_path(new_root, kv);
+            t.add(*i_key, *i_value);
 
             ++i_key;
             ++i_value;
         }
 
-        return Map(*this, new_root);
+        return t.persistent();
     }
 
-    /** Create a new map by adding an elements and values to an existing map. Usable in case key and 
+    /** Create a new map by adding an elements and values to an existing map. Usable in case key and
     *   value types are the same.*/
     template<class KVI>
     Map add(const Map& old, KVI i_elems, KVI elems_end)
     {
-        Node* new_root = old.root_;
-
-        KVI first;
-
-        while((i_elems != elems_end))
+        if(build_thread_count_ > 1)
         {
-            first = i_elems;
-            ++i_elems;
-            if(i_elems != elems_end)
+            std::vector<KeyValue> entries;
+            while(i_elems != elems_end)
             {
-                KeyValue* kv = new_keyvalue(*first, *i_elems);
-                new_root = instantiate_tree_path(new_root, kv);
+                KVI first = i_elems;
+                ++i_elems;
+                if(i_elems == elems_end) break;
+                KeyValue kv = KeyValue::make(0, *first, *i_elems);
+                entries.push_back(kv);
+                ++i_elems;
             }
-            
-            ++i_elems;
+            return add_entries(old, entries);
         }
 
-        return Map(*this, new_root);
+        Transient t(*this, old.root_);
+        t.add(i_elems, elems_end);
+        return t.persistent();
     }
 
-    /** Create a new map by adding an allocated keyvalue instance to an existing map.*/
-    Map add(const Map& old, const KeyValue* keyvalue)
+    /** Create a new map by adding entries to an existing map. The hash of the entries is computed
+     *  here. Large inputs are built in parallel, see set_build_thread_count.*/
+    Map add_entries(const Map& old, std::vector<KeyValue>& entries)
     {
-        Node* new_root = instantiate_tree_path(old.root_, keyvalue);
-        return Map(*this, new_root);
+        return add_entries(old, entries, build_thread_count_);
     }
 
-    KeyValue* new_keyvalue(const K& k, const V& v)
+    /** As above, but inputs of at least the minimum build size are built by thread_count threads.
+     *  For callers that know the keys and values of these entries are safe to copy from several threads.*/
+    Map add_entries(const Map& old, std::vector<KeyValue>& entries, size_t thread_count)
     {
-        KeyValue* kv = keyvalue_chunks_.reserve_element();
-        kv->first  = k;
-        kv->second = v;
-        kv->hash   = HashFun::hash(k);
-        return kv;
+        if(entries.size() < build_min_size_ || thread_count < 2)
+        {
+            Transient t(*this, old.root_);
+            for(auto e = entries.begin(); e != entries.end(); ++e) t.add(e->first, e->second);
+            return t.persistent();
+        }
+
+        return Map(*this, insert_parallel(old.root_, entries, thread_count));
     }
 
-    /** Replace the existing reference array at node with a new array that has the newnode inserted at loc. */
-    void node_insert_replace_refarray(Node* parent, Node* newnode, const uint32_t local_index, const uint32_t child_level)
+    /** Set the number of threads used to build maps from ranges of at least min_size keys. Keys
+     *  and values are hashed and copied by several threads at once, which must be safe for K and V.*/
+    void set_build_thread_count(size_t count, size_t min_size = PARALLEL_BUILD_MIN_SIZE)
     {
-        size_t   old_count       = parent->size();
-        size_t   new_count       = old_count + 1;
-        uint32_t local_index_bit = 1 << local_index;
-
-        typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(new_count);
-        typename Node::Ref* old_children = parent->child_array;
+        build_thread_count_ = count > 0 ? count : 1;
+        build_min_size_ = min_size;
+    }
 
-        // Create new child array for current node and mark new index used.
-        parent->child_array = child_array;
-        parent->used |= local_index_bit;
+    /** Return an id not used by the other transients of the pool.*/
+    uint32_t new_edit_id()
+    {
+        if(++edit_count_ == 0) ++edit_count_; // 0 marks persistent nodes.
+        return edit_count_;
+    }
 
-        uint32_t array_index = parent->index(local_index_bit); 
-        // TODO: Check all child_array references that they use explicitly ref.
-        child_array[array_index].node = newnode;
+    /** Return node if it is owned by the transient edit, otherwise a copy of it. A copy made for a
+     *  transient gets its own arrays so that later additions can edit them in place. Copies made
+     *  for persistent updates share the arrays until they are changed.*/
+    Node* editable_node(Node* node, uint32_t edit)
+    {
+        if(edit && node->edit == edit)
+        {
+            regray(node);
+            return node;
+        }
 
-        auto child_ref = child_array + array_index;
+        Node* n = node_chunks_.reserve_element();
+        n->datamap = node->datamap;
+        n->nodemap = node->nodemap;
+        n->edit = edit;
+        n->children = node->children;
 
-        // Copy all other children to new places in new child array
-        for(auto oi = old_children; oi != old_children + old_count; ++oi)
+        if(node->is_collision())
+        {
+            // Collision lists are updated in place, so the copy must not share the list.
+            n->collisions = new KeyValueList(*node->collisions);
+        }
+        else
         {
-            const uint32_t* child_hash = oi->node->hash_value();
-            assert(child_hash);
-            auto ref = parent->get(*child_hash, child_level);
-            assert(ref != child_ref);
-            ref->node = oi->node;
+            n->data = node->data;
+            if(edit)
+            {
+                n->data = copy_data(node->data, node->data_count());
+                n->children = copy_children(node->children, node->child_count());
+            }
         }
+
+        return n;
     }
 
-    /** Create new nodes on map for the path for the given hash value
-     *  @param hash hash value in.
-     *  @returns RootValue for new tree
-     */
-    Node* instantiate_tree_path(const Node* old_root, const KeyValue* kv)
+    Node* new_node(uint32_t edit)
     {
-        Node* newroot = new_node();// This will be the root of the duplicate map.
+        Node* n = node_chunks_.reserve_element();
+        n->edit = edit;
+        return n;
+    }
 
-        if(old_root) *newroot = *old_root; // At first just copy children.
+    KeyValue* copy_data(const KeyValue* data, uint32_t count)
+    {
+        if(count == 0) return 0;
+        KeyValue* result = keyvalue_chunks_.reserve_consecutive_elements(count);
+        for(uint32_t i = 0; i < count; ++i) result[i] = data[i];
+        return result;
+    }
 
-        uint32_t level = 0;
-        uint32_t hash = kv->hash;
-        Node* current = newroot;
+    Node** copy_children(Node* const* children, uint32_t count)
+    {
+        if(count == 0) return 0;
+        Node** result = ref_chunks_.reserve_consecutive_elements(count);
+        unsafe_copy(children, children + count, result);
+        return result;
+    }
 
-        // Go all the way down once we find an empty node. Then assign it as the value.
-        for(;true;level++)
-        {
-            // Calculate the array index for this level of hash and the corresponding bit pattern.
-            uint32_t local_index = (hash >> (level*5)) & 0x1f; // |0-31|
+    /** Return the root of a trie with key set to value.
+     *  @param edit id of the transient owning the path or 0 to leave old_root unchanged.*/
+    Node* insert(Node* old_root, const K& key, const V& value, uint32_t edit = 0)
+    {
+        return insert_hashed(old_root, KeyValue::hash_of(key), key, value, edit);
+    }
 
-            if(! current->index_in_use(local_index))
-            {     
-                // Assign new node positioned at index
+    /** Return the root of a trie with key of the given hash set to value.*/
+    Node* insert_hashed(Node* old_root, uint32_t hash, const K& key, const V& value, uint32_t edit)
+    {
+        Node* root = old_root ? editable_node(old_root, edit) : new_node(edit);
+        Node* node = root;
 
-                Node* newnode = new_node(); // This node will contain the value.
-                newnode->type =  Node::ValueNode;
-                newnode->value.keyvalue = kv;
+        for(uint32_t level = 0; level < COLLISION_LEVEL; ++level)
+        {
+            uint32_t bit = position_bit(hash, level);
 
-                node_insert_replace_refarray(current, newnode, local_index, level);
+            if(node->datamap & bit)
+            {
+                uint32_t index = Node::index(node->datamap, bit);
+                KeyValue& kv = node->data[index];
 
-                break; 
+                if(kv.matches(key, hash))
+                {
+                    // Replace matching key
+                    if(!edit)
+                    {
+                        node->data = copy_data(node->data, node->data_count());
+                    }
+                    node->data[index].second = value;
+                }
+                else
+                {
+                    // Push both keyvalues down to a new child.
+                    Node* child = merge(kv, hash, key, value, level + 1, edit);
+                    data_to_child(node, bit, child);
+                }
+                return root;
+            }
+            else if(node->nodemap & bit)
+            {
+                uint32_t index = Node::index(node->nodemap, bit);
+                if(!edit)
+                {
+                    node->children = copy_children(node->children, node->child_count());
+                }
+                Node* child = editable_node(node->children[index], edit);
+                node->children[index] = child;
+                node = child;
             }
             else
             {
-                // Index was in use.
-
-                size_t count = current->size();
+                insert_data(node, bit, hash, key, value);
+                return root;
+            }
+        }
 
-                typename Node::Ref* child_array = ref_chunks_.reserve_consecutive_elements(count);
-                typename Node::Ref* old_children = current->child_array;
-                unsafe_copy(old_children, old_children + count, child_array);
+        // Ran out of levels. Replace existing value or append to the collision list.
+        for(auto i = node->collisions->begin(); i != node->collisions->end(); ++i)
+        {
+            if(keyvalue_match_get(*i, key, hash))
+            {
+                i->second = value;
+                return root;
+            }
+        }
 
-                current->child_array = child_array;
+        node->collisions->push_back(KeyValue::make(hash, key, value));
+        return root;
+    }
 
-                uint32_t array_index = current->index(1 << local_index); 
+    /** Return the root of the trie at old_root with entries added. The entries are partitioned by
+     *  their position in the root and the subtrie of each position is built by one of several
+     *  threads into a pool of its own. The pools are then moved to this one and the subtries placed
+     *  under a new root. A repeated key gets the value added last, as with sequential insertion.
+     *  The position is KeyValue::position at level 0: the lowest 5 bits of the hash for hashed
+     *  keys and the top bits for integer keys, since those are the bits the root is indexed by.*/
+    Node* insert_parallel(Node* old_root, std::vector<KeyValue>& entries, size_t thread_count)
+    {
+        enum{POSITIONS = 1 << BITS};
 
-                Node* newnode = new_node();
-                *newnode = *child_array[array_index].node;
-                child_array[array_index].node = newnode;
+        struct HashEntries
+        {
+            std::vector<KeyValue>& entries;
+            size_t                 group_size;
+            void operator()(size_t group)
+            {
+                size_t first = std::min(entries.size(), group * group_size);
+                size_t last = std::min(entries.size(), first + group_size);
+                for(size_t i = first; i < last; ++i) entries[i].set_hash(KeyValue::hash_of(entries[i].first));
+            }
+        } hash_entries = {entries, (entries.size() + thread_count - 1) / thread_count};
+        run_in_parallel(thread_count, hash_entries);
+
+        // Stable partition by position, so that later entries of a key replace earlier ones.
+        std::vector<uint32_t> offsets(POSITIONS + 1, 0);
+        for(auto e = entries.begin(); e != entries.end(); ++e) ++offsets[KeyValue::position(e->key_hash(), 0) + 1];
+        for(size_t i = 0; i < POSITIONS; ++i) offsets[i + 1] += offsets[i];
+        std::vector<uint32_t> order(entries.size());
+        {
+            std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+            for(uint32_t i = 0; i < entries.size(); ++i) order[next[KeyValue::position(entries[i].key_hash(), 0)]++] = i;
+        }
 
-                // No suitable slot found yet.
-                if(level < 6)
+        struct BuildSubtries
+        {
+            std::vector<std::unique_ptr<PMapPool>>& builders;
+            std::vector<uint32_t>&                  edits;
+            const std::vector<KeyValue>&            entries;
+            const std::vector<uint32_t>&            order;
+            const std::vector<uint32_t>&            offsets;
+            const Node*                             old_root;
+            Node**                                  roots;
+            std::atomic<uint32_t>                   next_position;
+
+            void operator()(size_t thread)
+            {
+                PMapPool& builder = *builders[thread];
+                uint32_t edit = edits[thread];
+                uint32_t position;
+                while((position = next_position++) < POSITIONS)
                 {
-                    // Check if node value matches. If they do, replace current. 
-                    const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
-                    if(v)
+                    if(offsets[position] == offsets[position + 1]) continue;
+
+                    // Start from the entry or the subtrie of the old root at the position.
+                    // Old nodes are copied to the builder before they are changed.
+                    uint32_t bit = 1u << position;
+                    Node* root = builder.new_node(edit);
+                    if(old_root && (old_root->datamap & bit))
+                    {
+                        root->datamap = bit;
+                        root->data = builder.copy_data(&old_root->data[Node::index(old_root->datamap, bit)], 1);
+                    }
+                    else if(old_root && (old_root->nodemap & bit))
                     {
-                        // Replace matching key
-                        newnode->value.keyvalue = kv;
-                        break;
+                        root->nodemap = bit;
+                        root->children = builder.copy_children(&old_root->children[Node::index(old_root->nodemap, bit)], 1);
                     }
 
-                    // If not matching key, just continue onwards.
-                    current = newnode;
-                }
-                else
-                {
-                    // Ran out of level. Need a collision list or replace existing value.
-                    // Need collision list.
-                    if(newnode->type == Node::CollisionNode)
+                    for(uint32_t i = offsets[position]; i < offsets[position + 1]; ++i)
                     {
-                        // Already have a list. First check if value exists, then just replace it.
-                        // Otherwise append to list.
+                        const KeyValue& kv = entries[order[i]];
+                        root = builder.insert_hashed(root, kv.key_hash(), kv.first, kv.second, edit);
+                    }
+                    roots[position] = root;
+                }
+            }
+        };
 
-                        const KeyValueList* oldlist = newnode->value.collision_list;
-                        typename KeyValueList::iterator i    = oldlist->begin();
-                        typename KeyValueList::iterator end  = oldlist->end();
+        // Builders get edit ids of this pool, so that the nodes they leave owned are not
+        // taken for nodes of the transients of this pool.
+        std::vector<std::unique_ptr<PMapPool>> builders;
+        std::vector<uint32_t> edits;
+        for(size_t i = 0; i < thread_count; ++i)
+        {
+            builders.emplace_back(new PMapPool());
+            edits.push_back(new_edit_id());
+        }
 
-                        bool replace = false;
-                        for(;i != end; ++i)
-                        {
-                            const KeyValue* ikv = *i;
-                            const V* v = keyvalue_match_get(*ikv, kv->first, hash);
-                            if(v)
-                            {
-                                replace = true;
-                                break;
-                            }
-                        }
+        Node* roots[POSITIONS] = {0};
+        BuildSubtries build = {builders, edits, entries, order, offsets, old_root, roots, {0}};
+        run_in_parallel(thread_count, build);
 
-                        if(replace)
-                        {
-                            KeyValueList tmp = oldlist->remove(i);
-                            *(newnode->value.collision_list) = tmp.add(kv);
-                        }
-                        else
-                        {
-                            *(newnode->value.collision_list) = oldlist->add(kv);
-                        }
-                    }
-                    else
-                    {
-                        // Replace single value with a list or replace existing value.
-                        const V* v = keyvalue_match_get(*newnode->value.keyvalue, kv->first, hash);
-                        if(v)
-                        {
-                            // Replace matching key
-                            newnode->value.keyvalue = kv;
-                            break;
-                        }
-                        else
-                        {
-                            //Need collision list
-                            newnode->type = Node::CollisionNode;
-                            const KeyValue* current_kv = newnode->value.keyvalue;
-                            newnode->value.collision_list = new KeyValueList(collided_list_pool_, 0);
-                            *(newnode->value.collision_list) = collided_list_pool_.new_list(current_kv, kv);
-                        }
-                    }
+        for(auto b = builders.begin(); b != builders.end(); ++b)
+        {
+            keyvalue_chunks_.adopt((*b)->keyvalue_chunks_);
+            node_chunks_.adopt((*b)->node_chunks_);
+            ref_chunks_.adopt((*b)->ref_chunks_);
+        }
 
-                    break;
-                }
+        // Place the new subtries and the untouched positions of the old root under a new root.
+        Node* root = new_node(0);
+        for(uint32_t position = 0; position < POSITIONS; ++position)
+        {
+            uint32_t bit = 1u << position;
+            const Node* from = roots[position] ? roots[position] : old_root;
+            if(from)
+            {
+                if(from->datamap & bit) root->datamap |= bit;
+                if(from->nodemap & bit) root->nodemap |= bit;
             }
         }
 
-        return newroot;
+        root->data = root->datamap ? keyvalue_chunks_.reserve_consecutive_elements(count_bits64(root->datamap)) : 0;
+        root->children = root->nodemap ? ref_chunks_.reserve_consecutive_elements(count_bits64(root->nodemap)) : 0;
+
+        for(uint32_t position = 0; position < POSITIONS; ++position)
+        {
+            uint32_t bit = 1u << position;
+            const Node* from = roots[position] ? roots[position] : old_root;
+            if(root->datamap & bit) root->data[Node::index(root->datamap, bit)] = from->data[Node::index(from->datamap, bit)];
+            if(root->nodemap & bit) root->children[Node::index(root->nodemap, bit)] = from->children[Node::index(from->nodemap, bit)];
+        }
+
+        return root;
     }
 
-    // TODO all absolutely non-member functions to static
-    void recursive_mark(Node* node)
+    /** Return a node holding keyvalue a and the new keyvalue at level.*/
+    Node* merge(const KeyValue& a, uint32_t hash, const K& key, const V& value, uint32_t level, uint32_t edit)
     {
-        node_chunks_.set_marked_if_contained(node); 
-        size_t size = node->size();
-        if(size > 0)
+        Node* n = new_node(edit);
+        KeyValue b = KeyValue::make(hash, key, value);
+
+        if(level == COLLISION_LEVEL)
         {
-            ref_chunks_.set_marked_if_contained_array(node->child_array, size);
+            n->datamap = n->nodemap = Node::COLLISION;
+            n->collisions = new KeyValueList();
+            n->collisions->push_back(a);
+            n->collisions->push_back(b);
+            return n;
         }
 
-        if(node->type == Node::ValueNode)
+        uint32_t bit_a = position_bit(a.key_hash(), level);
+        uint32_t bit_b = position_bit(hash, level);
+
+        if(bit_a == bit_b)
         {
-            keyvalue_chunks_.set_marked_if_contained(node->value.keyvalue);
+            n->nodemap = bit_a;
+            n->children = ref_chunks_.reserve_consecutive_elements(1);
+            n->children[0] = merge(a, hash, key, value, level + 1, edit);
         }
-        else if(node->type == Node::CollisionNode)
+        else
+        {
+            n->datamap = bit_a | bit_b;
+            n->data = keyvalue_chunks_.reserve_consecutive_elements(2);
+            n->data[bit_a < bit_b ? 0 : 1] = a;
+            n->data[bit_a < bit_b ? 1 : 0] = b;
+        }
+        return n;
+    }
+
+    /** Add keyvalue to node at the empty position bit.*/
+    void insert_data(Node* node, uint32_t bit, uint32_t hash, const K& key, const V& value)
+    {
+        uint32_t count = node->data_count();
+        uint32_t index = Node::index(node->datamap, bit);
+
+        KeyValue* data = keyvalue_chunks_.reserve_consecutive_elements(count + 1);
+        for(uint32_t i = 0; i < index; ++i) data[i] = node->data[i];
+        data[index] = KeyValue::make(hash, key, value);
+        for(uint32_t i = index; i < count; ++i) data[i + 1] = node->data[i];
+
+        node->data = data;
+        node->datamap |= bit;
+    }
+
+    /** Replace the keyvalue at position bit with child.*/
+    void data_to_child(Node* node, uint32_t bit, Node* child)
+    {
+        uint32_t data_count = node->data_count();
+        uint32_t data_index = Node::index(node->datamap, bit);
+        KeyValue* data = data_count > 1 ? keyvalue_chunks_.reserve_consecutive_elements(data_count - 1) : 0;
+        for(uint32_t i = 0, j = 0; i < data_count; ++i) if(i != data_index) data[j++] = node->data[i];
+
+        uint32_t child_count = node->child_count();
+        uint32_t child_index = Node::index(node->nodemap, bit);
+        Node** children = ref_chunks_.reserve_consecutive_elements(child_count + 1);
+        for(uint32_t i = 0; i < child_index; ++i) children[i] = node->children[i];
+        children[child_index] = child;
+        for(uint32_t i = child_index; i < child_count; ++i) children[i + 1] = node->children[i];
+
+        node->data = data;
+        node->children = children;
+        node->datamap &= ~bit;
+        node->nodemap |= bit;
+    }
+
+    /** Replace the child at position bit with keyvalue.*/
+    void child_to_data(Node* node, uint32_t bit, const KeyValue& kv)
+    {
+        uint32_t child_count = node->child_count();
+        uint32_t child_index = Node::index(node->nodemap, bit);
+        Node** children = child_count > 1 ? ref_chunks_.reserve_consecutive_elements(child_count - 1) : 0;
+        for(uint32_t i = 0, j = 0; i < child_count; ++i) if(i != child_index) children[j++] = node->children[i];
+
+        uint32_t data_count = node->data_count();
+        uint32_t data_index = Node::index(node->datamap, bit);
+        KeyValue* data = keyvalue_chunks_.reserve_consecutive_elements(data_count + 1);
+        for(uint32_t i = 0; i < data_index; ++i) data[i] = node->data[i];
+        data[data_index] = kv;
+        for(uint32_t i = data_index; i < data_count; ++i) data[i + 1] = node->data[i];
+
+        node->data = data;
+        node->children = children;
+        node->nodemap &= ~bit;
+        node->datamap |= bit;
+    }
+
+    /** Return a copy of the trie at node without key. The key must be in the trie. Return 0 if the
+     *  trie becomes empty. Nodes below the root left with a single keyvalue are inlined to their parent.*/
+    Node* remove_path(const Node* node, const K& key, uint32_t hash, uint32_t level)
+    {
+        Node* n = new_node(0);
+
+        if(node->is_collision())
         {
-            auto iter = node->value.collision_list->begin();
-            auto end = node->value.collision_list->end();
-            for(;iter != end; ++iter)
+            n->datamap = n->nodemap = Node::COLLISION;
+            n->collisions = new KeyValueList();
+            for(auto i = node->collisions->begin(); i != node->collisions->end(); ++i)
             {
-                keyvalue_chunks_.set_marked_if_contained(*iter);
+                if(!keyvalue_match_get(*i, key, hash)) n->collisions->push_back(*i);
             }
+            return n;
         }
 
-        for(auto ref = node->begin(); ref != node->end(); ++ref)
-            recursive_mark(ref->node);
+        n->datamap = node->datamap;
+        n->nodemap = node->nodemap;
+        n->data = node->data;
+        n->children = node->children;
 
-    };
+        uint32_t bit = position_bit(hash, level);
+
+        if(node->datamap & bit)
+        {
+            uint32_t count = node->data_count();
+            uint32_t index = Node::index(node->datamap, bit);
+            n->data = count > 1 ? keyvalue_chunks_.reserve_consecutive_elements(count - 1) : 0;
+            for(uint32_t i = 0, j = 0; i < count; ++i) if(i != index) n->data[j++] = node->data[i];
+            n->datamap &= ~bit;
+
+            if(n->datamap == 0 && n->nodemap == 0) return 0;
+            return n;
+        }
+
+        uint32_t index = Node::index(node->nodemap, bit);
+        Node* child = remove_path(node->children[index], key, hash, level + 1);
+
+        if(child->data_count() == 1 && child->child_count() == 0)
+        {
+            // Keep the trie canonical: a single keyvalue is stored in the parent.
+            child_to_data(n, bit, child->entries()[0]);
+        }
+        else
+        {
+            n->children = copy_children(node->children, node->child_count());
+            n->children[index] = child;
+        }
+        return n;
+    }
+
+    /** Mark the keyvalue and child arrays of node.*/
+    void mark_arrays(Node* node)
+    {
+        if(node->is_collision()) return;
+        uint32_t data_count = node->data_count();
+        uint32_t child_count = node->child_count();
+        if(data_count > 0) keyvalue_chunks_.set_marked_if_contained_array(node->data, data_count);
+        if(child_count > 0) ref_chunks_.set_marked_if_contained_array(node->children, child_count);
+    }
+
+    // TODO all absolutely non-member functions to static
+    void recursive_mark(Node* node)
+    {
+        // Subtrees shared by several roots are visited once.
+        if(!node_chunks_.mark(node)) return;
+        mark_arrays(node);
+        for(uint32_t i = 0, count = node->child_count(); i < count; ++i) recursive_mark(node->children[i]);
+    }
 
     /** Mark all found entries when iterating from this node. Maximum child depth is
-     * seven so stack should not be terribly wasted. */
+     * eight so stack should not be terribly wasted. */
     void mark_referenced(Node* node)
     {
         recursive_mark(node);
     }
 
+    /** Mark a node and its arrays from one of several marking threads and push the children
+     *  of the node if it was not marked before.*/
+    struct ParallelMark
+    {
+        PMapPool& pool;
+        void operator()(Node* node, std::vector<Node*>& stack)
+        {
+            if(!pool.node_chunks_.mark_atomic(node)) return;
+            if(node->is_collision()) return;
+
+            uint32_t data_count = node->data_count();
+            uint32_t child_count = node->child_count();
+            if(data_count > 0) pool.keyvalue_chunks_.mark_array_atomic(node->data, data_count);
+            if(child_count > 0) pool.ref_chunks_.mark_array_atomic(node->children, child_count);
+
+            for(uint32_t i = 0; i < child_count; ++i) stack.push_back(node->children[i]);
+        }
+    };
+
     /** Garbage collection for map.*/
     void gc()
     {
-        // Must cleanup keyvalues, nodes, refs and gc collided_list_pool_
-        // Mark all empty
+        gc_mark();
+        gc_sweep();
+    }
 
+    /** First half of gc(): mark the nodes reachable from the referenced maps. See PListPool::gc_mark.*/
+    void gc_mark()
+    {
         // Visit all heads (iterate through map)
-        // For each node: mark node, mark refs, go through all keyvalues and mark them
+        // For each node: mark node, mark its keyvalue and child arrays
         // Then, collect all
-        // Finally gc collided_list_pool_
-        
-        // TODO: Make gc more efficient.
-        // i) collect all live references to an array and sort them.
-        // ii) Sort all chunks in order of their first address
-        // Now the two lists can be passed in linear fashion. 
-        // Takes space (on 64 bit system) 8 * Chunk bytes + 8 * reference bytes.
-        // i.e. for million references ~9MB.
 
+        // The chunk of each slot is found from the slab it is in and marking stops at
+        // subtrees already marked, so marking is linear in the number of live nodes.
+
+        // Abandon incremental collection if one is running.
+        phase_ = GC_IDLE;
+        gray_.clear();
+        regray_.clear();
 
         // Clean mark fields.
         keyvalue_chunks_.mark_all_empty();
@@ -1858,70 +2986,1471 @@ public:
         ref_chunks_.mark_all_empty();
 
         // Then clean up unused references, visit all heads and mark visited nodes as active
-        ref_count_ = copyif(ref_count_, [](const std::pair<Node*, int>& p){return p.second > 0;});
+        roots_.prune();
 
         // Go through each head.
-        for(auto r = ref_count_.begin(); r!= ref_count_.end(); ++r) mark_referenced(r->first);
-
-        // Lastly, collect unused slots.
-        keyvalue_chunks_.collect_chunks();
-        node_chunks_.collect_chunks();
-        ref_chunks_.collect_chunks();
-
-        // After all used slots are collected garbage collect collided list pool (unused heads
-        // have been released in the possible destructors of the list heads).
-        collided_list_pool_.gc();
-
+        size_t thread_count = node_chunks_.chunk_count() >= gc_min_chunks_ ? gc_thread_count_ : 1;
+        if(thread_count > 1)
+        {
+            ParallelMark mark = {*this};
+            ParallelMarker<Node*, ParallelMark> marker(mark, thread_count);
+            marker.run(roots_.nodes());
+        }
+        else
+        {
+            for(auto r = roots_.begin(); r!= roots_.end(); ++r) mark_referenced(*r);
+        }
     }
 
-    /** Allocate new empty node.*/
-    Node* new_node()
+    /** Second half of gc(): free the nodes left unmarked by gc_mark().*/
+    void gc_sweep()
     {
-        Node* n = node_chunks_.reserve_element();
-        n->type = Node::EmptyNode;
-        return n;
+        // Collision lists are freed with their nodes.
+        size_t thread_count = node_chunks_.chunk_count() >= gc_min_chunks_ ? gc_thread_count_ : 1;
+        keyvalue_chunks_.collect_chunks(thread_count);
+        node_chunks_.collect_chunks(thread_count);
+        ref_chunks_.collect_chunks(thread_count);
     }
 
-    /** Allocate new node with one value.*/
-#if 0 // TODO remove?
-    Node* new_node(const KeyValue& v)
+    /** Set the number of threads used by gc(). Pools of less than min_chunks node chunks
+     *  are collected by the calling thread only.*/
+    void set_gc_thread_count(size_t count, size_t min_chunks = PARALLEL_GC_MIN_CHUNKS)
     {
-        Node* n = node_chunks_.reserve_element();
-        *kv = v;
-
-        n->type = Node::ValueNode;
-        n->value.keyvalue = kv;
-
-        return n;
+        gc_thread_count_ = count > 0 ? count : 1;
+        gc_min_chunks_ = min_chunks;
     }
-#endif
 
     /** Return number of bytes used by the chunk pool in total. */
     size_t reserved_size_bytes()
     {
-        size_t ref_map_size = ref_count_.size() *  sizeof(typename refcount_map::value_type);
-        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.reserved_size_bytes() + 
-                       node_chunks_.reserved_size_bytes() +  ref_chunks_.reserved_size_bytes() + collided_list_pool_.reserved_size_bytes();
+        size_t ref_map_size = roots_.size() * sizeof(Node*);
+        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.reserved_size_bytes() +
+                       node_chunks_.reserved_size_bytes() +  ref_chunks_.reserved_size_bytes();
         return total;
     }
 
     size_t live_size_bytes()
     {
-        size_t ref_map_size = ref_count_.size() * sizeof(typename refcount_map::value_type);
-        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.live_size_bytes() + 
-                       node_chunks_.live_size_bytes() +  ref_chunks_.live_size_bytes() + collided_list_pool_.live_size_bytes();
+        size_t ref_map_size = roots_.size() * sizeof(Node*);
+        size_t total = sizeof(*this) + ref_map_size +  keyvalue_chunks_.live_size_bytes() +
+                       node_chunks_.live_size_bytes() +  ref_chunks_.live_size_bytes();
         return total;
     }
+
+    /** Return number of nodes, key-value slots and child slots reserved since the pool was created. */
+    size_t allocated_count() const
+    {
+        return keyvalue_chunks_.allocated_count() + node_chunks_.allocated_count() + ref_chunks_.allocated_count();
+    }
 private:
     keyvalue_chunk_box keyvalue_chunks_;
     node_chunk_box     node_chunks_;
     ref_chunk_box      ref_chunks_;
-    KeyValueListPool   collided_list_pool_;
-    refcount_map       ref_count_; // Store references to root nodes
+    RootSet<Node>      roots_;     // Root nodes referenced by maps
+    GcPhase            phase_;
+    std::vector<Node*> gray_;      //> Nodes shaded but not yet marked.
+    std::vector<Node*> regray_;    //> Nodes edited in place while marking. Rescanned even if marked.
+    size_t             gc_thread_count_; //> Threads used by gc() on large pools.
+    size_t             gc_min_chunks_;   //> Node chunk count from which gc() uses several threads.
+    size_t             build_thread_count_; //> Threads used to build maps from large ranges.
+    size_t             build_min_size_;     //> Range size from which maps are built by several threads.
+    uint32_t           edit_count_;      //> Last transient edit id.
 };
 
 #endif
 
+/////////// Persistent vector //////////////
+
+/** Persistent vector stored as a bit-partitioned trie of 32-way branches.
+
+    Elements are kept in 32 element leaves. The last leaf, the tail, is held by the head outside
+    of the trie so that appending reaches into the trie only once every 32 elements. The index of
+    an element is split into 5-bit fields, the highest field indexing the root:
+
+    index: ...|ccccc|bbbbb|aaaaa
+               root   ...   leaf
+
+    Indexing, update and append are O(log32 n). A new version copies only the path to the
+    changed leaf and shares all other nodes with the vector it was made from.
+
+    A vector refers to a head that holds the size, the depth of the trie, the root and the tail.
+    A tail is appended to in place if the vector appended to is the longest one using it, so a
+    chain of appends does not copy elements. Otherwise the tail is copied first.*/
+template<class T>
+class PVectorPool
+{
+public:
+    enum{BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1};
+
+    /** Leaf of the trie or a tail.*/
+    struct Leaf
+    {
+        T        data[WIDTH];
+        uint32_t used; //> Slots written. The vectors using the leaf may have fewer elements.
+
+        Leaf():used(0){}
+    };
+
+    /** Inner node of the trie. Children of the branches just above the leaves are leaves.*/
+    struct Branch
+    {
+        union Child
+        {
+            Branch* branch;
+            Leaf*   leaf;
+        };
+
+        Child children[WIDTH];
+
+        Branch(){for(size_t i = 0; i < WIDTH; ++i) children[i].branch = 0;}
+    };
+
+    struct Head
+    {
+        Branch*   root;  //> Null while all elements fit in the tail.
+        Leaf*     tail;
+        uint32_t  size;
+        uint32_t  shift; //> Bits of index below the root level.
+        RootCount refs;  //> Handles to the vector.
+
+        Head():root(0), tail(0), size(0), shift(BITS){}
+
+        /** Index of the first element in the tail.*/
+        uint32_t tail_offset() const {return size < WIDTH ? 0 : ((size - 1) >> BITS) << BITS;}
+    };
+
+    /** The vector class.*/
+    class Vector
+    {
+    public:
+        struct iterator
+        {
+            const PVectorPool* pool;
+            const Head*        head;
+            uint32_t           index;
+            const Leaf*        leaf;
+
+            iterator():pool(0), head(0), index(0), leaf(0){}
+            iterator(const PVectorPool* p, const Head* h, uint32_t i):pool(p), head(h), index(i), leaf(0)
+            {
+                if(head && index < head->size) leaf = pool->leaf_for(head, index);
+            }
+
+            const T& operator*() const {return leaf->data[index & MASK];}
+            const T* operator->() const {return &leaf->data[index & MASK];}
+            void operator++()
+            {
+                ++index;
+                if((index & MASK) == 0 && index < head->size) leaf = pool->leaf_for(head, index);
+            }
+            bool operator!=(const iterator& i) const {return index != i.index;}
+            bool operator==(const iterator& i) const {return index == i.index;}
+        };
+
+        typedef iterator const_iterator;
+        typedef T        value_type;
+
+        Vector(PVectorPool& pool, Head* head):pool_(pool), head_(head){pool_.add_ref(head_);}
+        ~Vector(){pool_.remove_ref(head_);}
+
+        Vector(const Vector& v):pool_(v.pool_), head_(v.head_){pool_.add_ref(head_);}
+        Vector(Vector&& v):pool_(v.pool_), head_(v.head_){v.head_ = 0;}
+
+        Vector& operator=(const Vector& v)
+        {
+            assert(&pool_ == &v.pool_);
+            if(this != &v)
+            {
+                pool_.add_ref(v.head_);
+                pool_.remove_ref(head_);
+                head_ = v.head_;
+            }
+            return *this;
+        }
+
+        Vector& operator=(Vector&& v)
+        {
+            assert(&pool_ == &v.pool_);
+            if(this != &v)
+            {
+                pool_.remove_ref(head_);
+                head_ = v.head_;
+                v.head_ = 0;
+            }
+            return *this;
+        }
+
+        size_t size() const {return head_ ? head_->size : 0;}
+        bool   empty() const {return size() == 0;}
+
+        /** Return element at index. Index must be less than size().*/
+        const T& operator[](size_t index) const
+        {
+            assert(index < size());
+            return pool_.leaf_for(head_, uint32_t(index))->data[index & MASK];
+        }
+
+        /** Return a vector with data appended.*/
+        Vector add(const T& data) const
+        {
+            Head* h = pool_.new_head(head_);
+            pool_.push(h, data);
+            return Vector(pool_, h);
+        }
+
+        /** Return a vector with the elements in iterator range appended.*/
+        template<class I>
+        Vector add_end(I ibegin, I iend) const
+        {
+            if(ibegin == iend) return *this;
+            Head* h = pool_.new_head(head_);
+            for(; ibegin != iend; ++ibegin) pool_.push(h, *ibegin);
+            return Vector(pool_, h);
+        }
+
+        /** Return a vector with the element at index replaced by data. Index must be less than size().*/
+        Vector set(size_t index, const T& data) const
+        {
+            assert(index < size());
+            Head* h = pool_.new_head(head_);
+            pool_.assoc(h, uint32_t(index), data);
+            return Vector(pool_, h);
+        }
+
+        /** Return a vector of all but the first count elements.*/
+        Vector drop(size_t count) const
+        {
+            if(count == 0) return *this;
+            iterator i = begin();
+            for(; i != end() && count > 0; --count) ++i;
+            return pool_.new_vector(i, end());
+        }
+
+        iterator begin() const {return iterator(&pool_, head_, 0);}
+        iterator end() const {return iterator(&pool_, head_, uint32_t(size()));}
+
+        bool operator==(const Vector& v) const
+        {
+            if(size() != v.size()) return false;
+            iterator i = begin(), last = end(), vi = v.begin();
+            for(; i != last; ++i, ++vi) if(!(*i == *vi)) return false;
+            return true;
+        }
+
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref(){pool_.add_ref(head_);}
+
+        /** Mark the vector reachable in the running incremental collection.*/
+        void shade() const {pool_.shade(head_);}
+
+    private:
+        PVectorPool& pool_;
+        Head*        head_;
+    };
+
+    typedef ChunkBox<Head>   head_chunk_box;
+    typedef ChunkBox<Branch> branch_chunk_box;
+    typedef ChunkBox<Leaf>   leaf_chunk_box;
+
+    PVectorPool():phase_(GC_IDLE){}
+
+    ~PVectorPool()
+    {
+        kill();
+    }
+
+    /** Recycle all memory. */
+    void kill()
+    {
+        roots_.clear();
+        heads_.keep_slabs();
+        branches_.keep_slabs();
+        leaves_.keep_slabs();
+        gc();
+    }
+
+    /** Create new empty vector.*/
+    Vector new_vector()
+    {
+        return Vector(*this, 0);
+    }
+
+    /** Create new vector from the elements in iterator range.*/
+    template<class I>
+    Vector new_vector(I ibegin, I iend)
+    {
+        return new_vector().add_end(ibegin, iend);
+    }
+
+    /** Remove reference to head.*/
+    void remove_ref(Head* h)
+    {
+        roots_.remove_ref(h);
+    }
+
+    /** Add reference to head. Also the write barrier of the incremental collection.*/
+    void add_ref(Head* h)
+    {
+        shade(h);
+        roots_.add_ref(h);
+    }
+
+    /** Return the leaf holding the element at index.*/
+    const Leaf* leaf_for(const Head* h, uint32_t index) const
+    {
+        if(index >= h->tail_offset()) return h->tail;
+
+        const Branch* b = h->root;
+        for(uint32_t level = h->shift; level > BITS; level -= BITS) b = b->children[(index >> level) & MASK].branch;
+        return b->children[(index >> BITS) & MASK].leaf;
+    }
+
+    /** Collect all nodes not reachable from the referenced vectors.*/
+    void gc()
+    {
+        gc_mark();
+        gc_sweep();
+    }
+
+    /** First half of gc(): mark the nodes reachable from the referenced vectors. See PListPool::gc_mark.*/
+    void gc_mark()
+    {
+        // Abandon incremental collection if one is running.
+        phase_ = GC_IDLE;
+        gray_.clear();
+        regray_.clear();
+
+        heads_.mark_all_empty();
+        branches_.mark_all_empty();
+        leaves_.mark_all_empty();
+
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) mark_head(*r);
+    }
+
+    /** Second half of gc(): free the nodes left unmarked by gc_mark().*/
+    void gc_sweep()
+    {
+        heads_.collect_chunks();
+        branches_.collect_chunks();
+        leaves_.collect_chunks();
+    }
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        roots_.clear_counts();
+    }
+
+    /** Start an incremental collection. Roots are given to shade(). While marking, add_ref
+     *  shades each head it is given, which covers the vectors returned by all operations.
+     *  Tails appended to in place are scanned again.*/
+    void begin_incremental()
+    {
+        heads_.mark_all_empty();
+        branches_.mark_all_empty();
+        leaves_.mark_all_empty();
+        gray_.clear();
+        regray_.clear();
+        phase_ = GC_MARK;
+
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) shade(*r);
+    }
+
+    /** Add head to the nodes to mark if marking is in progress.*/
+    void shade(Head* h){if(h && phase_ == GC_MARK) gray_.push_back(GrayNode(h, HEAD_LEVEL));}
+
+    /** Mark at most budget nodes reachable from the shaded ones. visit is called with each
+     *  element of the leaves marked. Return the number of nodes marked.*/
+    template<class F>
+    size_t mark_step(size_t budget, F& visit)
+    {
+        size_t work = 0;
+        while(work < budget && !(gray_.empty() && regray_.empty()))
+        {
+            if(!regray_.empty())
+            {
+                Leaf* l = regray_.back();
+                regray_.pop_back();
+                leaves_.mark(l);
+                for(uint32_t i = 0; i < l->used; ++i) visit(l->data[i]);
+                ++work;
+                continue;
+            }
+
+            GrayNode g = gray_.back();
+            gray_.pop_back();
+
+            if(g.level == HEAD_LEVEL)
+            {
+                Head* h = static_cast<Head*>(g.node);
+                if(!heads_.mark(h)) continue;
+                if(h->tail) gray_.push_back(GrayNode(h->tail, 0));
+                if(h->root) gray_.push_back(GrayNode(h->root, h->shift));
+            }
+            else if(g.level == 0)
+            {
+                Leaf* l = static_cast<Leaf*>(g.node);
+                if(!leaves_.mark(l)) continue;
+                for(uint32_t i = 0; i < l->used; ++i) visit(l->data[i]);
+            }
+            else
+            {
+                Branch* b = static_cast<Branch*>(g.node);
+                if(!branches_.mark(b)) continue;
+                for(size_t i = 0; i < WIDTH; ++i)
+                {
+                    if(b->children[i].branch) gray_.push_back(GrayNode(b->children[i].branch, g.level - BITS));
+                }
+            }
+            ++work;
+        }
+        return work;
+    }
+
+    bool marking_done() const {return gray_.empty() && regray_.empty();}
+
+    /** Start freeing the nodes left unmarked.*/
+    void begin_sweep()
+    {
+        roots_.prune();
+        heads_.begin_sweep();
+        branches_.begin_sweep();
+        leaves_.begin_sweep();
+        phase_ = GC_SWEEP;
+    }
+
+    /** Free unmarked nodes in at most chunk_budget chunks. Return true when the collection is complete.*/
+    bool sweep_step(size_t& chunk_budget)
+    {
+        if(!(heads_.sweep_step(chunk_budget) &&
+             branches_.sweep_step(chunk_budget) &&
+             leaves_.sweep_step(chunk_budget))) return false;
+
+        phase_ = GC_IDLE;
+        return true;
+    }
+
+    GcPhase gc_phase() const {return phase_;}
+
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        return sizeof(*this) + roots_.size() * sizeof(Head*) + heads_.reserved_size_bytes() +
+               branches_.reserved_size_bytes() + leaves_.reserved_size_bytes();
+    }
+
+    size_t live_size_bytes()
+    {
+        return sizeof(*this) + roots_.size() * sizeof(Head*) + heads_.live_size_bytes() +
+               branches_.live_size_bytes() + leaves_.live_size_bytes();
+    }
+
+    /** Return number of nodes reserved since the pool was created. */
+    size_t allocated_count() const
+    {
+        return heads_.allocated_count() + branches_.allocated_count() + leaves_.allocated_count();
+    }
+
+private:
+    enum{HEAD_LEVEL = 0xffffffffu};
+
+    /** Node waiting to be marked. Level is the shift of a branch, 0 for a leaf or HEAD_LEVEL.*/
+    struct GrayNode
+    {
+        void*    node;
+        uint32_t level;
+        GrayNode(void* n, uint32_t l):node(n), level(l){}
+    };
+
+    /** Return a new head with the contents of old or an empty one.*/
+    Head* new_head(const Head* old)
+    {
+        Head* h = heads_.reserve_element();
+        if(old) *h = *old;
+        return h;
+    }
+
+    Branch* new_branch(const Branch* old = 0)
+    {
+        Branch* b = branches_.reserve_element();
+        if(old) *b = *old;
+        return b;
+    }
+
+    /** Return new leaf with the first count elements of old.*/
+    Leaf* new_leaf(const Leaf* old = 0, uint32_t count = 0)
+    {
+        Leaf* l = leaves_.reserve_element();
+        for(uint32_t i = 0; i < count; ++i) l->data[i] = old->data[i];
+        l->used = count;
+        return l;
+    }
+
+    /** Return a chain of branches from level down to leaf.*/
+    typename Branch::Child new_path(uint32_t level, Leaf* leaf)
+    {
+        typename Branch::Child c;
+        if(level == 0)
+        {
+            c.leaf = leaf;
+        }
+        else
+        {
+            c.branch = new_branch();
+            c.branch->children[0] = new_path(level - BITS, leaf);
+        }
+        return c;
+    }
+
+    /** Return a copy of parent with the full tail of a vector of size elements added.*/
+    Branch* push_tail(uint32_t size, uint32_t level, const Branch* parent, Leaf* tail)
+    {
+        Branch* b = new_branch(parent);
+        uint32_t index = ((size - 1) >> level) & MASK;
+
+        if(level == BITS)
+        {
+            b->children[index].leaf = tail;
+        }
+        else
+        {
+            Branch* child = b->children[index].branch;
+            b->children[index] = child ? make_child(push_tail(size, level - BITS, child, tail)) : new_path(level - BITS, tail);
+        }
+        return b;
+    }
+
+    static typename Branch::Child make_child(Branch* b)
+    {
+        typename Branch::Child c;
+        c.branch = b;
+        return c;
+    }
+
+    /** Append data to the vector of head h. h must not be shared yet.*/
+    void push(Head* h, const T& data)
+    {
+        uint32_t tail_size = h->size - h->tail_offset();
+
+        if(tail_size < WIDTH)
+        {
+            if(!h->tail || h->tail->used != tail_size)
+            {
+                h->tail = new_leaf(h->tail, tail_size);
+            }
+            else if(phase_ == GC_MARK)
+            {
+                // The tail may have been marked already.
+                regray_.push_back(h->tail);
+            }
+            h->tail->data[tail_size] = data;
+            h->tail->used = tail_size + 1;
+        }
+        else
+        {
+            // Move the full tail into the trie. Add a level if the root is full.
+            if(h->root && (h->size >> BITS) > (1u << h->shift))
+            {
+                Branch* root = new_branch();
+                root->children[0].branch = h->root;
+                root->children[1] = new_path(h->shift, h->tail);
+                h->root = root;
+                h->shift += BITS;
+            }
+            else
+            {
+                h->root = push_tail(h->size, h->shift, h->root, h->tail);
+            }
+
+            h->tail = new_leaf();
+            h->tail->data[0] = data;
+            h->tail->used = 1;
+        }
+
+        ++h->size;
+    }
+
+    /** Replace the element at index of the vector of head h. h must not be shared yet.*/
+    void assoc(Head* h, uint32_t index, const T& data)
+    {
+        if(index >= h->tail_offset())
+        {
+            h->tail = new_leaf(h->tail, h->size - h->tail_offset());
+            h->tail->data[index & MASK] = data;
+        }
+        else
+        {
+            h->root = assoc_path(h->shift, h->root, index, data);
+        }
+    }
+
+    Branch* assoc_path(uint32_t level, const Branch* old, uint32_t index, const T& data)
+    {
+        Branch* b = new_branch(old);
+        uint32_t i = (index >> level) & MASK;
+
+        if(level == BITS)
+        {
+            Leaf* l = new_leaf(b->children[i].leaf, WIDTH);
+            l->data[index & MASK] = data;
+            b->children[i].leaf = l;
+        }
+        else
+        {
+            b->children[i].branch = assoc_path(level - BITS, b->children[i].branch, index, data);
+        }
+        return b;
+    }
+
+    void mark_head(Head* h)
+    {
+        if(!heads_.mark(h)) return;
+        if(h->tail) leaves_.mark(h->tail);
+        if(h->root) mark_branch(h->root, h->shift);
+    }
+
+    void mark_branch(Branch* b, uint32_t level)
+    {
+        // Subtrees shared by several versions are visited once.
+        if(!branches_.mark(b)) return;
+        for(size_t i = 0; i < WIDTH; ++i)
+        {
+            if(!b->children[i].branch) continue;
+            if(level == BITS) leaves_.mark(b->children[i].leaf);
+            else              mark_branch(b->children[i].branch, level - BITS);
+        }
+    }
+
+    head_chunk_box        heads_;
+    branch_chunk_box      branches_;
+    leaf_chunk_box        leaves_;
+    RootSet<Head>         roots_;  //> Heads referenced by vectors
+    GcPhase               phase_;
+    std::vector<GrayNode> gray_;   //> Nodes shaded but not yet marked.
+    std::vector<Leaf*>    regray_; //> Tails appended to in place while marking.
+};
+
+/////////// Persistent sorted map //////////////
+
+/** Persistent ordered map stored as a B+ tree.
+
+    Keyvalues are kept in sorted leaves of up to WIDTH entries. A branch holds up to WIDTH
+    children and a lower bound of the keys below each child, so a lookup reads one node per level
+    and scans at most WIDTH keys in it. Nodes other than the root are kept at least half full.
+
+    Insertion, removal and lookup are O(log n). A new version copies the path to the changed
+    leaf, and the siblings split or merged with the nodes on it, and shares all other nodes with
+    the map it was made from. Maps iterate in key order, from the first key or from the bound
+    given to lower_bound and upper_bound.
+
+    A map refers to a head that holds the size, the height of the tree and the root. Heads are
+    reference counted and collected as in PVectorPool.
+
+    Less must be a strict weak ordering. Keys not less than each other are the same key.*/
+template<class K, class V, class Less = std::less<K>>
+class PSortedMapPool
+{
+public:
+    enum{WIDTH = 16, MIN_FILL = WIDTH / 2, MAX_HEIGHT = 24};
+
+    /** Key-value pair. */
+    struct KeyValue{K first; V second;};
+
+    struct Branch;
+    struct Leaf;
+
+    /** Child of a branch. Branches know the height of their children.*/
+    union Child
+    {
+        Branch* branch;
+        Leaf*   leaf;
+    };
+
+    struct Leaf
+    {
+        KeyValue entries[WIDTH];
+        uint32_t count;
+
+        Leaf():count(0){}
+    };
+
+    struct Branch
+    {
+        K        keys[WIDTH];     //> Lower bound of the keys below each child. Keys of the children before are less.
+        Child    children[WIDTH];
+        uint32_t count;
+
+        Branch():count(0){for(size_t i = 0; i < WIDTH; ++i) children[i].branch = 0;}
+    };
+
+    struct Head
+    {
+        Child     root;   //> A leaf if height is 0. Null for the empty map.
+        uint32_t  size;
+        uint32_t  height; //> Levels of branches above the leaves.
+        RootCount refs;   //> Handles to the map.
+
+        Head():size(0), height(0){root.branch = 0;}
+    };
+
+    /** Iterator in key order.*/
+    struct iterator
+    {
+        const Branch* path[MAX_HEIGHT]; //> Branches from the root down.
+        uint32_t      index[MAX_HEIGHT]; //> Index of the child taken in each branch on the path.
+        uint32_t      height;
+        const Leaf*   leaf;              //> Null at the end.
+        uint32_t      position;
+
+        iterator():height(0), leaf(0), position(0){}
+
+        const KeyValue& operator*() const {return leaf->entries[position];}
+        const KeyValue* operator->() const {return &leaf->entries[position];}
+
+        void operator++()
+        {
+            if(++position == leaf->count) next_leaf();
+        }
+
+        bool operator==(const iterator& i) const {return leaf == i.leaf && position == i.position;}
+        bool operator!=(const iterator& i) const {return !(*this == i);}
+
+        /** Descend to the first leaf below child of the branch at depth.*/
+        void descend(Child child, uint32_t depth)
+        {
+            for(; depth < height; ++depth)
+            {
+                path[depth] = child.branch;
+                index[depth] = 0;
+                child = child.branch->children[0];
+            }
+            leaf = child.leaf;
+            position = 0;
+        }
+
+        /** Move to the first entry of the next leaf or to the end.*/
+        void next_leaf()
+        {
+            for(uint32_t depth = height; depth > 0; --depth)
+            {
+                const Branch* b = path[depth - 1];
+                if(index[depth - 1] + 1 < b->count)
+                {
+                    Child child = b->children[++index[depth - 1]];
+                    descend(child, depth);
+                    return;
+                }
+            }
+            leaf = 0;
+            position = 0;
+        }
+    };
+
+    typedef iterator const_iterator;
+
+    /** The sorted map class.*/
+    class Map
+    {
+    public:
+        typedef K        key_type;
+        typedef V        mapped_type;
+        typedef KeyValue value_type;
+        typedef typename PSortedMapPool::iterator iterator;
+
+        Map(PSortedMapPool& pool, Head* head):pool_(pool), head_(head){pool_.add_ref(head_);}
+        ~Map(){pool_.remove_ref(head_);}
+
+        Map(const Map& m):pool_(m.pool_), head_(m.head_){pool_.add_ref(head_);}
+        Map(Map&& m):pool_(m.pool_), head_(m.head_){m.head_ = 0;}
+
+        Map& operator=(const Map& m)
+        {
+            assert(&pool_ == &m.pool_);
+            if(this != &m)
+            {
+                pool_.add_ref(m.head_);
+                pool_.remove_ref(head_);
+                head_ = m.head_;
+            }
+            return *this;
+        }
+
+        Map& operator=(Map&& m)
+        {
+            assert(&pool_ == &m.pool_);
+            if(this != &m)
+            {
+                pool_.remove_ref(head_);
+                head_ = m.head_;
+                m.head_ = 0;
+            }
+            return *this;
+        }
+
+        size_t size() const {return head_ ? head_->size : 0;}
+        bool   empty() const {return size() == 0;}
+
+        ConstOption<V> try_get_value(const K& key) const {return ConstOption<V>(pool_.find(head_, key));}
+
+        /** Return a map with key set to value.*/
+        Map add(const K& key, const V& value) const {return Map(pool_, pool_.insert(head_, key, value));}
+
+        /** Return a map without key.*/
+        Map remove(const K& key) const
+        {
+            if(!pool_.find(head_, key)) return *this;
+            return Map(pool_, pool_.erase(head_, key));
+        }
+
+        iterator begin() const {return pool_.seek(head_, 0, false);}
+        iterator end() const {return iterator();}
+
+        /** Return iterator to the first entry with key not less than key.*/
+        iterator lower_bound(const K& key) const {return pool_.seek(head_, &key, false);}
+
+        /** Return iterator to the first entry with key greater than key.*/
+        iterator upper_bound(const K& key) const {return pool_.seek(head_, &key, true);}
+
+        /** Return the entry with the greatest key not greater than key or null.*/
+        const KeyValue* floor(const K& key) const {return pool_.floor(head_, key);}
+
+        /** Return the entry with the least key not less than key or null.*/
+        const KeyValue* ceiling(const K& key) const
+        {
+            iterator i = lower_bound(key);
+            return i != end() ? &(*i) : 0;
+        }
+
+        bool operator==(const Map& m) const
+        {
+            if(size() != m.size()) return false;
+            iterator i = begin(), last = end(), mi = m.begin();
+            for(; i != last; ++i, ++mi)
+            {
+                if(!(equal_keys(i->first, mi->first) && i->second == mi->second)) return false;
+            }
+            return true;
+        }
+
+        // Run garbage collector on the root pool.
+        void gc(){pool_.gc();}
+
+        /** Warning: Use only if you know what you are doing. */
+        void increment_ref(){pool_.add_ref(head_);}
+
+        /** Mark the map reachable in the running incremental collection.*/
+        void shade() const {pool_.shade(head_);}
+
+    private:
+        PSortedMapPool& pool_;
+        Head*           head_;
+    };
+
+    typedef ChunkBox<Head>   head_chunk_box;
+    typedef ChunkBox<Branch> branch_chunk_box;
+    typedef ChunkBox<Leaf>   leaf_chunk_box;
+
+    PSortedMapPool():phase_(GC_IDLE){}
+
+    ~PSortedMapPool()
+    {
+        kill();
+    }
+
+    /** Recycle all memory. */
+    void kill()
+    {
+        roots_.clear();
+        heads_.keep_slabs();
+        branches_.keep_slabs();
+        leaves_.keep_slabs();
+        gc();
+    }
+
+    /** Create new empty map.*/
+    Map new_map()
+    {
+        return Map(*this, 0);
+    }
+
+    /** Create new map from the keys and values of the ranges.*/
+    template<class KI, class VI>
+    Map new_map(KI i_key, KI key_end, VI i_value, VI value_end)
+    {
+        Head* h = 0;
+        for(; i_key != key_end && i_value != value_end; ++i_key, ++i_value) h = insert(h, *i_key, *i_value);
+        return Map(*this, h);
+    }
+
+    /** Remove reference to head.*/
+    void remove_ref(Head* h)
+    {
+        roots_.remove_ref(h);
+    }
+
+    /** Add reference to head. Also the write barrier of the incremental collection.*/
+    void add_ref(Head* h)
+    {
+        shade(h);
+        roots_.add_ref(h);
+    }
+
+    static bool less(const K& a, const K& b){return Less()(a, b);}
+    static bool equal_keys(const K& a, const K& b){return !less(a, b) && !less(b, a);}
+
+    /** Return index of the child of b that may hold key.*/
+    static uint32_t child_index(const Branch* b, const K& key)
+    {
+        uint32_t i = 1;
+        while(i < b->count && !less(key, b->keys[i])) ++i;
+        return i - 1;
+    }
+
+    /** Return index of the first entry of l with key not less than key.*/
+    static uint32_t lower_index(const Leaf* l, const K& key)
+    {
+        uint32_t i = 0;
+        while(i < l->count && less(l->entries[i].first, key)) ++i;
+        return i;
+    }
+
+    /** Return value of key in the map of head h or null.*/
+    const V* find(const Head* h, const K& key) const
+    {
+        if(!h || !h->root.branch) return 0;
+
+        Child c = h->root;
+        for(uint32_t level = h->height; level > 0; --level) c = c.branch->children[child_index(c.branch, key)];
+
+        uint32_t i = lower_index(c.leaf, key);
+        return (i < c.leaf->count && !less(key, c.leaf->entries[i].first)) ? &c.leaf->entries[i].second : 0;
+    }
+
+    /** Return iterator to the first entry of the map of head h with key not less than key, or
+     *  greater than key if upper is set. Return iterator to the first entry if key is null.*/
+    iterator seek(const Head* h, const K* key, bool upper) const
+    {
+        iterator it;
+        if(!h || !h->root.branch) return it;
+
+        it.height = h->height;
+        if(!key)
+        {
+            it.descend(h->root, 0);
+            return it;
+        }
+
+        Child c = h->root;
+        for(uint32_t depth = 0; depth < h->height; ++depth)
+        {
+            it.path[depth] = c.branch;
+            it.index[depth] = child_index(c.branch, *key);
+            c = c.branch->children[it.index[depth]];
+        }
+
+        it.leaf = c.leaf;
+        it.position = lower_index(c.leaf, *key);
+        if(upper && it.position < c.leaf->count && !less(*key, c.leaf->entries[it.position].first)) ++it.position;
+        if(it.position == c.leaf->count) it.next_leaf();
+        return it;
+    }
+
+    /** Return the entry of the map of head h with the greatest key not greater than key or null.*/
+    const KeyValue* floor(const Head* h, const K& key) const
+    {
+        if(!h || !h->root.branch) return 0;
+
+        // The subtree before the path taken holds the greatest key if the leaf reached has none.
+        Child c = h->root;
+        Child before;
+        before.branch = 0;
+        uint32_t before_level = 0;
+
+        for(uint32_t level = h->height; level > 0; --level)
+        {
+            uint32_t i = child_index(c.branch, key);
+            if(i > 0)
+            {
+                before = c.branch->children[i - 1];
+                before_level = level - 1;
+            }
+            c = c.branch->children[i];
+        }
+
+        uint32_t i = lower_index(c.leaf, key);
+        if(i < c.leaf->count && !less(key, c.leaf->entries[i].first)) return &c.leaf->entries[i];
+        if(i > 0) return &c.leaf->entries[i - 1];
+        if(!before.branch) return 0;
+
+        for(; before_level > 0; --before_level) before = before.branch->children[before.branch->count - 1];
+        return &before.leaf->entries[before.leaf->count - 1];
+    }
+
+    /** Return head of a map with key set to value.*/
+    Head* insert(const Head* old, const K& key, const V& value)
+    {
+        Head* h = new_head(old);
+
+        if(!h->root.branch)
+        {
+            Leaf* l = new_leaf();
+            l->entries[0].first = key;
+            l->entries[0].second = value;
+            l->count = 1;
+            h->root.leaf = l;
+            h->height = 0;
+            h->size = 1;
+            return h;
+        }
+
+        Split s = insert_node(h->root, h->height, key, value);
+        h->root = s.left;
+        if(s.added) ++h->size;
+
+        if(s.right.branch)
+        {
+            // Root was split. Add a level.
+            Branch* root = new_branch();
+            root->keys[0] = lower_bound_key(s.left, h->height);
+            root->keys[1] = s.right_bound;
+            root->children[0] = s.left;
+            root->children[1] = s.right;
+            root->count = 2;
+            h->root.branch = root;
+            ++h->height;
+        }
+        return h;
+    }
+
+    /** Return head of a map without key. The key must be in the map of old.*/
+    Head* erase(const Head* old, const K& key)
+    {
+        Head* h = new_head(old);
+        h->root = remove_node(h->root, h->height, key);
+        --h->size;
+
+        while(h->height > 0 && h->root.branch->count == 1)
+        {
+            h->root = h->root.branch->children[0];
+            --h->height;
+        }
+        if(h->height == 0 && h->root.leaf->count == 0) h->root.leaf = 0;
+        return h;
+    }
+
+    /** Collect all nodes not reachable from the referenced maps.*/
+    void gc()
+    {
+        gc_mark();
+        gc_sweep();
+    }
+
+    /** First half of gc(): mark the nodes reachable from the referenced maps. See PListPool::gc_mark.*/
+    void gc_mark()
+    {
+        // Abandon incremental collection if one is running.
+        phase_ = GC_IDLE;
+        gray_.clear();
+
+        heads_.mark_all_empty();
+        branches_.mark_all_empty();
+        leaves_.mark_all_empty();
+
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) mark_head(*r);
+    }
+
+    /** Second half of gc(): free the nodes left unmarked by gc_mark().*/
+    void gc_sweep()
+    {
+        heads_.collect_chunks();
+        branches_.collect_chunks();
+        leaves_.collect_chunks();
+    }
+
+    /** Clear refcounts. Warning: use only if you know what you are doing. */
+    void clear_root_refcounts()
+    {
+        roots_.clear_counts();
+    }
+
+    /** Start an incremental collection. Roots are given to shade(). While marking, add_ref
+     *  shades each head it is given, which covers the maps returned by all operations. Nodes
+     *  are never changed once shared, so no other barrier is needed.*/
+    void begin_incremental()
+    {
+        heads_.mark_all_empty();
+        branches_.mark_all_empty();
+        leaves_.mark_all_empty();
+        gray_.clear();
+        phase_ = GC_MARK;
+
+        roots_.prune();
+        for(auto r = roots_.begin(); r != roots_.end(); ++r) shade(*r);
+    }
+
+    /** Add head to the nodes to mark if marking is in progress.*/
+    void shade(Head* h){if(h && phase_ == GC_MARK) gray_.push_back(GrayNode(h, HEAD_LEVEL));}
+
+    /** Mark at most budget nodes reachable from the shaded ones. visit is called with the key
+     *  and the value of each entry of the leaves marked. Return the number of nodes marked.*/
+    template<class F>
+    size_t mark_step(size_t budget, F& visit)
+    {
+        size_t work = 0;
+        while(work < budget && !gray_.empty())
+        {
+            GrayNode g = gray_.back();
+            gray_.pop_back();
+
+            if(g.level == HEAD_LEVEL)
+            {
+                Head* h = static_cast<Head*>(g.node);
+                if(!heads_.mark(h)) continue;
+                if(h->root.branch) gray_.push_back(GrayNode(h->root.branch, h->height));
+            }
+            else if(g.level == 0)
+            {
+                Leaf* l = static_cast<Leaf*>(g.node);
+                if(!leaves_.mark(l)) continue;
+                for(uint32_t i = 0; i < l->count; ++i)
+                {
+                    visit(l->entries[i].first);
+                    visit(l->entries[i].second);
+                }
+            }
+            else
+            {
+                Branch* b = static_cast<Branch*>(g.node);
+                if(!branches_.mark(b)) continue;
+                for(uint32_t i = 0; i < b->count; ++i)
+                {
+                    visit(b->keys[i]);
+                    gray_.push_back(GrayNode(b->children[i].branch, g.level - 1));
+                }
+            }
+            ++work;
+        }
+        return work;
+    }
+
+    bool marking_done() const {return gray_.empty();}
+
+    /** Start freeing the nodes left unmarked.*/
+    void begin_sweep()
+    {
+        roots_.prune();
+        heads_.begin_sweep();
+        branches_.begin_sweep();
+        leaves_.begin_sweep();
+        phase_ = GC_SWEEP;
+    }
+
+    /** Free unmarked nodes in at most chunk_budget chunks. Return true when the collection is complete.*/
+    bool sweep_step(size_t& chunk_budget)
+    {
+        if(!(heads_.sweep_step(chunk_budget) &&
+             branches_.sweep_step(chunk_budget) &&
+             leaves_.sweep_step(chunk_budget))) return false;
+
+        phase_ = GC_IDLE;
+        return true;
+    }
+
+    GcPhase gc_phase() const {return phase_;}
+
+    /** Return number of bytes used by the chunk pool in total. */
+    size_t reserved_size_bytes()
+    {
+        return sizeof(*this) + roots_.size() * sizeof(Head*) + heads_.reserved_size_bytes() +
+               branches_.reserved_size_bytes() + leaves_.reserved_size_bytes();
+    }
+
+    size_t live_size_bytes()
+    {
+        return sizeof(*this) + roots_.size() * sizeof(Head*) + heads_.live_size_bytes() +
+               branches_.live_size_bytes() + leaves_.live_size_bytes();
+    }
+
+    /** Return number of nodes reserved since the pool was created. */
+    size_t allocated_count() const
+    {
+        return heads_.allocated_count() + branches_.allocated_count() + leaves_.allocated_count();
+    }
+
+private:
+    enum{HEAD_LEVEL = 0xffffffffu};
+
+    /** Node waiting to be marked. Level is the height of a branch, 0 for a leaf or HEAD_LEVEL.*/
+    struct GrayNode
+    {
+        void*    node;
+        uint32_t level;
+        GrayNode(void* n, uint32_t l):node(n), level(l){}
+    };
+
+    /** Copy of a node an entry was inserted to and its new right sibling if the node was split.*/
+    struct Split
+    {
+        Child left;
+        Child right;       //> Null if the node was not split.
+        K     right_bound; //> Lower bound of the keys of right.
+        bool  added;       //> False if the value of an existing key was replaced.
+    };
+
+    Head* new_head(const Head* old)
+    {
+        Head* h = heads_.reserve_element();
+        if(old)
+        {
+            h->root = old->root;
+            h->size = old->size;
+            h->height = old->height;
+        }
+        return h;
+    }
+
+    Branch* new_branch(const Branch* old = 0)
+    {
+        Branch* b = branches_.reserve_element();
+        if(old) *b = *old;
+        return b;
+    }
+
+    Leaf* new_leaf(const Leaf* old = 0)
+    {
+        Leaf* l = leaves_.reserve_element();
+        if(old) *l = *old;
+        return l;
+    }
+
+    static uint32_t node_count(Child c, uint32_t level){return level == 0 ? c.leaf->count : c.branch->count;}
+
+    static const K& lower_bound_key(Child c, uint32_t level){return level == 0 ? c.leaf->entries[0].first : c.branch->keys[0];}
+
+    Split insert_node(Child node, uint32_t level, const K& key, const V& value)
+    {
+        Split s;
+        s.right.branch = 0;
+        s.added = true;
+
+        if(level == 0)
+        {
+            const Leaf* old = node.leaf;
+            uint32_t i = lower_index(old, key);
+
+            if(i < old->count && !less(key, old->entries[i].first))
+            {
+                Leaf* l = new_leaf(old);
+                l->entries[i].second = value;
+                s.left.leaf = l;
+                s.added = false;
+                return s;
+            }
+
+            // Gather the entries to the new leaf and split it if it overflows.
+            KeyValue entries[WIDTH + 1];
+            for(uint32_t j = 0; j < i; ++j) entries[j] = old->entries[j];
+            entries[i].first = key;
+            entries[i].second = value;
+            for(uint32_t j = i; j < old->count; ++j) entries[j + 1] = old->entries[j];
+            uint32_t count = old->count + 1;
+
+            uint32_t left_count = count <= WIDTH ? count : count / 2;
+            Leaf* left = new_leaf();
+            for(uint32_t j = 0; j < left_count; ++j) left->entries[j] = entries[j];
+            left->count = left_count;
+            s.left.leaf = left;
+
+            if(left_count < count)
+            {
+                Leaf* right = new_leaf();
+                for(uint32_t j = left_count; j < count; ++j) right->entries[j - left_count] = entries[j];
+                right->count = count - left_count;
+                s.right.leaf = right;
+                s.right_bound = right->entries[0].first;
+            }
+            return s;
+        }
+
+        const Branch* old = node.branch;
+        uint32_t i = child_index(old, key);
+        Split child = insert_node(old->children[i], level - 1, key, value);
+        s.added = child.added;
+
+        Branch* b = new_branch(old);
+        b->children[i] = child.left;
+        if(less(key, b->keys[i])) b->keys[i] = key;
+
+        if(child.right.branch)
+        {
+            // Room is made for the new sibling. A full branch is split in halves.
+            Branch* right = 0;
+            if(b->count == WIDTH)
+            {
+                right = new_branch();
+                uint32_t left_count = WIDTH / 2;
+                for(uint32_t j = left_count; j < WIDTH; ++j)
+                {
+                    right->keys[j - left_count] = b->keys[j];
+                    right->children[j - left_count] = b->children[j];
+                }
+                right->count = WIDTH - left_count;
+                b->count = left_count;
+            }
+
+            Branch* target = b;
+            uint32_t at = i + 1;
+            if(right && at > b->count)
+            {
+                target = right;
+                at -= b->count;
+            }
+
+            for(uint32_t j = target->count; j > at; --j)
+            {
+                target->keys[j] = target->keys[j - 1];
+                target->children[j] = target->children[j - 1];
+            }
+            target->keys[at] = child.right_bound;
+            target->children[at] = child.right;
+            ++target->count;
+
+            if(right)
+            {
+                s.right.branch = right;
+                s.right_bound = right->keys[0];
+            }
+        }
+
+        s.left.branch = b;
+        return s;
+    }
+
+    /** Return copy of node without key. Key must be in the subtree of node.*/
+    Child remove_node(Child node, uint32_t level, const K& key)
+    {
+        Child result;
+
+        if(level == 0)
+        {
+            const Leaf* old = node.leaf;
+            uint32_t i = lower_index(old, key);
+            Leaf* l = new_leaf();
+            for(uint32_t j = 0, k = 0; j < old->count; ++j) if(j != i) l->entries[k++] = old->entries[j];
+            l->count = old->count - 1;
+            result.leaf = l;
+            return result;
+        }
+
+        const Branch* old = node.branch;
+        uint32_t i = child_index(old, key);
+
+        Branch* b = new_branch(old);
+        b->children[i] = remove_node(old->children[i], level - 1, key);
+        if(node_count(b->children[i], level - 1) < MIN_FILL && b->count > 1) rebalance(b, i, level - 1);
+
+        result.branch = b;
+        return result;
+    }
+
+    /** Merge the underfull child i of b with a sibling, or move entries from the sibling to it.*/
+    void rebalance(Branch* b, uint32_t i, uint32_t child_level)
+    {
+        uint32_t left = i > 0 ? i - 1 : i;
+        uint32_t right = left + 1;
+
+        Child lc = b->children[left];
+        Child rc = b->children[right];
+        uint32_t count = node_count(lc, child_level) + node_count(rc, child_level);
+        uint32_t left_count = count <= WIDTH ? count : count / 2;
+
+        // Split the entries of both children again to one or two new nodes.
+        if(child_level == 0)
+        {
+            KeyValue entries[2 * WIDTH];
+            uint32_t n = 0;
+            for(uint32_t j = 0; j < lc.leaf->count; ++j) entries[n++] = lc.leaf->entries[j];
+            for(uint32_t j = 0; j < rc.leaf->count; ++j) entries[n++] = rc.leaf->entries[j];
+
+            Leaf* l = new_leaf();
+            for(uint32_t j = 0; j < left_count; ++j) l->entries[j] = entries[j];
+            l->count = left_count;
+            b->children[left].leaf = l;
+
+            if(left_count < count)
+            {
+                Leaf* r = new_leaf();
+                for(uint32_t j = left_count; j < count; ++j) r->entries[j - left_count] = entries[j];
+                r->count = count - left_count;
+                b->children[right].leaf = r;
+                b->keys[right] = r->entries[0].first;
+                return;
+            }
+        }
+        else
+        {
+            K     keys[2 * WIDTH];
+            Child children[2 * WIDTH];
+            uint32_t n = 0;
+            for(uint32_t j = 0; j < lc.branch->count; ++j, ++n){keys[n] = lc.branch->keys[j]; children[n] = lc.branch->children[j];}
+            for(uint32_t j = 0; j < rc.branch->count; ++j, ++n){keys[n] = rc.branch->keys[j]; children[n] = rc.branch->children[j];}
+
+            Branch* l = new_branch();
+            for(uint32_t j = 0; j < left_count; ++j){l->keys[j] = keys[j]; l->children[j] = children[j];}
+            l->count = left_count;
+            b->children[left].branch = l;
+
+            if(left_count < count)
+            {
+                Branch* r = new_branch();
+                for(uint32_t j = left_count; j < count; ++j){r->keys[j - left_count] = keys[j]; r->children[j - left_count] = children[j];}
+                r->count = count - left_count;
+                b->children[right].branch = r;
+                b->keys[right] = r->keys[0];
+                return;
+            }
+        }
+
+        // Merged to one node. Remove the right child.
+        for(uint32_t j = right; j + 1 < b->count; ++j)
+        {
+            b->keys[j] = b->keys[j + 1];
+            b->children[j] = b->children[j + 1];
+        }
+        --b->count;
+        b->children[b->count].branch = 0;
+    }
+
+    void mark_head(Head* h)
+    {
+        if(!heads_.mark(h)) return;
+        if(h->root.branch) mark_node(h->root, h->height);
+    }
+
+    void mark_node(Child c, uint32_t level)
+    {
+        if(level == 0)
+        {
+            leaves_.mark(c.leaf);
+            return;
+        }
+
+        // Subtrees shared by several versions are visited once.
+        if(!branches_.mark(c.branch)) return;
+        for(uint32_t i = 0; i < c.branch->count; ++i) mark_node(c.branch->children[i], level - 1);
+    }
+
+    head_chunk_box        heads_;
+    branch_chunk_box      branches_;
+    leaf_chunk_box        leaves_;
+    RootSet<Head>         roots_;  //> Heads referenced by maps
+    GcPhase               phase_;
+    std::vector<GrayNode> gray_;   //> Nodes shaded but not yet marked.
+};
+
 #if 0
 /** Generic collection printer */
 template<class T>
@@ -5,8 +5,15 @@
 #include "persistent_containers.h"
 #include "masp.h"
 #include "masp_classwrap.h"
+#include "iotools.h"
+#include "tinythread.h"
 #include <string>
+#include <sstream>
 #include <functional>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
 using namespace std::placeholders;
 #include "unittester.h"
 
@@ -56,6 +63,12 @@ bool compare_parsing(masp::Masp& m, const char* str, std::function<T(const masp:
     return result;
 }
 
+/** Evaluate str and compare the result to an integer. */
+bool number_is(masp::Masp& m, const char* str, int expect)
+{
+    return compare_parsing<masp::Number>(m, str, masp::value_number, masp::Number::make(expect), masp::NUMBER);
+}
+
 #define FAKE_CONTENTS "Fake!"
 class FakeInputFile{
 public:
@@ -197,6 +210,765 @@ UTEST(masp, simple_parsing)
 }
 
 
+UTEST(masp, number_lexer)
+{
+    masp::Masp m;
+
+    auto int_is = [&m](const char* str, int expect){
+        masp::masp_result r = masp::read_eval(m, str);
+        if(!r.valid() || r.as_value()->get()->type != masp::NUMBER) return false;
+        masp::Number n = masp::value_number(*r.as_value()->get());
+        return n.type == masp::Number::INT && n.to_int() == expect;
+    };
+
+    auto float_is = [&m](const char* str, double expect){
+        masp::masp_result r = masp::read_eval(m, str);
+        if(!r.valid() || r.as_value()->get()->type != masp::NUMBER) return false;
+        masp::Number n = masp::value_number(*r.as_value()->get());
+        return n.type == masp::Number::FLOAT && n.to_float() == expect;
+    };
+
+    auto is_symbol = [&m](const char* str){
+        masp::masp_result r = masp::string_to_value(m, str);
+        if(!r.valid()) return false;
+        const masp::Value* v = r.as_value()->get();
+        return masp::value_list(*v)->size() == 2 && masp::value_list(*v)->second()->type == masp::SYMBOL;
+    };
+
+    ASSERT_TRUE(int_is("0", 0) && int_is("7", 7) && int_is("+12", 12) && int_is("-345", -345), "decimal failed");
+    ASSERT_TRUE(int_is("0x1F", 31) && int_is("0Xff", 255) && int_is("0b101", 5) && int_is("0B0", 0), "prefixed integer failed");
+    ASSERT_TRUE(int_is("(+ 1 0x10)", 17), "integer in list failed");
+    ASSERT_TRUE(float_is("1.5", 1.5) && float_is("-2.25", -2.25) && float_is("3.", 3.0), "float failed");
+    ASSERT_TRUE(float_is("1e3", 1000.0) && float_is("2.5E-1", 0.25) && float_is("+1e+2", 100.0), "exponent failed");
+    ASSERT_TRUE(float_is("007", 7.0) && float_is("-0", 0.0), "leading zero decimal failed");
+    ASSERT_TRUE(int_is("([0.5 2] 1)", 2) && float_is("({'a 0.5} 'a)", 0.5), "number in container failed");
+
+    ASSERT_TRUE(is_symbol("1a") && is_symbol("0x") && is_symbol("0b2") && is_symbol("1e") && is_symbol("-0x10"), "malformed number must be a symbol");
+    ASSERT_TRUE(is_symbol("1.2.3") && is_symbol("-") && is_symbol("+x"), "symbol failed");
+}
+
+UTEST(masp, stream_parsing)
+{
+    masp::Masp m;
+
+    // Span several stream blocks with forms, strings and comments crossing the block boundaries.
+    std::ostringstream os;
+    os << "(def acc 0)\n";
+    for(int i = 0; i < 4000; ++i)
+    {
+        os << "; comment " << i << " (\n";
+        os << "(set acc (+ acc " << i << " (count \"a string ) with ; \")))\n";
+        os << "'[" << i << " 0x" << std::hex << i << std::dec << " " << i << ".5e1]\n";
+    }
+    os << "acc";
+    std::string text = os.str();
+    ASSERT_TRUE(text.size() > 3 * 64 * 1024, "test input too short");
+
+    masp::masp_result from_string = masp::string_to_value(m, text.c_str());
+    std::istringstream is(text);
+    masp::masp_result from_stream = masp::stream_to_value(m, is);
+
+    ASSERT_TRUE(from_string.valid() && from_stream.valid(), "parse failed");
+    ASSERT_TRUE(masp::value_to_string(*from_string.as_value()->get()) == masp::value_to_string(*from_stream.as_value()->get()), "stream parse differs");
+
+    masp::masp_result r = masp::eval(m, from_stream.as_value()->get());
+    ASSERT_TRUE(r.valid() && masp::value_number(*r.as_value()->get()).to_int() == (3999 * 4000) / 2 + 4000 * 18, "stream evaluation failed");
+
+    std::istringstream open_scope("(def a 1) (+ 1");
+    ASSERT_FALSE(masp::stream_to_value(m, open_scope).valid(), "open scope must fail");
+    std::istringstream quote("(def a 1) '");
+    ASSERT_FALSE(masp::stream_to_value(m, quote).valid(), "empty quote must fail");
+    ASSERT_FALSE(masp::file_to_value(m, "no/such/file.mp").valid(), "missing file must fail");
+}
+
+UTEST(masp, compiled_forms)
+{
+    using namespace glh;
+
+    masp::Masp m;
+
+    ASSERT_TRUE(number_is(m, "(if (< 1 2) 1 2)", 1), "if failed");
+    ASSERT_TRUE(number_is(m, "(if (< 2 1) 1 2)", 2), "if else failed");
+    ASSERT_TRUE(number_is(m, "(cond ((< 2 1) 1) ((< 1 2) 2) (else 3))", 2), "cond failed");
+    ASSERT_TRUE(number_is(m, "(def x 1) (set x 5) x", 5), "set failed");
+    ASSERT_TRUE(number_is(m, "(def adder (fn (a) (fn (b) (+ a b)))) ((adder 3) 4)", 7), "closure failed");
+    ASSERT_TRUE(number_is(m, "(defn fact (n) (if (< n 2) 1 (* n (fact (- n 1))))) (fact 5)", 120), "recursion failed");
+    ASSERT_TRUE(number_is(m, "(defn add2 [a b] (+ a b)) (add2 1 2)", 3), "vector parameters failed");
+    ASSERT_TRUE(number_is(m, "([1 2 3] 1)", 2), "vector application failed");
+    ASSERT_TRUE(number_is(m, "({'a 1 'b 2} 'b)", 2), "map application failed");
+    ASSERT_TRUE(number_is(m, "(count (map (range 10) (fn (x) (* x x))))", 10), "map with function failed");
+
+    ASSERT_TRUE(number_is(m, "(defn counter () (def n 0) (fn () (set n (+ n 1)) n)) (def c (counter)) (c) (c)", 2), "captured set failed");
+    ASSERT_TRUE(number_is(m, "(defn late (x) (def g (fn () x)) (set x 10) (g)) (late 1)", 10), "shared capture failed");
+    ASSERT_TRUE(number_is(m, "(defn rec (a) (def f (fn (k) (if (< k 1) a (f (- k 1))))) (f 5)) (rec 42)", 42), "local recursion failed");
+    ASSERT_TRUE(number_is(m, "(defn curry (x) (fn (y) (fn (z) (+ x y z)))) (((curry 1) 2) 3)", 6), "nested capture failed");
+
+    ASSERT_FALSE(masp::read_eval(m, "(undefined-symbol 1)").valid(), "Unknown symbol must fail.");
+    ASSERT_TRUE(number_is(m, "(fact 3)", 6), "Evaluation after failure failed.");
+
+    m.gc();
+    ASSERT_TRUE(number_is(m, "((adder 1) (fact 4))", 25), "Evaluation after gc failed.");
+}
+
+UTEST(masp, interned_symbols)
+{
+    const char* name = "foo-bar";
+
+    masp::Value a = masp::make_value_symbol("foo-bar");
+    masp::Value b = masp::make_value_symbol(name, name + strlen(name));
+    masp::Value c = masp::make_value_symbol("foo");
+    masp::Value s = masp::make_value_string("foo-bar");
+
+    ASSERT_TRUE(a.value.symbol == b.value.symbol, "Same name was interned twice.");
+    ASSERT_TRUE(a == b && a.get_hash() == b.get_hash(), "Equal symbols differ.");
+    ASSERT_FALSE(a == c, "Different symbols are equal.");
+    ASSERT_FALSE(a == s, "Symbol equals string.");
+    ASSERT_TRUE(strcmp(masp::value_string(a), name) == 0, "Symbol name mismatch.");
+
+    masp::Masp m;
+    masp::masp_result r = masp::read_eval(m, "(def foo-bar 1) 'foo-bar");
+    ASSERT_TRUE(r.valid() && (*r.as_value()->get()) == a, "Parsed symbol differs.");
+
+    // Threads intern the same names concurrently.
+    struct Interner
+    {
+        std::vector<const masp::Symbol*> symbols;
+        static void run(void* arg)
+        {
+            Interner* self = static_cast<Interner*>(arg);
+            for(int i = 0; i < 2000; ++i)
+            {
+                std::ostringstream name;
+                name << "threaded-symbol-" << i;
+                self->symbols.push_back(masp::make_value_symbol(name.str().c_str()).value.symbol);
+            }
+        }
+    };
+
+    Interner interners[4];
+    std::vector<std::unique_ptr<tthread::thread>> threads;
+    for(auto& in : interners) threads.emplace_back(new tthread::thread(Interner::run, &in));
+    for(auto& t : threads) t->join();
+
+    bool same = true;
+    for(auto& in : interners) same = same && in.symbols == interners[0].symbols;
+    ASSERT_TRUE(same, "Threads interned different symbols.");
+}
+
+UTEST(masp, shared_strings)
+{
+    masp::Value a = masp::make_value_string("hello world");
+    masp::Value b = a;
+    ASSERT_TRUE(a.value.string == b.value.string, "Copied string was not shared.");
+
+    masp::Value hello = masp::make_value_substring(a, 0, 5);
+    masp::Value world = masp::make_value_substring(a, 6, 11);
+    ASSERT_TRUE(hello == masp::make_value_string("hello"), "Prefix slice differs.");
+    ASSERT_TRUE(hello.get_hash() == masp::make_value_string("hello").get_hash(), "Slice hash differs.");
+    ASSERT_TRUE(strcmp(masp::value_string(hello), "hello") == 0, "Prefix slice is not terminated.");
+    ASSERT_TRUE(strcmp(masp::value_string(world), "world") == 0, "Suffix slice differs.");
+    ASSERT_TRUE(masp::value_string(world) == masp::value_string(a) + 6, "Suffix slice copied its chars.");
+
+    a = masp::Value();
+    b = masp::Value();
+    ASSERT_TRUE(strcmp(masp::value_string(world), "world") == 0, "Slice outlived by its buffer.");
+
+    masp::Masp m;
+    masp::masp_result r = masp::read_eval(m, "(def s \"masp strings\") (count (subs s 5))");
+    ASSERT_TRUE(r.valid() && (*r.as_value()->get()) == masp::make_value_number(7), "subs failed.");
+    masp::masp_result joined = masp::read_eval(m, "(str (subs s 0 4) \"-\" (subs s 5 8))");
+    ASSERT_TRUE(joined.valid() && (*joined.as_value()->get()) == masp::make_value_string("masp-str"), "subs into str failed.");
+}
+
+UTEST(masp, calls_do_not_allocate)
+{
+    masp::Masp m;
+
+    ASSERT_TRUE(masp::read_eval(m, "(defn down (n a b) (if (< n 1) a (down (- n 1) b a)))").valid(), "def failed");
+
+    masp::masp_result parsed = masp::string_to_value(m, "(down 1000 1 2)");
+    ASSERT_TRUE(parsed.valid(), "parse failed");
+
+    size_t live_before = m.live_size_bytes();
+    masp::masp_result r = masp::eval(m, parsed.as_value()->get());
+    ASSERT_TRUE(r.valid(), "eval failed");
+    ASSERT_TRUE(m.live_size_bytes() == live_before, "Function calls allocated from pools.");
+
+    // Parameters are not filled in with nil.
+    masp::masp_result missing = masp::read_eval(m, "((fn (x y) y) 1)");
+    ASSERT_TRUE(!missing.valid() && missing.message().find("Too few arguments") != std::string::npos, "missing argument was nil");
+    ASSERT_FALSE(masp::read_eval(m, "(defn pair (x y) y) (pair)").valid(), "call without arguments succeeded");
+    ASSERT_FALSE(masp::read_eval(m, "(defn short (n) (if (< n 1) n (down (- n 1) 1))) (short 3)").valid(), "tail call without argument succeeded");
+    masp::masp_result extra = masp::read_eval(m, "((fn (x) x) 1 2 3)");
+    ASSERT_TRUE(!extra.valid() && extra.message().find("Too many arguments") != std::string::npos, "extra arguments were dropped");
+    ASSERT_FALSE(masp::read_eval(m, "(defn one (a) a) (one 1 2)").valid(), "call with an extra argument succeeded");
+    ASSERT_FALSE(masp::read_eval(m, "(defn more (n) (if (< n 1) n (down (- n 1) 1 2 3))) (more 3)").valid(), "tail call with extra argument succeeded");
+    ASSERT_TRUE(number_is(m, "(def last 0) (iter 'a 'b [1 2 3 4] (fn (a _) (set last a))) last", 3), "iter with matching arity failed");
+    ASSERT_TRUE(masp::read_eval(m, "(down 10 1 2)").valid(), "interpreter unusable after error");
+}
+
+masp::Value arg_count(masp::Masp& m, masp::ArgSpan args, masp::Map& env)
+{
+    return masp::make_value_number((int) args.size());
+}
+
+masp::Value arg_count_vector(masp::Masp& m, masp::Vector& args, masp::Map& env)
+{
+    return masp::make_value_number((int) args.size());
+}
+
+/** Collect garbage and reuse the freed pool nodes, then sum the first elements of the vectors.*/
+template<class I>
+masp::Value collect_and_sum_firsts(masp::Masp& m, I begin, I end)
+{
+    m.gc();
+    masp::read_eval(m, "(count (map (range 2000) (fn (x) [x x x])))");
+
+    int sum = 0;
+    for(; begin != end; ++begin) sum += masp::value_number((*masp::value_vector(*begin))[0]).to_int();
+    return masp::make_value_number(sum);
+}
+
+masp::Value gc_sum(masp::Masp& m, masp::ArgSpan args, masp::Map& env)
+{
+    return collect_and_sum_firsts(m, args.begin(), args.end());
+}
+
+masp::Value gc_sum_vector(masp::Masp& m, masp::Vector& args, masp::Map& env)
+{
+    return collect_and_sum_firsts(m, args.begin(), args.end());
+}
+
+UTEST(masp, primitive_arguments)
+{
+    masp::Masp m;
+    masp::add_fun(m, "argc", arg_count);
+    masp::add_fun(m, "argc-vector", arg_count_vector);
+
+    std::ostringstream many;
+    many << "(argc";
+    for(int i = 0; i < 1000; ++i) many << " " << i;
+    many << ")";
+
+    masp::masp_result r = masp::read_eval(m, "(+ (argc 1 2 3) (argc-vector 1 2))");
+    ASSERT_TRUE(r.valid() && (*r.as_value()->get()) == masp::make_value_number(5), "Native or adapted call failed.");
+    masp::masp_result nested = masp::read_eval(m, "(first (map [1 2 3] (fn (x) (+ x (argc 1 2 (argc 3 4))))))");
+    ASSERT_TRUE(nested.valid() && (*nested.as_value()->get()) == masp::make_value_number(4), "Nested call failed.");
+    masp::masp_result long_list = masp::read_eval(m, many.str().c_str());
+    ASSERT_TRUE(long_list.valid() && (*long_list.as_value()->get()) == masp::make_value_number(1000), "Long argument list failed.");
+
+    // Arguments held only by a running primitive survive a collection.
+    masp::add_fun(m, "gc-sum", gc_sum);
+    masp::add_fun(m, "gc-sum-vector", gc_sum_vector);
+
+    std::ostringstream vectors;
+    for(int i = 0; i < 300; ++i) vectors << " [" << i << "]";
+
+    std::string sum = "(gc-sum" + vectors.str() + ")";
+    masp::masp_result collected = masp::read_eval(m, sum.c_str());
+    ASSERT_TRUE(collected.valid() && (*collected.as_value()->get()) == masp::make_value_number(300 * 299 / 2),
+                "Long argument list was collected.");
+
+    std::string sum_vector = "(first (map [1] (fn (x) (gc-sum-vector" + vectors.str() + "))))";
+    masp::masp_result adapted = masp::read_eval(m, sum_vector.c_str());
+    ASSERT_TRUE(adapted.valid() && (*adapted.as_value()->get()) == masp::make_value_number(300 * 299 / 2),
+                "Adapted arguments were collected.");
+}
+
+/** Evaluate str twice and check that the result is expect and that pools did not
+ *  grow during the second evaluation. */
+bool eval_in_constant_pool_memory(masp::Masp& m, const char* str, int expect)
+{
+    masp::masp_result parsed = masp::string_to_value(m, str);
+    if(!parsed.valid()) return false;
+
+    masp::masp_result first = masp::eval(m, parsed.as_value()->get());
+    size_t live_before = m.live_size_bytes();
+    masp::masp_result r = masp::eval(m, parsed.as_value()->get());
+
+    return r.valid() && expect_value<masp::Number>(*r.as_value(), masp::value_number, masp::Number::make(expect), masp::NUMBER) &&
+        m.live_size_bytes() == live_before;
+}
+
+UTEST(masp, tail_calls_and_loops)
+{
+    using namespace glh;
+
+    masp::Masp m;
+
+    ASSERT_TRUE(number_is(m, "(defn fact (n) (loop [i n acc 1] (if (< i 2) acc (recur (- i 1) (* acc i))))) (fact 10)", 3628800), "loop failed");
+    ASSERT_TRUE(number_is(m, "(defn inc-loop (x) (+ 1 (loop (i x) (if (< i 10) (recur (+ i 1)) i)))) (inc-loop 0)", 11), "nested loop failed");
+    ASSERT_TRUE(number_is(m, "(def fs (loop (i 0 acc '()) (if (< i 3) (recur (+ i 1) (cons (fn () i) acc)) acc))) ((first fs))", 2), "loop capture failed");
+    ASSERT_FALSE(masp::read_eval(m, "(loop (i 0) (+ 1 (recur i)))").valid(), "recur outside tail position must fail.");
+
+    ASSERT_TRUE(masp::read_eval(m, "(defn down (n) (if (< n 1) 0 (down (- n 1))))").valid(), "def failed");
+    ASSERT_TRUE(eval_in_constant_pool_memory(m, "(down 1000000)", 0), "Tail recursion failed.");
+    ASSERT_TRUE(eval_in_constant_pool_memory(m, "(loop (i 0) (if (< i 1000000) (recur (+ i 1)) i))", 1000000), "Loop failed.");
+}
+
+/** Evaluate str and log the time it took. */
+bool timed_parsing(masp::Masp& m, const char* name, const char* str, int expect)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    bool result = number_is(m, str, expect);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    GLH_TEST_LOG(name << ": " << ms << " ms");
+
+    return result;
+}
+
+UTEST(masp, incremental_gc)
+{
+    const char* setup =
+        "(def keep (map (range 1000) (fn (x) (make-map 'x x 'l [x (+ x 1) (+ x 2)]))))"
+        "(count keep)"
+        "(count (map (range 2000) (fn (x) [x x x x x])))";
+    const char* mutate = "(def keep (cons (make-map 'x -1 'l (range 3)) keep))";
+
+    masp::Masp m;
+    masp::Masp reference;
+    ASSERT_TRUE(masp::read_eval(m, setup).valid() && masp::read_eval(reference, setup).valid(), "setup failed");
+
+    size_t live_before = m.live_size_bytes();
+
+    // Step with a small budget and change the state between the steps.
+    size_t steps = 0;
+    while(!m.gc_step(50))
+    {
+        if(steps++ < 20)
+        {
+            ASSERT_TRUE(masp::read_eval(m, mutate).valid() && masp::read_eval(reference, mutate).valid(), "mutate failed");
+        }
+    }
+
+    const masp::GcStats& stats = m.gc_stats();
+    ASSERT_TRUE(stats.incremental_cycles == 1 && stats.steps > 20, "Collection was not incremental.");
+    ASSERT_TRUE(stats.max_pause_ms >= stats.last_pause_ms && stats.total_pause_ms >= stats.max_pause_ms, "Bad pause statistics.");
+    ASSERT_TRUE(m.live_size_bytes() < live_before, "Garbage was not collected.");
+
+    std::string expect = masp::value_to_string(*masp::get_value(reference, "keep"));
+    ASSERT_TRUE(masp::value_to_string(*masp::get_value(m, "keep")) == expect, "Live data changed by incremental collection.");
+
+    m.gc();
+    ASSERT_TRUE(masp::value_to_string(*masp::get_value(m, "keep")) == expect, "Live data changed by full collection.");
+    ASSERT_TRUE(m.gc_stats().full_collections == 1, "Full collection was not counted.");
+
+    // Values written to a closure between steps survive after the closure was marked.
+    ASSERT_TRUE(masp::read_eval(m, "(defn make-box () (def v nil) (fn (x) (if x (set v x) v)))"
+                                   "(def box (make-box)) (def data [[1 2] [3 4]])").valid(), "def failed");
+    ASSERT_FALSE(m.gc_step(1), "Collection finished in one step.");
+    ASSERT_TRUE(masp::read_eval(m, "(box data) (def data nil)").valid(), "mutate failed");
+    steps = 0;
+    while(!m.gc_step(1))
+    {
+        if(++steps == 5) ASSERT_TRUE(masp::read_eval(m, "(box (conj (box nil) [5 6]))").valid(), "mutate failed");
+    }
+    ASSERT_TRUE(steps > 5, "Closure was not changed during marking.");
+    ASSERT_TRUE(masp::read_eval(m, "(count (map (range 2000) (fn (x) [x x x])))").valid(), "reuse failed");
+    ASSERT_TRUE(masp::value_to_string(*masp::read_eval(m, "(box nil)").as_value()->get()) == "[[1 2 ] [3 4 ] [5 6 ] ]",
+                "Value held by a marked closure was collected.");
+}
+
+UTEST(masp, destroy_large_interpreter)
+{
+    // Enough nodes to fill several slabs that the collections of the destructor leave empty.
+    const char* fill = "(count (map (range 0 1 200000) (fn (y) (make-map 'a y 'b [y y y]))))";
+    auto filled = [fill](masp::Masp& m){
+        masp::masp_result r = masp::read_eval(m, fill);
+        return r.valid() && masp::value_to_string(*r.as_value()->get()) == "200000";
+    };
+
+    {
+        masp::Masp m;
+        ASSERT_TRUE(filled(m), "fill failed");
+    }
+    {
+        masp::Masp m;
+        ASSERT_TRUE(filled(m), "fill failed");
+        m.gc();
+    }
+    {
+        // Workers collect after the job and are destroyed with the pool.
+        masp::MaspPool pool(3);
+        masp::Masp m;
+        m.set_worker_pool(&pool);
+        masp::masp_result r = masp::read_eval(m, "(count (pmap (range 0 1 200000) (fn (y) (count (make-map 'a y 'b [y y y])))))");
+        ASSERT_TRUE(r.valid() && masp::value_to_string(*r.as_value()->get()) == "200000", "pmap failed");
+    }
+}
+
+UTEST(masp, persistent_vectors)
+{
+    masp::Masp m;
+
+    ASSERT_TRUE(timed_parsing(m, "conj 100000",
+        "(def v (loop [i 0 acc []] (if (< i 100000) (recur (+ i 1) (conj acc i)) acc))) (count v)", 100000), "conj failed");
+    ASSERT_TRUE(number_is(m, "(+ (v 0) (v 31) (v 32) (v 1055) (v 99999))", 0 + 31 + 32 + 1055 + 99999), "vector indexing failed");
+    ASSERT_TRUE(number_is(m, "(def a [1 2 3]) (def b (conj a 4)) (def c (conj a 5)) (+ (b 3) (c 3) (count a))", 12), "vector versions are not independent");
+    ASSERT_TRUE(number_is(m, "(count (cons 0 a))", 4), "cons to vector failed");
+    ASSERT_TRUE(number_is(m, "(first (next [7 8 9]))", 8), "next of vector failed");
+
+    ASSERT_TRUE(masp::read_eval(m, "(def vm (conj [] {'a 5} (range 3)))").valid(), "def failed");
+    m.gc();
+    ASSERT_TRUE(number_is(m, "(+ ((vm 0) 'a) (count (vm 1)) (v 65536))", 5 + 3 + 65536), "vector contents lost in gc");
+}
+
+UTEST(masp, map_diff_merge)
+{
+    masp::Masp m;
+
+    ASSERT_TRUE(masp::read_eval(m, "(def a (make-map 'x 1 'y 2 'z 3)) (def b (remove (insert a 'x 10 'w 4) 'z))").valid(), "def failed");
+    ASSERT_TRUE(number_is(m, "(count (diff a b))", 3), "diff found wrong number of changes");
+    ASSERT_TRUE(number_is(m, "(+ (((diff a b) 'x) 0) (((diff a b) 'x) 1) (((diff a b) 'w) 1) (((diff a b) 'z) 0))", 1 + 10 + 4 + 3), "diff values failed");
+    ASSERT_TRUE(number_is(m, "(count (diff a a))", 0), "diff of equal maps failed");
+    ASSERT_TRUE(number_is(m, "(def c (merge a b)) (+ (c 'x) (c 'y) (c 'z) (c 'w))", 10 + 2 + 3 + 4), "merge failed");
+    ASSERT_TRUE(number_is(m, "(def d (merge a b (fn (k u v) (+ u v)))) (d 'x)", 11), "merge with resolver failed");
+
+    // Large maps of numbers are built in parallel.
+    std::ostringstream big;
+    big << "(def big (make-map";
+    for(int i = 0; i < 20000; ++i) big << " " << i << " " << 2 * i;
+    big << "))";
+    ASSERT_TRUE(masp::read_eval(m, big.str().c_str()).valid(), "def big failed");
+    ASSERT_TRUE(number_is(m, "(count big)", 20000), "big map count failed");
+    ASSERT_TRUE(number_is(m, "(+ (big 0) (big 777) (big 19999))", 2 * 777 + 2 * 19999), "big map lookup failed");
+}
+
+UTEST(masp, sorted_maps)
+{
+    masp::Masp m;
+
+    ASSERT_TRUE(masp::read_eval(m, "(def s (make-sorted-map 30 'c 10 'a 20 'b)) (def t (insert s 25 [1 2] 5 'z))").valid(), "def failed");
+    ASSERT_TRUE(number_is(m, "(count t)", 5), "insert failed");
+    ASSERT_TRUE(number_is(m, "(first (keys t))", 5), "keys are not in order");
+    ASSERT_TRUE(number_is(m, "(first (next (next (next (keys t)))))", 25), "keys are not in order");
+    ASSERT_TRUE(number_is(m, "((t 25) 1)", 2), "lookup failed");
+    ASSERT_TRUE(number_is(m, "((floor-entry t 24) 0)", 20), "floor-entry failed");
+    ASSERT_TRUE(number_is(m, "((ceiling-entry t 24) 0)", 25), "ceiling-entry failed");
+    ASSERT_TRUE(number_is(m, "(count (subrange t 10 30))", 3), "subrange failed");
+    ASSERT_TRUE(number_is(m, "(count (remove t 5 30 99))", 3), "remove failed");
+    masp::masp_result below = masp::read_eval(m, "(floor-entry t 1)");
+    ASSERT_TRUE(below.valid() && below.as_value()->get()->is_nil(), "floor-entry below the first key is not nil");
+    ASSERT_TRUE(!masp::read_eval(m, "(insert s [1] 1)").valid(), "collection keys were accepted");
+
+    ASSERT_TRUE(masp::read_eval(m, "(def names (make-sorted-map \"pear\" 3 \"apple\" 1 \"fig\" 2))").valid(), "def failed");
+    ASSERT_TRUE(compare_parsing<std::string>(m, "(first (keys names))", masp::value_string, std::string("apple"), masp::STRING), "strings are not in order");
+
+    m.gc();
+    ASSERT_TRUE(number_is(m, "(+ ((t 25) 0) (names \"fig\"))", 3), "Evaluation after gc failed.");
+}
+
+UTEST(masp, lazy_sequences)
+{
+    masp::Masp m;
+
+    ASSERT_TRUE(masp::read_eval(m, "(def calls 0) (def sq (fn (x) (set calls (+ calls 1)) (* x x)))"
+                                   "(def even? (fn (x) (= x (* 2 (/ x 2)))))").valid(), "def failed");
+
+    // Only the elements needed by the take are mapped.
+    ASSERT_TRUE(number_is(m, "(count (take 10 (filter (map (range 1000000) sq) even?)))", 10), "take of filter failed");
+    ASSERT_TRUE(number_is(m, "calls", 19), "pipeline realized more than it needed");
+
+    // Sequences are realized a chunk at a time and only once.
+    ASSERT_TRUE(number_is(m, "(def r (map (range 100) sq)) (set calls 0) (first (next r))", 1), "next of sequence failed");
+    ASSERT_TRUE(number_is(m, "calls", 32), "sequence was not realized by chunk");
+    ASSERT_TRUE(number_is(m, "(+ (count r) (count r) calls)", 300), "count realized a sequence twice");
+
+    ASSERT_TRUE(number_is(m, "(first (drop 3 (range 10)))", 3), "drop failed");
+    ASSERT_TRUE(number_is(m, "(count (drop-last 2 (range 10)))", 8), "drop-last failed");
+    ASSERT_TRUE(number_is(m, "(first (drop-while (range 10) (fn (x) (< x 4))))", 4), "drop-while failed");
+    ASSERT_TRUE(number_is(m, "(count (take-while (range 100) (fn (x) (< x 7))))", 7), "take-while failed");
+    ASSERT_TRUE(number_is(m, "(count (filter [1 2 3 4] (fn (x) (> x 2))))", 2), "filter of vector failed");
+    ASSERT_TRUE(number_is(m, "(fnext (drop 1 '(7 8 9)))", 9), "drop of list failed");
+    ASSERT_TRUE(number_is(m, "(+ (first (cons 9 (range 3))) (count (cons 9 (range 40))))", 50), "cons to sequence failed");
+    ASSERT_TRUE(number_is(m, "(def total 0) (iter (range 5) (fn (x) (set total (+ total x)))) total", 10), "iter failed");
+    ASSERT_TRUE(number_is(m, "(if (= (take 3 (range 10)) (range 3)) 1 0)", 1), "equal sequences differ");
+
+    // Ranges are sequences, which are read like lists.
+    ASSERT_TRUE(number_is(m, "(if (list? (range 0 1 3)) 1 0)", 1), "range is not a list");
+    ASSERT_TRUE(number_is(m, "(def c (conj (range 0 1 3) 9)) (if (list? c) (+ (count c) (first (nnext (next c)))) 0)", 13), "conj to range failed");
+    ASSERT_TRUE(number_is(m, "(if (= '(0 1 2) (range 0 1 3)) 1 0)", 1), "range differs from equal list");
+    ASSERT_TRUE(number_is(m, "(if (= (range 0 1 3) [0 1 2]) 1 0)", 1), "range differs from equal vector");
+    ASSERT_TRUE(number_is(m, "(if (= '(0 1) (range 0 1 3)) 1 0)", 0), "range equals shorter list");
+    ASSERT_TRUE(number_is(m, "(def km (make-map '(0 1 2) 5)) (km (range 0 1 3))", 5), "range did not find list key");
+
+    masp::masp_result printed = masp::read_eval(m, "(take 3 (range 10))");
+    ASSERT_TRUE(printed.valid() && masp::value_to_string(*printed.as_value()->get()) == "(0 1 2 )", "sequence printed wrong");
+
+    // Errors of the stages of a lazy result fail the evaluation.
+    masp::masp_result failed = masp::read_eval(m, "(take 3 (filter (range 0 1 10) (fn (x) (undefined x))))");
+    ASSERT_FALSE(failed.valid(), "error in lazy stage was not reported");
+    ASSERT_TRUE(failed.message().find("undefined") != std::string::npos, "wrong error from lazy stage");
+
+    // Printing a sequence nested in a value runs its stages.
+    masp::masp_result nested = masp::read_eval(m, "[(take 3 (filter (range 0 1 10) (fn (x) (undefined x))))]");
+    bool print_failed = false;
+    try{masp::value_to_string(*nested.as_value()->get());}
+    catch(const masp::EvaluationException&){print_failed = true;}
+    ASSERT_TRUE(nested.valid() && print_failed, "error in nested lazy stage was not thrown by printing");
+
+    // Realized elements and the sources of the rest survive a collection.
+    ASSERT_TRUE(masp::read_eval(m, "(def keep (map (range 100) (fn (x) [x (range x)])))"
+                                   "(def half (drop 50 keep)) (first (next keep))").valid(), "def failed");
+    m.gc();
+    ASSERT_TRUE(number_is(m, "(+ (count ((first half) 1)) (count keep) (first (first (drop 60 keep))))", 50 + 100 + 60), "Sequence lost elements in gc.");
+}
+
+UTEST(masp, module_cache)
+{
+    const char* source_path = "masp_module_test.mp";
+    const char* module_path = "masp_module_test.mpc";
+    std::remove(module_path);
+
+    ASSERT_TRUE(string_to_file(source_path,
+        "(def modval (+ 1 2)) (defn modfun (x) (* x modval)) '(a \"s\" 1.5 true nil [1 2])"), "could not write module");
+
+    const char* import = "(import \"masp_module_test.mp\")";
+    const char* expect = "(a \"s\" 1.5 true nil (make-vector 1 2 ) )";
+
+    auto imported = [import, expect](masp::Masp& m){
+        masp::masp_result r = masp::read_eval(m, import);
+        return r.valid() && masp::value_to_string(*r.as_value()->get()) == expect;
+    };
+
+    masp::Masp a;
+    ASSERT_TRUE(imported(a) && number_is(a, "(modfun 2)", 6), "first import failed");
+    ASSERT_TRUE(a.module_stats().parsed == 1 && std::get<1>(file_to_bytes(module_path)), "module was not precompiled");
+
+    ASSERT_TRUE(imported(a) && a.module_stats().cached == 1 && a.module_stats().parsed == 1, "second import was not cached");
+    a.gc();
+    ASSERT_TRUE(imported(a) && number_is(a, "(modfun 3)", 9), "cached module lost in gc");
+
+    masp::Masp b;
+    ASSERT_TRUE(imported(b) && number_is(b, "(modfun 2)", 6), "precompiled import failed");
+    ASSERT_TRUE(b.module_stats().precompiled == 1 && b.module_stats().parsed == 0, "precompiled module was not used");
+
+    // Changed source is parsed again.
+    ASSERT_TRUE(string_to_file(source_path, "(def modval 4) (modfun 2)"), "could not write module");
+    ASSERT_TRUE(number_is(b, import, 8) && b.module_stats().parsed == 1, "changed module was not parsed");
+
+    // Modules whose code would take more values from the stack than it pushed are ignored.
+    // The call of (modfun 2) is changed to pass three arguments.
+    std::vector<uint8_t> bytes = std::get<0>(file_to_bytes(module_path));
+    const uint8_t call_and_return[] = {14, 1, 0, 0, 17, 0, 0, 0}; // OP_CALL 1, then OP_RETURN.
+    auto call = std::search(bytes.begin(), bytes.end(), std::begin(call_and_return), std::end(call_and_return));
+    ASSERT_TRUE(call != bytes.end(), "call not found in module file");
+    call[1] = 3;
+    {
+        std::ofstream out(module_path, std::ios::binary);
+        out.write((const char*) bytes.data(), bytes.size());
+    }
+    masp::Masp d;
+    ASSERT_TRUE(masp::read_eval(d, "(defn modfun (x) (* x modval))").valid(), "defn failed");
+    ASSERT_TRUE(number_is(d, import, 8) && d.module_stats().parsed == 1, "module with stack underflow was used");
+
+    // Malformed module files are ignored.
+    ASSERT_TRUE(string_to_file(module_path, "MASPC"), "could not write module file");
+    masp::Masp c;
+    ASSERT_TRUE(masp::read_eval(c, "(defn modfun (x) (* x modval))").valid(), "defn failed");
+    ASSERT_TRUE(number_is(c, import, 8) && c.module_stats().parsed == 1, "malformed module file was used");
+
+    // Forms before one that does not compile are run.
+    ASSERT_TRUE(string_to_file(source_path, "(def early 1) (fn)"), "could not write module");
+    ASSERT_FALSE(masp::read_eval(c, import).valid(), "compile error was not reported");
+    ASSERT_TRUE(number_is(c, "early", 1), "forms before compile error were not run");
+
+    ASSERT_FALSE(masp::read_eval(c, "(import \"no/such/module.mp\")").valid(), "missing module must fail");
+
+    std::remove(source_path);
+    std::remove(module_path);
+}
+
+UTEST(masp, parse_benchmark)
+{
+    // A colors.mp like data table.
+    std::ostringstream os;
+    os << "(def table [";
+    for(int i = 0; i < 20000; ++i)
+    {
+        os << "{'name \"color-" << i << "\" 'r " << (i % 256) / 255.0 << " 'g 0x" << std::hex << (i % 256) << std::dec
+           << " 'b " << i % 7 << " 'a 1.0e0}\n";
+    }
+    os << "]) (count table)";
+    std::string text = os.str();
+
+    masp::Masp m;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    masp::masp_result parsed = masp::string_to_value(m, text.c_str());
+    auto mid = std::chrono::high_resolution_clock::now();
+    std::istringstream is(text);
+    masp::masp_result streamed = masp::stream_to_value(m, is);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    ASSERT_TRUE(parsed.valid() && streamed.valid(), "parse failed");
+
+    double mb        = text.size() / (1024.0 * 1024.0);
+    double string_ms = std::chrono::duration<double, std::milli>(mid - start).count();
+    double stream_ms = std::chrono::duration<double, std::milli>(end - mid).count();
+    GLH_TEST_LOG("parse " << mb << " MB: " << string_ms << " ms (" << mb / (string_ms / 1000.0) << " MB/s)");
+    GLH_TEST_LOG("stream parse " << mb << " MB: " << stream_ms << " ms (" << mb / (stream_ms / 1000.0) << " MB/s)");
+
+    masp::masp_result r = masp::eval(m, parsed.as_value()->get());
+    ASSERT_TRUE(r.valid() && masp::value_number(*r.as_value()->get()).to_int() == 20000, "table evaluation failed");
+}
+
+/** Columns of the profile report line of the function name. */
+struct ProfileLine{size_t calls; double inclusive_ms, exclusive_ms; size_t list_nodes, map_nodes, other_nodes;};
+
+bool profile_line(const std::string& report, const char* name, ProfileLine& line)
+{
+    std::istringstream is(report);
+    std::string row;
+    while(std::getline(is, row))
+    {
+        std::istringstream rs(row);
+        std::string row_name;
+        if(rs >> line.calls >> line.inclusive_ms >> line.exclusive_ms >> line.list_nodes >> line.map_nodes
+              >> line.other_nodes >> row_name && row_name == name) return true;
+    }
+    return false;
+}
+
+masp::Value profile_off(masp::Masp& m, masp::ArgSpan args, masp::Map& env)
+{
+    m.set_profiling(false);
+    return masp::make_value_number(0);
+}
+
+UTEST(masp, profiler)
+{
+    masp::Masp m;
+    masp::add_fun(m, "profile-off", profile_off);
+
+    const char* fib = "(defn fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)";
+    ProfileLine line;
+
+    // Nothing is recorded while profiling is off.
+    ASSERT_TRUE(masp::read_eval(m, fib).valid(), "fib failed");
+    ASSERT_FALSE(profile_line(m.profile_report(), "fib", line), "profile recorded while off");
+
+    m.set_profiling(true);
+    ASSERT_TRUE(masp::read_eval(m, fib).valid(), "fib failed");
+    std::string report = m.profile_report();
+    GLH_TEST_LOG("profile:\n" << report);
+
+    ASSERT_TRUE(profile_line(report, "fib", line) && line.calls == 21891, "fib calls not counted");
+    ASSERT_TRUE(line.inclusive_ms >= line.exclusive_ms, "fib inclusive time less than exclusive");
+    ASSERT_TRUE(profile_line(report, "+", line) && line.calls == 10945, "primitive calls not counted");
+    ASSERT_TRUE(m.profile_collapsed_stacks().find("<toplevel>;fib;fib") != std::string::npos, "fib stacks missing");
+
+    // Nodes are attributed to the primitive allocating them.
+    m.reset_profile();
+    ASSERT_TRUE(masp::read_eval(m,
+        "(defn build (n) (loop (i 0 acc '()) (if (< i n) (recur (+ i 1) (cons i acc)) acc)))"
+        "(defn maps (n) (make-map 'a n 'b n)) (build 100) (maps 1)").valid(), "build failed");
+    report = m.profile_report();
+    ASSERT_FALSE(profile_line(report, "fib", line), "profile was not reset");
+    ASSERT_TRUE(profile_line(report, "cons", line) && line.calls == 100 && line.list_nodes > 0, "list nodes not counted");
+    ASSERT_TRUE(profile_line(report, "build", line) && line.list_nodes == 0, "list nodes counted for caller");
+    ASSERT_TRUE(profile_line(report, "make-map", line) && line.map_nodes > 0, "map nodes not counted");
+
+    // Anonymous functions are named after the enclosing function.
+    ASSERT_TRUE(masp::read_eval(m, "(defn outer (x) ((fn (y) (* y 2)) x)) (outer 2)").valid(), "outer failed");
+    ASSERT_TRUE(profile_line(m.profile_report(), "outer/fn", line) && line.calls == 1, "anonymous function not named");
+
+    // Errors and turning profiling off during evaluation close the open calls.
+    ASSERT_FALSE(masp::read_eval(m, "(defn fails (n) (if (< n 1) (undefined-fun) (fails (- n 1)))) (+ 1 (fails 5))").valid(),
+                 "error not reported");
+    ASSERT_TRUE(masp::read_eval(m, "(defn stops (n) (if (< n 1) (profile-off) (+ 1 (stops (- n 1))))) (stops 5)").valid(),
+                "profile-off failed");
+    ASSERT_FALSE(m.profiling(), "profiling still on");
+    ASSERT_TRUE(profile_line(m.profile_report(), "stops", line) && line.calls == 6, "calls before profile-off lost");
+    ASSERT_TRUE(masp::read_eval(m, fib).valid(), "fib failed after profile-off");
+}
+
+UTEST(masp, worker_pool)
+{
+    const char* work = "(defn work (x) (loop (i 0 acc 0) (if (< i 100) (recur (+ i 1) (+ acc (* (+ x i) 3))) acc)))";
+
+    auto result_string = [](masp::Masp& m, const char* str){
+        masp::masp_result r = masp::read_eval(m, str);
+        return r.valid() ? masp::value_to_string(*r.as_value()->get()) : std::string("error:") + r.message();
+    };
+
+    masp::MaspPool pool(4);
+    ASSERT_TRUE(pool.size() == 4, "wrong worker count");
+    ASSERT_TRUE(pool.load(work).valid(), "loading workers failed");
+
+    // Without a pool pmap runs in the interpreter itself.
+    masp::Masp serial;
+    ASSERT_TRUE(masp::read_eval(serial, work).valid(), "defn failed");
+    std::string expect = result_string(serial, "(pmap (range 100) work)");
+
+    masp::Masp m;
+    m.set_worker_pool(&pool);
+    ASSERT_TRUE(result_string(m, "(pmap (range 100) 'work)").find("error:") == 0, "symbol is not a function");
+    ASSERT_TRUE(masp::read_eval(m, work).valid(), "defn failed");
+    ASSERT_TRUE(result_string(m, "(pmap (range 100) work)") == expect, "pmap results differ");
+
+    // Values and functions are passed serialized.
+    ASSERT_TRUE(result_string(m, "(pmap '(1 2 3) (fn (x) (* x 10)))") == "(10 20 30 )", "list pmap failed");
+    ASSERT_TRUE(result_string(m, "(pmap [(make-vector 1 2) (make-vector 3)] count)") == "[2 1 ]", "primitive pmap failed");
+    ASSERT_TRUE(result_string(m, "(pmap [(make-map 'a \"s\" 'b 1.5)] (fn (x) (make-vector (x 'a) (x 'b) nil true)))") ==
+                "[[\"s\" 1.5 nil true ] ]", "map values failed");
+    ASSERT_TRUE(result_string(m, "(pmap [2 3] (fn (x) (range x)))") == "[(0 1 ) (0 1 2 ) ]", "sequence results failed");
+    ASSERT_TRUE(result_string(m, "(pmap [] work)") == "[]", "empty pmap failed");
+    ASSERT_TRUE(result_string(m, "(pfor [1 2 3] work)") == "nil", "pfor failed");
+
+    // Errors.
+    ASSERT_TRUE(result_string(m, "(defn scale (k) (pmap [1 2] (fn (x) (* x k)))) (scale 2)").find("captures") != std::string::npos,
+                "capturing function was sent");
+    ASSERT_TRUE(result_string(m, "(pmap [1 2 3] (fn (x) (undefined-fun x)))").find("error:pmap:") == 0, "worker error not reported");
+    ASSERT_TRUE(result_string(m, "(count (pmap (range 10) work))") == "10", "pool unusable after error");
+
+    // Workers import modules.
+    const char* source_path = "masp_pool_test.mp";
+    ASSERT_TRUE(string_to_file(source_path, "(defn twice (x) (* 2 x))"), "could not write module");
+    ASSERT_TRUE(result_string(m, "(pimport \"masp_pool_test.mp\") (pmap [1 2] twice)").find("error:") == 0, "twice defined in caller");
+    ASSERT_TRUE(result_string(m, "(pmap [1 2] (fn (x) (twice x)))") == "[2 4 ]", "import to workers failed");
+    std::remove(source_path);
+    std::remove("masp_pool_test.mpc");
+
+    // Scaling of an expensive function over 10k items.
+    masp::MaspPool all(0);
+    all.load(work);
+    m.set_worker_pool(&all);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string parallel = result_string(m, "(count (pmap (range 10000) work))");
+    auto mid = std::chrono::high_resolution_clock::now();
+    std::string sequential = result_string(m, "(count (map (range 10000) work))");
+    auto end = std::chrono::high_resolution_clock::now();
+
+    ASSERT_TRUE(parallel == "10000" && sequential == "10000", "pmap 10000 failed");
+
+    double pmap_ms = std::chrono::duration<double, std::milli>(mid - start).count();
+    double map_ms  = std::chrono::duration<double, std::milli>(end - mid).count();
+    GLH_TEST_LOG("pmap 10000 on " << all.size() << " workers: " << pmap_ms << " ms, map: " << map_ms << " ms");
+}
+
+UTEST(masp, eval_benchmark)
+{
+    using namespace glh;
+
+    masp::Masp m;
+
+    ASSERT_TRUE(timed_parsing(m, "fib 20",
+        "(defn fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)", 6765), "fib failed");
+
+    ASSERT_TRUE(timed_parsing(m, "count down 10000",
+        "(defn down (n) (if (< n 1) 0 (down (- n 1)))) (down 10000)", 0), "count down failed");
+
+    ASSERT_TRUE(timed_parsing(m, "map 100000",
+        "(def dbl (fn (x) (+ (* x 2) 1))) (count (map (range 100000) dbl))", 100000), "map failed");
+
+    ASSERT_TRUE(timed_parsing(m, "map lookups 50000",
+        "(def m (make-map 'a 1 'b 2 'c 3)) (count (map (range 50000) (fn (x) (+ (m 'a) (m 'c) x))))", 50000), "map lookups failed");
+}
+
 #if 0
 class WrappedInStream{ public:
     virtual ~WrappedInStream(){}
@@ -4,6 +4,7 @@
 #include "glhack.h"
 #include "persistent_containers.h"
 #include<string>
+#include<chrono>
 #include "unittester.h"
 
 
@@ -326,6 +327,721 @@ UTEST(collections_pmap, PMap_write_and_find_elements)
 
 }
 
+UTEST(collections, PList_root_refcounts)
+{
+    using namespace glh;
+
+    PListPool<int> pool;
+    size_t empty_size = pool.live_size_bytes();
+
+    {
+        auto a = pool.new_list(list(1, 2, 3));
+        std::vector<PListPool<int>::List> copies(10, a);
+        auto b = a.add(0);
+        copies.clear();
+
+        pool.gc();
+        ASSERT_TRUE(a.size() == 3 && b.size() == 4, "Lists referenced by handles were collected.");
+
+        // Only the head of b is freed once b is gone.
+        size_t with_b = pool.live_size_bytes();
+        b = a;
+        pool.gc();
+        ASSERT_TRUE(pool.live_size_bytes() < with_b, "Unreferenced head was not collected.");
+        ASSERT_TRUE(*b.begin() == 1, "Reassigned handle lost its list.");
+    }
+
+    pool.gc();
+    ASSERT_TRUE(pool.live_size_bytes() == empty_size, "Pool kept unreferenced lists.");
+}
+
+template<class Box>
+bool chunkbox_reserve_and_release(Box& box)
+{
+    // Reserve single elements and arrays, keep every other array alive.
+    std::vector<int*> arrays;
+    for(int i = 0; i < 10000; ++i)
+    {
+        int* e = box.reserve_element();
+        *e = i;
+        size_t size = 1 + i % 20;
+        int* a = box.reserve_consecutive_elements(size);
+        if(!a || box.find_chunk(a) != box.find_chunk(a + size - 1)) return false;
+        for(size_t j = 0; j < size; ++j) a[j] = i;
+        if(i % 2 == 0) arrays.push_back(a);
+    }
+
+    size_t slabs_before = box.slab_count();
+
+    box.mark_all_empty();
+    for(size_t i = 0; i < arrays.size(); ++i) box.set_marked_if_contained_array(arrays[i], 1 + (2 * i) % 20);
+    box.collect_chunks();
+
+    for(size_t i = 0; i < arrays.size(); ++i)
+    {
+        for(size_t j = 0; j < 1 + (2 * i) % 20; ++j) if(arrays[i][j] != (int) (2 * i)) return false;
+    }
+
+    ut_test_out() << "Slabs before collect: " << slabs_before << " after: " << box.slab_count() << std::endl;
+
+    // With nothing marked all slabs except the one in use are returned.
+    box.mark_all_empty();
+    box.collect_chunks();
+    return box.slab_count() == 1 && box.live_size_bytes() == 0;
+}
+
+UTEST(collections, ChunkBox_slabs)
+{
+    glh::ChunkBox<int> box64(4096);
+    ASSERT_TRUE(chunkbox_reserve_and_release(box64), "64 slot chunk box failed.");
+
+    glh::ChunkBox<int, uint32_t> box32(4096);
+    ASSERT_TRUE(chunkbox_reserve_and_release(box32), "32 slot chunk box failed.");
+
+    glh::ChunkBox<int> huge_box(2 * 1024 * 1024, true);
+    ASSERT_TRUE(chunkbox_reserve_and_release(huge_box), "Chunk box on huge pages failed.");
+}
+
+UTEST(collections, ChunkBox_allocation_benchmark)
+{
+    using namespace glh;
+    const int count = 1000000;
+
+    PListPool<int> list_pool;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto list = list_pool.new_list();
+    for(int i = 0; i < count; ++i) list = list.add(i);
+    auto end = std::chrono::high_resolution_clock::now();
+    ut_test_out() << count << " list nodes: " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+
+    PMapPool<int, int> map_pool;
+    start = std::chrono::high_resolution_clock::now();
+    auto map = map_pool.new_map();
+    for(int i = 0; i < count / 10; ++i) map = map.add(i, i);
+    end = std::chrono::high_resolution_clock::now();
+    ut_test_out() << count / 10 << " map entries: " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+
+    ASSERT_TRUE(list.size() == count && map.size() == count / 10, "Allocation benchmark lost elements.");
+}
+
+typedef glh::PMapPool<int, int> IIMapPool;
+
+/** Fill pool with garbage and live maps, gc with thread_count threads and check the live maps.
+ *  Return the live size of the pool after the gc.*/
+size_t map_parallel_gc_body(size_t thread_count, int key_count, bool& result)
+{
+    IIMapPool pool;
+    pool.set_gc_thread_count(thread_count, 0);
+
+    std::vector<IIMapPool::Map> live;
+    IIMapPool::Map map = pool.new_map();
+    for(int i = 0; i < key_count; ++i)
+    {
+        map = map.add(i, 2 * i);
+        if(i % 1000 == 0) live.push_back(map);
+    }
+    live.push_back(map);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    pool.gc();
+    auto end = std::chrono::high_resolution_clock::now();
+    ut_test_out() << "gc with " << thread_count << " threads: "
+                  << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+
+    result = true;
+    for(int i = 0; i < key_count && result; ++i)
+    {
+        glh::ConstOption<int> value = map.try_get_value(i);
+        result = value.is_valid() && *value == 2 * i;
+    }
+    for(size_t i = 0; i < live.size() && result; ++i) result = live[i].size() == std::min<size_t>(i * 1000 + 1, key_count);
+
+    return pool.live_size_bytes();
+}
+
+UTEST(collections_pmap, PMap_parallel_gc)
+{
+    const int key_count = 5000;
+    bool serial_result = false;
+    bool parallel_result = false;
+
+    size_t serial_size = map_parallel_gc_body(1, key_count, serial_result);
+    size_t parallel_size = map_parallel_gc_body(4, key_count, parallel_result);
+
+    ASSERT_TRUE(serial_result, "Serial gc lost live map elements.");
+    ASSERT_TRUE(parallel_result, "Parallel gc lost live map elements.");
+    ASSERT_TRUE(serial_size == parallel_size, "Parallel gc did not collect the same slots as serial gc.");
+}
+
+UTEST(collections, PList_parallel_gc)
+{
+    using namespace glh;
+
+    size_t live_size[2];
+    size_t thread_counts[2] = {1, 4};
+
+    for(int t = 0; t < 2; ++t)
+    {
+        PListPool<int> pool;
+        pool.set_gc_thread_count(thread_counts[t], 0);
+
+        std::vector<PListPool<int>::List> live;
+        for(int i = 0; i < 100; ++i)
+        {
+            auto list = pool.new_list(range_to_list(0, 1, 1000));
+            if(i % 2 == 0) live.push_back(list);
+        }
+
+        pool.gc();
+        live_size[t] = pool.live_size_bytes();
+
+        for(auto l = live.begin(); l != live.end(); ++l)
+        {
+            int expected = 0;
+            for(auto i = l->begin(); i != l->end(); ++i) ASSERT_TRUE(*i == expected++, "Parallel gc corrupted a live list.");
+            ASSERT_TRUE(expected == 1000, "Parallel gc truncated a live list.");
+        }
+    }
+
+    ASSERT_TRUE(live_size[0] == live_size[1], "Parallel gc did not collect the same slots as serial gc.");
+}
+
+UTEST(collections_pmap, PMap_gc_benchmark)
+{
+    const int key_count = 1000000;
+
+    IIMapPool pool;
+    IIMapPool::Map map = pool.new_map();
+    for(int i = 0; i < key_count; ++i) map = map.add(i, i);
+
+    // First collection frees the intermediate maps, the second one only marks live nodes.
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        pool.gc();
+        auto end = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        ut_test_out() << "gc pass " << pass << " of " << key_count << " entry map: " << ms << " ms, live "
+                      << pool.live_size_bytes() / 1024 << " kB" << std::endl;
+    }
+
+    ASSERT_TRUE(map.size() == key_count, "Map lost elements in gc.");
+    ASSERT_TRUE(*map.try_get_value(key_count / 2) == key_count / 2, "Map lost elements in gc.");
+}
+
+/** Time lookup and iteration of a map of key_count entries and report the pool bytes per entry.*/
+template<class Pool, class KeyFun>
+bool map_layout_benchmark_body(const char* name, int key_count, KeyFun key)
+{
+    typedef std::chrono::high_resolution_clock clock;
+    auto ms_since = [](clock::time_point start){return std::chrono::duration<double, std::milli>(clock::now() - start).count();};
+
+    Pool pool;
+    size_t empty_size = pool.live_size_bytes();
+
+    auto builder = pool.new_map().transient();
+    for(int i = 0; i < key_count; ++i) builder.add(key(i), i);
+    typename Pool::Map map = builder.persistent();
+    pool.gc();
+
+    auto start = clock::now();
+    long long lookup_sum = 0;
+    for(int pass = 0; pass < 4; ++pass)
+        for(int i = 0; i < key_count; ++i) lookup_sum += *map.try_get_value(key(i));
+    double lookup_ms = ms_since(start);
+
+    start = clock::now();
+    long long iter_sum = 0;
+    for(int pass = 0; pass < 4; ++pass)
+        for(auto i = map.begin(); i != map.end(); ++i) iter_sum += i->second;
+    double iter_ms = ms_since(start);
+
+    double bytes = double(pool.live_size_bytes() - empty_size) / key_count;
+    ut_test_out() << name << " " << key_count << " entries: lookup " << (4.0 * key_count / lookup_ms) / 1000.0 << " M/s, iteration "
+                  << (4.0 * key_count / iter_ms) / 1000.0 << " M/s, " << bytes << " bytes per entry" << std::endl;
+
+    long long expected = 4LL * (long long)key_count * (key_count - 1) / 2;
+    return lookup_sum == expected && iter_sum == expected;
+}
+
+UTEST(collections_pmap, PMap_layout_benchmark)
+{
+    auto int_key = [](int i){return i;};
+    auto string_key = [](int i){return glh::to_string(i);};
+
+    ASSERT_TRUE(map_layout_benchmark_body<IIMapPool>("int map", 1000000, int_key), "Benchmark lost elements.");
+    ASSERT_TRUE(map_layout_benchmark_body<SIMapPool>("string map", 100000, string_key), "Benchmark lost elements.");
+}
+
+UTEST(collections_pmap, PMap_parallel_build)
+{
+    typedef std::chrono::high_resolution_clock clock;
+    auto ms_since = [](clock::time_point start){return std::chrono::duration<double, std::milli>(clock::now() - start).count();};
+
+    const int key_count = 1000000;
+
+    // Repeated keys must keep the value added last.
+    std::vector<int> keys, values;
+    for(int i = 0; i < key_count; ++i){keys.push_back(i); values.push_back(i);}
+    for(int i = 0; i < 1000; ++i){keys.push_back(i * 7); values.push_back(-i);}
+
+    IIMapPool sequential_pool;
+    auto start = clock::now();
+    IIMapPool::Map sequential = sequential_pool.new_map().add(keys.begin(), keys.end(), values.begin(), values.end());
+    double sequential_ms = ms_since(start);
+
+    IIMapPool pool;
+    pool.set_build_thread_count(4);
+    start = clock::now();
+    IIMapPool::Map parallel = pool.new_map().add(keys.begin(), keys.end(), values.begin(), values.end());
+    double parallel_ms = ms_since(start);
+
+    ut_test_out() << key_count << " keys: sequential build " << sequential_ms << " ms, parallel build " << parallel_ms << " ms" << std::endl;
+
+    ASSERT_TRUE(parallel.size() == sequential.size() && parallel == sequential, "Parallel build differs from sequential insertion.");
+    ASSERT_TRUE(*parallel.try_get_value(7) == -1, "Repeated key did not keep the last value.");
+
+    // Adding to an existing map leaves the old map unchanged.
+    std::vector<std::string> string_keys;
+    std::vector<int> string_values;
+    for(int i = 0; i < 50000; ++i){string_keys.push_back(glh::to_string(i)); string_values.push_back(i);}
+
+    SIMapPool string_pool;
+    string_pool.set_build_thread_count(3);
+    SIMap old_map = string_pool.new_map().add("1", -1).add("x", -2);
+    SIMap new_map = old_map.add(string_keys.begin(), string_keys.end(), string_values.begin(), string_values.end());
+    string_pool.gc();
+
+    ASSERT_TRUE(old_map.size() == 2 && *old_map.try_get_value("1") == -1, "Parallel build changed the old map.");
+    ASSERT_TRUE(new_map.size() == 50001 && *new_map.try_get_value("1") == 1 && *new_map.try_get_value("x") == -2 &&
+                *new_map.try_get_value("49999") == 49999, "Parallel build to an existing map failed.");
+
+    auto builder = new_map.transient();
+    builder.add("y", 5);
+    ASSERT_TRUE(!new_map.try_get_value("y").is_valid(), "Transient modified nodes of a parallel build.");
+}
+
+/** Hash ints through get_hash32 so that the keys are stored with their hash.*/
+struct HashedInt { static uint32_t hash(const int& i){return glh::get_hash32(i);} };
+
+UTEST(collections_pmap, PMap_integer_keys)
+{
+    typedef glh::PMapPool<int, int, glh::AreEqual<int>, HashedInt> HashedIIMapPool;
+
+    const int key_count = 200000;
+
+    glh::Random<int> rand;
+    std::map<int, int> reference;
+    for(int i = 0; i < key_count; ++i) reference[rand.rand()] = i;
+    reference[0] = -1;
+    reference[-1] = -2;
+    reference[std::numeric_limits<int>::min()] = -3;
+    reference[std::numeric_limits<int>::max()] = -4;
+
+    IIMapPool pool;
+    HashedIIMapPool hashed_pool;
+    size_t empty_size = pool.live_size_bytes();
+    size_t hashed_empty_size = hashed_pool.live_size_bytes();
+
+    auto builder = pool.new_map().transient();
+    auto hashed_builder = hashed_pool.new_map().transient();
+    for(auto& kv : reference)
+    {
+        builder.add(kv.first, kv.second);
+        hashed_builder.add(kv.first, kv.second);
+    }
+    IIMapPool::Map map = builder.persistent();
+    HashedIIMapPool::Map hashed_map = hashed_builder.persistent();
+    pool.gc();
+    hashed_pool.gc();
+
+    bool ordered = map.size() == reference.size();
+    auto r = reference.begin();
+    for(auto i = map.begin(); ordered && i != map.end(); ++i, ++r) ordered = i->first == r->first && i->second == r->second;
+    ASSERT_TRUE(ordered, "Integer keyed map is not iterated in key order.");
+
+    ut_test_out() << "bytes per entry: integer keys " << double(pool.live_size_bytes() - empty_size) / reference.size()
+                  << ", hashed keys " << double(hashed_pool.live_size_bytes() - hashed_empty_size) / reference.size() << std::endl;
+
+    map = map.remove(0).remove(std::numeric_limits<int>::min());
+    ASSERT_TRUE(!map.try_get_value(0).is_valid() && *map.try_get_value(-1) == -2 && map.begin()->first > std::numeric_limits<int>::min(),
+                "Integer keyed map removal failed.");
+}
+
+UTEST(collections_pmap, PMap_remove_canonical)
+{
+    const int key_count = 5000;
+
+    IIMapPool pool;
+    IIMapPool::Map all = pool.new_map();
+    IIMapPool::Map even = pool.new_map();
+    for(int i = 0; i < key_count; ++i)
+    {
+        all = all.add(i, i);
+        if(i % 2 == 0) even = even.add(i, i);
+    }
+
+    IIMapPool::Map removed = all;
+    for(int i = 1; i < key_count; i += 2) removed = removed.remove(i);
+
+    ASSERT_TRUE(removed.size() == even.size() && removed == even && even == removed, "Removal lost elements.");
+
+    // A canonical trie iterates in the same order as the one built without the removed keys.
+    bool same_order = true;
+    for(auto i = removed.begin(), j = even.begin(); i != removed.end(); ++i, ++j) same_order = same_order && i->first == j->first;
+    ASSERT_TRUE(same_order, "Removal left a non-canonical trie.");
+
+    for(int i = 0; i < key_count; i += 2) removed = removed.remove(i);
+    ASSERT_TRUE(removed.size() == 0, "Removing all keys left elements.");
+    ASSERT_TRUE(all.size() == key_count, "Removal changed the original map.");
+}
+
+UTEST(collections_pmap, PMap_diff_merge)
+{
+    const int key_count = 100000;
+
+    IIMapPool pool;
+    auto builder = pool.new_map().transient();
+    for(int i = 0; i < key_count; ++i) builder.add(i, i);
+    IIMapPool::Map old_map = builder.persistent();
+
+    // Change, remove and add a few keys.
+    IIMapPool::Map new_map = old_map.add(10, -10).add(20, -20).remove(30).add(key_count + 1, 1);
+
+    int added = 0, removed = 0, changed = 0, visits = 0;
+    old_map.diff(new_map, [&](int key, const int* old_value, const int* new_value){
+        ++visits;
+        if(!old_value) added += key == key_count + 1;
+        else if(!new_value) removed += key == 30;
+        else changed += (*new_value == -key) && (*old_value == key);
+    });
+
+    ASSERT_TRUE(added == 1 && removed == 1 && changed == 2 && visits == 4, "Diff did not find the changes.");
+    ASSERT_TRUE(!(old_map == new_map) && new_map == old_map.add(10, -10).add(20, -20).remove(30).add(key_count + 1, 1), "Map equality failed.");
+
+    // Keys in both maps sum their values, new_map keeps the keys missing from old_map.
+    IIMapPool::Map merged = new_map.merge(old_map, [](int, int value, int other){return value + other;});
+    ASSERT_TRUE(merged.size() == key_count + 1, "Merge lost keys.");
+    ASSERT_TRUE(*merged.try_get_value(10) == 0 && *merged.try_get_value(30) == 30 && *merged.try_get_value(40) == 40,
+                "Merge did not resolve the values.");
+
+    // A map diffed with itself visits nothing.
+    visits = 0;
+    old_map.diff(old_map, [&](int, const int*, const int*){++visits;});
+    ASSERT_TRUE(visits == 0, "Shared map was not skipped.");
+}
+
+struct ConcurrentReadContext
+{
+    glh::Published<IIMapPool::Map>* published;
+    std::atomic<bool>               done;
+    std::atomic<int>                reads;
+    std::atomic<int>                errors;
+
+    /** Check that every key of the published map holds the same version number.*/
+    static void read(void* arg)
+    {
+        ConcurrentReadContext* c = static_cast<ConcurrentReadContext*>(arg);
+        while(!c->done)
+        {
+            glh::Published<IIMapPool::Map>::Reader reader(*c->published);
+            int version = *reader->try_get_value(0);
+            int count = 0;
+            for(auto i = reader->begin(); i != reader->end(); ++i, ++count)
+            {
+                if(i->second != version) ++c->errors;
+            }
+            if(count != 1000) ++c->errors;
+            ++c->reads;
+        }
+    }
+};
+
+UTEST(collections_pmap, PMap_concurrent_readers)
+{
+    const int key_count = 1000;
+    const int version_count = 300;
+    const int reader_count = 3;
+
+    IIMapPool pool;
+    auto builder = pool.new_map().transient();
+    for(int i = 0; i < key_count; ++i) builder.add(i, 0);
+
+    glh::Published<IIMapPool::Map> published(builder.persistent());
+
+    ConcurrentReadContext context;
+    context.published = &published;
+    context.done = false;
+    context.reads = 0;
+    context.errors = 0;
+
+    std::vector<std::unique_ptr<tthread::thread>> readers;
+    for(int i = 0; i < reader_count; ++i) readers.emplace_back(new tthread::thread(ConcurrentReadContext::read, &context));
+
+    // Owner keeps allocating and collecting while the readers traverse the old versions.
+    for(int version = 1; version < version_count; ++version)
+    {
+        auto next = published.current().transient();
+        for(int i = 0; i < key_count; ++i) next.add(i, version);
+        published.publish(next.persistent());
+
+        if(version % 10 == 0)
+        {
+            published.reclaim();
+            pool.gc();
+        }
+    }
+
+    context.done = true;
+    for(auto& r : readers) r->join();
+
+    published.reclaim();
+    ut_test_out() << context.reads << " concurrent reads, " << published.retired_count() << " versions retired." << std::endl;
+
+    ASSERT_TRUE(context.errors == 0, "Reader saw a modified or freed version.");
+    ASSERT_TRUE(published.retired_count() == 0, "Replaced versions were not released.");
+}
+
+/** Run an incremental gc of pool, calling edit(i) for i in [0, edit_count) between marking steps
+ *  of one node. Sweeping is done a chunk at a time. */
+template<class Pool, class Edit>
+void incremental_gc_with_edits(Pool& pool, int edit_count, Edit edit)
+{
+    auto visit = [](const int&){};
+    pool.begin_incremental();
+    for(int i = 0; i < edit_count; ++i)
+    {
+        edit(i);
+        pool.mark_step(1, visit);
+    }
+    while(!pool.marking_done()) pool.mark_step(64, visit);
+    pool.begin_sweep();
+    size_t budget = 1;
+    while(!pool.sweep_step(budget)) budget = 1;
+}
+
+UTEST(collections_pmap, PMap_transient)
+{
+    const int key_count = 10000;
+
+    IIMapPool persistent_pool;
+    IIMapPool::Map persistent_map = persistent_pool.new_map();
+    for(int i = 0; i < key_count; ++i) persistent_map = persistent_map.add(i, i);
+
+    IIMapPool pool;
+    IIMapPool::Map base = pool.new_map(1, -1);
+    auto builder = base.transient();
+    for(int i = 0; i < key_count; ++i) builder.add(i, i);
+    IIMapPool::Map map = builder.persistent();
+
+    // Adding after persistent() must not change the map returned.
+    builder.add(key_count, key_count);
+
+    ASSERT_TRUE(base.size() == 1 && *base.try_get_value(1) == -1, "Transient changed the original map.");
+    ASSERT_TRUE(map.size() == key_count, "Transient lost elements.");
+    for(int i = 0; i < key_count; ++i)
+    {
+        ASSERT_TRUE(*map.try_get_value(i) == *persistent_map.try_get_value(i), "Transient map differs from the persistent one.");
+    }
+    ASSERT_TRUE(!map.try_get_value(key_count).is_valid(), "Transient edited a persistent map.");
+
+    ut_test_out() << "live before gc, persistent: " << persistent_pool.live_size_bytes() / 1024 << " kB, transient: "
+                  << pool.live_size_bytes() / 1024 << " kB" << std::endl;
+    ASSERT_TRUE(pool.live_size_bytes() < persistent_pool.live_size_bytes(), "Transient built intermediate maps.");
+
+    // Edits in place while marking must keep the new nodes alive.
+    IIMapPool::Transient marked = pool.new_map().transient();
+    incremental_gc_with_edits(pool, key_count, [&](int i){marked.add(i, -i);});
+
+    IIMapPool::Map marked_map = marked.persistent();
+    pool.gc();
+    ASSERT_TRUE(marked_map.size() == key_count, "Transient lost elements in incremental gc.");
+    for(int i = 0; i < key_count; ++i)
+    {
+        ASSERT_TRUE(*marked_map.try_get_value(i) == -i, "Transient lost elements in incremental gc.");
+    }
+}
+
+UTEST(collections, PList_transient)
+{
+    glh::PListPool<int> pool;
+    auto builder = pool.transient();
+    for(int i = 0; i < 1000; ++i) builder.add_end(i);
+    glh::PListPool<int>::List list = builder.persistent();
+    pool.gc();
+
+    ASSERT_TRUE(list.size() == 1000, "Transient lost elements.");
+    int expected = 0;
+    for(auto i = list.begin(); i != list.end(); ++i) ASSERT_TRUE(*i == expected++, "Transient changed the order of elements.");
+}
+
+UTEST(collections, PList_unrolled)
+{
+    glh::PListPool<int> pool;
+
+    // Lists sharing a tail must not see each other's elements prepended to the shared node.
+    auto base = pool.new_list(1, 2);
+    auto a = base.add(10);
+    auto b = base.add(20);
+    auto aa = a.add(11);
+    ASSERT_TRUE(*a.first() == 10 && *b.first() == 20 && *aa.first() == 11, "Prepends to a shared tail interfered.");
+    ASSERT_TRUE(*aa.second() == 10 && *b.second() == 1 && *base.second() == 2, "second() returned a wrong element.");
+    ASSERT_TRUE(aa.rest() == a && a.rest() == base && b.rest() == base, "rest() did not return the shared tail.");
+    ASSERT_TRUE(aa.rrest() == base && aa.rrrest().size() == 1 && base.rrest().empty(), "rrest() dropped a wrong number of elements.");
+
+    // Sizes are cached, so check them against a walk of the list.
+    std::vector<glh::PListPool<int>::List> lists;
+    auto list = pool.new_list();
+    for(int i = 0; i < 100; ++i)
+    {
+        list = list.add(i);
+        if(i % 7 == 0) lists.push_back(list.add(-i));
+        if(i % 13 == 0) lists.push_back(list.add_end(base.begin(), base.end()));
+        lists.push_back(list.rrest());
+    }
+    std::function<bool(const int&)> is_fifty = [](const int& i){return i == 50;};
+    lists.push_back(list.remove(list.find(&list, is_fifty)));
+    pool.gc();
+
+    for(auto l = lists.begin(); l != lists.end(); ++l)
+    {
+        size_t count = 0;
+        for(auto i = l->begin(); i != l->end(); ++i) ++count;
+        ASSERT_TRUE(count == l->size(), "Cached list length did not match the elements.");
+    }
+
+    auto removed = lists.back();
+    ASSERT_TRUE(removed.size() == 99 && *removed.first() == 99, "Element was not removed.");
+    int expected = 99;
+    for(auto i = removed.begin(); i != removed.end(); ++i, --expected)
+    {
+        if(expected == 50) --expected;
+        ASSERT_TRUE(*i == expected, "Remove changed the other elements.");
+    }
+}
+
+UTEST(collections, PVector_test)
+{
+    typedef glh::PVectorPool<int> IVectorPool;
+    const int count = 100000;
+
+    IVectorPool pool;
+    IVectorPool::Vector vec = pool.new_vector();
+    for(int i = 0; i < count; ++i) vec = vec.add(i);
+
+    ASSERT_TRUE(vec.size() == count, "Vector lost elements.");
+    bool all_found = true;
+    for(int i = 0; i < count; ++i) all_found = all_found && vec[i] == i;
+    ASSERT_TRUE(all_found, "Indexing failed.");
+
+    int expected = 0;
+    for(auto i = vec.begin(); i != vec.end(); ++i) all_found = all_found && *i == expected++;
+    ASSERT_TRUE(all_found && expected == count, "Iteration failed.");
+
+    // Versions share structure but not changes.
+    IVectorPool::Vector changed = vec.set(1000, -1).set(count - 1, -2);
+    IVectorPool::Vector shorter = vec.drop(count - 40);
+    IVectorPool::Vector branch_a = shorter.add(1);
+    IVectorPool::Vector branch_b = shorter.add(2);
+    ASSERT_TRUE(vec[1000] == 1000 && vec[count - 1] == count - 1, "set changed the original vector.");
+    ASSERT_TRUE(changed[1000] == -1 && changed[count - 1] == -2 && changed[1001] == 1001, "set failed.");
+    ASSERT_TRUE(shorter.size() == 40 && shorter[0] == count - 40, "drop failed.");
+    ASSERT_TRUE(branch_a[40] == 1 && branch_b[40] == 2 && shorter.size() == 40, "Appending to a shared tail failed.");
+
+    size_t live_before = pool.live_size_bytes();
+    pool.gc();
+    ASSERT_TRUE(pool.live_size_bytes() < live_before, "Intermediate vectors were not collected.");
+    ASSERT_TRUE(vec[count / 2] == count / 2 && changed[1000] == -1 && branch_b[40] == 2, "Live vectors lost in gc.");
+
+    // Appends while marking must keep the appended elements.
+    IVectorPool::Vector marked = pool.new_vector();
+    incremental_gc_with_edits(pool, 1000, [&](int i){marked = marked.add(i);});
+
+    all_found = marked.size() == 1000;
+    for(int i = 0; i < 1000; ++i) all_found = all_found && marked[i] == i;
+    ASSERT_TRUE(all_found, "Vector lost elements in incremental gc.");
+}
+
+UTEST(collections, PSortedMap_test)
+{
+    typedef glh::PSortedMapPool<int, int> IISortedMapPool;
+    typedef IISortedMapPool::Map          IISortedMap;
+    const int count = 20000;
+
+    IISortedMapPool pool;
+    IISortedMap map = pool.new_map();
+    std::map<int, int> reference;
+    glh::Random<int> random;
+
+    for(int i = 0; i < count; ++i)
+    {
+        int key = int(unsigned(random.rand()) % (count * 2));
+        map = map.add(key, i);
+        reference[key] = i;
+    }
+
+    ASSERT_TRUE(map.size() == reference.size(), "Sorted map size differs.");
+    bool all_found = true;
+    for(auto r = reference.begin(); r != reference.end(); ++r)
+    {
+        glh::ConstOption<int> value = map.try_get_value(r->first);
+        all_found = all_found && value.is_valid() && *value == r->second;
+    }
+    ASSERT_TRUE(all_found, "Lookup failed.");
+
+    auto r = reference.begin();
+    for(auto i = map.begin(); i != map.end(); ++i, ++r) all_found = all_found && r != reference.end() && i->first == r->first && i->second == r->second;
+    ASSERT_TRUE(all_found && r == reference.end(), "Iteration is not in key order.");
+
+    // Ranges and nearest keys.
+    for(int key = -2; key < count * 2 + 2; key += 7)
+    {
+        auto lower = reference.lower_bound(key);
+        auto upper = reference.upper_bound(key);
+        auto i_lower = map.lower_bound(key);
+        auto i_upper = map.upper_bound(key);
+        all_found = all_found && (lower == reference.end() ? i_lower == map.end() : i_lower->first == lower->first);
+        all_found = all_found && (upper == reference.end() ? i_upper == map.end() : i_upper->first == upper->first);
+
+        const IISortedMapPool::KeyValue* floor = map.floor(key);
+        all_found = all_found && (upper == reference.begin() ? floor == 0 : floor && floor->first == (--upper)->first);
+    }
+    ASSERT_TRUE(all_found, "Range lookup failed.");
+
+    // Removing keys rebalances the tree. The original map is not changed.
+    IISortedMap removed = map;
+    std::map<int, int> removed_reference = reference;
+    for(int i = 0; i < count; ++i)
+    {
+        int key = int(unsigned(random.rand()) % (count * 2));
+        removed = removed.remove(key);
+        removed_reference.erase(key);
+    }
+
+    r = removed_reference.begin();
+    for(auto i = removed.begin(); i != removed.end(); ++i, ++r) all_found = all_found && r != removed_reference.end() && i->first == r->first;
+    ASSERT_TRUE(all_found && r == removed_reference.end() && removed.size() == removed_reference.size(), "Remove failed.");
+    ASSERT_TRUE(map.size() == reference.size() && map.try_get_value(reference.begin()->first).is_valid(), "Remove changed the original map.");
+
+    IISortedMap emptied = removed;
+    for(auto e = removed_reference.begin(); e != removed_reference.end(); ++e) emptied = emptied.remove(e->first);
+    ASSERT_TRUE(emptied.empty() && emptied.begin() == emptied.end() && emptied.floor(0) == 0, "Removing all keys failed.");
+
+    size_t live_before = pool.live_size_bytes();
+    pool.gc();
+    ASSERT_TRUE(pool.live_size_bytes() < live_before, "Intermediate maps were not collected.");
+    ASSERT_TRUE(map.size() == reference.size() && *map.try_get_value(reference.rbegin()->first) == reference.rbegin()->second,
+                "Live maps lost in gc.");
+
+    // Insertions while marking must keep the inserted entries.
+    IISortedMap marked = pool.new_map();
+    incremental_gc_with_edits(pool, 1000, [&](int i){marked = marked.add(999 - i, i);});
+
+    int expected = 0;
+    for(auto i = marked.begin(); i != marked.end(); ++i) all_found = all_found && i->first == expected++;
+    ASSERT_TRUE(all_found && expected == 1000, "Sorted map lost entries in incremental gc.");
+}
+
 #if 1
 UTEST(collections_pmap, PMap_combinations)
 {
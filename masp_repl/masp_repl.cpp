@@ -5,21 +5,33 @@
 #include<cstring>
 #include <sstream>
 
+const char* g_profile_path = "masp_profile.folded";
+
 
 void print_help()
 {
     std::cout << "Welcome to Masp parser version " << MASP_VERSION << "\n" <<
                  "'help' Show this help.\n" <<
                  "'quit' Exit interpreter.\n" <<
-                 "'memory' Display used memory (live/reserved).\n";
+                 "'memory' Display used memory (live/reserved).\n" <<
+                 "'profile on|off|reset' Start, stop or clear profiling of evaluated code.\n" <<
+                 "'profile report' Display the profile and write its call stacks to " << g_profile_path << ".\n";
 }
 
 //TODO: gc
 
 void printing_response(masp::Masp& M, masp::Value* v)
 {
-    std::string outline = masp::value_to_typed_string(v);
-    std::cout << outline << std::endl;
+    // Printing realizes lazy sequences nested in the value, which may fail.
+    try
+    {
+        std::string outline = masp::value_to_typed_string(v);
+        std::cout << outline << std::endl;
+    }
+    catch(const masp::EvaluationException& e)
+    {
+        std::cout << "Error:" << e.get_message() << std::endl;
+    }
 }
 
 void eval_response(masp::Masp& M, masp::Value* v)
@@ -109,6 +121,26 @@ void repl(masp::Masp& M)
             print_memory(cout, "Before collection: ",live_size_before, reserved_size_before);
             print_memory(cout, "After collection: ", live_size, reserved_size);
         }
+        else if(strcmp(line, "profile on") == 0)
+        {
+            M.set_profiling(true);
+        }
+        else if(strcmp(line, "profile off") == 0)
+        {
+            M.set_profiling(false);
+        }
+        else if(strcmp(line, "profile reset") == 0)
+        {
+            M.reset_profile();
+        }
+        else if(strcmp(line, "profile report") == 0)
+        {
+            cout << M.profile_report();
+            if(string_to_file(g_profile_path, M.profile_collapsed_stacks().c_str()))
+                cout << "Call stacks written to " << g_profile_path << endl;
+            else
+                cout << "Could not write " << g_profile_path << endl;
+        }
         else if(strcmp(line, "eval") == 0)
         {
             mode = EVAL;
@@ -141,31 +173,14 @@ void repl(masp::Masp& M)
 
 void eval_file(const char* path, masp::Masp& M)
 {
+    using namespace masp;
 
-    using std::cout;
-    using std::cin;
-    using std::endl;
-
-    std::string str;
-    bool        success;
-
-    std::tie(str, success) = file_to_string(path);
-
-    if(success)
-    {
-        using namespace masp;
-
-        masp_result result = string_to_value(M, str.c_str());
+    masp_result result = file_to_value(M, path);
 
-        if(result.valid()) {
-            eval_response(M, (*result).get());
-        } else {
-            std::cout << "Parse error:" << result.message() << std::endl;
-        }
-    }
-    else
-    {
-        cout << "Could not read file:" << path << endl;
+    if(result.valid()) {
+        eval_response(M, (*result).get());
+    } else {
+        std::cout << "Parse error:" << result.message() << std::endl;
     }
 }
 
@@ -176,6 +191,10 @@ int main(int argc, char* argv[])
     masp::load_masp_unsafe_extensions(M);
     M.set_args(argc, argv);
 
+    // Workers for pmap and pfor. Scripts set them up with pimport.
+    masp::MaspPool pool(0, masp::load_masp_unsafe_extensions);
+    M.set_worker_pool(&pool);
+
     if(argc == 1)
     {
         repl(M);